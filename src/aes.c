@@ -15,106 +15,202 @@
 **
 ****************************************************************************/
 
-#define _GNU_SOURCE
-#include <unistd.h>
-#include <sys/socket.h>
-#include <alloca.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <string.h>
 
 #include "aes.h"
 
-#ifndef AF_ALG
-#define AF_ALG	38
-#define PF_ALG	AF_ALG
+#if defined(__GNUC__) && (__GNUC__ >= 5 || defined(__clang__)) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define HAVE_AESNI
+#include <cpuid.h>
+#include <wmmintrin.h>
 #endif
 
-#ifndef HAVE_LINUX_IF_ALG_H
-struct sockaddr_alg {
-    uint16_t    salg_family;
-    uint8_t     salg_type[14];
-    uint32_t    salg_feat;
-    uint32_t    salg_mask;
-    uint8_t     salg_name[64];
+static const uint8_t sbox[256] = {
+    0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5,
+    0x30, 0x01, 0x67, 0x2b, 0xfe, 0xd7, 0xab, 0x76,
+    0xca, 0x82, 0xc9, 0x7d, 0xfa, 0x59, 0x47, 0xf0,
+    0xad, 0xd4, 0xa2, 0xaf, 0x9c, 0xa4, 0x72, 0xc0,
+    0xb7, 0xfd, 0x93, 0x26, 0x36, 0x3f, 0xf7, 0xcc,
+    0x34, 0xa5, 0xe5, 0xf1, 0x71, 0xd8, 0x31, 0x15,
+    0x04, 0xc7, 0x23, 0xc3, 0x18, 0x96, 0x05, 0x9a,
+    0x07, 0x12, 0x80, 0xe2, 0xeb, 0x27, 0xb2, 0x75,
+    0x09, 0x83, 0x2c, 0x1a, 0x1b, 0x6e, 0x5a, 0xa0,
+    0x52, 0x3b, 0xd6, 0xb3, 0x29, 0xe3, 0x2f, 0x84,
+    0x53, 0xd1, 0x00, 0xed, 0x20, 0xfc, 0xb1, 0x5b,
+    0x6a, 0xcb, 0xbe, 0x39, 0x4a, 0x4c, 0x58, 0xcf,
+    0xd0, 0xef, 0xaa, 0xfb, 0x43, 0x4d, 0x33, 0x85,
+    0x45, 0xf9, 0x02, 0x7f, 0x50, 0x3c, 0x9f, 0xa8,
+    0x51, 0xa3, 0x40, 0x8f, 0x92, 0x9d, 0x38, 0xf5,
+    0xbc, 0xb6, 0xda, 0x21, 0x10, 0xff, 0xf3, 0xd2,
+    0xcd, 0x0c, 0x13, 0xec, 0x5f, 0x97, 0x44, 0x17,
+    0xc4, 0xa7, 0x7e, 0x3d, 0x64, 0x5d, 0x19, 0x73,
+    0x60, 0x81, 0x4f, 0xdc, 0x22, 0x2a, 0x90, 0x88,
+    0x46, 0xee, 0xb8, 0x14, 0xde, 0x5e, 0x0b, 0xdb,
+    0xe0, 0x32, 0x3a, 0x0a, 0x49, 0x06, 0x24, 0x5c,
+    0xc2, 0xd3, 0xac, 0x62, 0x91, 0x95, 0xe4, 0x79,
+    0xe7, 0xc8, 0x37, 0x6d, 0x8d, 0xd5, 0x4e, 0xa9,
+    0x6c, 0x56, 0xf4, 0xea, 0x65, 0x7a, 0xae, 0x08,
+    0xba, 0x78, 0x25, 0x2e, 0x1c, 0xa6, 0xb4, 0xc6,
+    0xe8, 0xdd, 0x74, 0x1f, 0x4b, 0xbd, 0x8b, 0x8a,
+    0x70, 0x3e, 0xb5, 0x66, 0x48, 0x03, 0xf6, 0x0e,
+    0x61, 0x35, 0x57, 0xb9, 0x86, 0xc1, 0x1d, 0x9e,
+    0xe1, 0xf8, 0x98, 0x11, 0x69, 0xd9, 0x8e, 0x94,
+    0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf,
+    0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68,
+    0x41, 0x99, 0x2d, 0x0f, 0xb0, 0x54, 0xbb, 0x16
 };
 
-#define ALG_SET_KEY     1
-#define ALG_SET_OP      3
-#define ALG_OP_ENCRYPT  1
-#else
-#include <linux/if_alg.h>
-#endif
+static inline uint8_t xtime(uint8_t x)
+{
+    return (uint8_t) ((x << 1) ^ ((x & 0x80) ? 0x1b : 0x00));
+}
 
-#ifndef SOL_ALG
-#define SOL_ALG 279
-#endif
+#ifdef HAVE_AESNI
 
-bool aes_encrypt(const uint8_t *key, size_t key_len, const uint8_t *in,
-        uint8_t *out, size_t len)
+static bool cpu_has_aesni(void)
 {
-    uint32_t op = ALG_OP_ENCRYPT;
-    char *msg_buf;
-    size_t msg_size;
-    struct msghdr msg;
-    struct cmsghdr *c_msg;
-    ssize_t result;
-
-    struct sockaddr_alg sa = {
-            .salg_family = AF_ALG,
-            .salg_type = "skcipher",
-            .salg_name = "ecb(aes)"
-    };
+    static int detected = -1;
+    unsigned int eax, ebx, ecx, edx;
+
+    if (detected < 0) {
+        if (__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+            detected = (ecx & bit_AES) != 0;
+        else
+            detected = 0;
+    }
+    return detected;
+}
 
-    struct iovec iov = {
-            .iov_base = (void *) in,
-            .iov_len = len
-    };
+__attribute__((target("aes,sse2")))
+static void aes_encrypt_block_ni(const struct aes_key *key,
+        const uint8_t *in, uint8_t *out)
+{
+    const __m128i *rk = (const __m128i *) key->round_keys;
+    __m128i s;
+    int r;
+
+    s = _mm_xor_si128(_mm_loadu_si128((const __m128i *) in),
+            _mm_loadu_si128(rk));
+    for (r = 1; r < key->rounds; r++)
+        s = _mm_aesenc_si128(s, _mm_loadu_si128(rk + r));
+    s = _mm_aesenclast_si128(s, _mm_loadu_si128(rk + key->rounds));
+    _mm_storeu_si128((__m128i *) out, s);
+}
 
-    int sock = socket(AF_ALG, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
-    if (bind(sock, (struct sockaddr *)&sa, sizeof(sa))) {
-        close(sock);
-        return 0;
-    }
-    if (setsockopt(sock, SOL_ALG, ALG_SET_KEY, key, key_len)) {
-        close(sock);
-        return 0;
-    }
+#endif
 
-    int cipher = accept4(sock, NULL, 0, SOCK_CLOEXEC);
-    if (cipher == -1) {
-        close(sock);
-        return 0;
+bool aes_set_key(struct aes_key *key, const uint8_t *k, size_t key_len)
+{
+    static const uint8_t rcon[11] = {
+        0x00, 0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80, 0x1b, 0x36
+    };
+    uint8_t *w = key->round_keys;
+    int nk = key_len / 4;
+    int i, words;
+    uint8_t t[4], tmp;
+
+    if (key_len != 16 && key_len != 24 && key_len != 32)
+        return false;
+
+    key->rounds = nk + 6;
+    words = 4 * (key->rounds + 1);
+    memcpy(w, k, key_len);
+
+    for (i = nk; i < words; i++) {
+        memcpy(t, w + 4 * (i - 1), 4);
+        if (i % nk == 0) {
+            tmp = t[0];
+            t[0] = sbox[t[1]] ^ rcon[i / nk];
+            t[1] = sbox[t[2]];
+            t[2] = sbox[t[3]];
+            t[3] = sbox[tmp];
+        } else if (nk > 6 && i % nk == 4) {
+            t[0] = sbox[t[0]];
+            t[1] = sbox[t[1]];
+            t[2] = sbox[t[2]];
+            t[3] = sbox[t[3]];
+        }
+        w[4 * i + 0] = w[4 * (i - nk) + 0] ^ t[0];
+        w[4 * i + 1] = w[4 * (i - nk) + 1] ^ t[1];
+        w[4 * i + 2] = w[4 * (i - nk) + 2] ^ t[2];
+        w[4 * i + 3] = w[4 * (i - nk) + 3] ^ t[3];
     }
-    close(sock);
 
-    msg_size = CMSG_SPACE(sizeof(op));
+#ifdef HAVE_AESNI
+    key->aesni = cpu_has_aesni();
+#else
+    key->aesni = false;
+#endif
+    return true;
+}
 
-    msg_buf = alloca(msg_size);
+void aes_encrypt_block(const struct aes_key *key, const uint8_t *in,
+        uint8_t *out)
+{
+    const uint8_t *rk = key->round_keys;
+    uint8_t s[16], t[16];
+    uint8_t a0, a1, a2, a3, all;
+    int r, c, i;
+
+#ifdef HAVE_AESNI
+    if (key->aesni) {
+        aes_encrypt_block_ni(key, in, out);
+        return;
+    }
+#endif
 
-    memset(msg_buf, 0, msg_size);
-    memset(&msg, 0, sizeof(msg));
+    for (i = 0; i < 16; i++)
+        s[i] = in[i] ^ rk[i];
+
+    for (r = 1; r <= key->rounds; r++) {
+        /* SubBytes and ShiftRows, with the state in column order */
+        for (c = 0; c < 4; c++) {
+            t[4 * c + 0] = sbox[s[4 * c + 0]];
+            t[4 * c + 1] = sbox[s[4 * ((c + 1) & 3) + 1]];
+            t[4 * c + 2] = sbox[s[4 * ((c + 2) & 3) + 2]];
+            t[4 * c + 3] = sbox[s[4 * ((c + 3) & 3) + 3]];
+        }
+
+        rk += 16;
+        if (r == key->rounds) {
+            for (i = 0; i < 16; i++)
+                s[i] = t[i] ^ rk[i];
+            break;
+        }
+
+        /* MixColumns and AddRoundKey */
+        for (c = 0; c < 4; c++) {
+            a0 = t[4 * c + 0];
+            a1 = t[4 * c + 1];
+            a2 = t[4 * c + 2];
+            a3 = t[4 * c + 3];
+            all = a0 ^ a1 ^ a2 ^ a3;
+            s[4 * c + 0] = a0 ^ all ^ xtime(a0 ^ a1) ^ rk[4 * c + 0];
+            s[4 * c + 1] = a1 ^ all ^ xtime(a1 ^ a2) ^ rk[4 * c + 1];
+            s[4 * c + 2] = a2 ^ all ^ xtime(a2 ^ a3) ^ rk[4 * c + 2];
+            s[4 * c + 3] = a3 ^ all ^ xtime(a3 ^ a0) ^ rk[4 * c + 3];
+        }
+    }
 
-    msg.msg_iov = &iov;
-    msg.msg_control = msg_buf;
-    msg.msg_controllen = msg_size;
-    msg.msg_iovlen = 1;
+    memcpy(out, s, 16);
+}
 
-    c_msg = CMSG_FIRSTHDR(&msg);
-    c_msg->cmsg_level = SOL_ALG;
-    c_msg->cmsg_type = ALG_SET_OP;
-    c_msg->cmsg_len = CMSG_LEN(sizeof(op));
-    memcpy(CMSG_DATA(c_msg), &op, sizeof(op));
+bool aes_encrypt(const uint8_t *key, size_t key_len, const uint8_t *in,
+        uint8_t *out, size_t len)
+{
+    struct aes_key schedule;
+    size_t i;
 
-    result = sendmsg(cipher, &msg, 0);
-    if (result < 0) {
-        return 0;
-    }
+    if (len % 16)
+        return false;
+    if (!aes_set_key(&schedule, key, key_len))
+        return false;
 
-    result = read(cipher, out, len);
-    if (result < 0) {
-        return 0;
-    }
+    for (i = 0; i < len; i += 16)
+        aes_encrypt_block(&schedule, in + i, out + i);
 
-    return 1;
+    return true;
 }
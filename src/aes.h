@@ -18,10 +18,28 @@
 #ifndef CIPHER_H
 #define CIPHER_H
 
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/* Expanded key schedule, computed once per key */
+struct aes_key {
+    uint8_t round_keys[240];
+    int rounds;
+    bool aesni;
+};
+
+bool aes_set_key(struct aes_key *key, const uint8_t *k, size_t key_len);
+
+/* Encrypt a single 16 byte block, which may be done in place */
+void aes_encrypt_block(const struct aes_key *key, const uint8_t *in,
+        uint8_t *out);
+
+/* Encrypt "len" bytes in ECB mode, where "len" is a multiple of 16 */
 bool aes_encrypt(const uint8_t *key, size_t key_len, const uint8_t *in,
         uint8_t *out, size_t len);
 
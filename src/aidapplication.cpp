@@ -1,15 +1,18 @@
 #include "aidapplication.h"
 #include "simfilesystem.h"
 #include "simauth.h"
+#include "simapdu.h"
 
 #include <qatutils.h>
 #include <qsimcontrolevent.h>
+#include <string.h>
 
 AidApplication::AidApplication( QObject *parent, SimXmlNode& n )
     : QObject( parent )
 {
     SimXmlNode *child = n.children;
 
+    fs = 0;
     type = n.getAttribute( "type" );
     aid = n.getAttribute( "id" );
 
@@ -152,7 +155,6 @@ bool AidAppWrapper::command( const QString& cmd )
 
         return true;
     } else if ( cmd.startsWith( "AT+CGLA" ) ) {
-        QString auth_data;
         QString command;
         QString resp;
         AidApplication *app;
@@ -172,18 +174,38 @@ bool AidAppWrapper::command( const QString& cmd )
         }
 
         command = params[2].replace("\"", "");
-        auth_data = command.mid(10);
+        QByteArray apdu = QAtUtils::fromHex( command );
+        if ( apdu.size() < 4 ) {
+            rules->respond( "+CGLA: 4,\"6700\"" );
+            rules->respond( "OK" );
+            return true;
+        }
 
-        switch (checkCommand(app, command)) {
+        // Anything other than AUTHENTICATE operates on the application's files.
+        if ( apdu[1] != (char)0x88 ) {
+            if ( !app->fs ) {
+                rules->respond( "ERROR" );
+                return true;
+            }
+            QByteArray result = app->fs->engine()->execute( apdu );
+            rules->respond( QString( "+CGLA: %1,\"%2\"" )
+                            .arg( result.size() * 2 )
+                            .arg( QAtUtils::toHex( result ) ) );
+            rules->respond( "OK" );
+            return true;
+        }
+
+        enum CmdType type = checkCommand( app, apdu );
+        switch (type) {
         case CMD_TYPE_GSM_AUTH:
         {
-            QString sres, kc;
-            QString rand = auth_data.mid(2, 32);
-            auth->gsmAuthenticate(rand, sres, kc);
+            GsmResult result;
+            QByteArray rand = apdu.mid(6, 16);
+            auth->gsmAuthenticate( (const uint8_t *)rand.constData(), result );
 
-            resp = QString( "+CGLA: 32,\"04 %1 08 %2 \"" )
-                                        .arg( sres, kc );
-            resp.replace( " ", "");
+            resp = "+CGLA: 32,\"04" +
+                   QByteArray( (const char *)result.sres, 4 ).toHex() + "08" +
+                   QByteArray( (const char *)result.kc, 8 ).toHex() + "\"";
 
             rules->respond( resp );
             rules->respond( "OK" );
@@ -193,21 +215,20 @@ bool AidAppWrapper::command( const QString& cmd )
         break;
         case CMD_TYPE_UMTS_AUTH:
         {
-            enum UmtsStatus status;
-            QString res, ck, ik, auts;
-            QString rand = auth_data.mid(2, 32);
-            QString autn = auth_data.mid(36, 32);
+            UmtsChallenge challenge;
+            UmtsResult result;
+            memcpy( challenge.rand, apdu.constData() + 6, 16 );
+            memcpy( challenge.autn, apdu.constData() + 23, 16 );
 
-            status = auth->umtsAuthenticate( rand, autn, res, ck, ik, auts );
+            auth->umtsAuthenticate( challenge, result );
             resp = QString("+CGLA: ");
 
-            QString test;
-
-            switch (status) {
+            switch (result.status) {
             case UMTS_OK:
-                resp += QString( "88,\"DB08 %1 10 %2 10 %3\"" )
-                .arg( res, ck, ik );
-                resp.replace( " ", "" );
+                resp += "88,\"DB08" +
+                    QByteArray( (const char *)result.res, 8 ).toHex() + "10" +
+                    QByteArray( (const char *)result.ck, 16 ).toHex() + "10" +
+                    QByteArray( (const char *)result.ik, 16 ).toHex() + "\"";
 
                 break;
             case UMTS_INVALID_MAC:
@@ -216,8 +237,8 @@ bool AidAppWrapper::command( const QString& cmd )
 
                 break;
             case UMTS_SYNC_FAILURE:
-                resp += QString( "34,\"DC0E %1 \"" ).arg( auts );
-                resp.replace( " ", "" );
+                resp += "34,\"DC0E" +
+                    QByteArray( (const char *)result.auts, 14 ).toHex() + "\"";
 
                 break;
             case UMTS_ERROR:
@@ -227,43 +248,50 @@ bool AidAppWrapper::command( const QString& cmd )
 
             rules->respond( resp );
             rules->respond( "OK" );
+
+            return true;
         }
         break;
-        default:
+        case CMD_TYPE_UNKNOWN:
             return false;
+        default:
+            rules->respond( QString( "+CGLA: 4,\"%1\"" )
+                            .arg( (int)type, 4, 16, QChar('0') ).toUpper() );
+            rules->respond( "OK" );
+            return true;
         }
     }
 
     return false;
 }
 
-enum CmdType AidAppWrapper::checkCommand( AidApplication *app, QString command)
+enum CmdType AidAppWrapper::checkCommand( AidApplication *app, const QByteArray& apdu )
 {
-    QString cls = command.mid(0, 2);
-    QString ins = command.mid(2, 2);
-    QString p1 = command.mid(4, 2);
-    QString p2 = command.mid(6, 2);
-    QString lc = command.mid(8, 2);
+    quint8 cls = (quint8)apdu[0];
+    quint8 ins = (quint8)apdu[1];
+    quint8 p1 = (quint8)apdu[2];
+    quint8 p2 = (quint8)apdu[3];
+    quint8 lc = apdu.size() > 4 ? (quint8)apdu[4] : 0;
 
-    if ( cls != "00" )
+    if ( cls != 0x00 )
         return CMD_TYPE_UNSUPPORTED_CLS;
 
-    if ( ins != "88" )
+    if ( ins != 0x88 )
         return CMD_TYPE_UNSUPPORTED_INS;
 
-    if ( p1 != "00" )
+    if ( p1 != 0x00 )
         return CMD_TYPE_INCORRECT_P2_P1;
 
-    if ( p2 == "80" ) {
-        if ( lc != "11" )
+    if ( p2 == 0x80 ) {
+        if ( lc != 0x11 || apdu.size() < 5 + 0x11 )
             return CMD_TYPE_WRONG_LENGTH;
 
         if ( !(app->getType() == "USim" || app->getType() == "ISim") )
             return CMD_TYPE_APP_ERROR;
 
         return CMD_TYPE_GSM_AUTH;
-    } else if ( p2 == "81" ) {
-        if ( lc != "22" )
+    } else if ( p2 == 0x81 ) {
+        if ( lc != 0x22 || apdu.size() < 5 + 0x22 )
             return CMD_TYPE_WRONG_LENGTH;
 
         if ( app->getType() != "ISim" )
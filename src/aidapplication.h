@@ -81,7 +81,7 @@ private:
     SimRules *rules;
     SimAuth *auth;
 
-    enum CmdType checkCommand( AidApplication *app, QString command);
+    enum CmdType checkCommand( AidApplication *app, const QByteArray& apdu );
 
 };
 
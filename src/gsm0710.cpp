@@ -0,0 +1,484 @@
+/****************************************************************************
+**
+** This file is part of the Qt Extended Opensource Package.
+**
+** This file may be used under the terms of the GNU General Public License
+** version 2.0 as published by the Free Software Foundation and appearing
+** in the file LICENSE.GPL included in the packaging of this file.
+**
+** Please review the following information to ensure GNU General Public
+** Licensing requirements will be met:
+**     http://www.fsf.org/licensing/licenses/info/GPLv2.html.
+**
+**
+****************************************************************************/
+
+#include "gsm0710.h"
+#include <qdebug.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#define MIN_RING_SIZE       256
+
+// Longest command line that we are prepared to buffer.  This is
+// plenty for the largest SMS PDU or SIM toolkit payload in hex.
+#define MAX_LINE_LENGTH     65536
+
+static const unsigned char crcTable[256] = {
+    0x00, 0x91, 0xE3, 0x72, 0x07, 0x96, 0xE4, 0x75,
+    0x0E, 0x9F, 0xED, 0x7C, 0x09, 0x98, 0xEA, 0x7B,
+    0x1C, 0x8D, 0xFF, 0x6E, 0x1B, 0x8A, 0xF8, 0x69,
+    0x12, 0x83, 0xF1, 0x60, 0x15, 0x84, 0xF6, 0x67,
+    0x38, 0xA9, 0xDB, 0x4A, 0x3F, 0xAE, 0xDC, 0x4D,
+    0x36, 0xA7, 0xD5, 0x44, 0x31, 0xA0, 0xD2, 0x43,
+    0x24, 0xB5, 0xC7, 0x56, 0x23, 0xB2, 0xC0, 0x51,
+    0x2A, 0xBB, 0xC9, 0x58, 0x2D, 0xBC, 0xCE, 0x5F,
+    0x70, 0xE1, 0x93, 0x02, 0x77, 0xE6, 0x94, 0x05,
+    0x7E, 0xEF, 0x9D, 0x0C, 0x79, 0xE8, 0x9A, 0x0B,
+    0x6C, 0xFD, 0x8F, 0x1E, 0x6B, 0xFA, 0x88, 0x19,
+    0x62, 0xF3, 0x81, 0x10, 0x65, 0xF4, 0x86, 0x17,
+    0x48, 0xD9, 0xAB, 0x3A, 0x4F, 0xDE, 0xAC, 0x3D,
+    0x46, 0xD7, 0xA5, 0x34, 0x41, 0xD0, 0xA2, 0x33,
+    0x54, 0xC5, 0xB7, 0x26, 0x53, 0xC2, 0xB0, 0x21,
+    0x5A, 0xCB, 0xB9, 0x28, 0x5D, 0xCC, 0xBE, 0x2F,
+    0xE0, 0x71, 0x03, 0x92, 0xE7, 0x76, 0x04, 0x95,
+    0xEE, 0x7F, 0x0D, 0x9C, 0xE9, 0x78, 0x0A, 0x9B,
+    0xFC, 0x6D, 0x1F, 0x8E, 0xFB, 0x6A, 0x18, 0x89,
+    0xF2, 0x63, 0x11, 0x80, 0xF5, 0x64, 0x16, 0x87,
+    0xD8, 0x49, 0x3B, 0xAA, 0xDF, 0x4E, 0x3C, 0xAD,
+    0xD6, 0x47, 0x35, 0xA4, 0xD1, 0x40, 0x32, 0xA3,
+    0xC4, 0x55, 0x27, 0xB6, 0xC3, 0x52, 0x20, 0xB1,
+    0xCA, 0x5B, 0x29, 0xB8, 0xCD, 0x5C, 0x2E, 0xBF,
+    0x90, 0x01, 0x73, 0xE2, 0x97, 0x06, 0x74, 0xE5,
+    0x9E, 0x0F, 0x7D, 0xEC, 0x99, 0x08, 0x7A, 0xEB,
+    0x8C, 0x1D, 0x6F, 0xFE, 0x8B, 0x1A, 0x68, 0xF9,
+    0x82, 0x13, 0x61, 0xF0, 0x85, 0x14, 0x66, 0xF7,
+    0xA8, 0x39, 0x4B, 0xDA, 0xAF, 0x3E, 0x4C, 0xDD,
+    0xA6, 0x37, 0x45, 0xD4, 0xA1, 0x30, 0x42, 0xD3,
+    0xB4, 0x25, 0x57, 0xC6, 0xB3, 0x22, 0x50, 0xC1,
+    0xBA, 0x2B, 0x59, 0xC8, 0xBD, 0x2C, 0x5E, 0xCF
+};
+
+int gsm0710ComputeCrc( const char *data, uint len )
+{
+    int sum = 0xFF;
+    while ( len > 0 ) {
+        sum = crcTable[ ( sum ^ *data++ ) & 0xFF ];
+        --len;
+    }
+    return ((0xFF - sum) & 0xFF);
+}
+
+// Encode a frame header into "hdr", returning its length.  "len" must
+// be at most GSM0710_MAX_FRAME_SIZE, which fits in 15 bits.
+static int frameHeader( char *hdr, int channel, int type, uint len )
+{
+    Q_ASSERT( len <= GSM0710_MAX_FRAME_SIZE );
+    hdr[0] = (char)((channel << 2) | 0x03);
+    hdr[1] = (char)type;
+    if ( len <= 127 ) {
+        hdr[2] = (char)((len << 1) | 0x01);
+        return 3;
+    } else {
+        hdr[2] = (char)(len << 1);
+        hdr[3] = (char)(len >> 7);
+        return 4;
+    }
+}
+
+// Append a byte to an advanced option frame, escaping it if necessary.
+static inline void appendStuffed( QByteArray& out, char ch )
+{
+    if ( ch == (char)0x7E || ch == (char)0x7D ) {
+        out += (char)0x7D;
+        out += (char)(ch ^ 0x20);
+    } else {
+        out += ch;
+    }
+}
+
+void gsm0710AppendFrames( QByteArray& out, bool advanced, int channel,
+                          int type, const char *data, uint len,
+                          uint frameSize )
+{
+    char hdr[4];
+    int hdrlen;
+    char fcs = 0;
+    uint fcsFrameLen = (uint)(-1);
+
+    if ( frameSize < 1 )
+        frameSize = 1;
+    else if ( frameSize > GSM0710_MAX_FRAME_SIZE )
+        frameSize = GSM0710_MAX_FRAME_SIZE;
+
+    // Reserve for the worst case, so that the frames for a whole
+    // response are built with a single allocation.
+    uint frames = ( len + frameSize - 1 ) / frameSize;
+    if ( frames == 0 )
+        frames = 1;
+    if ( advanced )
+        out.reserve( out.size() + len * 2 + frames * 8 );
+    else
+        out.reserve( out.size() + len + frames * 7 );
+
+    do {
+        uint templen = qMin( len, frameSize );
+
+        // The FCS of a UIH frame covers only the header, so it is the
+        // same for all full-sized frames of a response.
+        if ( advanced ) {
+            hdrlen = 2;
+            frameHeader( hdr, channel, type, 0 );
+        } else {
+            hdrlen = frameHeader( hdr, channel, type, templen );
+        }
+        if ( ( advanced ? 0 : templen ) != fcsFrameLen ) {
+            fcs = (char)gsm0710ComputeCrc( hdr, hdrlen );
+            fcsFrameLen = ( advanced ? 0 : templen );
+        }
+
+        if ( advanced ) {
+            out += (char)0x7E;
+            for ( int i = 0; i < hdrlen; ++i )
+                appendStuffed( out, hdr[i] );
+            for ( uint i = 0; i < templen; ++i )
+                appendStuffed( out, data[i] );
+            appendStuffed( out, fcs );
+            out += (char)0x7E;
+        } else {
+            out += (char)0xF9;
+            out.append( hdr, hdrlen );
+            out.append( data, templen );
+            out += fcs;
+            out += (char)0xF9;
+        }
+
+        data += templen;
+        len -= templen;
+    } while ( len > 0 );
+}
+
+SimMuxDecoder::SimMuxDecoder()
+{
+    posn = 0;
+    advanced = false;
+}
+
+SimMuxDecoder::~SimMuxDecoder()
+{
+}
+
+void SimMuxDecoder::append( const QByteArray& data )
+{
+    // Drop the frames that have already been processed.  If there is
+    // no partial frame left over, the new data is used without copying.
+    if ( posn >= incoming.size() ) {
+        incoming = data;
+    } else {
+        if ( posn > 0 )
+            incoming = incoming.mid( posn );
+        incoming += data;
+    }
+    posn = 0;
+}
+
+bool SimMuxDecoder::nextFrame( int& channel, int& type, const char *& payload, int& len )
+{
+    if ( advanced )
+        return nextAdvancedFrame( channel, type, payload, len );
+    else
+        return nextBasicFrame( channel, type, payload, len );
+}
+
+bool SimMuxDecoder::nextBasicFrame( int& channel, int& type, const char *& payload, int& len )
+{
+    const char *buf = incoming.constData();
+    int size = incoming.size();
+    int hdrlen;
+
+    while ( posn < size ) {
+        if ( buf[posn] != (char)0xF9 ) {
+            // Skip garbage byte outside of a GSM 07.10 packet.
+            ++posn;
+            continue;
+        }
+
+        // Skip additional 0xF9 bytes between frames.
+        while ( ( posn + 1 ) < size && buf[posn + 1] == (char)0xF9 ) {
+            ++posn;
+        }
+
+        // We need at least 4 bytes for the header.
+        if ( ( posn + 4 ) > size )
+            return false;
+
+        // The low bit of the address should be 1, which indicates a
+        // short channel number.
+        if ( ( buf[posn + 1] & 0x01 ) == 0 ) {
+            ++posn;
+            continue;
+        }
+
+        // Get the packet length, which takes two bytes if the low bit
+        // of the first length byte is 0, and validate it.
+        if ( ( buf[posn + 3] & 0x01 ) != 0 ) {
+            hdrlen = 3;
+            len = (buf[posn + 3] >> 1) & 0x7F;
+        } else {
+            if ( ( posn + 5 ) > size )
+                return false;
+            hdrlen = 4;
+            len = ( (buf[posn + 3] >> 1) & 0x7F ) |
+                  ( (buf[posn + 4] & 0xFF) << 7 );
+            if ( len > GSM0710_MAX_FRAME_SIZE ) {
+                ++posn;
+                continue;
+            }
+        }
+        if ( ( posn + hdrlen + 2 + len ) > size )
+            return false;
+
+        // Verify the packet header checksum.
+        int start = posn;
+        posn += hdrlen + 2 + len;
+        if ( ( ( gsm0710ComputeCrc( buf + start + 1, hdrlen ) ^
+                 buf[start + hdrlen + 1 + len] ) & 0xFF ) != 0 ) {
+            qDebug() << "*** GSM 07.10 checksum check failed ***";
+            continue;
+        }
+
+        // Get the channel number and packet type from the header.
+        channel = (buf[start + 1] >> 2) & 0x3F;
+        type = buf[start + 2] & 0xEF;  // Strip "PF" bit.
+        payload = buf + start + hdrlen + 1;
+        return true;
+    }
+    return false;
+}
+
+bool SimMuxDecoder::nextAdvancedFrame( int& channel, int& type, const char *& payload, int& len )
+{
+    const char *buf = incoming.constData();
+    int size = incoming.size();
+
+    while ( posn < size ) {
+        if ( buf[posn] != (char)0x7E ) {
+            // Skip garbage byte outside of a GSM 07.10 packet.
+            ++posn;
+            continue;
+        }
+
+        // Skip additional flags between frames.
+        while ( ( posn + 1 ) < size && buf[posn + 1] == (char)0x7E ) {
+            ++posn;
+        }
+
+        // Find the closing flag, which also opens the next frame.
+        int end = incoming.indexOf( (char)0x7E, posn + 1 );
+        if ( end < 0 ) {
+            if ( size - posn > GSM0710_MAX_FRAME_SIZE * 2 + 8 ) {
+                qDebug() << "*** GSM 07.10 frame too long ***";
+                posn = size;
+            }
+            return false;
+        }
+
+        // Remove the byte stuffing.
+        frame.resize( end - posn - 1 );
+        char *out = frame.data();
+        int used = 0;
+        for ( int i = posn + 1; i < end; ++i ) {
+            if ( buf[i] == (char)0x7D && ( i + 1 ) < end )
+                out[used++] = buf[++i] ^ 0x20;
+            else
+                out[used++] = buf[i];
+        }
+        posn = end;
+
+        // We need at least the address, control and FCS bytes.
+        if ( used < 3 || ( out[0] & 0x01 ) == 0 )
+            continue;
+
+        // The FCS covers the header for UIH frames, and the whole
+        // frame otherwise.
+        type = out[1] & 0xEF;   // Strip "PF" bit.
+        int fcslen = ( type == GSM0710_TYPE_UIH ? 2 : used - 1 );
+        if ( ( ( gsm0710ComputeCrc( out, fcslen ) ^ out[used - 1] ) & 0xFF ) != 0 ) {
+            qDebug() << "*** GSM 07.10 checksum check failed ***";
+            continue;
+        }
+
+        channel = (out[0] >> 2) & 0x3F;
+        payload = out + 2;
+        len = used - 3;
+        return true;
+    }
+    return false;
+}
+
+QByteArray SimMuxDecoder::takeRemaining()
+{
+    // Skip the closing flag of the last frame.
+    char flag = advanced ? (char)0x7E : (char)0xF9;
+    if ( posn < incoming.size() && incoming[posn] == flag )
+        ++posn;
+
+    QByteArray rest = incoming.mid( posn );
+    incoming.clear();
+    posn = 0;
+    return rest;
+}
+
+SimRingBuffer::SimRingBuffer()
+{
+    buf = 0;
+    capacity = 0;
+    mask = 0;
+    head = 0;
+    used = 0;
+}
+
+SimRingBuffer::~SimRingBuffer()
+{
+    free( buf );
+}
+
+void SimRingBuffer::grow( int needed )
+{
+    int newCapacity = ( capacity ? capacity : MIN_RING_SIZE );
+    while ( newCapacity < needed )
+        newCapacity *= 2;
+
+    // Unwrap the existing contents into the start of the new buffer.
+    char *newBuf = (char *)malloc( newCapacity );
+    int first = qMin( used, capacity - head );
+    if ( first > 0 )
+        memcpy( newBuf, buf + head, first );
+    if ( used > first )
+        memcpy( newBuf + first, buf, used - first );
+
+    free( buf );
+    buf = newBuf;
+    capacity = newCapacity;
+    mask = newCapacity - 1;
+    head = 0;
+}
+
+void SimRingBuffer::append( const char *data, int len )
+{
+    if ( len <= 0 )
+        return;
+    if ( used + len > capacity )
+        grow( used + len );
+
+    int tail = ( head + used ) & mask;
+    int first = qMin( len, capacity - tail );
+    memcpy( buf + tail, data, first );
+    if ( len > first )
+        memcpy( buf, data + first, len - first );
+    used += len;
+}
+
+void SimRingBuffer::discard( int len )
+{
+    if ( len >= used ) {
+        head = 0;
+        used = 0;
+    } else {
+        head = ( head + len ) & mask;
+        used -= len;
+    }
+}
+
+QString SimRingBuffer::toLatin1String( int len ) const
+{
+    if ( len <= 0 )
+        return QString( "" );
+    int first = qMin( len, capacity - head );
+    QString result = QString::fromLatin1( buf + head, first );
+    if ( len > first )
+        result += QString::fromLatin1( buf, len - first );
+    return result;
+}
+
+SimLineReader::SimLineReader()
+{
+    scanned = 0;
+    skip = 0;
+    discarding = false;
+}
+
+SimLineReader::~SimLineReader()
+{
+}
+
+void SimLineReader::append( const char *data, int len )
+{
+    ring.append( data, len );
+}
+
+bool SimLineReader::nextLine( QString& line )
+{
+    for (;;) {
+        // Drop the LF after a CR, or the CR after a ^Z, even when it
+        // arrives in a later read than the terminator itself.
+        if ( skip && scanned == 0 && !ring.isEmpty() ) {
+            if ( ring.at( 0 ) == skip )
+                ring.discard( 1 );
+            skip = 0;
+        }
+
+        int size = ring.size();
+        int posn = scanned;
+        char ch = 0;
+        while ( posn < size ) {
+            ch = ring.at( posn );
+            if ( ch == '\r' || ch == '\n' || ch == 0x1A )
+                break;
+            ++posn;
+        }
+
+        if ( posn >= size ) {
+            // No terminator yet: remember how far we got, and give up
+            // on lines that are too long to be a sensible command.
+            scanned = size;
+            if ( size > MAX_LINE_LENGTH ) {
+                if ( !discarding )
+                    qWarning() << "Discarding over-long command line of at least"
+                               << size << "bytes";
+                discarding = true;
+                ring.clear();
+                scanned = 0;
+            }
+            return false;
+        }
+
+        if ( ch == '\r' )
+            skip = '\n';
+        else if ( ch == 0x1A )
+            skip = '\r';
+        else
+            skip = 0;
+
+        scanned = 0;
+        if ( discarding ) {
+            // This is the tail end of an over-long line.
+            ring.discard( posn + 1 );
+            discarding = false;
+            continue;
+        }
+
+        line = ring.toLatin1String( posn );
+        ring.discard( posn + 1 );
+        return true;
+    }
+}
+
+void SimLineReader::clear()
+{
+    ring.clear();
+    scanned = 0;
+    skip = 0;
+    discarding = false;
+}
@@ -0,0 +1,127 @@
+/****************************************************************************
+**
+** This file is part of the Qt Extended Opensource Package.
+**
+** This file may be used under the terms of the GNU General Public License
+** version 2.0 as published by the Free Software Foundation and appearing
+** in the file LICENSE.GPL included in the packaging of this file.
+**
+** Please review the following information to ensure GNU General Public
+** Licensing requirements will be met:
+**     http://www.fsf.org/licensing/licenses/info/GPLv2.html.
+**
+**
+****************************************************************************/
+
+#ifndef GSM0710_H
+#define GSM0710_H
+
+#include <qstring.h>
+#include <qbytearray.h>
+
+#define GSM0710_MAX_CHANNELS        64
+
+// Default and maximum values for N1, the maximum frame information size.
+// TS 27.010 allows N1 up to 32768, but the basic option's length field
+// has 15 bits, so 32767 is the largest frame that can be described.
+#define GSM0710_BASIC_FRAME_SIZE    31
+#define GSM0710_ADVANCED_FRAME_SIZE 64
+#define GSM0710_MAX_FRAME_SIZE      32767
+
+// Frame types, without the poll/final bit.
+#define GSM0710_TYPE_UIH            0xEF
+#define GSM0710_TYPE_UI             0x03
+
+// Compute the GSM 07.10 frame check sequence over a header.
+int gsm0710ComputeCrc( const char *data, uint len );
+
+// Append the frames needed to send data on a channel to "out".  The data
+// is split into frames of at most frameSize bytes.  Advanced option
+// frames are delimited by 0x7E flags and byte stuffed.
+void gsm0710AppendFrames( QByteArray& out, bool advanced, int channel,
+                          int type, const char *data, uint len,
+                          uint frameSize );
+
+// Extracts frames from the data received in GSM 07.10 mode.
+class SimMuxDecoder
+{
+public:
+    SimMuxDecoder();
+    ~SimMuxDecoder();
+
+    void setAdvanced( bool value ) { advanced = value; }
+    bool isAdvanced() const { return advanced; }
+
+    void append( const QByteArray& data );
+
+    // Extract the next valid frame.  The payload pointer remains
+    // valid until the next call to append() or nextFrame().
+    bool nextFrame( int& channel, int& type, const char *& payload, int& len );
+
+    // Take the data after the last frame, when leaving GSM 07.10 mode.
+    QByteArray takeRemaining();
+
+private:
+    QByteArray incoming;
+    int posn;
+    QByteArray frame;
+    bool advanced;
+
+    bool nextBasicFrame( int& channel, int& type, const char *& payload, int& len );
+    bool nextAdvancedFrame( int& channel, int& type, const char *& payload, int& len );
+};
+
+// Growable ring buffer of bytes.  Data is appended at the tail and
+// consumed from the head, so nothing is moved when part of it is used.
+class SimRingBuffer
+{
+public:
+    SimRingBuffer();
+    ~SimRingBuffer();
+
+    int size() const { return used; }
+    bool isEmpty() const { return used == 0; }
+
+    char at( int index ) const { return buf[(head + index) & mask]; }
+
+    void append( const char *data, int len );
+    void discard( int len );
+    void clear() { head = 0; used = 0; }
+
+    // Decode the first len bytes as Latin-1 into a string.
+    QString toLatin1String( int len ) const;
+
+private:
+    char *buf;
+    int capacity;
+    int mask;
+    int head;
+    int used;
+
+    void grow( int needed );
+};
+
+// Splits the data received on one channel into command lines.  Lines
+// end in CR, LF or the ^Z that terminates an SMS PDU.  A line that
+// grows beyond the maximum length is discarded up to its terminator.
+class SimLineReader
+{
+public:
+    SimLineReader();
+    ~SimLineReader();
+
+    void append( const char *data, int len );
+
+    // Extract the next complete line, if there is one.
+    bool nextLine( QString& line );
+
+    void clear();
+
+private:
+    SimRingBuffer ring;
+    int scanned;
+    char skip;
+    bool discarding;
+};
+
+#endif
@@ -51,6 +51,18 @@ QSMSMessageList & HardwareManipulator::getSMSList()
     return SMSList;
 }
 
+// Keep the SMS store in a file.  If the file cannot be used, the user is
+// told that this modem's messages are only kept in memory.
+bool HardwareManipulator::openMessageStore( const QString& fileName )
+{
+    if ( SMSList.open( fileName ) )
+        return true;
+    warning( tr("SMS store not saved"),
+             tr("The SMS store %1 %2, so this modem's messages will only be "
+                "kept in memory").arg( fileName ).arg( SMSList.errorString() ) );
+    return false;
+}
+
 void HardwareManipulator::warning( const QString &title, const QString &message)
 {
     qWarning() << title << ":" << message;
@@ -60,8 +72,6 @@ void HardwareManipulator::setPhoneNumber( const QString& )
 {
 }
 
-QString PS_toHex( const QByteArray& binary );
-
 void HardwareManipulator::constructCBMessage(const QString &messageCode, int geographicalScope, const QString &updateNumber,
     const QString &channel, int language, const QString &content)
 {
@@ -143,21 +153,30 @@ void HardwareManipulator::constructSMSMessage( const int type, const QString &se
 
 void HardwareManipulator::sendSMS( const QSMSMessage &m )
 {
-    if( m.shouldSplit() ) {
-        QList<QSMSMessage> list = m.split();
+    QList<QSMSMessage> list;
+    if( m.shouldSplit() )
+        list = m.split();
+    else
+        list += m;
+
+    // Store all of the parts or none of them, as a partial message
+    // could never be reassembled.
+    if ( SMSList.count() + list.count() > SMSList.capacity() ) {
+        qWarning() << "SMS store is full, dropping incoming message";
+        return;
+    }
 
-        for( int i =0; i < list.count(); i++ ) {
-            QByteArray pdu = list[i].toPdu();
-            uint pdulen = pdu.length() - QSMSMessage::pduAddressLength( pdu );
-            SMSList.appendSMS( pdu, pdulen );
-            emit unsolicitedCommand("+CMTI: \"SM\","+QString::number( getSMSList().count()));
-        }
-    } else {
-        QByteArray pdu = m.toPdu();
+    for( int i =0; i < list.count(); i++ ) {
+        QByteArray pdu = list[i].toPdu();
         uint pdulen = pdu.length() - QSMSMessage::pduAddressLength( pdu );
-        SMSList.appendSMS( pdu, pdulen );
-        emit unsolicitedCommand("+CMTI: \"SM\","+QString::number( getSMSList().count()));
+        int index = SMSList.appendSMS( pdu, pdulen );
+        if ( index < 0 ) {
+            qWarning() << "SMS store cannot hold part" << i + 1 << "of incoming message";
+            break;
+        }
+        emit unsolicitedCommand("+CMTI: \"SM\","+QString::number( index + 1 ));
     }
+    emit variableChanged( "SMSUSED", QString::number( SMSList.count() ) );
 }
 
 void HardwareManipulator::constructSMSDatagram(int src, int dst,
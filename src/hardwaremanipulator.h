@@ -36,6 +36,7 @@ Q_OBJECT
 public:
     HardwareManipulator(SimRules *sr, QObject *parent=0);
     QSMSMessageList & getSMSList();
+    bool openMessageStore( const QString& fileName );
     bool getSimPresent();
     QStringList getSimAppsNameList();
 
@@ -19,24 +19,45 @@
 
 #include <server.h>
 #include "control.h"
+#include "simsmstraffic.h"
+#include "simfileprofile.h"
 #include <qapplication.h>
 #include <qstring.h>
+#include <qdir.h>
 #include <qdebug.h>
 #include <stdlib.h>
+#include <limits.h>
 
 static void usage()
 {
     qWarning() << "Usage:"
                << QFileInfo(QCoreApplication::instance()->applicationFilePath()).fileName().toLocal8Bit().constData()
-               << "[-v] [-p port] [-gui] filename";
+               << "[-v] [-p port] [-n modems] [-t threads] [-s directory] [-sim directory] [-sms traffic] [-compile profile] [-gui] filename";
     exit(-1);
 }
 
+// Parse a decimal command-line argument in the range min to max.
+static bool parseNumber(const char *arg, int min, int max, int &value)
+{
+    bool ok;
+    int number = QString(arg).toInt(&ok);
+    if (!ok || number < min || number > max)
+        return false;
+    value = number;
+    return true;
+}
+
 int main(int argc, char **argv)
 {
     QString filename = NULL;
     QCoreApplication *app;
     int port = 12345;
+    int modems = 1;
+    int threads = 0;
+    QString storeDir;
+    QString profileDir;
+    QString compileProfile;
+    QString smsTraffic;
     int index;
     int r;
     bool with_gui = false;
@@ -52,8 +73,63 @@ int main(int argc, char **argv)
             if (index >= argc) {
                 qWarning() << "ERROR: Got -p but missing port number";
                 usage();
+            } else if (!parseNumber(argv[index], 1, 65535, port)) {
+                qWarning() << "ERROR: Invalid port number";
+                usage();
+            }
+        } else if (strcmp(argv[index],"-n") == 0) {
+            index++;
+            if (index >= argc) {
+                qWarning() << "ERROR: Got -n but missing number of modems";
+                usage();
+            } else if (!parseNumber(argv[index], 1, 65535, modems)) {
+                qWarning() << "ERROR: Invalid number of modems";
+                usage();
+            }
+        } else if (strcmp(argv[index],"-t") == 0) {
+            index++;
+            if (index >= argc) {
+                qWarning() << "ERROR: Got -t but missing number of threads";
+                usage();
+            } else if (!parseNumber(argv[index], 1, INT_MAX, threads)) {
+                qWarning() << "ERROR: Invalid number of threads";
+                usage();
+            }
+        } else if (strcmp(argv[index],"-s") == 0) {
+            index++;
+            if (index >= argc) {
+                qWarning() << "ERROR: Got -s but missing store directory";
+                usage();
+            } else {
+                storeDir = argv[index];
+            }
+        } else if (strcmp(argv[index],"-sim") == 0) {
+            index++;
+            if (index >= argc) {
+                qWarning() << "ERROR: Got -sim but missing profile directory";
+                usage();
+            } else {
+                profileDir = argv[index];
+            }
+        } else if (strcmp(argv[index],"-compile") == 0) {
+            index++;
+            if (index >= argc) {
+                qWarning() << "ERROR: Got -compile but missing profile name";
+                usage();
             } else {
-                port = atoi(argv[index]);
+                compileProfile = argv[index];
+            }
+        } else if (strcmp(argv[index],"-sms") == 0) {
+            index++;
+            SimSmsTrafficConfig config;
+            if (index >= argc) {
+                qWarning() << "ERROR: Got -sms but missing traffic settings";
+                usage();
+            } else if (!config.parse(argv[index])) {
+                qWarning() << "ERROR: Invalid SMS traffic settings";
+                usage();
+            } else {
+                smsTraffic = argv[index];
             }
         } else if (strcmp(argv[index],"-gui") == 0) {
             // turn on gui option
@@ -77,6 +153,28 @@ int main(int argc, char **argv)
         usage();
     }
 
+    // -p may come after -n, so check the range of ports once both are known.
+    if (port + modems - 1 > 65535) {
+        qWarning() << "ERROR: Invalid number of modems";
+        usage();
+    }
+
+    // Compile the SIM filesystems of the rules into a profile and stop.
+    if (!compileProfile.isEmpty()) {
+        SimRuleSet rules(filename);
+        if (!SimFileProfile::compile(rules, compileProfile)) {
+            qWarning() << "ERROR: Could not compile" << filename;
+            return 1;
+        }
+        return 0;
+    }
+
+    if (with_gui && threads > 0) {
+        // The control widgets can only be created in the GUI thread.
+        qWarning() << "ERROR: -t cannot be combined with -gui";
+        usage();
+    }
+
     if (with_gui) {
         QApplication *gui = new QApplication(argc, argv);
         gui->setQuitOnLastWindowClosed(false);
@@ -85,14 +183,49 @@ int main(int argc, char **argv)
     } else
         app = new QCoreApplication(argc, argv);
 
-    PhoneSimServer *pss = new PhoneSimServer(filename, port, 0);
+    // All simulated modems share the same parsed rules.  Each one listens
+    // on its own port, starting at the one given with -p.
+    SimRuleSet *rules = new SimRuleSet(filename);
+    PhoneSimShardPool *pool = 0;
+
+    if (threads > 0)
+        pool = new PhoneSimShardPool(threads);
+
+    for (index = 0; index < modems; index++) {
+        PhoneSimServer *pss = new PhoneSimServer(rules, port + index, 0);
+
+        if (with_gui)
+            pss->setHardwareManipulator(new ControlFactory);
+        else
+            pss->setHardwareManipulator(new HardwareManipulatorFactory);
 
-    if (with_gui)
-        pss->setHardwareManipulator(new ControlFactory);
-    else
-        pss->setHardwareManipulator(new HardwareManipulatorFactory);
+        if (modems > 1)
+            pss->setPhoneNumber(QString::number(555000 + index));
+
+        // Each modem gets its own SMS store and SIM update journal,
+        // named after its port.
+        if (!storeDir.isEmpty()) {
+            pss->setMessageStore(QDir(storeDir).filePath(
+                    QString("phonesim-%1.sms").arg(port + index)));
+            pss->setSimJournal(QDir(storeDir).filePath(
+                    QString("phonesim-%1.simj").arg(port + index)));
+        }
+
+        // Likewise for the SIM profile, so that each modem can have
+        // a distinct SIM without a rule file of its own.
+        if (!profileDir.isEmpty())
+            pss->setSimProfile(QDir(profileDir).filePath(
+                    QString("phonesim-%1.sim").arg(port + index)));
+
+        if (!smsTraffic.isEmpty())
+            pss->setSmsTraffic(smsTraffic);
+
+        if (pool)
+            pss->setShardPool(pool);
+    }
 
     r = app->exec();
+    delete pool;
     delete app;
 
     return r;
@@ -21,15 +21,20 @@
 
 #include "hardwaremanipulator.h"
 #include "simfilesystem.h"
+#include "simfileprofile.h"
+#include "simapdu.h"
 #include "simapplication.h"
 #include "callmanager.h"
 #include "simauth.h"
 #include "aidapplication.h"
+#include "simsmstraffic.h"
 #include <qatutils.h>
+#include <qsmsmessage.h>
 
 #include <qstring.h>
 #include <qbytearray.h>
 #include <qregexp.h>
+#include <qvarlengtharray.h>
 #include <qdebug.h>
 
 #define PHONEBOOK_NLENGTH 32
@@ -42,6 +47,103 @@
 
 #define INVALID_VALUE_HIDDEN -1
 
+// Number of records that a listing encodes before returning to the
+// event loop, and the amount of unsent output at which it waits for
+// the client to catch up.
+#define PIN_MAX_RETRIES         3
+
+#define LISTING_CHUNK_RECORDS   32
+#define LISTING_MAX_BACKLOG     65536
+
+// Timer wheel entries for delayed events on a connection.
+class SimDelayedResponse : public SimTimerEntry
+{
+public:
+    SimDelayedResponse( SimRules *rules, const QByteArray& response, int channel )
+    { this->rules = rules; this->response = response; this->channel = channel; }
+
+    void fire() { rules->delayedResponse( response, channel ); }
+
+private:
+    SimRules *rules;
+    QByteArray response;
+    int channel;
+};
+
+// The wildcard is captured when the command matches, but any other
+// variables in the value are expanded when the timeout fires.
+class SimDelayedSet : public SimTimerEntry
+{
+public:
+    SimDelayedSet( SimRules *rules, int slot, const SimTemplate *value,
+                   const QString& wild )
+    { this->rules = rules; this->slot = slot; this->value = value; this->wild = wild; }
+
+    void fire()
+    { rules->storeVariable( slot, value ? value->expand( rules, wild ) : wild ); }
+
+private:
+    SimRules *rules;
+    int slot;
+    const SimTemplate *value;
+    QString wild;
+};
+
+class SimUnsolicitedEntry : public SimTimerEntry
+{
+public:
+    SimUnsolicitedEntry( SimRules *rules, const SimUnsolicited *item )
+    { this->rules = rules; this->item = item; }
+
+    void fire() { rules->unsolicitedTimeout( item ); }
+
+private:
+    SimRules *rules;
+    const SimUnsolicited *item;
+};
+
+class SimDelayedListing : public SimTimerEntry
+{
+public:
+    SimDelayedListing( SimRules *rules, SimListing *listing )
+    { this->rules = rules; this->listing = listing; }
+
+    void fire() { rules->listingReady( listing ); }
+
+private:
+    SimRules *rules;
+    SimListing *listing;
+};
+
+// Listings for AT+CMGL and AT+CPBR.
+class SimSMSListing : public SimListing
+{
+public:
+    SimSMSListing( const QList<int>& indexes, bool eol )
+    { this->indexes = indexes; this->eol = eol; posn = 0; }
+
+    bool encode( SimRules *rules, QByteArray& out, int count );
+
+private:
+    QList<int> indexes;
+    int posn;
+    bool eol;
+};
+
+class SimPhoneBookListing : public SimListing
+{
+public:
+    SimPhoneBookListing( SimPhoneBook *pb, int first, int last )
+    { this->pb = pb; this->first = first; this->last = last; }
+
+    bool encode( SimRules *rules, QByteArray& out, int count );
+
+private:
+    SimPhoneBook *pb;
+    int first;
+    int last;
+};
+
 SimXmlNode::SimXmlNode( const QString& _tag )
 {
     parent = 0;
@@ -170,18 +272,21 @@ SimXmlNode *SimXmlHandler::documentElement() const
 }
 
 
-SimState::SimState( SimRules *rules, SimXmlNode& e )
+SimState::SimState( SimRuleSet *ruleSet, SimXmlNode& e )
 {
-    _rules = rules;
+    _ruleSet = ruleSet;
     if ( e.tag == "state" ) {
         _name = e.getAttribute( "name" );
     }
+    trie.append( TrieNode() );
     SimXmlNode *n = e.children;
     while ( n != 0 ) {
         if ( n->tag == "chat" ) {
 
             // Load a chat response definition.
-            items.append( new SimChat( this, *n ) );
+            SimChat *chat = new SimChat( this, *n );
+            items.append( chat );
+            addToIndex( chat );
 
         } else if ( n->tag == "unsolicited" ) {
 
@@ -194,38 +299,90 @@ SimState::SimState( SimRules *rules, SimXmlNode& e )
 }
 
 
-void SimState::enter()
+SimState::~SimState()
 {
-    QList<SimItem *>::Iterator iter;
-    for ( iter = items.begin(); iter != items.end(); ++iter ) {
-        (*iter)->enter();
+    qDeleteAll( items );
+}
+
+
+void SimState::addToIndex( SimChat *chat )
+{
+    int index = chats.size();
+    chats.append( chat );
+
+    if ( chat->isDynamic() ) {
+        dynamicChats.append( index );
+    } else if ( !chat->isWildcard() ) {
+        // Only the first of several identical commands can ever match.
+        if ( !exactChats.contains( chat->pattern() ) )
+            exactChats.insert( chat->pattern(), index );
+    } else {
+        QString prefix = chat->literalPrefix();
+        int node = 0;
+        for ( int posn = 0; posn < prefix.length(); ++posn ) {
+            ushort ch = prefix[posn].unicode();
+            int child = trie[node].next.value( ch, -1 );
+            if ( child < 0 ) {
+                child = trie.size();
+                trie.append( TrieNode() );
+                trie[node].next.insert( ch, child );
+            }
+            node = child;
+        }
+        trie[node].chats.append( index );
     }
 }
 
 
-void SimState::leave()
+void SimState::enter( SimRules *rules ) const
 {
-    QList<SimItem *>::Iterator iter;
+    QList<SimItem *>::ConstIterator iter;
     for ( iter = items.begin(); iter != items.end(); ++iter ) {
-        (*iter)->leave();
+        (*iter)->enter( rules );
     }
 }
 
 
-bool SimState::command( const QString& cmd )
+void SimState::leave( SimRules *rules ) const
 {
-    // Search for a "SimChat" item that understands the command.
-    QList<SimItem *>::Iterator iter;
+    QList<SimItem *>::ConstIterator iter;
     for ( iter = items.begin(); iter != items.end(); ++iter ) {
-        if ( (*iter)->command( cmd ) ) {
+        (*iter)->leave( rules );
+    }
+}
+
+
+bool SimState::command( SimRules *rules, const QString& cmd ) const
+{
+    // Collect the chats that could possibly match this command.
+    QVarLengthArray<int, 32> candidates;
+    int exact = exactChats.value( cmd, -1 );
+    if ( exact >= 0 )
+        candidates.append( exact );
+    int node = 0;
+    for ( int posn = 0; node >= 0; ++posn ) {
+        const TrieNode& current = trie.at( node );
+        foreach ( int index, current.chats )
+            candidates.append( index );
+        if ( posn >= cmd.length() )
+            break;
+        node = current.next.value( cmd[posn].unicode(), -1 );
+    }
+    foreach ( int index, dynamicChats )
+        candidates.append( index );
+
+    // Try them in rule file order, so the first matching chat wins.
+    qSort( candidates.begin(), candidates.end() );
+    for ( int i = 0; i < candidates.size(); ++i ) {
+        if ( chats[candidates[i]]->command( rules, cmd ) ) {
             return true;
         }
     }
 
     // Pass unhandled commands to the default state to be processed.
-    SimState *defaultState = rules()->defaultState();
+    SimState *defaultState = _ruleSet->defaultState();
     if ( defaultState != this ) {
-        return defaultState->command( cmd );
+        return defaultState->command( rules, cmd );
     } else {
         return false;
     }
@@ -238,11 +395,14 @@ SimChat::SimChat( SimState *state, SimXmlNode& e )
     SimXmlNode *n = e.children;
     responseDelay = 0;
     wildcard = false;
+    dynamic = false;
+    wildPosn = -1;
     eol = true;
 
     listSMS = false;
     deleteSMS = false;
     readSMS = false;
+    writeSMS = false;
 
     while ( n != 0 ) {
         if ( n->tag == "command" ) {
@@ -258,9 +418,22 @@ SimChat::SimChat( SimState *state, SimXmlNode& e )
             QString wc = n->getAttribute( "wildcard" );
             if ( wc == "true" )
                 wildcard = true;    // Force the use of wildcarding.
+            dynamic = _command.contains( "${" );
+            if ( dynamic )
+                commandTemplate = SimTemplate( state->ruleSet(), _command );
+            if ( wildcard && !dynamic ) {
+                // Compile the pattern once, rather than on every command.
+                // QRegExp prepares its engine on first use, so match
+                // once now, while the rules are still private to this
+                // thread, and copies will share the prepared engine.
+                matcher = QRegExp( _command, Qt::CaseSensitive,
+                                   QRegExp::Wildcard );
+                matcher.indexIn( QString(), 0 );
+                wildPosn = w;
+            }
         } else if ( n->tag == "response" ) {
             QString delay = n->getAttribute( "delay" );
-            response = n->contents;
+            response = SimTemplate( state->ruleSet(), n->contents );
             if ( delay != QString() )
                 responseDelay = delay.toInt();
             else
@@ -271,25 +444,27 @@ SimChat::SimChat( SimState *state, SimXmlNode& e )
             switchTo = n->getAttribute( "name" );
         } else if ( n->tag == "set" ) {
             QString name = n->getAttribute( "name" );
-	    variables += name;
-	    values += n->getAttribute( "value" );
-            int delay = n->getAttribute( "delay" ).toInt();
-            if (delay)
-                delays[name] = delay;
+            variables += state->ruleSet()->intern( name );
+            values += SimTemplate( state->ruleSet(), n->getAttribute( "value" ) );
+            delays += n->getAttribute( "delay" ).toInt();
         } else if ( n->tag == "newcall" ) {
             newCallVar = n->getAttribute( "name" );
         } else if ( n->tag == "forgetcall" ) {
-            forgetCallId = n->getAttribute( "id" );
+            forgetCallId = SimTemplate( state->ruleSet(), n->getAttribute( "id" ) );
         } else if ( n->tag == "listSMS" ) {
             listSMS = true;
         } else if ( n->tag =="deleteSMS" ) {
             deleteSMS = true;
         } else if ( n->tag == "readSMS" ) {
             readSMS = true;
+        } else if ( n->tag == "writeSMS" ) {
+            writeSMS = true;
         }
 
         n = n->next;
     }
+
+    response.prerender( eol );
 }
 
 QString PS_toHex( const QByteArray& binary )
@@ -305,13 +480,72 @@ QString PS_toHex( const QByteArray& binary )
     return str;
 }
 
-bool SimChat::command( const QString& cmd )
+static void appendHex( QByteArray& out, const QByteArray& binary )
+{
+    static char const hexchars[] = "0123456789ABCDEF";
+    int posn = out.size();
+
+    out.resize( posn + binary.size() * 2 );
+    char *d = out.data() + posn;
+    for ( int i = 0; i < binary.size(); i++ ) {
+        *d++ = hexchars[ (binary[i] >> 4) & 0x0F ];
+        *d++ = hexchars[ binary[i] & 0x0F ];
+    }
+}
+
+// Parse the <stat> argument of AT+CMGL, in PDU or text form.  Returns
+// 4 for all messages, or -1 if the argument is not recognized.
+static int smsListStatus( const QString& args )
+{
+    static const char * const names[] =
+        { "\"REC UNREAD\"", "\"REC READ\"", "\"STO UNSENT\"", "\"STO SENT\"", "\"ALL\"" };
+    QString arg = args;
+    if ( arg.startsWith( QChar('=') ) )
+        arg = arg.mid( 1 );
+    arg = arg.trimmed();
+    if ( arg.isEmpty() )
+        return 4;
+    for ( int stat = 0; stat < 5; ++stat ) {
+        if ( arg == QLatin1String( names[stat] ) )
+            return stat;
+    }
+    bool ok;
+    int stat = arg.toInt( &ok );
+    if ( ok && stat >= 0 && stat <= 4 )
+        return stat;
+    return -1;
+}
+
+QString SimChat::literalPrefix() const
+{
+    // Stop at the first character that QRegExp::Wildcard treats specially.
+    int posn = 0;
+    while ( posn < _command.length() ) {
+        QChar ch = _command[posn];
+        if ( ch == '*' || ch == '?' || ch == '[' )
+            break;
+        ++posn;
+    }
+    return _command.left( posn );
+}
+
+bool SimChat::command( SimRules *rules, const QString& cmd ) const
 {
     QString wild;
     // command may contain vars, expand them.
-    QString _ecommand = state()->rules()->expand(_command);
-
-    if ( wildcard ) {
+    QString _ecommand = dynamic ? commandTemplate.expand(rules) : _command;
+
+    if ( wildcard && !dynamic ) {
+        // Match with a copy, since the match state is kept in the
+        // QRegExp and the pattern may be in use by connections in other
+        // threads.  The engine was prepared when the rules were loaded,
+        // so the copy only takes a reference to it.
+        QRegExp rx( matcher );
+        if ( rx.indexIn( cmd, 0 ) == 0 )
+            wild = cmd.mid(wildPosn,cmd.length()-_ecommand.length()+1);
+        else
+            return false;
+    } else if ( wildcard ) {
         int s=QRegExp(_ecommand,Qt::CaseSensitive,QRegExp::Wildcard).indexIn(cmd,0);
         if (s==0) {
             int w=_ecommand.indexOf(QChar('*'));
@@ -330,111 +564,149 @@ bool SimChat::command( const QString& cmd )
     }
 
     // Send the response.
-    if (!readSMS && !deleteSMS && !listSMS)
-        state()->rules()->respond( response, responseDelay, eol );
+    if (!readSMS && !deleteSMS && !listSMS && !writeSMS)
+        rules->respond( response, responseDelay, eol );
 
     // Set the variables.
     for ( int varNum = 0; varNum < variables.size(); ++varNum ) {
-    	QString variable = variables[varNum];
-	QString value = values[varNum];
-        int delay = delays.value(variable, 0);
-        QString val;
-
-        if ( value == "*" )
-            val = wild;
-        else {
-            int index = value.indexOf( "${*}" );
-            if ( index != -1 ) {
-                if ( wild.length() > 0 && wild[wild.length() - 1] == 0x1A ) {
-                    // Strip the terminating ^Z from SMS PDU's.
-                    wild = wild.left( wild.length() - 1 );
-                }
-
-                val = value.left( index ) + wild + value.mid( index + 4 );
-            } else
-                val = value;
+        const SimTemplate& value = values[varNum];
+        int delay = delays[varNum];
+        bool literal = ( value.text() == "*" );
+
+        if ( !literal && value.hasWildcard() && wild.length() > 0 &&
+             wild[wild.length() - 1] == 0x1A ) {
+            // Strip the terminating ^Z from SMS PDU's.
+            wild = wild.left( wild.length() - 1 );
         }
 
         if (delay) {
-            QVariantTimer *timer = new QVariantTimer(this->state()->rules());
-
-            timer->param = QVariant::fromValue(QPairKV(variable, val));
-
-            timer->setSingleShot( true );
-
-            connect(timer, SIGNAL(timeout()), this->state()->rules(),
-                    SLOT(delaySetVariable()));
-            timer->start( delay );
-        } else
-            state()->rules()->setVariable( variable, val );
+            SimTimerWheel::instance()->start
+                ( new SimDelayedSet( rules, variables[varNum],
+                                     literal ? 0 : &value, wild ),
+                  rules, delay );
+        } else if ( literal )
+            rules->storeVariable( variables[varNum], wild );
+        else
+            rules->storeVariable( variables[varNum], value.expand( rules, wild ) );
     }
 
     // Switch to the new state.
     if ( switchTo != QString() ) {
-        state()->rules()->switchTo( switchTo );
+        rules->switchTo( switchTo );
     }
 
     // Allocate a new call identifier or forget this call identifier.
     if ( newCallVar.length() > 0 ) {
-        state()->rules()->setVariable
-            ( newCallVar, QString::number( state()->rules()->newCall() ) );
+        rules->setVariable
+            ( newCallVar, QString::number( rules->newCall() ) );
     }
-    if ( forgetCallId.length() > 0 ) {
-        if ( forgetCallId == "*" )
+    if ( !forgetCallId.text().isEmpty() ) {
+        if ( forgetCallId.text() == "*" )
             if ( wild.length() == 0 )
-                state()->rules()->forgetAllCalls();
+                rules->forgetAllCalls();
             else
-                state()->rules()->forgetCall( wild.toInt() );
+                rules->forgetCall( wild.toInt() );
         else
-            state()->rules()->forgetCall
-                ( state()->rules()->expand( forgetCallId ).toInt() );
-    }
-    if ( listSMS && state()->rules()->getMachine() ) {
-        QString listSMSResponse;
-        QSMSMessageList &SMSList = state()->rules()->getMachine()->getSMSList();
-        QString status;
-
-        if ( state()->rules()->variable("MSGMEM") == "SM" ) {
-            for ( int i=0; i<SMSList.count(); i++ ) {
-                if ( SMSList.getDeletedFlag(i) == true )
-                    continue;
-
-                status = QString::number(SMSList.getStatus(i));
-                listSMSResponse.append("+CMGL: " + QString::number(i+1) + "," + status + ",," +
-                                       QString::number(SMSList.getLength(i)) + "\\n" +
-                                       PS_toHex( SMSList.readSMS(i) ) + "\\n");
-            }
+            rules->forgetCall
+                ( forgetCallId.expand( rules ).toInt() );
+    }
+    if ( listSMS && wild.trimmed() == "=?" ) {
+        // Report the <stat> values that can be listed.
+        if ( rules->variable("CMGF") == "1" )
+            rules->respond( "+CMGL: (\"REC UNREAD\",\"REC READ\",\"STO UNSENT\","
+                            "\"STO SENT\",\"ALL\")\\n\\nOK", responseDelay, eol );
+        else
+            rules->respond( "+CMGL: (0-4)\\n\\nOK", responseDelay, eol );
+    } else if ( listSMS && rules->getMachine() ) {
+        QSMSMessageList &SMSList = rules->getMachine()->getSMSList();
+        QList<int> list;
+
+        if ( rules->variable("MSGMEM") == "SM" ) {
+            // Only visit the slots that hold messages with the requested
+            // status, rather than scanning the whole store.
+            int stat = smsListStatus( wild );
+            if ( stat == 4 )
+                list = SMSList.indexes();
+            else if ( stat >= 0 )
+                list = SMSList.indexes( (QSMSMessageList::SMSStatus)stat );
         }
 
-	if (listSMSResponse.isEmpty())
-            listSMSResponse.append("+CMS ERROR: 321");
-	else
-            listSMSResponse.append("\\nOK");
-
-        state()->rules()->respond(listSMSResponse , responseDelay, eol );
+        // The records are encoded a chunk at a time as the output drains.
+        if ( list.isEmpty() )
+            rules->respond( "+CMS ERROR: 321", responseDelay, eol );
+        else
+            rules->startListing( new SimSMSListing( list, eol ), responseDelay );
     }
 
-    if ( deleteSMS && state()->rules()->getMachine() ) {
+    if ( deleteSMS && rules->getMachine() ) {
         QString deleteSMSResponse;
-        QSMSMessageList &SMSList = state()->rules()->getMachine()->getSMSList();
-        int index = wild.toInt();
-
-        if ( index > SMSList.count() || index <= 0 || (SMSList.getDeletedFlag(index-1) == true) ) {
+        QSMSMessageList &SMSList = rules->getMachine()->getSMSList();
+        QStringList args = wild.split( QChar(',') );
+        int index = args[0].toInt();
+        int delflag = ( args.size() > 1 ? args[1].toInt() : 0 );
+
+        if ( delflag >= 1 && delflag <= 4 ) {
+            // Delete by status, ignoring the index: 1 = read, 2 = also
+            // sent, 3 = also unsent, 4 = everything.
+            QList<int> list = SMSList.indexes( QSMSMessageList::REC_READ );
+            if ( delflag >= 2 )
+                list += SMSList.indexes( QSMSMessageList::STO_SENT );
+            if ( delflag >= 3 )
+                list += SMSList.indexes( QSMSMessageList::STO_UNSENT );
+            if ( delflag >= 4 )
+                list += SMSList.indexes( QSMSMessageList::REC_UNREAD );
+            foreach ( int i, list )
+                SMSList.deleteSMS(i);
+            deleteSMSResponse.append("OK");
+        } else if ( delflag != 0 || !SMSList.contains(index-1) ) {
             deleteSMSResponse.append("ERROR");
         } else {
             SMSList.deleteSMS(index-1);
             deleteSMSResponse.append("OK");
         }
+        rules->setVariable( "SMSUSED", QString::number( SMSList.count() ) );
+
+        rules->respond(deleteSMSResponse , responseDelay, eol );
+    }
+
+    if ( writeSMS && rules->getMachine() ) {
+        QString writeSMSResponse;
+        QSMSMessageList &SMSList = rules->getMachine()->getSMSList();
+
+        // The command is the PDU itself, and the arguments to the
+        // AT+CMGW that preceded it were saved in SMSWRITEARGS.
+        QString hex = cmd;
+        if ( hex.endsWith( QChar(0x1A) ) )
+            hex.chop( 1 );
+        QByteArray pdu = QAtUtils::fromHex( hex );
+        QStringList args = rules->variable( "SMSWRITEARGS" ).split( QChar(',') );
+        int stat = QSMSMessageList::STO_UNSENT;
+        if ( args.size() > 1 && !args[1].isEmpty() )
+            stat = args[1].toInt();
+
+        int index = -1;
+        if ( stat >= QSMSMessageList::REC_UNREAD && stat <= QSMSMessageList::STO_SENT ) {
+            index = SMSList.appendSMS
+                ( pdu, pdu.length() - QSMSMessage::pduAddressLength( pdu ),
+                  (QSMSMessageList::SMSStatus)stat );
+            if ( index >= 0 )
+                writeSMSResponse = "+CMGW: " + QString::number(index+1) + "\\n\\nOK";
+            else
+                writeSMSResponse = "+CMS ERROR: 322";   // Memory full.
+        } else {
+            writeSMSResponse = "ERROR";
+        }
+        rules->setVariable( "SMSUSED", QString::number( SMSList.count() ) );
 
-        state()->rules()->respond(deleteSMSResponse , responseDelay, eol );
+        rules->respond(writeSMSResponse , responseDelay, eol );
     }
 
-    if ( readSMS && state()->rules()->getMachine() ) {
+    if ( readSMS && rules->getMachine() ) {
         QString readSMSResponse;
-        QSMSMessageList &SMSList = state()->rules()->getMachine()->getSMSList();
+        QSMSMessageList &SMSList = rules->getMachine()->getSMSList();
         int index = wild.toInt();
 
-        if ( index > SMSList.count() || index <= 0 || (SMSList.getDeletedFlag(index-1) == true) ) {
+        if ( !SMSList.contains(index-1) ) {
             readSMSResponse.append("ERROR");
         } else {
             QString status = QString::number(SMSList.getStatus(index-1));
@@ -444,54 +716,36 @@ bool SimChat::command( const QString& cmd )
         }
 
 	readSMSResponse += "\\nOK";
-        state()->rules()->respond(readSMSResponse , responseDelay, eol );
+        rules->respond(readSMSResponse , responseDelay, eol );
     }
     return true;
 }
 
 
 SimUnsolicited::SimUnsolicited( SimState *state, SimXmlNode& e )
-    : SimItem( state ), done(false)
+    : SimItem( state )
 {
     QString delay = e.getAttribute( "delay" );
-    response = e.contents;
+    response = SimTemplate( state->ruleSet(), e.contents );
     if ( delay != QString() )
         responseDelay = delay.toInt();
     else
         responseDelay = 0;
     switchTo = e.getAttribute( "switch" );
     doOnce = e.getAttribute( "once" ) == "true";
-
-    timer = new QTimer( this );
-    timer->setSingleShot( true );
-    connect( timer, SIGNAL(timeout()), this, SLOT(timeout()) );
+    response.prerender( true );
 }
 
 
-void SimUnsolicited::enter()
+void SimUnsolicited::enter( SimRules *rules ) const
 {
-    if (!doOnce || !done)
-        timer->start( responseDelay );
+    rules->startUnsolicited( this );
 }
 
 
-void SimUnsolicited::leave()
+void SimUnsolicited::leave( SimRules *rules ) const
 {
-    timer->stop();
-}
-
-
-void SimUnsolicited::timeout()
-{
-    if (state() && state()->rules()) {
-        state()->rules()->unsolicited( response );
-
-        if ( switchTo != QString() ) {
-            state()->rules()->switchTo( switchTo );
-        }
-    }
-
-    done = true;
+    rules->stopUnsolicited( this );
 }
 
 static bool readXmlFile( SimXmlHandler *handler, const QString& filename )
@@ -516,7 +770,253 @@ static bool readXmlFile( SimXmlHandler *handler, const QString& filename )
     return !reader.hasError();
 }
 
-SimRules::SimRules( int fd, QObject *p,  const QString& filename, HardwareManipulatorFactory *hmf )
+// Append a character to "res" in UTF-8, combining surrogate pairs.
+static inline void appendUtf8( QByteArray& res, ushort ch,
+                               const QChar *& buf, const QChar *end )
+{
+    if ( ch < 0x80 ) {
+        res += (char)ch;
+    } else if ( ch < 0x800 ) {
+        res += (char)(0xC0 | (ch >> 6));
+        res += (char)(0x80 | (ch & 0x3F));
+    } else if ( ch >= 0xD800 && ch < 0xDC00 && buf < end &&
+                buf->unicode() >= 0xDC00 && buf->unicode() < 0xE000 ) {
+        uint ucs4 = 0x10000 + ( ( ch - 0xD800 ) << 10 ) +
+                    ( (buf++)->unicode() - 0xDC00 );
+        res += (char)(0xF0 | (ucs4 >> 18));
+        res += (char)(0x80 | ((ucs4 >> 12) & 0x3F));
+        res += (char)(0x80 | ((ucs4 >> 6) & 0x3F));
+        res += (char)(0x80 | (ucs4 & 0x3F));
+    } else {
+        res += (char)(0xE0 | (ch >> 12));
+        res += (char)(0x80 | ((ch >> 6) & 0x3F));
+        res += (char)(0x80 | (ch & 0x3F));
+    }
+}
+
+// Expand escapes and end of line markers in the data, and append the
+// UTF-8 bytes to be sent to the client to "res".
+static void appendEscaped( QByteArray& res, const QString& data, bool eol )
+{
+    static char const escapes[] = "\a\bcde\fghijklm\nopq\rs\tu\vwxyz";
+    const QChar *buf = data.constData();
+    const QChar *end = buf + data.length();
+    ushort ch;
+    ushort prevch = 0;
+
+    res.reserve( res.size() + data.length() + 4 );
+    res += "\r\n";
+
+    while ( buf < end && ( ch = (buf++)->unicode() ) != 0 ) {
+        if ( ch == '\n' ) {
+            res += "\r\n";
+        } else if ( ch == '\\' ) {
+            if ( buf >= end || buf->unicode() == 0 ) {
+                res += '\\';
+                break;
+            }
+            ch = (buf++)->unicode();
+            if ( ch == 'n' ) {
+                res += "\r\n";
+                ch = '\n';
+            } else if ( ch >= 'a' && ch <= 'z' ) {
+                ch = escapes[ch - 'a'];
+                res += (char)ch;
+            } else {
+                res += '\\';
+                appendUtf8( res, ch, buf, end );
+            }
+        } else if ( ch != '\r' ) {
+            appendUtf8( res, ch, buf, end );
+        }
+        prevch = ch;
+    }
+    if ( prevch != '\n' && eol )
+        res += "\r\n";
+}
+
+SimTemplate::SimTemplate( SimRuleSet *ruleSet, const QString& text )
+{
+    int prev, index, len, start, end;
+
+    _text = text;
+    literalLength = 0;
+    wireEol = false;
+
+    // Split the text into literals separated by ${name} references.
+    prev = 0;
+    len = text.length();
+    index = text.indexOf( QChar('$') );
+    while ( index != -1 ) {
+        if ( ( index + 1 ) < len && text[index + 1] == '{' ) {
+            start = index + 2;
+            end = text.indexOf( QChar('}'), start );
+            if ( end == -1 )
+                end = len;
+            literals += text.mid( prev, index - prev );
+            QString name = text.mid( start, end - start );
+            if ( name == "*" )
+                slotIds += -1;
+            else
+                slotIds += ruleSet->intern( name );
+            prev = qMin( end + 1, len );
+            index = text.indexOf( QChar('$'), prev );
+        } else {
+            index = text.indexOf( QChar('$'), index + 1 );
+        }
+    }
+    literals += text.mid( prev );
+
+    foreach ( QString literal, literals )
+        literalLength += literal.length();
+}
+
+void SimTemplate::expand( QString& out, const SimRules *rules,
+                          const QString& wild ) const
+{
+    if ( slotIds.isEmpty() ) {
+        out += _text;
+        return;
+    }
+    out.reserve( out.length() + literalLength + slotIds.size() * 16 );
+    out += literals[0];
+    for ( int i = 0; i < slotIds.size(); ++i ) {
+        int slot = slotIds[i];
+        if ( slot < 0 )
+            out += wild;
+        else
+            out += rules->slotValue( slot );
+        out += literals[i + 1];
+    }
+}
+
+void SimTemplate::prerender( bool eol )
+{
+    wire.clear();
+    if ( slotIds.isEmpty() ) {
+        appendEscaped( wire, _text, eol );
+        wireEol = eol;
+    }
+}
+
+QString SimTemplate::expand( const SimRules *rules, const QString& wild ) const
+{
+    if ( slotIds.isEmpty() )
+        return _text;
+    QString result;
+    expand( result, rules, wild );
+    return result;
+}
+
+SimRuleSet::SimRuleSet( const QString& filename )
+{
+    _fileName = filename;
+    defState = 0;
+
+    // Load the simulator rules into memory as a DOM-like tree.
+    handler = new SimXmlHandler();
+    if ( !readXmlFile( handler, filename ) ) {
+        qWarning() << filename << ": could not parse simulator rule file";
+        delete handler;
+        handler = 0;
+        return;
+    }
+
+    // Load the default state.
+    defState = new SimState( this, *(handler->documentElement()) );
+    states.append( defState );
+
+    // Load the other states, and the start state's name (if specified).
+    SimXmlNode *n = handler->documentElement()->children;
+    while ( n != 0 ) {
+        if ( n->tag == "state" ) {
+
+            // Load a new state definition.
+            SimState *state = new SimState( this, *n );
+            states.append( state );
+            if ( !namedStates.contains( state->name() ) )
+                namedStates.insert( state->name(), state );
+
+        } else if ( n->tag == "start" ) {
+
+            // Set a new start state.
+            start = n->getAttribute( "name" );
+
+        } else if ( n->tag == "filesystem" ) {
+
+            // Compile the SIM filesystem once for all connections.
+            fileImages.insert( n, new SimFileImage( *n ) );
+
+        } else if ( n->tag == "application" ) {
+
+            // Each application has its own ISIM filesystem.
+            SimXmlNode *child = n->children;
+            for ( ; child != 0; child = child->next ) {
+                if ( child->tag == "filesystem" )
+                    fileImages.insert( child, new SimFileImage( *child, FILE_SYSTEM_TYPE_ISIM ) );
+            }
+
+        }
+        n = n->next;
+    }
+}
+
+SimRuleSet::~SimRuleSet()
+{
+    qDeleteAll( profiles );
+    qDeleteAll( fileImages );
+    qDeleteAll( states );
+    delete handler;
+}
+
+const SimFileProfile *SimRuleSet::simProfile( const QString& fileName )
+{
+    QMutexLocker locker( &profileLock );
+    if ( profiles.contains( fileName ) )
+        return profiles.value( fileName );
+
+    // Remember a profile that cannot be opened as well, so that it is
+    // only reported once rather than for every connection.
+    SimFileProfile *profile = new SimFileProfile;
+    if ( !profile->open( fileName ) ) {
+        qWarning() << "Using the SIM filesystem from the rules instead of" << fileName;
+        delete profile;
+        profile = 0;
+    }
+    profiles.insert( fileName, profile );
+    return profile;
+}
+
+SimState *SimRuleSet::state( const QString& name ) const
+{
+    if ( name == "default" )
+        return defaultState();
+
+    SimState *state = namedStates.value( name, 0 );
+    if ( !state )
+        qWarning() << "Warning: no state called \"" << name << "\" has been defined";
+    return state;
+}
+
+int SimRuleSet::intern( const QString& name )
+{
+    QHash<QString, int>::ConstIterator it = slotIndex.find( name );
+    if ( it != slotIndex.constEnd() )
+        return it.value();
+    int slot = slotIndex.size();
+    slotIndex.insert( name, slot );
+    return slot;
+}
+
+SimXmlNode *SimRuleSet::documentElement() const
+{
+    if ( handler )
+        return handler->documentElement();
+    else
+        return 0;
+}
+
+SimRules::SimRules( int fd, QObject *p, SimRuleSet *rs, HardwareManipulatorFactory *hmf )
     : QTcpSocket(p)
 {
     setSocketDescriptor(fd);
@@ -562,15 +1062,23 @@ SimRules::SimRules( int fd, QObject *p,  const QString& filename, HardwareManipu
         this,SLOT(tryReadCommand()));
     connect(this,SIGNAL(disconnected()),
         this,SLOT(destruct()));
+    connect(this,SIGNAL(bytesWritten(qint64)),
+        this,SLOT(listingsDrained()));
     // Initialize the local state.
+    ruleSet = rs;
     currentState = 0;
     defState = 0;
     usedCallIds = 0;
     fileSystem = 0;
+    simProfile = 0;
+    smsTraffic = 0;
     useGsm0710 = false;
+    muxAdvanced = false;
+    muxFrameSize = GSM0710_BASIC_FRAME_SIZE;
+    flushPending = false;
+    listingPending = false;
+    listingStalled = false;
     currentChannel = 1;
-    incomingUsed = 0;
-    lineUsed = 0;
     defaultToolkitApp = toolkitApp = new DemoSimApplication( this, this );
     conformanceApp = new ConformanceSimApplication( this, this );
     connect( _callManager, SIGNAL(controlEvent(QSimControlEvent)),
@@ -582,36 +1090,18 @@ SimRules::SimRules( int fd, QObject *p,  const QString& filename, HardwareManipu
     if ( machine )
         machine->handleNewApp();
 
-    // Load the simulator rules into memory as a DOM-like tree.
-    SimXmlHandler *handler = new SimXmlHandler();
-    if ( !readXmlFile( handler, filename ) ) {
-        qWarning() << filename << ": could not parse simulator rule file";
-        delete handler;
+    // The rules themselves are parsed once and shared by all connections.
+    if ( !ruleSet->isValid() )
         return;
-    }
-
-    // Load the default state and set it as current.
-    defState = new SimState( this, *(handler->documentElement()) );
-    states.append( defState );
+    defState = ruleSet->defaultState();
+    slotValues.resize( ruleSet->slotCount() );
 
     initPhoneBooks();
 
-    // Load the other states, and the start state's name (if specified).
-    SimXmlNode *n = handler->documentElement()->children;
-    QString start = QString();
+    // Build the per-connection data described by the rule file.
+    SimXmlNode *n = ruleSet->documentElement()->children;
     while ( n != 0 ) {
-        if ( n->tag == "state" ) {
-
-            // Load a new state definition.
-            SimState *state = new SimState( this, *n );
-            states.append( state );
-
-        } else if ( n->tag == "start" ) {
-
-            // Set a new start state.
-            start = n->getAttribute( "name" );
-
-        } else if ( n->tag == "set" ) {
+        if ( n->tag == "set" ) {
 
             // Set the initial value of a variable.
             QString name = n->getAttribute( "name" );
@@ -632,7 +1122,9 @@ SimRules::SimRules( int fd, QObject *p,  const QString& filename, HardwareManipu
 
         } else if ( n->tag == "simauth" ) {
 
-            _simAuth = new SimAuth( this, *n );
+            _simAuth = new SimAuth( this, n->getAttribute( "ki" ),
+                                    n->getAttribute( "opc" ),
+                                    n->getAttribute( "sqn" ) );
 
         } else if ( n->tag == "application" ) {
             AidApplication *app = new AidApplication( this, *n );
@@ -643,238 +1135,120 @@ SimRules::SimRules( int fd, QObject *p,  const QString& filename, HardwareManipu
 
     if ( _applications.length() > 0 )
         _app_wrapper = new AidAppWrapper( this, _applications, _simAuth );
+    attachApplications();
 
-    // Clean up the XML reader objects.
-    delete handler;
+    // Size the SMS store so that AT+CPMS can report its real limits.
+    if ( machine ) {
+        QSMSMessageList& SMSList = machine->getSMSList();
+        int capacity = variable( "SMSCAPACITY" ).toInt();
+        if ( capacity > 0 && !SMSList.setCapacity( capacity ) )
+            qWarning() << "SMS store capacity" << capacity << "is too small";
+        setVariable( "SMSCAPACITY", QString::number( SMSList.capacity() ) );
+        setVariable( "SMSUSED", QString::number( SMSList.count() ) );
+    }
 
     // Set the start state appropriately.
-    currentState = state( start );
+    currentState = state( ruleSet->startState() );
     if ( !currentState )
         currentState = defState;
-    currentState->enter();
-}
-
-
-#define MAX_GSM0710_FRAME_SIZE      31
-
-
-static const unsigned char crcTable[256] = {
-    0x00, 0x91, 0xE3, 0x72, 0x07, 0x96, 0xE4, 0x75,
-    0x0E, 0x9F, 0xED, 0x7C, 0x09, 0x98, 0xEA, 0x7B,
-    0x1C, 0x8D, 0xFF, 0x6E, 0x1B, 0x8A, 0xF8, 0x69,
-    0x12, 0x83, 0xF1, 0x60, 0x15, 0x84, 0xF6, 0x67,
-    0x38, 0xA9, 0xDB, 0x4A, 0x3F, 0xAE, 0xDC, 0x4D,
-    0x36, 0xA7, 0xD5, 0x44, 0x31, 0xA0, 0xD2, 0x43,
-    0x24, 0xB5, 0xC7, 0x56, 0x23, 0xB2, 0xC0, 0x51,
-    0x2A, 0xBB, 0xC9, 0x58, 0x2D, 0xBC, 0xCE, 0x5F,
-    0x70, 0xE1, 0x93, 0x02, 0x77, 0xE6, 0x94, 0x05,
-    0x7E, 0xEF, 0x9D, 0x0C, 0x79, 0xE8, 0x9A, 0x0B,
-    0x6C, 0xFD, 0x8F, 0x1E, 0x6B, 0xFA, 0x88, 0x19,
-    0x62, 0xF3, 0x81, 0x10, 0x65, 0xF4, 0x86, 0x17,
-    0x48, 0xD9, 0xAB, 0x3A, 0x4F, 0xDE, 0xAC, 0x3D,
-    0x46, 0xD7, 0xA5, 0x34, 0x41, 0xD0, 0xA2, 0x33,
-    0x54, 0xC5, 0xB7, 0x26, 0x53, 0xC2, 0xB0, 0x21,
-    0x5A, 0xCB, 0xB9, 0x28, 0x5D, 0xCC, 0xBE, 0x2F,
-    0xE0, 0x71, 0x03, 0x92, 0xE7, 0x76, 0x04, 0x95,
-    0xEE, 0x7F, 0x0D, 0x9C, 0xE9, 0x78, 0x0A, 0x9B,
-    0xFC, 0x6D, 0x1F, 0x8E, 0xFB, 0x6A, 0x18, 0x89,
-    0xF2, 0x63, 0x11, 0x80, 0xF5, 0x64, 0x16, 0x87,
-    0xD8, 0x49, 0x3B, 0xAA, 0xDF, 0x4E, 0x3C, 0xAD,
-    0xD6, 0x47, 0x35, 0xA4, 0xD1, 0x40, 0x32, 0xA3,
-    0xC4, 0x55, 0x27, 0xB6, 0xC3, 0x52, 0x20, 0xB1,
-    0xCA, 0x5B, 0x29, 0xB8, 0xCD, 0x5C, 0x2E, 0xBF,
-    0x90, 0x01, 0x73, 0xE2, 0x97, 0x06, 0x74, 0xE5,
-    0x9E, 0x0F, 0x7D, 0xEC, 0x99, 0x08, 0x7A, 0xEB,
-    0x8C, 0x1D, 0x6F, 0xFE, 0x8B, 0x1A, 0x68, 0xF9,
-    0x82, 0x13, 0x61, 0xF0, 0x85, 0x14, 0x66, 0xF7,
-    0xA8, 0x39, 0x4B, 0xDA, 0xAF, 0x3E, 0x4C, 0xDD,
-    0xA6, 0x37, 0x45, 0xD4, 0xA1, 0x30, 0x42, 0xD3,
-    0xB4, 0x25, 0x57, 0xC6, 0xB3, 0x22, 0x50, 0xC1,
-    0xBA, 0x2B, 0x59, 0xC8, 0xBD, 0x2C, 0x5E, 0xCF
-};
-
-static int computeCrc( const char *data, uint len )
-{
-    int sum = 0xFF;
-    while ( len > 0 ) {
-        sum = crcTable[ ( sum ^ *data++ ) & 0xFF ];
-        --len;
-    }
-    return ((0xFF - sum) & 0xFF);
+    currentState->enter( this );
 }
 
 
 void SimRules::tryReadCommand()
 {
-    int len, posn;
-    int channel, type;
-    int temp, lasteol;
+    const char *payload;
+    int len, channel, type;
 
-    // Read as much data as possible into "incomingBuffer".
-    len = sizeof(incomingBuffer) - 1 - incomingUsed;
-    len = read( incomingBuffer + incomingUsed, len );
-    if ( len <= 0 ) {
+    // Take everything that is available from the socket.
+    QByteArray data = readAll();
+    if ( data.isEmpty() ) {
         // The connection has been closed by the remote end.
         return;
     }
-    incomingUsed += len;
 
-    // Split the incoming data into GSM 07.10 packets or text lines.
-    if ( useGsm0710 ) {
-        // Extract GSM 07.10 packets from the incoming buffer.
-        posn = 0;
-        while ( posn < incomingUsed ) {
-            if ( incomingBuffer[posn] == (char)0xF9 ) {
+    if ( !useGsm0710 ) {
+        processText( data.constData(), data.size() );
+        return;
+    }
 
-                // Skip additional 0xF9 bytes between frames.
-                while ( ( posn + 1 ) < incomingUsed &&
-                        incomingBuffer[posn + 1] == (char)0xF9 ) {
-                    ++posn;
-                }
+    // Extract GSM 07.10 packets from the incoming data.
+    muxDecoder.append( data );
+    while ( muxDecoder.nextFrame( channel, type, payload, len ) ) {
+
+        // Dispatch data packets to the appropriate channel.
+        if ( type != GSM0710_TYPE_UIH && type != GSM0710_TYPE_UI )
+            continue;
+        if ( channel == 0 ) {
+            if ( len == 2 &&
+                 payload[0] == (char)0xC3 &&
+                 payload[1] == (char)0x01 ) {
+                // This is the "terminate" commmand, which
+                // indicates that we should exit GSM 07.10 mode.
+                useGsm0710 = false;
+                qDebug() << "GSM 07.10 mode deactivated";
+                break;
+            }
+        } else {
+            // Ordinary data packet on a specific channel.  Each
+            // channel has its own line buffer, so partial lines
+            // on different channels cannot corrupt each other.
+            SimLineReader& reader = lineReaders[channel];
+            QString line;
+            reader.append( payload, len );
+            currentChannel = channel;
+            while ( !listingActive( channel ) && reader.nextLine( line ) )
+                command( line );
+            currentChannel = 1;
+        }
+    }
 
-                // We need at least 4 bytes for the header.
-                if ( ( posn + 4 ) > incomingUsed )
-                    break;
+    if ( !useGsm0710 ) {
+        // We've just exited GSM 07.10 mode.
+        QByteArray rest = muxDecoder.takeRemaining();
+        processText( rest.constData(), rest.size() );
+    }
+}
 
-                // The low bits of the second and fourth bytes should be 1,
-                // which indicates short channel number and length values.
-                if ( ( incomingBuffer[posn + 1] & 0x01 ) == 0 ||
-                     ( incomingBuffer[posn + 3] & 0x01 ) == 0 ) {
-                    ++posn;
-                    continue;
-                }
+bool SimRules::startMultiplexing( const QString& args )
+{
+    // AT+CMUX=<mode>[,<subset>[,<port_speed>[,<N1>[,...]]]]
+    QStringList params = args.split( QChar(',') );
+    bool ok;
 
-                // Get the packet length and validate it.
-                len = (incomingBuffer[posn + 3] >> 1) & 0x7F;
-                if ( ( posn + 5 + len ) > incomingUsed )
-                    break;
-
-                // Verify the packet header checksum.
-                if ( ( ( computeCrc( incomingBuffer + posn + 1, 3 ) ^
-                         incomingBuffer[posn + len + 4] ) & 0xFF ) != 0 ) {
-                    qDebug() << "*** GSM 07.10 checksum check failed ***";
-                    posn += len + 5;
-                    continue;
-                }
+    int mode = params[0].toInt( &ok );
+    if ( !ok || ( mode != 0 && mode != 1 ) )
+        return false;
 
-                // Get the channel number and packet type from the header.
-                channel = (incomingBuffer[posn + 1] >> 2) & 0x3F;
-                type = incomingBuffer[posn + 2] & 0xEF;  // Strip "PF" bit.
-
-                // Dispatch data packets to the appropriate channel.
-                if ( type == 0xEF || type == 0x03 ) {
-                    if ( channel == 0 ) {
-                        if ( len == 2 &&
-                             incomingBuffer[posn + 4] == (char)0xC3 &&
-                             incomingBuffer[posn + 5] == (char)0x01 ) {
-                            // This is the "terminate" commmand, which
-                            // indicates that we should exit GSM 07.10 mode.
-                            useGsm0710 = false;
-                            posn += len + 5;
-                            if ( posn < incomingUsed &&
-                                 incomingBuffer[posn] == (char)0xF9 ) {
-                                // Skip the trailing 0xF9 on the terminate.
-                                ++posn;
-                            }
-                            qDebug() << "GSM 07.10 mode deactivated";
-                            break;
-                        }
-                    } else {
-                        // Ordinary data packet on a specific channel.
-                        memcpy( lineBuffer + lineUsed,
-                                incomingBuffer + posn + 4, len );
-                        lineUsed += len;
-
-                        // Process any complete lines that we have received.
-                        lasteol = 0;
-                        temp = 0;
-                        currentChannel = channel;
-                        while ( temp < lineUsed ) {
-                            if ( lineBuffer[temp] == '\r' ) {
-                                lineBuffer[temp] = '\0';
-                                command( lineBuffer + lasteol );
-                                ++temp;
-                                if ( temp < lineUsed &&
-                                     lineBuffer[temp] == '\n' ) {
-                                    ++temp;
-                                }
-                                lasteol = temp;
-                            } else if ( lineBuffer[temp] == 0x1A ) {
-                                // Probably the terminator on an SMS PDU,
-                                // which may or may not be followed by a CR.
-                                lineBuffer[temp] = '\0';
-                                command( lineBuffer + lasteol );
-                                ++temp;
-                                if ( temp < lineUsed &&
-                                     lineBuffer[temp] == '\r' ) {
-                                    ++temp;
-                                }
-                                lasteol = temp;
-                            } else if ( lineBuffer[temp] == '\n' ) {
-                                lineBuffer[temp] = '\0';
-                                command( lineBuffer + lasteol );
-                                ++temp;
-                                lasteol = temp;
-                            } else {
-                                ++temp;
-                            }
-                        }
-                        currentChannel = 1;
-                        memmove( lineBuffer, lineBuffer + lasteol,
-                                 lineUsed - lasteol );
-                        lineUsed -= lasteol;
-                    }
-                }
-                posn += len + 5;
+    // Only UIH frames are supported.
+    if ( params.size() > 1 && !params[1].isEmpty() &&
+         params[1].toInt() != 0 )
+        return false;
 
-            } else {
-                // Skip garbage byte outside of a GSM 07.10 packet.
-                ++posn;
-            }
-        }
-        memmove( incomingBuffer, incomingBuffer + posn, incomingUsed - posn );
-        incomingUsed -= posn;
-        if ( !useGsm0710 )
-            goto processText;   // We've just exited GSM 07.10 mode.
-    } else {
-        // We aren't using multi-plexing yet, so split into text lines.
-    processText:
-        len = 0;
-        while ( len < incomingUsed ) {
-            if ( incomingBuffer[len] == '\r' ) {
-                if ( (len + 1) < incomingUsed &&
-                     incomingBuffer[len + 1] == '\n' ) {
-                    ++len;
-                }
-                lineBuffer[lineUsed] = '\0';
-                if ( lineBuffer[0] != (char)0xF9 ) {
-                    command( lineBuffer );
-                }
-                lineUsed = 0;
-            } else if ( incomingBuffer[len] == 0x1A ) {
-                // Probably the terminator on an SMS PDU,
-                // which may or may not be followed by a CR.
-                if ( (len + 1) < incomingUsed &&
-                     incomingBuffer[len + 1] == '\r' ) {
-                    ++len;
-                }
-                lineBuffer[lineUsed] = '\0';
-                if ( lineBuffer[0] != (char)0xF9 ) {
-                    command( lineBuffer );
-                }
-                lineUsed = 0;
-            } else if ( incomingBuffer[len] == '\n' ) {
-                lineBuffer[lineUsed] = '\0';
-                if ( lineBuffer[0] != (char)0xF9 ) {
-                    command( lineBuffer );
-                }
-                lineUsed = 0;
-            } else if ( lineUsed < (int)( sizeof(lineBuffer) - 1 ) ) {
-                lineBuffer[lineUsed++] = incomingBuffer[len];
-            }
-            ++len;
-        }
-        incomingUsed = 0;
+    int frameSize = ( mode == 1 ? GSM0710_ADVANCED_FRAME_SIZE
+                                : GSM0710_BASIC_FRAME_SIZE );
+    if ( params.size() > 3 && !params[3].isEmpty() ) {
+        frameSize = params[3].toInt( &ok );
+        if ( !ok || frameSize < 1 || frameSize > GSM0710_MAX_FRAME_SIZE )
+            return false;
+    }
+
+    // The caller switches to GSM 07.10 once the OK has gone out as text.
+    muxAdvanced = ( mode == 1 );
+    muxFrameSize = frameSize;
+    muxDecoder.setAdvanced( muxAdvanced );
+    return true;
+}
+
+void SimRules::processText( const char *data, int len )
+{
+    // We aren't using multi-plexing yet, so split into text lines.
+    SimLineReader& reader = lineReaders[0];
+    QString line;
+    reader.append( data, len );
+    while ( !listingActive( 0 ) && reader.nextLine( line ) ) {
+        if ( !line.startsWith( QChar(0xF9) ) )
+            command( line );
     }
 }
 
@@ -894,9 +1268,11 @@ void SimRules::destruct()
     if ( getMachine() )
         getMachine()->handleNewApp();
 
-    if ( defState )
-        delete defState;
-    defState = NULL;
+    // Cancel delayed responses and unsolicited notifications.
+    SimTimerWheel::instance()->cancel( this );
+    unsolicitedTimers.clear();
+    qDeleteAll( listings );
+    listings.clear();
 
     if ( _simAuth )
         delete _simAuth;
@@ -910,6 +1286,16 @@ void SimRules::destruct()
         delete fileSystem;
     fileSystem = NULL;
 
+    // The profile is owned by the rule set, and outlives the filesystems.
+    foreach ( AidApplication *app, _applications ) {
+        delete app->fs;
+        app->fs = NULL;
+    }
+    simProfile = NULL;
+
+    delete smsTraffic;
+    smsTraffic = NULL;
+
     if (machine) machine->deleteLater();
     deleteLater();
 }
@@ -921,6 +1307,92 @@ void SimRules::setPhoneNumber(const QString &s)
     if (machine) machine->setPhoneNumber(s);
 }
 
+void SimRules::setMessageStore(const QString &fileName)
+{
+    if ( !machine )
+        return;
+
+    // Any messages already in the file are available straight away.
+    // SMSSTORE names the file, or is empty if the store is in memory.
+    QSMSMessageList& SMSList = machine->getSMSList();
+    if ( machine->openMessageStore( fileName ) )
+        storeVariable( "SMSSTORE", fileName );
+    else
+        storeVariable( "SMSSTORE", QString() );
+    setVariable( "SMSCAPACITY", QString::number( SMSList.capacity() ) );
+    setVariable( "SMSUSED", QString::number( SMSList.count() ) );
+}
+
+void SimRules::setSimProfile(const QString &fileName)
+{
+    if ( simProfile )
+        return;
+
+    const SimFileProfile *profile = ruleSet->simProfile( fileName );
+    if ( !profile )
+        return;
+    simProfile = profile;
+
+    // Switch the SIM and its applications over to the profile's images.
+    const SimFileImage *image = profile->image();
+    if ( image ) {
+        delete fileSystem;
+        fileSystem = new SimFileSystem( this, image );
+    }
+    foreach ( AidApplication *app, _applications ) {
+        image = profile->image( app->getAid() );
+        if ( image ) {
+            delete app->fs;
+            app->fs = new SimFileSystem( this, image, FILE_SYSTEM_TYPE_ISIM );
+        }
+    }
+    attachApplications();
+}
+
+void SimRules::attachApplications()
+{
+    // Let SELECT by name find each application's ADF.
+    foreach ( AidApplication *app, _applications ) {
+        QByteArray aid = SimApduEngine::aidFromTemplate
+            ( QAtUtils::fromHex( app->getAid() ) );
+        if ( app->getType() == "USim" && fileSystem )
+            fileSystem->engine()->setAid( aid );
+        if ( app->fs )
+            app->fs->engine()->setAid( aid );
+    }
+}
+
+void SimRules::setSimJournal(const QString &fileName)
+{
+    // Each application's filesystem has a journal of its own.
+    if ( fileSystem && !fileSystem->setJournal( fileName ) )
+        qWarning() << "SIM updates will not be kept in" << fileName;
+    foreach ( AidApplication *app, _applications ) {
+        QString name = fileName + "-" + app->getAid();
+        if ( app->fs && !app->fs->setJournal( name ) )
+            qWarning() << "SIM updates will not be kept in" << name;
+    }
+}
+
+void SimRules::startSmsTraffic(const QString &spec)
+{
+    SimSmsTrafficConfig config;
+    if ( smsTraffic || !config.parse( spec ) )
+        return;
+
+    smsTraffic = new SimSmsTraffic( config, mPhoneNumber, this );
+    connect( smsTraffic, SIGNAL(send(QString)),
+             this, SLOT(respond(QString)) );
+    connect( smsTraffic, SIGNAL(unsolicited(QString)),
+             this, SLOT(unsolicited(QString)) );
+    connect( smsTraffic, SIGNAL(variable(QString,QString)),
+             this, SLOT(setVariable(QString,QString)) );
+    if ( machine ) {
+        connect( smsTraffic, SIGNAL(store(QSMSMessage)),
+                 machine, SLOT(sendSMS(QSMSMessage)) );
+    }
+}
+
 HardwareManipulator * SimRules::getMachine() const
 {
     return machine;
@@ -947,28 +1419,53 @@ void SimRules::switchTo(const QString& name)
     SimState *newState = state( name );
     if ( newState ) {
         if ( currentState )
-            currentState->leave();
+            currentState->leave( this );
         currentState = newState;
-        currentState->enter();
+        currentState->enter( this );
     }
 }
 
 
 SimState *SimRules::state( const QString& name ) const
 {
-    if ( name == "default" )
-        return defaultState();
+    if ( name.isEmpty() )
+        return 0;
+    return ruleSet->state( name );
+}
 
-    QList<SimState *>::ConstIterator iter;
-    for ( iter = states.begin(); iter != states.end(); ++iter ) {
 
-        if ( (*iter)->name() == name ) {
-            return *iter;
-        }
+void SimRules::startUnsolicited( const SimUnsolicited *item )
+{
+    if ( item->doOnce && unsolicitedDone.contains( item ) )
+        return;
+
+    // Restart the timer if it is already running.
+    stopUnsolicited( item );
+    SimTimerEntry *entry = new SimUnsolicitedEntry( this, item );
+    unsolicitedTimers.insert( item, entry );
+    SimTimerWheel::instance()->start( entry, this, item->responseDelay );
+}
+
+
+void SimRules::stopUnsolicited( const SimUnsolicited *item )
+{
+    SimTimerEntry *entry = unsolicitedTimers.take( item );
+    if ( entry )
+        SimTimerWheel::instance()->cancel( entry );
+}
+
+
+void SimRules::unsolicitedTimeout( const SimUnsolicited *item )
+{
+    unsolicitedTimers.remove( item );
+
+    unsolicited( item->response );
 
+    if ( item->switchTo != QString() ) {
+        switchTo( item->switchTo );
     }
-    qWarning() << "Warning: no state called \"" << name << "\" has been defined";
-    return 0;
+
+    unsolicitedDone.insert( item );
 }
 
 bool SimRules::simCsimOk( const QByteArray& payload )
@@ -1038,16 +1535,17 @@ bool SimRules::simCommand( const QString& cmd )
         return false;
     }
 
-    if ( param[0] != (char)0xA0 ) {
-        /* CLA not supported */
-        respond( "+CSIM: 4,6800\\n\\nOK" );
-        return false;
-    }
+    // Toolkit commands come in the GSM class, or the proprietary UICC
+    // class; everything else is for the APDU engine.
+    quint8 cla = (quint8)param[0];
+    bool toolkit = ( cla == 0xA0 || ( cla & 0xF0 ) == 0x80 );
 
     // Determine what kind of command we are dealing with.
     // Check for TERMINAL PROFILE, FETCH, TERMINAL RESPONSE,
     // ENVELOPE and UNBLOCK CHV packets.
-    if ( param[1] == (char)0x10 ) {
+    if ( !toolkit && !( cla == 0x00 && param[1] == (char)0x2c ) ) {
+        // Not a toolkit command.
+    } else if ( param[1] == (char)0x10 ) {
         /* Abort the SIM application and force it to return to the main menu. */
         if ( toolkitApp )
             toolkitApp->abort();
@@ -1093,7 +1591,7 @@ bool SimRules::simCommand( const QString& cmd )
         // UNBLOCK CHV command, for resetting a PIN using a PUK.
         QString pinName = "PINVALUE";
         QString pukName = "PUKVALUE";
-        if ( param[3] == (char)0x02 ) {
+        if ( param[3] == (char)0x02 || param[3] == (char)0x81 ) {
             pinName = "PIN2VALUE";
             pukName = "PUK2VALUE";
         }
@@ -1106,7 +1604,8 @@ bool SimRules::simCommand( const QString& cmd )
         if ( QString::fromUtf8( pukValue ) != variable( pukName ) ) {
             respond( "+CSIM: 4,9804\\n\\nOK" );
         } else {
-            setVariable( pinName, QString::fromUtf8( pinValue ) );
+            unblockPin( pinName == "PINVALUE" ? 0 : 1,
+                        QString::fromUtf8( pinValue ) );
             simCsimOk( QByteArray() );
         }
 
@@ -1125,7 +1624,13 @@ bool SimRules::simCommand( const QString& cmd )
         /* Envelope not supported or current command doesn't allow envelopes. */
         respond( "+CSIM: 4,6F00\\n\\nOK" );
         return true;
-    } else if ( param[1] == (char)0xf2 ) {
+    }
+
+    // Everything else operates on the SIM's files.
+    if ( fileSystem )
+        return simCsimResponse( fileSystem->engine()->execute( param ) );
+
+    if ( toolkit && param[1] == (char)0xf2 ) {
         /* STATUS command, for now ignore the parameters */
         return simCsimOk( QByteArray() );
     }
@@ -1135,6 +1640,18 @@ bool SimRules::simCommand( const QString& cmd )
     return true;
 }
 
+bool SimRules::simCsimResponse( const QByteArray& resp )
+{
+    // Successful responses may also report a pending toolkit command.
+    int size = resp.size();
+    if ( size >= 2 && resp[size - 2] == (char)0x90 && resp[size - 1] == (char)0x00 )
+        return simCsimOk( resp.left( size - 2 ) );
+
+    respond( "+CSIM: " + QString::number( size * 2 ) + "," +
+             QAtUtils::toHex( resp ) + "\\n\\nOK" );
+    return true;
+}
+
 void SimRules::command( const QString& cmd )
 {
     if(getMachine())
@@ -1147,11 +1664,15 @@ void SimRules::command( const QString& cmd )
     if (_app_wrapper && _app_wrapper->command( cmd ))
         return;
 
+    // Acknowledgements for generated SMS traffic.
+    if ( smsTraffic && smsTraffic->command( cmd ) )
+        return;
+
     // Process SIM toolkit related commands with the current SIM application.
     if ( simCommand( cmd ) )
         return;
 
-    if ( ! currentState->command( cmd ) ) {
+    if ( ! currentState->command( this, cmd ) ) {
         if ( cmd.startsWith( "AT+CRSM=" ) && fileSystem ) {
 
             // Process a filesystem access command.
@@ -1164,11 +1685,20 @@ void SimRules::command( const QString& cmd )
             // Process a phonebook access command.
             phoneBook( cmd );
 
-        } else if ( cmd.startsWith( "AT+CMUX=0," ) ) {
+        } else if ( cmd == "AT+CMUX=?" ) {
+
+            // Report the supported GSM 07.10 parameters.
+            respond( "+CMUX: (0,1),(0),(1-6),(1-32767),(1-255),(0-100),(2-255),(1-255),(1-7)\\n\\nOK" );
+
+        } else if ( cmd.startsWith( "AT+CMUX=" ) ) {
 
             // Request to turn on GSM 07.10 multiplexing.
-            respond( "OK" );
-            useGsm0710 = true;
+            if ( startMultiplexing( cmd.mid(8) ) ) {
+                respond( "OK" );
+                useGsm0710 = true;
+            } else {
+                respond( "ERROR" );
+            }
 
         } else if ( cmd.startsWith( "AT+CPWD=\"SC\",\"" ) ) {
 
@@ -1346,7 +1876,7 @@ void SimRules::loadPhoneBook( SimXmlNode& node )
 
 QString SimRules::convertCharset( const QString& str )
 {
-    if ( variables["SCS"] == "UCS2" ) {
+    if ( variable("SCS") == "UCS2" ) {
         static const char hexchars[] = "0123456789ABCDEF";
         const QChar *c = str.unicode();
         int length = str.length();
@@ -1432,55 +1962,9 @@ void SimRules::phoneBook( const QString& cmd )
             first = args.left(comma).toInt();
             last = args.mid(comma + 1).toInt();
         }
-        while ( first <= last ) {
-            QString number = pb->number( first );
-            QString name = convertCharset( pb ->name( first ) );
-            int hidden = pb->hidden( first );
-            QString group = convertCharset( pb->group( first ) );
-            QString adNumber = pb->adNumber( first );
-            QString secondText = convertCharset( pb->secondText( first ) );
-            QString email = convertCharset( pb->email( first ) );
-            QString sipUri = convertCharset( pb->sipUri( first ) );
-            QString telUri = convertCharset( pb->telUri( first ) );
-            if ( !number.isEmpty() ) {
-                QString s = "+CPBR: " + QString::number( first ) + "," +
-                         QAtUtils::encodeNumber( number ) + ",\"" +
-                         QAtUtils::quote( name ) + "\"";
-                if (hidden != INVALID_VALUE_HIDDEN) {
-                    s += "," + QString::number( hidden );
-                } else
-                    goto out;
-                if ( !group.isEmpty() ) {
-                    s += ",\"" + QAtUtils::quote( group ) + "\"";
-                } else
-                    goto out;
-                if ( !adNumber.isEmpty() ) {
-                    s += "," + QAtUtils::encodeNumber( adNumber );
-                } else
-                    goto out;
-                if ( !secondText.isEmpty() ) {
-                    s += ",\"" + QAtUtils::quote( secondText ) + "\"";
-                } else
-                    goto out;
-                if ( !email.isEmpty() ) {
-                    s += ",\"" + QAtUtils::quote( email ) + "\"";
-                } else
-                    goto out;
-                if ( !sipUri.isEmpty() ) {
-                    s += ",\"" + QAtUtils::quote( sipUri ) + "\"";
-                } else
-                    goto out;
-                if ( !telUri.isEmpty() ) {
-                    s += ",\"" + QAtUtils::quote( telUri ) + "\"";
-                } else
-                    goto out;
-
-out:
-                respond( s );
-            }
-            ++first;
-        }
-        respond( "OK" );
+
+        // Long ranges are sent a chunk at a time by the listing.
+        startListing( new SimPhoneBookListing( pb, first, last ), 0 );
     } else if ( cmd.startsWith( "AT+CPBW=" ) ) {
         uint posn = 8;
         int index = (int)QAtUtils::parseNumber( cmd, posn );
@@ -1527,6 +2011,52 @@ out:
     }
 }
 
+bool SimRules::pinVerified( int pin )
+{
+    if ( pin )
+        return !variable( "PIN2VERIFIED" ).isEmpty();
+    return variable( "PINNAME" ) == "READY";
+}
+
+int SimRules::pinRetries( int pin )
+{
+    QString count = variable( pin ? "PIN2RETRYCOUNT" : "PINRETRYCOUNT" );
+    if ( count.isEmpty() )
+        return PIN_MAX_RETRIES;
+    return qBound( 0, count.toInt(), PIN_MAX_RETRIES );
+}
+
+bool SimRules::verifyPin( int pin, const QString& value )
+{
+    int retries = pinRetries( pin );
+    if ( !retries )
+        return false;
+    if ( value == variable( pin ? "PIN2VALUE" : "PINVALUE" ) ) {
+        storeVariable( pin ? "PIN2RETRYCOUNT" : "PINRETRYCOUNT",
+                       QString::number( PIN_MAX_RETRIES ) );
+        storeVariable( pin ? "PIN2VERIFIED" : "PINNAME", pin ? "1" : "READY" );
+        return true;
+    }
+
+    // A wrong PIN1 leaves a disabled PIN alone until it is blocked.
+    --retries;
+    storeVariable( pin ? "PIN2RETRYCOUNT" : "PINRETRYCOUNT",
+                   QString::number( retries ) );
+    if ( pin )
+        storeVariable( "PIN2VERIFIED", QString() );
+    else if ( !retries )
+        storeVariable( "PINNAME", "SIM PUK" );
+    return false;
+}
+
+void SimRules::unblockPin( int pin, const QString& value )
+{
+    storeVariable( pin ? "PIN2VALUE" : "PINVALUE", value );
+    storeVariable( pin ? "PIN2RETRYCOUNT" : "PINRETRYCOUNT",
+                   QString::number( PIN_MAX_RETRIES ) );
+    storeVariable( pin ? "PIN2VERIFIED" : "PINNAME", pin ? "1" : "READY" );
+}
+
 void SimRules::changePin( const QString& cmd )
 {
     QStringList parts = cmd.split(QChar('"'));
@@ -1548,6 +2078,103 @@ void SimRules::changePin( const QString& cmd )
     respond( "OK" );
 }
 
+// Format a phone book entry for AT+CPBR, or return an empty string
+// if the entry is not in use.
+QString SimRules::phoneBookEntry( SimPhoneBook *pb, int index )
+{
+    QString number = pb->number( index );
+    if ( number.isEmpty() )
+        return QString();
+
+    QString name = convertCharset( pb ->name( index ) );
+    int hidden = pb->hidden( index );
+    QString group = convertCharset( pb->group( index ) );
+    QString adNumber = pb->adNumber( index );
+    QString secondText = convertCharset( pb->secondText( index ) );
+    QString email = convertCharset( pb->email( index ) );
+    QString sipUri = convertCharset( pb->sipUri( index ) );
+    QString telUri = convertCharset( pb->telUri( index ) );
+    QString s = "+CPBR: " + QString::number( index ) + "," +
+             QAtUtils::encodeNumber( number ) + ",\"" +
+             QAtUtils::quote( name ) + "\"";
+    if (hidden != INVALID_VALUE_HIDDEN) {
+        s += "," + QString::number( hidden );
+    } else
+        return s;
+    if ( !group.isEmpty() ) {
+        s += ",\"" + QAtUtils::quote( group ) + "\"";
+    } else
+        return s;
+    if ( !adNumber.isEmpty() ) {
+        s += "," + QAtUtils::encodeNumber( adNumber );
+    } else
+        return s;
+    if ( !secondText.isEmpty() ) {
+        s += ",\"" + QAtUtils::quote( secondText ) + "\"";
+    } else
+        return s;
+    if ( !email.isEmpty() ) {
+        s += ",\"" + QAtUtils::quote( email ) + "\"";
+    } else
+        return s;
+    if ( !sipUri.isEmpty() ) {
+        s += ",\"" + QAtUtils::quote( sipUri ) + "\"";
+    } else
+        return s;
+    if ( !telUri.isEmpty() )
+        s += ",\"" + QAtUtils::quote( telUri ) + "\"";
+    return s;
+}
+
+bool SimSMSListing::encode( SimRules *rules, QByteArray& out, int count )
+{
+    HardwareManipulator *machine = rules->getMachine();
+
+    if ( posn == 0 )
+        out += "\r\n";
+    while ( count-- > 0 && posn < indexes.size() ) {
+        // Skip messages that were deleted on another channel after
+        // the listing started.
+        int i = indexes[posn++];
+        if ( !machine || !machine->getSMSList().contains( i ) )
+            continue;
+        QSMSMessageList& SMSList = machine->getSMSList();
+        out += "+CMGL: ";
+        out += QByteArray::number( i + 1 );
+        out += ',';
+        out += QByteArray::number( (int)SMSList.getStatus( i ) );
+        out += ",,";
+        out += QByteArray::number( SMSList.getLength( i ) );
+        out += "\r\n";
+        appendHex( out, SMSList.readSMS( i ) );
+        out += "\r\n";
+    }
+    if ( posn < indexes.size() )
+        return true;
+
+    out += "\r\nOK";
+    if ( eol )
+        out += "\r\n";
+    return false;
+}
+
+bool SimPhoneBookListing::encode( SimRules *rules, QByteArray& out, int count )
+{
+    // Entries are not expanded, as names may legitimately contain '$'.
+    if ( last > pb->size() )
+        last = pb->size();
+    while ( count-- > 0 && first <= last ) {
+        QString s = rules->phoneBookEntry( pb, first++ );
+        if ( !s.isEmpty() )
+            appendEscaped( out, s, true );
+    }
+    if ( first <= last )
+        return true;
+
+    appendEscaped( out, "OK", true );
+    return false;
+}
+
 SimPhoneBook *SimRules::currentPB() const
 {
     if ( phoneBooks.contains( currentPhoneBook ) )
@@ -1580,66 +2207,39 @@ void SimRules::forgetAllCalls()
     usedCallIds = 0;
 }
 
-QString expandEscapes( const QString& data, bool eol )
+void SimRules::respond( const QString& resp, int delay, bool eol )
 {
-    // Expand escapes and end of line markers in the data.
-    static char const escapes[] = "\a\bcde\fghijklm\nopq\rs\tu\vwxyz";
-    QByteArray res;
-    QByteArray buffer = data.toUtf8();
-    const char *buf = buffer.data();
-    int ch;
-    int prevch = 0;
+    QByteArray escaped;
+    appendEscaped( escaped, expand( resp ), eol );
+    respondBytes( escaped, delay );
+}
 
-    res += ( '\r' );
-    res += ( '\n' );
+void SimRules::respond( const SimTemplate& resp, int delay, bool eol )
+{
+    respondBytes( render( resp, eol ), delay );
+}
 
-    while ( ( ch = *buf++ ) != '\0' ) {
-        if ( ch == '\n' ) {
-            res += ( '\r' );
-            res += ( '\n' );
-        } else if ( ch == '\\' ) {
-            ch = *buf++;
-            if ( ch == '\0' ) {
-                res += ( '\\' );
-                break;
-            } else if ( ch == 'n' ) {
-                res += ( '\r' );
-                res += ( '\n' );
-                ch = '\n';
-            } else if ( ch >= 'a' && ch <= 'z' ) {
-                ch = escapes[ch - 'a'];
-                res += ( ch );
-            } else {
-                res += ( '\\' );
-                res += ( ch );
-            }
-        } else if ( ch != '\r' ) {
-            res += ( ch );
-        }
-        prevch = ch;
-    }
-    if ( prevch != '\n' && eol ) {
-        res += ( '\r' );
-        res += ( '\n' );
-    }
+QByteArray SimRules::render( const SimTemplate& resp, bool eol )
+{
+    // Static responses were converted to wire format when loaded.
+    if ( resp.isPrerendered( eol ) )
+        return resp.wireData();
 
-    return QString::fromUtf8(res.data());
+    // Expand into a buffer that is reused from one response to the next.
+    expandBuffer.resize( 0 );
+    resp.expand( expandBuffer, this );
+    QByteArray escaped;
+    appendEscaped( escaped, expandBuffer, eol );
+    return escaped;
 }
 
-
-void SimRules::respond( const QString& resp, int delay, bool eol )
+void SimRules::respondBytes( const QByteArray& escaped, int delay )
 {
-    QString r = expand( resp );
-    QByteArray escaped = expandEscapes( r, eol ).toUtf8();
-
     if ( !delay ) {
-        writeChatData(escaped.data(), escaped.length());
-        flush();
+        writeChatData(escaped.constData(), escaped.length());
     } else {
-        SimDelayTimer *timer = new SimDelayTimer( escaped, currentChannel );
-        timer->setSingleShot( true );
-        connect(timer,SIGNAL(timeout()),this,SLOT(delayTimeout()));
-        timer->start( delay );
+        SimTimerWheel::instance()->start
+            ( new SimDelayedResponse( this, escaped, currentChannel ), this, delay );
     }
     if(getMachine())
         getMachine()->handleFromData(QString(escaped));
@@ -1661,25 +2261,12 @@ void SimRules::callControlEventNotify( const QSimControlEvent& evt )
               "," + QAtUtils::toHex( evt.toPdu() ) );
 }
 
-void SimRules::delayTimeout()
+void SimRules::delayedResponse( const QByteArray& response, int channel )
 {
-    SimDelayTimer *timer = (SimDelayTimer *)sender();
     int save = currentChannel;
-    currentChannel = timer->channel;
-    writeChatData(timer->response.toLatin1().data(), timer->response.length());
-    flush();
+    currentChannel = channel;
+    writeChatData( response.constData(), response.length() );
     currentChannel = save;
-    timer->deleteLater();
-}
-
-void SimRules::delaySetVariable()
-{
-    QVariantTimer *timer = (QVariantTimer *)sender();
-    QPairKV kv = timer->param.value<QPairKV>();
-
-    setVariable( kv.first, kv.second );
-
-    delete timer;
 }
 
 void SimRules::dialCheck( const QString& number, bool& ok )
@@ -1709,27 +2296,15 @@ void SimRules::dialCheck( const QString& number, bool& ok )
 
 void SimRules::unsolicited( const QString& resp )
 {
-    QString r = expand( resp );
-
-    QByteArray escaped = expandEscapes( r, true ).toUtf8();
-    writeChatData( escaped , escaped.length() );
-    flush();
+    QByteArray escaped;
+    appendEscaped( escaped, expand( resp ), true );
+    writeChatData( escaped.constData(), escaped.length() );
 }
 
-
-void SimRules::writeGsmFrame( int type, const char *data, uint len )
+void SimRules::unsolicited( const SimTemplate& resp )
 {
-    char frame[MAX_GSM0710_FRAME_SIZE + 6];
-    frame[0] = (char)0xF9;
-    frame[1] = (char)((currentChannel << 2) | 0x03);
-    frame[2] = (char)type;
-    frame[3] = (char)((len << 1) | 0x01);
-    if ( len > 0 )
-        memcpy( frame + 4, data, len);
-    // Note: GSM 07.10 says that the CRC is only computed over the header.
-    frame[len + 4] = (char)computeCrc( frame + 1, 3 );
-    frame[len + 5] = (char)0xF9;
-    write( frame, len + 6 );
+    QByteArray escaped = render( resp, true );
+    writeChatData( escaped.constData(), escaped.length() );
 }
 
 
@@ -1737,41 +2312,159 @@ void SimRules::writeChatData( const char *data, uint len )
 {
     if ( !isOpen() )
         return;
+    if ( !len )
+        return;
+
+    // Queue the data, framing it now so that a later change of mode
+    // does not affect output that has already been generated.
     if ( !useGsm0710 ) {
         // We aren't using multi-plexing at present.
-        write( data, len );
+        outgoing.append( data, len );
     } else {
-        // Format GSM 07.10 frames and send them via the current channel.
-        uint templen;
-        while ( len > 0 ) {
-            templen = len;
-            if ( templen > MAX_GSM0710_FRAME_SIZE ) {
-                templen = MAX_GSM0710_FRAME_SIZE;
-            }
-            writeGsmFrame( 0xEF, data, templen );
-            data += templen;
-            len -= templen;
-        }
+        // Format GSM 07.10 frames for the current channel.
+        gsm0710AppendFrames( outgoing, muxAdvanced, currentChannel,
+                             GSM0710_TYPE_UIH, data, len, muxFrameSize );
+    }
+
+    // Everything produced while handling the current event is
+    // sent with a single write once control returns to the event loop.
+    if ( !flushPending ) {
+        flushPending = true;
+        QMetaObject::invokeMethod( this, "flushOutgoing", Qt::QueuedConnection );
+    }
+}
+
+void SimRules::startListing( SimListing *listing, int delay )
+{
+    listing->channel = currentChannel;
+    listing->reader = ( useGsm0710 ? currentChannel : 0 );
+    listings.append( listing );
+    if ( delay ) {
+        SimTimerWheel::instance()->start
+            ( new SimDelayedListing( this, listing ), this, delay );
+    } else {
+        listingReady( listing );
+    }
+}
+
+void SimRules::listingReady( SimListing *listing )
+{
+    listing->ready = true;
+    scheduleListings();
+}
+
+void SimRules::scheduleListings()
+{
+    if ( !listingPending ) {
+        listingPending = true;
+        QMetaObject::invokeMethod( this, "continueListings", Qt::QueuedConnection );
+    }
+}
+
+void SimRules::continueListings()
+{
+    listingPending = false;
+
+    // Wait for bytesWritten() if the client is not keeping up, rather
+    // than buffering the whole listing in memory.
+    if ( outgoing.size() + bytesToWrite() > LISTING_MAX_BACKLOG ) {
+        listingStalled = true;
+        return;
+    }
+
+    // Encode the next chunk of every listing that is ready to run.
+    bool more = false;
+    QList<SimListing *> active = listings;
+    foreach ( SimListing *listing, active ) {
+        // Commands run by finishListing() may have changed the list.
+        if ( !listings.contains( listing ) || !listing->ready )
+            continue;
+        listingBuffer.resize( 0 );
+        bool done = !listing->encode( this, listingBuffer, LISTING_CHUNK_RECORDS );
+        int save = currentChannel;
+        currentChannel = listing->channel;
+        writeChatData( listingBuffer.constData(), listingBuffer.size() );
+        currentChannel = save;
+        if ( getMachine() )
+            getMachine()->handleFromData( QString( listingBuffer ) );
+        if ( done )
+            finishListing( listing );
+        else
+            more = true;
+    }
+    if ( more )
+        scheduleListings();
+}
+
+void SimRules::listingsDrained()
+{
+    if ( listingStalled && outgoing.size() + bytesToWrite() <= LISTING_MAX_BACKLOG / 2 ) {
+        listingStalled = false;
+        scheduleListings();
+    }
+}
+
+bool SimRules::listingActive( int reader ) const
+{
+    foreach ( SimListing *listing, listings ) {
+        if ( listing->reader == reader )
+            return true;
+    }
+    return false;
+}
+
+void SimRules::finishListing( SimListing *listing )
+{
+    int reader = listing->reader;
+    int channel = listing->channel;
+    listings.removeAll( listing );
+    delete listing;
+
+    // Process the commands that arrived on the channel while the
+    // listing was being sent.
+    SimLineReader& lines = lineReaders[reader];
+    QString line;
+    int save = currentChannel;
+    currentChannel = channel;
+    while ( !listingActive( reader ) && lines.nextLine( line ) ) {
+        if ( reader != 0 || !line.startsWith( QChar(0xF9) ) )
+            command( line );
+    }
+    currentChannel = save;
+}
+
+void SimRules::flushOutgoing()
+{
+    flushPending = false;
+    if ( outgoing.isEmpty() )
+        return;
+    if ( isOpen() ) {
+        write( outgoing );
+        flush();
     }
+    outgoing.clear();
 }
 
 
 QString SimRules::expand( const QString& s )
 {
     int prev, index, len, start, end;
-    QString result;
-    QString name;
 
     index = s.indexOf( QChar('$') );
     if ( index == -1 )
         return s;
 
+    // Expand in a single pass, with no temporary strings for the
+    // literal text between variable references.
+    QString result;
+    result.reserve( s.length() + 32 );
+    const QChar *data = s.constData();
     prev = 0;
     len = s.length();
     do {
-        result += s.mid( prev, index - prev );
+        result.append( data + prev, index - prev );
         ++index;
-        if ( index < len && s[index] == '{' ) {
+        if ( index < len && data[index] == '{' ) {
             ++index;
             start = index;
             end = s.indexOf( QChar('}'), index );
@@ -1781,15 +2474,14 @@ QString SimRules::expand( const QString& s )
             } else {
                 index = end + 1;
             }
-            name = s.mid( start, end - start );
-            result += variable(name);
+            result += variable( QString::fromRawData( data + start, end - start ) );
         } else {
-            result += "$";
+            result += QChar('$');
         }
         prev = index;
         index = s.indexOf( QChar('$'), index );
     } while ( index != -1 );
-    result += s.mid( prev );
+    result.append( data + prev, len - prev );
     return result;
 }
 
@@ -1808,11 +2500,27 @@ void SimRules::queryState( )
 
 void SimRules::setVariable( const QString& name, const QString& value )
 {
-        variables[name] = expand(value);
+    storeVariable( name, expand(value) );
 }
 
-QString SimRules::variable( const QString& name )
+void SimRules::storeVariable( const QString& name, const QString& value )
 {
-    return variables[name];
+    int slot = ruleSet->slot( name );
+    if ( slot >= 0 && slot < slotValues.size() )
+        slotValues[slot] = value;
+    else
+        otherVariables[name] = value;
+}
 
+void SimRules::storeVariable( int slot, const QString& value )
+{
+    slotValues[slot] = value;
+}
+
+QString SimRules::variable( const QString& name )
+{
+    int slot = ruleSet->slot( name );
+    if ( slot >= 0 && slot < slotValues.size() )
+        return slotValues.at( slot );
+    return otherVariables.value( name );
 }
@@ -29,9 +29,16 @@
 #include <qtcpsocket.h>
 #include <qapplication.h>
 #include <qmap.h>
+#include <qhash.h>
+#include <qset.h>
+#include <qvector.h>
+#include <qregexp.h>
 #include <qtimer.h>
 #include <qpointer.h>
+#include <qmutex.h>
 #include <qsimcontrolevent.h>
+#include "gsm0710.h"
+#include "simtimerwheel.h"
 
 #include <string.h>
 #include <stdlib.h>
@@ -46,17 +53,24 @@
 #include <netinet/in.h>
 
 
+class SimRuleSet;
 class SimState;
 class SimItem;
 class SimChat;
 class SimUnsolicited;
 class SimRules;
 class SimFileSystem;
+class SimFileImage;
+class SimFileProfile;
 class CallManager;
 class SimApplication;
 class SimAuth;
 class AidApplication;
 class AidAppWrapper;
+class SimSmsTraffic;
+
+// Convert binary data into upper case hex, for PDUs in responses.
+QString PS_toHex( const QByteArray& binary );
 
 
 class SimXmlNode
@@ -93,54 +107,164 @@ private:
 };
 
 
+// A string containing ${name} variable references, split into literal
+// text and interned variable slots when the rules are loaded.
+class SimTemplate
+{
+public:
+    SimTemplate() { literalLength = 0; wireEol = false; }
+    SimTemplate( SimRuleSet *ruleSet, const QString& text );
+
+    // Get the original text of the template.
+    QString text() const { return _text; }
+
+    // Returns true if the template does not reference any variables.
+    bool isStatic() const { return slotIds.isEmpty(); }
+
+    // Returns true if the template contains ${*}.
+    bool hasWildcard() const { return slotIds.contains( -1 ); }
+
+    // Append the expansion to "out".  ${*} expands to "wild".
+    void expand( QString& out, const SimRules *rules,
+                 const QString& wild = QString() ) const;
+    QString expand( const SimRules *rules,
+                    const QString& wild = QString() ) const;
+
+    // Convert a static template to the bytes sent for a response.
+    void prerender( bool eol );
+    bool isPrerendered( bool eol ) const
+        { return !wire.isEmpty() && wireEol == eol; }
+    const QByteArray& wireData() const { return wire; }
+
+private:
+    QString _text;
+    QStringList literals;
+    QVector<int> slotIds;
+    int literalLength;
+    QByteArray wire;
+    bool wireEol;
+};
+
+
+class SimRuleSet
+{
+public:
+    SimRuleSet( const QString& filename );
+    ~SimRuleSet();
+
+    // Determine if the rule file was loaded successfully.
+    bool isValid() const { return defState != 0; }
+
+    // Get the name of the rule file.
+    QString fileName() const { return _fileName; }
+
+    // Get the default state.
+    SimState *defaultState() const { return defState; }
+
+    // Get a particular state object.
+    SimState *state( const QString& name ) const;
+
+    // Get the name of the start state, which may be empty.
+    QString startState() const { return start; }
+
+    // Get the top-level element of the rule file.  Per-connection data,
+    // such as the SIM filesystem and phone books, is built from this.
+    SimXmlNode *documentElement() const;
+
+    // Variable names are interned into numbered slots while the rules
+    // are loaded, so that templates can refer to them by index.
+    int intern( const QString& name );
+    int slot( const QString& name ) const { return slotIndex.value( name, -1 ); }
+    int slotCount() const { return slotIndex.size(); }
+
+    // Get the SIM filesystem image compiled from a <filesystem> element.
+    const SimFileImage *fileImage( const SimXmlNode *node ) const
+        { return fileImages.value( node, 0 ); }
+
+    // Get a compiled SIM profile, which is opened the first time it is
+    // asked for and then shared by every connection that uses it.
+    // Returns null if the profile cannot be opened.  Thread-safe.
+    const SimFileProfile *simProfile( const QString& fileName );
+
+private:
+    QString _fileName;
+    SimXmlHandler *handler;
+    SimState *defState;
+    QList<SimState *> states;
+    QHash<QString, SimState *> namedStates;
+    QHash<QString, int> slotIndex;
+    QHash<const SimXmlNode *, SimFileImage *> fileImages;
+    QMutex profileLock;
+    QHash<QString, SimFileProfile *> profiles;
+    QString start;
+};
+
+
 class SimState
 {
     friend class SimRules;
 public:
-    SimState( SimRules *rules, SimXmlNode& e );
-    ~SimState() {}
+    SimState( SimRuleSet *ruleSet, SimXmlNode& e );
+    ~SimState();
 
-    // Get the rules object that contains this state.
-    SimRules *rules() const { return _rules; }
+    // Get the rule set that contains this state.
+    SimRuleSet *ruleSet() const { return _ruleSet; }
 
     // Get the name of this state.
     QString name() const { return _name; }
 
     // Enter this state, and enable unsolicited events.
-    void enter();
+    void enter( SimRules *rules ) const;
 
     // Leave this state, after disabling unsolicited events.
-    void leave();
+    void leave( SimRules *rules ) const;
 
     // Handle a command.  Returns false if the command was not understood.
-    bool command( const QString& cmd );
+    bool command( SimRules *rules, const QString& cmd ) const;
 
 private:
-    QPointer<SimRules> _rules;
+    SimRuleSet *_ruleSet;
     QString _name;
     QList<SimItem *> items;
 
+    // Command dispatch index, built once when the state is loaded.
+    // Literal commands are found with a single hash lookup, wildcard
+    // commands through a trie keyed on their literal prefix, and only
+    // commands that reference ${variables} are checked one by one.
+    struct TrieNode
+    {
+        QHash<ushort, int> next;
+        QList<int> chats;
+    };
+    QList<SimChat *> chats;
+    QHash<QString, int> exactChats;
+    QVector<TrieNode> trie;
+    QList<int> dynamicChats;
+
+    void addToIndex( SimChat *chat );
 };
 
 
-class SimItem : public QObject
+// Items are shared by all connections that use the same rule set, so
+// they must not hold any per-connection state.  Anything that changes
+// at runtime belongs to the SimRules object that is passed in.
+class SimItem
 {
-    Q_OBJECT
 public:
     SimItem( SimState *state ) { _state = state; }
     virtual ~SimItem() {}
 
     // Get the state that contains this item.
-    SimState *state() { return _state; }
+    SimState *state() const { return _state; }
 
     // Receive notification of the item's state being entered.
-    virtual void enter() {}
+    virtual void enter( SimRules * ) const {}
 
     // Receive notification of the item's state being left.
-    virtual void leave() {}
+    virtual void leave( SimRules * ) const {}
 
     // Attempt to handle a command.  Returns false if not recognised.
-    virtual bool command( const QString& ) { return false; }
+    virtual bool command( SimRules *, const QString& ) const { return false; }
 
 private:
     SimState *_state;
@@ -150,51 +274,62 @@ private:
 
 class SimChat : public SimItem
 {
-    Q_OBJECT
 public:
     SimChat( SimState *state, SimXmlNode& e );
     ~SimChat() {}
 
-    virtual bool command( const QString& cmd );
+    virtual bool command( SimRules *rules, const QString& cmd ) const;
+
+    // Raw command pattern, as written in the rule file.
+    QString pattern() const { return _command; }
+
+    // Returns true if the pattern uses wildcard matching.
+    bool isWildcard() const { return wildcard; }
+
+    // Returns true if the pattern must be expanded before each match.
+    bool isDynamic() const { return dynamic; }
+
+    // Literal text that every matching command must start with.
+    QString literalPrefix() const;
 
 private:
     QString _command;
-    QString response;
+    SimTemplate commandTemplate;
+    QRegExp matcher;
+    int wildPosn;
+    SimTemplate response;
     int responseDelay;
     QString switchTo;
     bool wildcard;
+    bool dynamic;
     bool eol;
-    QStringList variables;
-    QStringList values;
-    QMap<QString, int> delays;
+    QVector<int> variables;
+    QList<SimTemplate> values;
+    QVector<int> delays;
     QString newCallVar;
-    QString forgetCallId;
+    SimTemplate forgetCallId;
     bool listSMS;
     bool deleteSMS;
     bool readSMS;
+    bool writeSMS;
 };
 
 
 class SimUnsolicited : public SimItem
 {
-    Q_OBJECT
+    friend class SimRules;
 public:
     SimUnsolicited( SimState *state, SimXmlNode& e );
     ~SimUnsolicited() {}
 
-    virtual void enter();
-    virtual void leave();
+    virtual void enter( SimRules *rules ) const;
+    virtual void leave( SimRules *rules ) const;
 
 private:
-    QString response;
+    SimTemplate response;
     int responseDelay;
     QString switchTo;
     bool doOnce;
-    bool done;
-    QTimer *timer;
-
-private slots:
-    void timeout();
 
 };
 
@@ -241,13 +376,38 @@ private:
     QStringList telUris;
 };
 
+// A multi-line response, such as the result of AT+CMGL or AT+CPBR, that is
+// encoded a few records at a time so that a long listing does not hold up
+// the other channels on the connection.
+class SimListing
+{
+public:
+    SimListing() { channel = 1; reader = 0; ready = false; }
+    virtual ~SimListing() {}
+
+    // Append the wire format of up to "count" more records to "out".
+    // Returns false once the final result code has been appended.
+    virtual bool encode( SimRules *rules, QByteArray& out, int count ) = 0;
+
+private:
+    friend class SimRules;
+    int channel;
+    int reader;
+    bool ready;
+};
+
 class HardwareManipulatorFactory;
 class HardwareManipulator;
 class SimRules : public QTcpSocket
 {
     Q_OBJECT
+    friend class SimDelayedResponse;
+    friend class SimDelayedSet;
+    friend class SimDelayedListing;
+    friend class SimUnsolicitedEntry;
+    friend class SimPhoneBookListing;
 public:
-    SimRules(int fd, QObject *parent, const QString& filename, HardwareManipulatorFactory *hmf );
+    SimRules(int fd, QObject *parent, SimRuleSet *ruleSet, HardwareManipulatorFactory *hmf );
     ~SimRules() {}
 
     // get the variable value for.
@@ -261,6 +421,21 @@ public:
 
     // Issue a response to the client.
     void respond( const QString& resp, int delay, bool eol=true );
+    void respond( const SimTemplate& resp, int delay, bool eol=true );
+
+    // Send an unsolicited response from the rule file.
+    void unsolicited( const SimTemplate& resp );
+
+    // Send a listing on the current channel, after "delay" milliseconds.
+    // Further commands on the channel wait until the listing is complete.
+    void startListing( SimListing *listing, int delay );
+
+    // Get the value of an interned variable slot.
+    const QString& slotValue( int slot ) const { return slotValues.at( slot ); }
+
+    // Start or stop the timer for an unsolicited item on this connection.
+    void startUnsolicited( const SimUnsolicited *item );
+    void stopUnsolicited( const SimUnsolicited *item );
 
     // Expand variable references in a string.
     QString expand( const QString& s );
@@ -276,6 +451,23 @@ public:
 
     void setPhoneNumber(const QString &s);
 
+    // Get the shared SIM filesystem image for a <filesystem> element.
+    const SimFileImage *fileImage( const SimXmlNode *node ) const
+        { return ruleSet->fileImage( node ); }
+
+    // Keep the SMS store in a memory-mapped file instead of in memory.
+    void setMessageStore(const QString &fileName);
+
+    // Take the SIM filesystems from a compiled profile instead of the rules.
+    void setSimProfile(const QString &fileName);
+
+    // Keep the SIM's file updates in a journal, so that they survive
+    // restarts.  Call this after any setSimProfile().
+    void setSimJournal(const QString &fileName);
+
+    // Start injecting MT SMS traffic, as described by "spec".
+    void startSmsTraffic(const QString &spec);
+
     // Gets the hardware manipulator
     HardwareManipulator * getMachine() const;
 
@@ -288,6 +480,20 @@ public:
 
     const QList<SimApplication *> getSimApps();
 
+    // The card's PIN state, where "pin" is 0 for PIN1 and 1 for PIN2.  It
+    // is kept in the PINNAME and PINRETRYCOUNT variables for PIN1, and in
+    // PIN2VERIFIED and PIN2RETRYCOUNT for PIN2, so that the rule file's
+    // AT+CPIN and AT+CPINR chats and APDU VERIFY share one state.
+    bool pinVerified( int pin );
+    int pinRetries( int pin );
+
+    // Check "value" against a PIN, counting a wrong value as a failed
+    // attempt.  A PIN with no attempts left rejects every value.
+    bool verifyPin( int pin, const QString& value );
+
+    // Set a new value for a PIN after its PUK was given, and unblock it.
+    void unblockPin( int pin, const QString& value );
+
 signals:
     void returnQueryVariable( const QString&, const QString & );
     void returnQueryState( const QString& );
@@ -319,23 +525,35 @@ public slots:
 private slots:
     void tryReadCommand();
     void destruct();
-    void delayTimeout();
-    void delaySetVariable();
+    void flushOutgoing();
+    void continueListings();
+    void listingsDrained();
     void dialCheck( const QString& number, bool& ok );
 
 private:
+    SimRuleSet *ruleSet;
     SimState *currentState;
     SimState *defState;
-    QList<SimState *> states;
-    QMap<QString,QString> variables;
+    QVector<QString> slotValues;
+    QHash<QString,QString> otherVariables;
+    QString expandBuffer;
+    QHash<const SimUnsolicited *, SimTimerEntry *> unsolicitedTimers;
+    QSet<const SimUnsolicited *> unsolicitedDone;
     int usedCallIds;
     bool useGsm0710;
+    bool muxAdvanced;
+    int muxFrameSize;
     int currentChannel;
-    char incomingBuffer[1024];
-    int incomingUsed;
-    char lineBuffer[1024];
-    int lineUsed;
+    SimMuxDecoder muxDecoder;
+    QByteArray outgoing;
+    bool flushPending;
+    QList<SimListing *> listings;
+    QByteArray listingBuffer;
+    bool listingPending;
+    bool listingStalled;
+    SimLineReader lineReaders[GSM0710_MAX_CHANNELS];
     SimFileSystem *fileSystem;
+    const SimFileProfile *simProfile;
     SimApplication *defaultToolkitApp;
     SimApplication *toolkitApp;
     SimApplication *conformanceApp;
@@ -347,12 +565,24 @@ private:
     QString mPhoneNumber;
     HardwareManipulator *machine;
 
-    void writeGsmFrame( int type, const char *data, uint len );
+    void processText( const char *data, int len );
+    void delayedResponse( const QByteArray& response, int channel );
+    QByteArray render( const SimTemplate& resp, bool eol );
+    void respondBytes( const QByteArray& escaped, int delay );
+    void storeVariable( const QString& name, const QString& value );
+    void storeVariable( int slot, const QString& value );
+    void unsolicitedTimeout( const SimUnsolicited *item );
+    bool startMultiplexing( const QString& args );
     void writeChatData( const char *data, uint len );
+    void listingReady( SimListing *listing );
+    void scheduleListings();
+    bool listingActive( int reader ) const;
+    void finishListing( SimListing *listing );
 
     QString convertCharset( const QString& s );
     void initPhoneBooks();
     void phoneBook( const QString& cmd );
+    QString phoneBookEntry( SimPhoneBook *pb, int index );
     bool simCommand( const QString& cmd );
     void changePin( const QString& cmd );
     SimPhoneBook *currentPB() const;
@@ -365,33 +595,12 @@ private:
     SimAuth *_simAuth;
     QList<AidApplication *> _applications;
     AidAppWrapper *_app_wrapper;
+    SimSmsTraffic *smsTraffic;
 
     bool simCsimOk( const QByteArray& payload );
+    bool simCsimResponse( const QByteArray& resp );
+    void attachApplications();
 };
 
 
-class SimDelayTimer : public QTimer
-{
-    Q_OBJECT
-public:
-    SimDelayTimer( const QString& response, int channel )
-        : QTimer() { this->response = response; this->channel = channel; }
-
-public:
-    QString response;
-    int channel;
-};
-
-class QVariantTimer : public QTimer
-{
-    Q_OBJECT
-public:
-    QVariantTimer( QObject *parent = 0 ) : QTimer(parent) { }
-    QVariant param;
-};
-
-typedef QPair<QString,QString> QPairKV;
-
-Q_DECLARE_METATYPE(QPairKV);
-
 #endif
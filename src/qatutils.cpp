@@ -886,6 +886,16 @@ QByteArray QCodePage850Codec::convertFromUnicode(const QChar *in, int length, Co
     return result;
 }
 
+// Get the CP850 codec.  If Qt does not have one (i.e. QT_NO_CODECS is
+// defined), then we provide our own implementation.
+static QTextCodec *codePage850()
+{
+    QTextCodec *codec = QTextCodec::codecForName( "CP850" );
+    if ( !codec )
+        codec = new QCodePage850Codec();
+    return codec;
+}
+
 /*!
     Returns the text codec for the GSM character set identifier \a gsmCharset.
     The returned object should not be deleted.
@@ -918,6 +928,8 @@ QByteArray QCodePage850Codec::convertFromUnicode(const QChar *in, int length, Co
         \row \o \c xxx \o Any codec \c xxx that is supported by QTextCodec::codecForName().
     \endtable
 
+    This function may be called from any thread.
+
     \sa QTextCodec, QGsmCodec
 */
 QTextCodec *QAtUtils::codec( const QString& gsmCharset )
@@ -925,33 +937,30 @@ QTextCodec *QAtUtils::codec( const QString& gsmCharset )
     QString cs = gsmCharset.toLower();
     QTextCodec *codec = 0;
 
+    // The codecs that we provide are created the first time that they are
+    // asked for, from whichever thread asks first.  They are held in local
+    // statics with dynamic initializers, which the compiler guards so that
+    // each one is constructed exactly once.  QTextCodec owns them after that.
+
     // Convert the name into an appropriate codec.
     if ( cs == "gsm" ) {
         // 7-bit GSM character set.
-        static QTextCodec *gsm = 0;
-        if ( !gsm )
-            gsm = new QGsmCodec();
+        static QTextCodec *gsm = new QGsmCodec();
         codec = gsm;
     } else if ( cs == "gsm-noloss" ) {
         // 7-bit GSM character set, with no loss of quality.
-        static QTextCodec *gsmNoLoss = 0;
-        if ( !gsmNoLoss )
-            gsmNoLoss = new QGsmCodec( true );
+        static QTextCodec *gsmNoLoss = new QGsmCodec( true );
         codec = gsmNoLoss;
     } else if ( cs == "hex" ) {
         // Direct hex character set.  The underlying character set could
         // be anything according to the specification, but we need to pick
         // something.  We assume that it is 7-bit GSM, as that is the most
         // likely value.
-        static QTextCodec *hex = 0;
-        if ( !hex )
-            hex = new QGsmHexCodec();
+        static QTextCodec *hex = new QGsmHexCodec();
         codec = hex;
     } else if ( cs == "ucs2" ) {
         // Hex-encoded UCS2 character set.
-        static QTextCodec *ucs2 = 0;
-        if ( !ucs2 )
-            ucs2 = new QUcs2HexCodec();
+        static QTextCodec *ucs2 = new QUcs2HexCodec();
         codec = ucs2;
     } else if ( cs == "ira" ) {
         // International Reference Alphabet (i.e. ASCII).  Use Latin-1 codec.
@@ -964,20 +973,12 @@ QTextCodec *QAtUtils::codec( const QString& gsmCharset )
         // to handle embedded UCS-2 character strings.  A hex UCS-2 string
         // will start with "80" and end with "FFFF".  If the string does
         // not have this format, it is interpreted as code page 437.
-        static QTextCodec *cp437 = 0;
-        if ( !cp437 )
-            cp437 = new QCodePage437Codec();
+        static QTextCodec *cp437 = new QCodePage437Codec();
         codec = cp437;
     } else if ( cs == "pcdn" || cs == "pccp850" ) {
         // PC Danish/Norwegian character set.  Map to PC code page 850.
-        codec = QTextCodec::codecForName( "CP850" );
-        if ( !codec ) {
-            // Qt does not have CP850 (i.e. QT_NO_CODECS is defined),
-            // so we need to provide our own implementation.  The next
-            // time we are called, codecForName( "CP850" ) will return
-            // this object, so we won't need to allocate again.
-            codec = new QCodePage850Codec();
-        }
+        static QTextCodec *cp850 = codePage850();
+        codec = cp850;
     } else if ( cs.startsWith( "pccp" ) ) {
         // Some other PC DOS code page.
         codec = QTextCodec::codecForName( "CP" + cs.mid(4).toLatin1() );
@@ -18,6 +18,19 @@
 ****************************************************************************/
 
 #include <qgsmcodec.h>
+#include <qendian.h>
+#include <qhash.h>
+#include <string.h>
+
+// Define QGSMCODEC_NO_BMI2 to build only the portable septet kernels,
+// as unit/test-septets-swar does to check them on BMI2 machines.
+#if !defined(QGSMCODEC_NO_BMI2) && \
+    defined(__GNUC__) && (__GNUC__ >= 5 || defined(__clang__)) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define HAVE_BMI2
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
 
 const unsigned short GUC = 0x10;     // GSM Undefined character
 
@@ -184,6 +197,377 @@ static const unsigned short extensionLatin1Table[256] =
      UUC,  UUC,  UUC,  UUC,  UUC,  UUC,  UUC,  UUC
 };
 
+
+// National language locking shift tables from 3GPP TS 23.038, Annex A.3.
+// Spanish has no locking shift table and uses the default alphabet.
+// Codes that the Indic tables leave unassigned are marked as UUC.
+static const unsigned short turkishLockingTable[128] =
+{
+    0x40, 0xa3, 0x24, 0xa5, 0x20ac, 0xe9, 0xf9, 0x0131,
+    0xf2, 0xc7, 0x0a, 0x011e, 0x011f, 0x0d, 0xc5, 0xe5,
+    0x0394, 0x5f, 0x03a6, 0x0393, 0x039b, 0x03a9, 0x03a0, 0x03a8,
+    0x03a3, 0x0398, 0x039e, 0x20, 0x015e, 0x015f, 0xdf, 0xc9,
+    0x20, 0x21, 0x22, 0x23, 0xa4, 0x25, 0x26, 0x27,
+    0x28, 0x29, 0x2a, 0x2b, 0x2c, 0x2d, 0x2e, 0x2f,
+    0x30, 0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37,
+    0x38, 0x39, 0x3a, 0x3b, 0x3c, 0x3d, 0x3e, 0x3f,
+    0x0130, 0x41, 0x42, 0x43, 0x44, 0x45, 0x46, 0x47,
+    0x48, 0x49, 0x4a, 0x4b, 0x4c, 0x4d, 0x4e, 0x4f,
+    0x50, 0x51, 0x52, 0x53, 0x54, 0x55, 0x56, 0x57,
+    0x58, 0x59, 0x5a, 0xc4, 0xd6, 0xd1, 0xdc, 0xa7,
+    0xe7, 0x61, 0x62, 0x63, 0x64, 0x65, 0x66, 0x67,
+    0x68, 0x69, 0x6a, 0x6b, 0x6c, 0x6d, 0x6e, 0x6f,
+    0x70, 0x71, 0x72, 0x73, 0x74, 0x75, 0x76, 0x77,
+    0x78, 0x79, 0x7a, 0xe4, 0xf6, 0xf1, 0xfc, 0xe0
+};
+static const unsigned short portugueseLockingTable[128] =
+{
+    0x40, 0xa3, 0x24, 0xa5, 0xea, 0xe9, 0xfa, 0xed,
+    0xf3, 0xe7, 0x0a, 0xd4, 0xf4, 0x0d, 0xc1, 0xe1,
+    0x0394, 0x5f, 0xaa, 0xc7, 0xc0, 0x221e, 0x5e, 0x5c,
+    0x20ac, 0xd3, 0x7c, 0x20, 0xc2, 0xe2, 0xca, 0xc9,
+    0x20, 0x21, 0x22, 0x23, 0xba, 0x25, 0x26, 0x27,
+    0x28, 0x29, 0x2a, 0x2b, 0x2c, 0x2d, 0x2e, 0x2f,
+    0x30, 0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37,
+    0x38, 0x39, 0x3a, 0x3b, 0x3c, 0x3d, 0x3e, 0x3f,
+    0xcd, 0x41, 0x42, 0x43, 0x44, 0x45, 0x46, 0x47,
+    0x48, 0x49, 0x4a, 0x4b, 0x4c, 0x4d, 0x4e, 0x4f,
+    0x50, 0x51, 0x52, 0x53, 0x54, 0x55, 0x56, 0x57,
+    0x58, 0x59, 0x5a, 0xc3, 0xd5, 0xda, 0xdc, 0xa7,
+    0x7e, 0x61, 0x62, 0x63, 0x64, 0x65, 0x66, 0x67,
+    0x68, 0x69, 0x6a, 0x6b, 0x6c, 0x6d, 0x6e, 0x6f,
+    0x70, 0x71, 0x72, 0x73, 0x74, 0x75, 0x76, 0x77,
+    0x78, 0x79, 0x7a, 0xe3, 0xf5, 0x60, 0xfc, 0xe0
+};
+static const unsigned short bengaliLockingTable[128] =
+{
+    0x0981, 0x0982, 0x0983, 0x0985, 0x0986, 0x0987, 0x0988, 0x0989,
+    0x098a, 0x098b, 0x0a, 0x098c, UUC, 0x0d, UUC, 0x098f,
+    0x0990, UUC, UUC, 0x0993, 0x0994, 0x0995, 0x0996, 0x0997,
+    0x0998, 0x0999, 0x099a, 0x20, 0x099b, 0x099c, 0x099d, 0x099e,
+    0x20, 0x21, 0x099f, 0x09a0, 0x09a1, 0x09a2, 0x09a3, 0x09a4,
+    0x29, 0x28, 0x09a5, 0x09a6, 0x2c, 0x09a7, 0x2e, 0x09a8,
+    0x30, 0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37,
+    0x38, 0x39, 0x3a, 0x3b, UUC, 0x09aa, 0x09ab, 0x3f,
+    0x09ac, 0x09ad, 0x09ae, 0x09af, 0x09b0, UUC, 0x09b2, UUC,
+    UUC, UUC, 0x09b6, 0x09b7, 0x09b8, 0x09b9, 0x09bc, 0x09bd,
+    0x09be, 0x09bf, 0x09c0, 0x09c1, 0x09c2, 0x09c3, 0x09c4, UUC,
+    UUC, 0x09c7, 0x09c8, UUC, UUC, 0x09cb, 0x09cc, 0x09cd,
+    0x09ce, 0x61, 0x62, 0x63, 0x64, 0x65, 0x66, 0x67,
+    0x68, 0x69, 0x6a, 0x6b, 0x6c, 0x6d, 0x6e, 0x6f,
+    0x70, 0x71, 0x72, 0x73, 0x74, 0x75, 0x76, 0x77,
+    0x78, 0x79, 0x7a, 0x09d7, 0x09dc, 0x09dd, 0x09f0, 0x09f1
+};
+static const unsigned short hindiLockingTable[128] =
+{
+    0x0901, 0x0902, 0x0903, 0x0905, 0x0906, 0x0907, 0x0908, 0x0909,
+    0x090a, 0x090b, 0x0a, 0x090c, 0x090d, 0x0d, 0x090e, 0x090f,
+    0x0910, 0x0911, 0x0912, 0x0913, 0x0914, 0x0915, 0x0916, 0x0917,
+    0x0918, 0x0919, 0x091a, 0x20, 0x091b, 0x091c, 0x091d, 0x091e,
+    0x20, 0x21, 0x091f, 0x0920, 0x0921, 0x0922, 0x0923, 0x0924,
+    0x29, 0x28, 0x0925, 0x0926, 0x2c, 0x0927, 0x2e, 0x0928,
+    0x30, 0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37,
+    0x38, 0x39, 0x3a, 0x3b, 0x0929, 0x092a, 0x092b, 0x3f,
+    0x092c, 0x092d, 0x092e, 0x092f, 0x0930, 0x0931, 0x0932, 0x0933,
+    0x0934, 0x0935, 0x0936, 0x0937, 0x0938, 0x0939, 0x093c, 0x093d,
+    0x093e, 0x093f, 0x0940, 0x0941, 0x0942, 0x0943, 0x0944, 0x0945,
+    0x0946, 0x0947, 0x0948, 0x0949, 0x094a, 0x094b, 0x094c, 0x094d,
+    0x0950, 0x61, 0x62, 0x63, 0x64, 0x65, 0x66, 0x67,
+    0x68, 0x69, 0x6a, 0x6b, 0x6c, 0x6d, 0x6e, 0x6f,
+    0x70, 0x71, 0x72, 0x73, 0x74, 0x75, 0x76, 0x77,
+    0x78, 0x79, 0x7a, 0x0972, 0x097b, 0x097c, 0x097e, 0x097f
+};
+
+// National language single shift tables from 3GPP TS 23.038, Annex A.2,
+// as pairs of GSM code and Unicode character.
+static const unsigned short turkishSingleShift[][2] =
+{
+    { 0x0a, 0x0c }, { 0x14, 0x5e }, { 0x28, 0x7b }, { 0x29, 0x7d },
+    { 0x2f, 0x5c }, { 0x3c, 0x5b }, { 0x3d, 0x7e }, { 0x3e, 0x5d },
+    { 0x40, 0x7c }, { 0x47, 0x011e }, { 0x49, 0x0130 }, { 0x53, 0x015e },
+    { 0x63, 0xe7 }, { 0x65, 0x20ac }, { 0x67, 0x011f }, { 0x69, 0x0131 },
+    { 0x73, 0x015f }
+};
+static const unsigned short spanishSingleShift[][2] =
+{
+    { 0x09, 0xe7 }, { 0x0a, 0x0c }, { 0x14, 0x5e }, { 0x28, 0x7b },
+    { 0x29, 0x7d }, { 0x2f, 0x5c }, { 0x3c, 0x5b }, { 0x3d, 0x7e },
+    { 0x3e, 0x5d }, { 0x40, 0x7c }, { 0x41, 0xc1 }, { 0x49, 0xcd },
+    { 0x4f, 0xd3 }, { 0x55, 0xda }, { 0x61, 0xe1 }, { 0x65, 0x20ac },
+    { 0x69, 0xed }, { 0x6f, 0xf3 }, { 0x75, 0xfa }
+};
+static const unsigned short portugueseSingleShift[][2] =
+{
+    { 0x05, 0xea }, { 0x09, 0xe7 }, { 0x0a, 0x0c }, { 0x0b, 0xd4 },
+    { 0x0c, 0xf4 }, { 0x0e, 0xc1 }, { 0x0f, 0xe1 }, { 0x12, 0x03a6 },
+    { 0x13, 0x0393 }, { 0x14, 0x5e }, { 0x15, 0x03a9 }, { 0x16, 0x03a0 },
+    { 0x17, 0x03a8 }, { 0x18, 0x03a3 }, { 0x19, 0x0398 }, { 0x1f, 0xca },
+    { 0x28, 0x7b }, { 0x29, 0x7d }, { 0x2f, 0x5c }, { 0x3c, 0x5b },
+    { 0x3d, 0x7e }, { 0x3e, 0x5d }, { 0x40, 0x7c }, { 0x41, 0xc0 },
+    { 0x49, 0xcd }, { 0x4f, 0xd3 }, { 0x55, 0xda }, { 0x5b, 0xc3 },
+    { 0x5c, 0xd5 }, { 0x61, 0xc2 }, { 0x65, 0x20ac }, { 0x69, 0xed },
+    { 0x6f, 0xf3 }, { 0x75, 0xfa }, { 0x7b, 0xe3 }, { 0x7c, 0xf5 },
+    { 0x7f, 0xe2 }
+};
+static const unsigned short bengaliSingleShift[][2] =
+{
+    { 0x00, 0x40 }, { 0x01, 0xa3 }, { 0x02, 0x24 }, { 0x03, 0xa5 },
+    { 0x04, 0xbf }, { 0x05, 0x22 }, { 0x06, 0xa4 }, { 0x07, 0x25 },
+    { 0x08, 0x26 }, { 0x09, 0x27 }, { 0x0a, 0x0c }, { 0x0b, 0x2a },
+    { 0x0c, 0x2b }, { 0x0e, 0x2d }, { 0x0f, 0x2f }, { 0x10, 0x3c },
+    { 0x11, 0x3d }, { 0x12, 0x3e }, { 0x13, 0xa1 }, { 0x14, 0x5e },
+    { 0x15, 0xa1 }, { 0x16, 0x5f }, { 0x17, 0x23 }, { 0x18, 0x2a },
+    { 0x19, 0x09e6 }, { 0x1a, 0x09e7 }, { 0x1c, 0x09e8 }, { 0x1d, 0x09e9 },
+    { 0x1e, 0x09ea }, { 0x1f, 0x09eb }, { 0x20, 0x09ec }, { 0x21, 0x09ed },
+    { 0x22, 0x09ee }, { 0x23, 0x09ef }, { 0x24, 0x09df }, { 0x25, 0x09e0 },
+    { 0x26, 0x09e1 }, { 0x27, 0x09e2 }, { 0x28, 0x7b }, { 0x29, 0x7d },
+    { 0x2a, 0x09e3 }, { 0x2b, 0x09f2 }, { 0x2c, 0x09f3 }, { 0x2d, 0x09f4 },
+    { 0x2e, 0x09f5 }, { 0x2f, 0x5c }, { 0x30, 0x09f6 }, { 0x31, 0x09f7 },
+    { 0x32, 0x09f8 }, { 0x33, 0x09f9 }, { 0x34, 0x09fa }, { 0x3c, 0x5b },
+    { 0x3d, 0x7e }, { 0x3e, 0x5d }, { 0x40, 0x7c }, { 0x41, 0x41 },
+    { 0x42, 0x42 }, { 0x43, 0x43 }, { 0x44, 0x44 }, { 0x45, 0x45 },
+    { 0x46, 0x46 }, { 0x47, 0x47 }, { 0x48, 0x48 }, { 0x49, 0x49 },
+    { 0x4a, 0x4a }, { 0x4b, 0x4b }, { 0x4c, 0x4c }, { 0x4d, 0x4d },
+    { 0x4e, 0x4e }, { 0x4f, 0x4f }, { 0x50, 0x50 }, { 0x51, 0x51 },
+    { 0x52, 0x52 }, { 0x53, 0x53 }, { 0x54, 0x54 }, { 0x55, 0x55 },
+    { 0x56, 0x56 }, { 0x57, 0x57 }, { 0x58, 0x58 }, { 0x59, 0x59 },
+    { 0x5a, 0x5a }, { 0x65, 0x20ac }
+};
+static const unsigned short hindiSingleShift[][2] =
+{
+    { 0x00, 0x40 }, { 0x01, 0xa3 }, { 0x02, 0x24 }, { 0x03, 0xa5 },
+    { 0x04, 0xbf }, { 0x05, 0x22 }, { 0x06, 0xa4 }, { 0x07, 0x25 },
+    { 0x08, 0x26 }, { 0x09, 0x27 }, { 0x0a, 0x0c }, { 0x0b, 0x2a },
+    { 0x0c, 0x2b }, { 0x0e, 0x2d }, { 0x0f, 0x2f }, { 0x10, 0x3c },
+    { 0x11, 0x3d }, { 0x12, 0x3e }, { 0x13, 0xa1 }, { 0x14, 0x5e },
+    { 0x15, 0xa1 }, { 0x16, 0x5f }, { 0x17, 0x23 }, { 0x18, 0x2a },
+    { 0x19, 0x0964 }, { 0x1a, 0x0965 }, { 0x1c, 0x0966 }, { 0x1d, 0x0967 },
+    { 0x1e, 0x0968 }, { 0x1f, 0x0969 }, { 0x20, 0x096a }, { 0x21, 0x096b },
+    { 0x22, 0x096c }, { 0x23, 0x096d }, { 0x24, 0x096e }, { 0x25, 0x096f },
+    { 0x26, 0x0951 }, { 0x27, 0x0952 }, { 0x28, 0x7b }, { 0x29, 0x7d },
+    { 0x2a, 0x0953 }, { 0x2b, 0x0954 }, { 0x2c, 0x0958 }, { 0x2d, 0x0959 },
+    { 0x2e, 0x095a }, { 0x2f, 0x5c }, { 0x30, 0x095b }, { 0x31, 0x095c },
+    { 0x32, 0x095d }, { 0x33, 0x095e }, { 0x34, 0x095f }, { 0x35, 0x0960 },
+    { 0x36, 0x0961 }, { 0x37, 0x0962 }, { 0x38, 0x0963 }, { 0x39, 0x0970 },
+    { 0x3a, 0x0971 }, { 0x3c, 0x5b }, { 0x3d, 0x7e }, { 0x3e, 0x5d },
+    { 0x40, 0x7c }, { 0x41, 0x41 }, { 0x42, 0x42 }, { 0x43, 0x43 },
+    { 0x44, 0x44 }, { 0x45, 0x45 }, { 0x46, 0x46 }, { 0x47, 0x47 },
+    { 0x48, 0x48 }, { 0x49, 0x49 }, { 0x4a, 0x4a }, { 0x4b, 0x4b },
+    { 0x4c, 0x4c }, { 0x4d, 0x4d }, { 0x4e, 0x4e }, { 0x4f, 0x4f },
+    { 0x50, 0x50 }, { 0x51, 0x51 }, { 0x52, 0x52 }, { 0x53, 0x53 },
+    { 0x54, 0x54 }, { 0x55, 0x55 }, { 0x56, 0x56 }, { 0x57, 0x57 },
+    { 0x58, 0x58 }, { 0x59, 0x59 }, { 0x5a, 0x5a }, { 0x65, 0x20ac }
+};
+
+// Forward and reverse lookups for one national language, expanded
+// from the tables above the first time that they are needed.
+struct QGsmLanguageTables
+{
+    unsigned short locking[128];
+    unsigned short single[128];
+    QHash<unsigned short, unsigned short> fromLocking;
+    QHash<unsigned short, unsigned short> fromSingle;
+
+    QGsmLanguageTables()
+    {
+        for ( int code = 0; code < 128; ++code )
+            single[code] = UUC;
+    }
+    void setSingle( const unsigned short (*pairs)[2], int count )
+    {
+        for ( int index = 0; index < count; ++index )
+            single[pairs[index][0]] = pairs[index][1];
+    }
+    void buildReverse()
+    {
+        // The escape code maps to a space, which must not be used for
+        // encoding, and earlier codes win if a character appears twice.
+        for ( int code = 127; code >= 0; --code ) {
+            if ( code == 0x1B )
+                continue;
+            if ( locking[code] != UUC )
+                fromLocking.insert( locking[code], code );
+            if ( single[code] != UUC )
+                fromSingle.insert( single[code], code );
+        }
+    }
+};
+
+static QGsmLanguageTables *buildLanguageTables()
+{
+    QGsmLanguageTables *tables = new QGsmLanguageTables [QGsmCodec::NumLanguages];
+    for ( int language = 0; language < QGsmCodec::NumLanguages; ++language ) {
+        QGsmLanguageTables& t = tables[language];
+        switch ( language ) {
+        case QGsmCodec::Turkish:
+            memcpy( t.locking, turkishLockingTable, sizeof( t.locking ) );
+            break;
+        case QGsmCodec::Portuguese:
+            memcpy( t.locking, portugueseLockingTable, sizeof( t.locking ) );
+            break;
+        case QGsmCodec::Bengali:
+            memcpy( t.locking, bengaliLockingTable, sizeof( t.locking ) );
+            break;
+        case QGsmCodec::Hindi:
+            memcpy( t.locking, hindiLockingTable, sizeof( t.locking ) );
+            break;
+        default:
+            memcpy( t.locking, gsmLatin1Table, sizeof( t.locking ) );
+            break;
+        }
+        switch ( language ) {
+        case QGsmCodec::Turkish:
+            t.setSingle( turkishSingleShift, sizeof( turkishSingleShift ) /
+                                             sizeof( turkishSingleShift[0] ) );
+            break;
+        case QGsmCodec::Spanish:
+            t.setSingle( spanishSingleShift, sizeof( spanishSingleShift ) /
+                                             sizeof( spanishSingleShift[0] ) );
+            break;
+        case QGsmCodec::Portuguese:
+            t.setSingle( portugueseSingleShift, sizeof( portugueseSingleShift ) /
+                                                sizeof( portugueseSingleShift[0] ) );
+            break;
+        case QGsmCodec::Bengali:
+            t.setSingle( bengaliSingleShift, sizeof( bengaliSingleShift ) /
+                                             sizeof( bengaliSingleShift[0] ) );
+            break;
+        case QGsmCodec::Hindi:
+            t.setSingle( hindiSingleShift, sizeof( hindiSingleShift ) /
+                                           sizeof( hindiSingleShift[0] ) );
+            break;
+        default:
+            memcpy( t.single, extensionLatin1Table, sizeof( t.single ) );
+            break;
+        }
+        t.buildReverse();
+    }
+    return tables;
+}
+
+static const QGsmLanguageTables& languageTables( int language )
+{
+    static QGsmLanguageTables *tables = buildLanguageTables();
+    if ( language < 0 || language >= QGsmCodec::NumLanguages )
+        language = QGsmCodec::Default;
+    return tables[language];
+}
+
+// Septet packing.  Eight septets occupy exactly seven octets, so the
+// kernels below move eight characters per step through a 64-bit word,
+// and only fall back to bit-at-a-time handling for the final partial
+// group.  The fill bits that align user data after a UDH are carried
+// across the groups as a constant shift.
+
+static inline quint64 loadWord( const char *in )
+{
+    return qFromLittleEndian<quint64>( (const uchar *)in );
+}
+
+static inline void storeWord( char *out, quint64 value, int len )
+{
+    uchar buf[8];
+    qToLittleEndian<quint64>( value, buf );
+    memcpy( out, buf, len );
+}
+
+// Compress the low 7 bits of each byte in "x" into a 56-bit value.
+static inline quint64 packWord( quint64 x )
+{
+    x &= Q_UINT64_C(0x7F7F7F7F7F7F7F7F);
+    x = ( x & Q_UINT64_C(0x007F007F007F007F) ) |
+        ( ( x & Q_UINT64_C(0x7F007F007F007F00) ) >> 1 );
+    x = ( x & Q_UINT64_C(0x00003FFF00003FFF) ) |
+        ( ( x & Q_UINT64_C(0x3FFF00003FFF0000) ) >> 2 );
+    x = ( x & Q_UINT64_C(0x000000000FFFFFFF) ) |
+        ( ( x & Q_UINT64_C(0x0FFFFFFF00000000) ) >> 4 );
+    return x;
+}
+
+// Inverse of packWord(): spread 56 bits out to eight 7-bit bytes.
+static inline quint64 unpackWord( quint64 x )
+{
+    x = ( x & Q_UINT64_C(0x000000000FFFFFFF) ) |
+        ( ( x & Q_UINT64_C(0x00FFFFFFF0000000) ) << 4 );
+    x = ( x & Q_UINT64_C(0x00003FFF00003FFF) ) |
+        ( ( x & Q_UINT64_C(0x0FFFC0000FFFC000) ) << 2 );
+    x = ( x & Q_UINT64_C(0x007F007F007F007F) ) |
+        ( ( x & Q_UINT64_C(0x3F803F803F803F80) ) << 1 );
+    return x;
+}
+
+static int packGroups( char *out, const char *in, int groups, int fillBits, quint64& carry )
+{
+    for ( int group = 0; group < groups; ++group ) {
+        quint64 value = ( packWord( loadWord( in ) ) << fillBits ) | carry;
+        storeWord( out, value, 7 );
+        carry = value >> 56;
+        in += 8;
+        out += 7;
+    }
+    return groups;
+}
+
+static int unpackGroups( char *out, const char *in, int groups, int fillBits )
+{
+    for ( int group = 0; group < groups; ++group ) {
+        quint64 value = loadWord( in ) >> fillBits;
+        storeWord( out, unpackWord( value & Q_UINT64_C(0x00FFFFFFFFFFFFFF) ), 8 );
+        in += 7;
+        out += 8;
+    }
+    return groups;
+}
+
+#ifdef HAVE_BMI2
+
+// The BMI2 bit gather/scatter instructions do the whole group in one step.
+
+static bool detectBmi2()
+{
+    unsigned int eax, ebx, ecx, edx;
+    if ( __get_cpuid_max( 0, 0 ) < 7 )
+        return false;
+    __cpuid_count( 7, 0, eax, ebx, ecx, edx );
+    return ( ebx & bit_BMI2 ) != 0;
+}
+
+// The compiler guards the initialization of the local static, so the
+// CPU is only asked once even when several threads get here together.
+static bool cpuHasBmi2()
+{
+    static const bool detected = detectBmi2();
+    return detected;
+}
+
+__attribute__((target("bmi2")))
+static int packGroupsBmi2( char *out, const char *in, int groups, int fillBits, quint64& carry )
+{
+    for ( int group = 0; group < groups; ++group ) {
+        quint64 value = _pext_u64( loadWord( in ), Q_UINT64_C(0x7F7F7F7F7F7F7F7F) );
+        value = ( value << fillBits ) | carry;
+        storeWord( out, value, 7 );
+        carry = value >> 56;
+        in += 8;
+        out += 7;
+    }
+    return groups;
+}
+
+__attribute__((target("bmi2")))
+static int unpackGroupsBmi2( char *out, const char *in, int groups, int fillBits )
+{
+    for ( int group = 0; group < groups; ++group ) {
+        quint64 value = loadWord( in ) >> fillBits;
+        storeWord( out, _pdep_u64( value, Q_UINT64_C(0x7F7F7F7F7F7F7F7F) ), 8 );
+        in += 7;
+        out += 8;
+    }
+    return groups;
+}
+
+#endif
+
 /*!
     \class QGsmCodec
     \inpublicgroup QtBaseModule
@@ -216,7 +600,9 @@ static const unsigned short extensionLatin1Table[256] =
     \endcode
 
     This codec implementation conforms to 3GPP TS 03.38 and 3GPP TS 07.05,
-    including the extension tables from 3GPP TS 03.38.
+    including the extension tables from 3GPP TS 03.38.  The Turkish, Spanish,
+    Portuguese, Bengali and Hindi national language shift tables from
+    3GPP TS 23.038 are available through the static conversion functions.
 
     \sa QSMSMessage, QAtUtils::codec()
 */
@@ -345,6 +731,175 @@ QChar QGsmCodec::twoByteToUnicode(unsigned short ch)
     }
 }
 
+/*!
+    Returns true if \a language has national language tables, or is the
+    default alphabet; otherwise returns false.  Text that selects an
+    unsupported table is decoded with the default alphabet instead.
+
+    \sa hasLockingShift()
+*/
+bool QGsmCodec::isSupported(int language)
+{
+    return ( language == Default || language == Turkish ||
+             language == Spanish || language == Portuguese ||
+             language == Bengali || language == Hindi );
+}
+
+/*!
+    Returns true if \a language has a national locking shift table;
+    otherwise returns false.  Languages without one use the default
+    alphabet for their single-byte characters.
+*/
+bool QGsmCodec::hasLockingShift(int language)
+{
+    return ( language == Turkish || language == Portuguese ||
+             language == Bengali || language == Hindi );
+}
+
+/*!
+    Convert the Unicode character \a ch into its GSM-encoded counterpart
+    using the national language locking shift table \a lockingShift and
+    single shift table \a singleShift.  The return value will be greater
+    than 256 if the character must be encoded as two bytes, or 0xFFFF if
+    neither table can represent it.
+
+    \sa twoByteToUnicode()
+*/
+unsigned short QGsmCodec::twoByteFromUnicode(QChar ch, int lockingShift, int singleShift)
+{
+    const QGsmLanguageTables& locking = languageTables( lockingShift );
+    QHash<unsigned short, unsigned short>::ConstIterator it;
+    it = locking.fromLocking.constFind( ch.unicode() );
+    if ( it != locking.fromLocking.constEnd() )
+        return it.value();
+    const QGsmLanguageTables& single = languageTables( singleShift );
+    it = single.fromSingle.constFind( ch.unicode() );
+    if ( it != single.fromSingle.constEnd() )
+        return 0x1B00 | it.value();
+    return 0xFFFF;
+}
+
+/*!
+    Convert a single GSM-encoded character \a ch into its Unicode counterpart
+    using the national language locking shift table \a lockingShift and
+    single shift table \a singleShift.  If \a ch is greater than 256, then
+    it represents a two-byte sequence.
+
+    \sa twoByteFromUnicode()
+*/
+QChar QGsmCodec::twoByteToUnicode(unsigned short ch, int lockingShift, int singleShift)
+{
+    const QGsmLanguageTables& locking = languageTables( lockingShift );
+    if ( ch < 256 )
+        return QChar( locking.locking[ch & 0x7F] );
+    else if ( ( ch & 0xFF00 ) != 0x1B00 )
+        return QChar( 0 );
+
+    // Undefined single shift codes display as the locking shift character.
+    unsigned short mapping = languageTables( singleShift ).single[ch & 0x7F];
+    if ( mapping != UUC )
+        return QChar( mapping );
+    else
+        return QChar( locking.locking[ch & 0x7F] );
+}
+
+/*!
+    Returns the number of octets needed to hold \a septets 7-bit characters
+    that are preceded by \a fillBits bits of padding.
+
+    \sa packSeptets(), unpackSeptets()
+*/
+int QGsmCodec::packedLength( int septets, int fillBits )
+{
+    return ( fillBits + septets * 7 + 7 ) / 8;
+}
+
+/*!
+    Returns the name of the kernels that packSeptets() and unpackSeptets()
+    use on this CPU: "BMI2" or "SWAR".
+*/
+const char *QGsmCodec::septetKernel()
+{
+#ifdef HAVE_BMI2
+    if ( cpuHasBmi2() )
+        return "BMI2";
+#endif
+    return "SWAR";
+}
+
+/*!
+    Pack the \a count 7-bit characters at \a in into \a out, starting
+    after \a fillBits zero bits of padding.  The \a out buffer must hold
+    packedLength(\a count, \a fillBits) octets.
+
+    \sa unpackSeptets()
+*/
+void QGsmCodec::packSeptets( char *out, const char *in, int count, int fillBits )
+{
+    quint64 carry = 0;
+    int carryBits = fillBits;
+    int groups = count / 8;
+
+#ifdef HAVE_BMI2
+    if ( cpuHasBmi2() )
+        packGroupsBmi2( out, in, groups, fillBits, carry );
+    else
+#endif
+        packGroups( out, in, groups, fillBits, carry );
+    in += groups * 8;
+    out += groups * 7;
+    count -= groups * 8;
+
+    while ( count-- > 0 ) {
+        carry |= ( (quint64)( *in++ & 0x7F ) ) << carryBits;
+        carryBits += 7;
+        if ( carryBits >= 8 ) {
+            *out++ = (char)carry;
+            carry >>= 8;
+            carryBits -= 8;
+        }
+    }
+    if ( carryBits > 0 )
+        *out = (char)carry;
+}
+
+/*!
+    Unpack \a count 7-bit characters from \a in into \a out, skipping the
+    first \a fillBits bits of \a in.  The \a in buffer must hold
+    packedLength(\a count, \a fillBits) octets.
+
+    \sa packSeptets()
+*/
+void QGsmCodec::unpackSeptets( char *out, const char *in, int count, int fillBits )
+{
+    // Each group reads a full word, so stop while there is still an
+    // octet beyond the group's seven.
+    int groups = count / 8;
+    int safe = ( packedLength( count, fillBits ) - 1 ) / 7;
+    if ( groups > safe )
+        groups = safe;
+
+#ifdef HAVE_BMI2
+    if ( cpuHasBmi2() )
+        unpackGroupsBmi2( out, in, groups, fillBits );
+    else
+#endif
+        unpackGroups( out, in, groups, fillBits );
+    in += groups * 7;
+    out += groups * 8;
+    count -= groups * 8;
+
+    const uchar *data = (const uchar *)in;
+    int bit = fillBits;
+    while ( count-- > 0 ) {
+        uint value = data[bit >> 3] >> ( bit & 7 );
+        if ( ( bit & 7 ) > 1 )
+            value |= data[( bit >> 3 ) + 1] << ( 8 - ( bit & 7 ) );
+        *out++ = (char)( value & 0x7F );
+        bit += 7;
+    }
+}
+
 /*!
     Convert the \a length bytes at \a in into Unicode.  The \c invalidChars
     field of \a state will be incremented if there are invalid characters
@@ -354,36 +909,40 @@ QChar QGsmCodec::twoByteToUnicode(unsigned short ch)
 */
 QString QGsmCodec::convertToUnicode(const char *in, int length, ConverterState *state) const
 {
+    // Every input byte produces at most one character, so write straight
+    // into a buffer of that size and trim it afterwards.
     QString str;
+    str.resize( length > 0 ? length : 0 );
+    QChar *out = str.data();
+    const uchar *data = (const uchar *)in;
+    const uchar *end = data + length;
+    int invalid = 0;
     unsigned short ch;
-    while ( length > 0 ) {
-        if ( *in == 0x1B ) {
+    while ( data < end ) {
+        if ( *data == 0x1B ) {
             // Two-byte GSM sequence.
-            ++in;
-            --length;
-            if ( length <= 0 ) {
-                if ( state )
-                    (state->invalidChars)++;
+            if ( ++data >= end ) {
+                ++invalid;
                 break;
             }
-            ch = extensionLatin1Table[((int)(*in)) & 0xFF];
-            if ( ch != UUC ) {
-                str += QChar((unsigned int)ch);
-            } else {
-                str += QChar(gsmLatin1Table[((int)(*in)) & 0xFF]);
-                if ( state )
-                    (state->invalidChars)++;
+            ch = extensionLatin1Table[*data];
+            if ( ch == UUC ) {
+                ch = gsmLatin1Table[*data];
+                ++invalid;
             }
+            *out++ = QChar( (unsigned int)ch );
         } else {
-            ch = gsmLatin1Table[((int)(*in)) & 0xFF];
-            if ( ch != UUC )
-                str += QChar((unsigned int)ch);
-            else if ( state )
-                (state->invalidChars)++;
+            // Store unconditionally and only advance past defined characters.
+            ch = gsmLatin1Table[*data];
+            *out = QChar( (unsigned int)ch );
+            out += ( ch != UUC );
+            invalid += ( ch == UUC );
         }
-        ++in;
-        --length;
+        ++data;
     }
+    str.resize( out - str.constData() );
+    if ( state )
+        state->invalidChars += invalid;
     return str;
 }
 
@@ -398,6 +957,7 @@ QByteArray QGsmCodec::convertFromUnicode(const QChar *in, int length, ConverterS
 {
     QByteArray result;
     unsigned int unicode;
+    result.reserve( length );
     if ( noLoss ) {
         while ( length > 0 ) {
             unicode = (*in).unicode();
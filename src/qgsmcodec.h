@@ -26,6 +26,20 @@
 class QGsmCodec : public QTextCodec
 {
 public:
+    // National language identifiers from 3GPP TS 23.038.
+    enum Language
+    {
+        Default     = 0,
+        Turkish     = 1,
+        Spanish     = 2,
+        Portuguese  = 3,
+        Bengali     = 4,
+        // Gujarati (5) and languages 7 to 13 have no tables yet, and
+        // isSupported() returns false for them.
+        Hindi       = 6,
+        NumLanguages
+    };
+
     explicit QGsmCodec( bool noLoss=false );
     ~QGsmCodec();
 
@@ -38,6 +52,16 @@ public:
     static unsigned short twoByteFromUnicode(QChar ch);
     static QChar twoByteToUnicode(unsigned short ch);
 
+    static bool isSupported(int language);
+    static bool hasLockingShift(int language);
+    static unsigned short twoByteFromUnicode(QChar ch, int lockingShift, int singleShift);
+    static QChar twoByteToUnicode(unsigned short ch, int lockingShift, int singleShift);
+
+    static int packedLength(int septets, int fillBits = 0);
+    static void packSeptets(char *out, const char *in, int count, int fillBits = 0);
+    static void unpackSeptets(char *out, const char *in, int count, int fillBits = 0);
+    static const char *septetKernel();
+
 protected:
     QString convertToUnicode(const char *in, int length, ConverterState *state) const;
     QByteArray convertFromUnicode(const QChar *in, int length, ConverterState *state) const;
@@ -91,6 +91,9 @@ public:
         mDataCodingScheme = -1;
         mMessageClass = -1;
         mProtocol = 0;
+        mShiftsChosen = -1;
+        mLockingShift = 0;
+        mSingleShift = 0;
     }
 
     ~QSMSMessagePrivate()
@@ -163,6 +166,9 @@ public:
     int mDataCodingScheme;
     int mMessageClass;
     int mProtocol;
+    int mShiftsChosen;      // -1 if not chosen yet, 0 if none will do
+    int mLockingShift;
+    int mSingleShift;
 };
 
 /*!
@@ -507,6 +513,207 @@ void QSMSMessage::setBestScheme(QSMSDataCodingScheme scheme)
 }
 
 
+// Get the number of septets that "ch" occupies in the 7-bit alphabet with
+// the national language shift tables "lockingShift" and "singleShift".
+// Characters that cannot be represented are sent as a single septet.
+static inline uint encodedCost( QChar ch, int lockingShift, int singleShift )
+{
+    unsigned short c;
+    if ( lockingShift || singleShift )
+        c = QGsmCodec::twoByteFromUnicode( ch, lockingShift, singleShift );
+    else
+        c = QGsmCodec::twoByteFromUnicode( ch );
+    return ( c >= 256 && c != 0xFFFF ) ? 2 : 1;
+}
+
+static uint getEncodedLength( const QString& txt, uint size,
+                              int lockingShift = 0, int singleShift = 0 )
+{
+    uint len = 0;
+    for ( int u = 0; u < (int)size; u++ )
+        len += encodedCost( txt[u], lockingShift, singleShift );
+    return len;
+}
+
+// Get the number of septets needed for "txt" with the given national
+// language shift tables, or -1 if they cannot represent all of it.
+static int shiftedLength( const QString& txt, int lockingShift, int singleShift )
+{
+    int len = 0;
+    for ( int u = 0; u < txt.length(); u++ ) {
+        unsigned short c = QGsmCodec::twoByteFromUnicode
+            ( txt[u], lockingShift, singleShift );
+        if ( c == 0xFFFF )
+            return -1;
+        len += ( c >= 256 ? 2 : 1 );
+    }
+    return len;
+}
+
+// Number of user data header octets for national language shift elements.
+static inline uint shiftOctets( int lockingShift, int singleShift )
+{
+    return ( lockingShift ? 3 : 0 ) + ( singleShift ? 3 : 0 );
+}
+
+// Number of septets that a user data header of "octets" bytes occupies,
+// including the fill bits that align the text after it.
+static inline uint headerSeptets( uint octets )
+{
+    return ( octets * 8 + 6 ) / 7;
+}
+
+// Get the number of 7-bit messages needed for "septets" characters of text,
+// when each message also carries "extraOctets" of national language headers.
+static uint septetMessages( uint septets, uint extraOctets, uint& spaceLeftInLast )
+{
+    uint single = 160 - ( extraOctets ? headerSeptets( extraOctets + 1 ) : 0 );
+    if ( septets <= single ) {
+        spaceLeftInLast = single - septets;
+        return 1;
+    }
+
+    // Fragments also need the header length and concatenation element (6).
+    uint partSize = 160 - headerSeptets( extraOctets + 6 );
+    uint numMessages = ( septets + partSize - 1 ) / partSize;
+    septets %= partSize;
+    if ( septets != 0 )
+        spaceLeftInLast = partSize - septets;
+    else
+        spaceLeftInLast = 0;
+    return numMessages;
+}
+
+// Choose the national language shift tables that send "body" in the fewest
+// messages.  Text that the default alphabet can represent always uses it,
+// so that no extra headers are needed.  Returns false if no combination
+// of tables can represent the text.
+static bool chooseShifts( const QString& body, int& lockingShift, int& singleShift )
+{
+    lockingShift = QGsmCodec::Default;
+    singleShift = QGsmCodec::Default;
+    if ( QAtUtils::codec( "gsm-noloss" )->canEncode( body ) )
+        return true;
+
+    bool found = false;
+    uint bestMessages = 0;
+    uint bestSeptets = 0;
+    for ( int locking = 0; locking < QGsmCodec::NumLanguages; ++locking ) {
+        if ( locking != QGsmCodec::Default &&
+             !QGsmCodec::hasLockingShift( locking ) )
+            continue;
+        for ( int single = 0; single < QGsmCodec::NumLanguages; ++single ) {
+            if ( !QGsmCodec::isSupported( single ) )
+                continue;
+            int len = shiftedLength( body, locking, single );
+            if ( len < 0 )
+                continue;
+            uint extra = shiftOctets( locking, single );
+            uint spaceLeft;
+            uint messages = septetMessages( (uint)len, extra, spaceLeft );
+            uint septets = (uint)len + ( extra ? headerSeptets( extra + 1 ) : 0 );
+            if ( !found || messages < bestMessages ||
+                 ( messages == bestMessages && septets < bestSeptets ) ) {
+                found = true;
+                bestMessages = messages;
+                bestSeptets = septets;
+                lockingShift = locking;
+                singleShift = single;
+            }
+        }
+    }
+    return found;
+}
+
+// Choose the national language shift tables for the text of this message,
+// caching the result until the text changes, as bestScheme(), computeSize()
+// and split() all need it and searching the tables is expensive.
+bool QSMSMessage::textShifts( int& lockingShift, int& singleShift ) const
+{
+    if ( d->mShiftsChosen < 0 ) {
+        QString body = text();
+
+        // We need the private structure to be writable to cache the shifts.
+        const_cast<QSMSMessage *>(this)->dwrite();
+        d->mShiftsChosen = chooseShifts( body, d->mLockingShift, d->mSingleShift );
+    }
+    lockingShift = d->mLockingShift;
+    singleShift = d->mSingleShift;
+    return d->mShiftsChosen != 0;
+}
+
+// Find the national language shift elements in a user data header.
+// Tables that are not supported are replaced with the default alphabet,
+// as 3GPP TS 23.040 requires of a receiver, and false is returned.
+static bool nationalShifts( const QByteArray& headers, int& lockingShift, int& singleShift )
+{
+    uint posn = 0;
+    uint tag, len;
+    bool supported = true;
+    lockingShift = QGsmCodec::Default;
+    singleShift = QGsmCodec::Default;
+    while ( ( posn + 2 ) <= (uint)(headers.size()) ) {
+        tag = (unsigned char)(headers[posn]);
+        len = (unsigned char)(headers[posn + 1]);
+        if ( ( posn + len + 2 ) > (uint)(headers.size()) )
+            break;
+        if ( tag == (uint)SMS_HK_National_Single_Shift && len == 1 )
+            singleShift = (unsigned char)(headers[posn + 2]);
+        else if ( tag == (uint)SMS_HK_National_Locking_Shift && len == 1 )
+            lockingShift = (unsigned char)(headers[posn + 2]);
+        posn += len + 2;
+    }
+    if ( !QGsmCodec::isSupported( singleShift ) ) {
+        qWarning() << "QSMSMessage: unsupported national single shift table"
+                   << singleShift;
+        singleShift = QGsmCodec::Default;
+        supported = false;
+    }
+    if ( !QGsmCodec::hasLockingShift( lockingShift ) ) {
+        if ( lockingShift != QGsmCodec::Default ) {
+            qWarning() << "QSMSMessage: unsupported national locking shift table"
+                       << lockingShift;
+            supported = false;
+        }
+        lockingShift = QGsmCodec::Default;
+    }
+    return supported;
+}
+
+// Append national language shift elements to a user data header.
+static void appendShiftHeaders( QByteArray& headers, int lockingShift, int singleShift )
+{
+    if ( singleShift ) {
+        headers += (char)SMS_HK_National_Single_Shift;
+        headers += (char)1;
+        headers += (char)singleShift;
+    }
+    if ( lockingShift ) {
+        headers += (char)SMS_HK_National_Locking_Shift;
+        headers += (char)1;
+        headers += (char)lockingShift;
+    }
+}
+
+// Remove any national language shift elements from a user data header.
+static QByteArray removeShiftHeaders( const QByteArray& headers )
+{
+    QByteArray result;
+    uint posn = 0;
+    uint tag, len;
+    while ( ( posn + 2 ) <= (uint)(headers.size()) ) {
+        tag = (unsigned char)(headers[posn]);
+        len = (unsigned char)(headers[posn + 1]);
+        if ( ( posn + len + 2 ) > (uint)(headers.size()) )
+            break;
+        if ( tag != (uint)SMS_HK_National_Single_Shift &&
+             tag != (uint)SMS_HK_National_Locking_Shift )
+            result += headers.mid( posn, len + 2 );
+        posn += len + 2;
+    }
+    return result;
+}
+
 /*!
     Returns the best SMS data coding scheme to use for this
     message, determined by an inspection of the plain text body parts.
@@ -515,10 +722,9 @@ void QSMSMessage::setBestScheme(QSMSDataCodingScheme scheme)
 */
 QSMSDataCodingScheme QSMSMessage::bestScheme() const
 {
-    QTextCodec *codec = QAtUtils::codec( "gsm-noloss" );
     QString body = text();
     uint len = body.length();
-    bool gsmSafe;
+    int lockingShift, singleShift;
 
     // Did the user provide a scheme override?
     if ( d->mBestScheme != (QSMSDataCodingScheme)(-1) )
@@ -532,11 +738,9 @@ QSMSDataCodingScheme QSMSMessage::bestScheme() const
     if ( d->mForceGsm )
         return QSMS_DefaultAlphabet;
 
-    // Check the body for non-GSM characters.
-    gsmSafe = codec->canEncode( body );
-
-    // Use the default alphabet if everything is GSM-compatible.
-    if ( gsmSafe )
+    // Use the default alphabet if everything is GSM-compatible,
+    // possibly with the help of national language shift tables.
+    if ( textShifts( lockingShift, singleShift ) )
         return QSMS_DefaultAlphabet;
 
     // See if we can convert to 8-bit using the codec
@@ -774,6 +978,7 @@ void QSMSMessage::clearParts()
 {
     dwrite()->mParts.clear();
     dwrite()->mCachedBody = QString();
+    dwrite()->mShiftsChosen = -1;
 }
 
 /*!
@@ -796,6 +1001,7 @@ void QSMSMessage::addPart( const QSMSMessagePart& part )
     // Append the new part and clear the cached text.
     d->mParts.append( part );
     d->mCachedBody = QString();
+    d->mShiftsChosen = -1;
 }
 
 /*!
@@ -815,6 +1021,7 @@ void QSMSMessage::addParts( const QList<QSMSMessagePart>& parts )
     }
     d->mParts += parts;
     d->mCachedBody = QString();
+    d->mShiftsChosen = -1;
 }
 
 /*!
@@ -862,20 +1069,13 @@ void QSMSMessage::computeSize( uint& numMessages, uint& spaceLeftInLast ) const
 
     if ( scheme == QSMS_DefaultAlphabet ) {
 
-        // Encode the message using 7-bit GSM.
-        len = body.length();
-        if ( len <= 160 ) {
-            numMessages = 1;
-            spaceLeftInLast = 160 - len;
-        } else {
-            // 153 = 160 - fragment_header_size (7).
-            numMessages = ( len + 152 ) / 153;
-            len %= 153;
-            if ( len != 0 )
-                spaceLeftInLast = 153 - len;
-            else
-                spaceLeftInLast = 0;
-        }
+        // Encode the message using 7-bit GSM, counting the escape
+        // sequences and any national language shift headers.
+        int lockingShift, singleShift;
+        textShifts( lockingShift, singleShift );
+        len = getEncodedLength( body, body.length(), lockingShift, singleShift );
+        numMessages = septetMessages
+            ( len, shiftOctets( lockingShift, singleShift ), spaceLeftInLast );
 
     } else if ( scheme == QSMS_8BitAlphabet ) {
 
@@ -1198,7 +1398,7 @@ QList<QSMSMessage> QSMSMessage::split() const
 {
     QList<QSMSMessage> list;
     uint numMessages, spaceLeftInLast;
-    static uint fragmentCounter =0;
+    static QAtomicInt fragmentCounters;
 
     computeSize( numMessages, spaceLeftInLast );
     if ( numMessages <= 1 ) {
@@ -1207,6 +1407,9 @@ QList<QSMSMessage> QSMSMessage::split() const
         return list;
     }
 
+    // Allocate a reference number, which may be done from several threads.
+    uint fragmentCounter = (uint)fragmentCounters.fetchAndAddOrdered( 1 ) & 0xFF;
+
     // Get the number of characters to transmit in each fragment.
     int split;
     QSMSDataCodingScheme scheme = bestScheme();
@@ -1223,17 +1426,46 @@ QList<QSMSMessage> QSMSMessage::split() const
     QSMSMessage tmp;
     number = 1;
     if ( destinationPort() == -1 ) {
-        // Splitting a simple text message.
+        // Splitting a simple text message.  7-bit fragments are filled by
+        // septets, so that escape sequences are not split across them.
         QString txt = text();
+        int lockingShift = QGsmCodec::Default;
+        int singleShift = QGsmCodec::Default;
+        QList<int> lengths;
+        if ( scheme == QSMS_DefaultAlphabet ) {
+            textShifts( lockingShift, singleShift );
+            split = 160 - headerSeptets
+                ( shiftOctets( lockingShift, singleShift ) + 6 );
+        }
         while ( posn < txt.length() ) {
-            tmp = *this;
-            len = txt.length() - posn;
-            if ( len > split ) {
-                len = split;
+            if ( scheme == QSMS_DefaultAlphabet ) {
+                int septets = 0;
+                len = 0;
+                while ( ( posn + len ) < txt.length() ) {
+                    int cost = encodedCost
+                        ( txt[posn + len], lockingShift, singleShift );
+                    if ( ( septets + cost ) > split )
+                        break;
+                    septets += cost;
+                    ++len;
+                }
+            } else {
+                len = txt.length() - posn;
+                if ( len > split ) {
+                    len = split;
+                }
             }
+            lengths.append( len );
+            posn += len;
+        }
+        posn = 0;
+        foreach ( len, lengths ) {
+            tmp = *this;
             tmp.setText( txt.mid( posn, len ) );
             tmp.setFragmentHeader( fragmentCounter, number++,
-                                   numMessages, scheme );
+                                   lengths.size(), scheme );
+            appendShiftHeaders( tmp.dwrite()->mHeaders,
+                                lockingShift, singleShift );
             posn += len;
             list.append(tmp);
         }
@@ -1260,9 +1492,6 @@ QList<QSMSMessage> QSMSMessage::split() const
         }
     }
 
-    // Increase the fragment counter for the next multi-part SMS message.
-    fragmentCounter = ( fragmentCounter + 1 ) & 0xFF;
-
     return list;
 }
 
@@ -1306,6 +1535,34 @@ int QSMSMessage::pduAddressLength( const QByteArray& pdu )
         return 0;
 }
 
+/*!
+    Returns an SMS-STATUS-REPORT pdu, according to 3GPP TS 23.040, for the
+    message with reference number \a reference that was sent to \a recipient
+    via \a serviceCenter.  The report gives the time the message was
+    \a submitted, the time it was \a discharged and the TP-Status
+    value \a status, which is zero if the message was received.
+*/
+QByteArray QSMSMessage::statusReportPdu( const QString& serviceCenter, int reference,
+                                         const QString& recipient,
+                                         const QDateTime& submitted,
+                                         const QDateTime& discharged, int status )
+{
+    QPDUMessage pdu;
+    pdu.setAddress( serviceCenter, true );
+
+    pdu.setBits( 0, 2, SMS_StatusReport );
+    pdu.setBit( 2, true );              // TP-More-Messages-to-Send: no more
+    pdu.setBit( 5, false );             // TP-Status-Report-Qualifier: submit
+    pdu.commitBits();
+
+    pdu.appendOctet( (uchar)reference );    // TP-MR
+    pdu.setAddress( recipient, false );     // TP-RA
+    pdu.setTimeStamp( submitted );          // TP-SCTS
+    pdu.setTimeStamp( discharged );         // TP-DT
+    pdu.appendOctet( (uchar)status );       // TP-ST
+    return pdu.toByteArray();
+}
+
 int QSMSMessage::findPart( const QString& mimeType ) const
 {
     QList<QSMSMessagePart>::ConstIterator iter;
@@ -1527,9 +1784,6 @@ QByteArray QPDUMessage::getOctets( uint len )
     return result;
 }
 
-int QPDUMessage::mPosn;
-char QPDUMessage::mBits;
-
 void QPDUMessage::setBit(int b, bool on)
 {
     if ( on )
@@ -1550,12 +1804,6 @@ void QPDUMessage::commitBits()
     mBits = 0;
 }
 
-void QPDUMessage::commitBits( QByteArray &buffer )
-{
-    buffer += mBits;
-    mBits = 0;
-}
-
 bool QPDUMessage::bit(int b)
 {
     if ( needOctets(1) )
@@ -1593,23 +1841,8 @@ unsigned char QPDUMessage::peekOctet() const
 static QByteArray collapse7Bit( const QByteArray& in )
 {
     QByteArray out;
-    int byte = 0;
-    int size = 0;
-    for ( int posn = 0; posn < in.length(); ++posn ) {
-        for ( int bit = 0; bit < 7; ++bit ) {
-            if ( ( in[posn] & (1 << bit) ) != 0 )
-                byte |= (1 << size);
-            ++size;
-            if ( size >= 8 ) {
-                out += (char)byte;
-                byte = 0;
-                size = 0;
-            }
-        }
-    }
-    if ( size != 0 ) {
-        out += (char)byte;
-    }
+    out.resize( QGsmCodec::packedLength( in.length() ) );
+    QGsmCodec::packSeptets( out.data(), in.constData(), in.length() );
     return out;
 }
 
@@ -1672,10 +1905,7 @@ void QPDUMessage::appendAddress( QByteArray &buffer, const QString &strin, bool
         buffer.append( len );
 
         // Output the type of number information.
-        setBits(0, 4, SMS_NumberId_Unknown);
-        setBits(4, 3, at);
-        setBit(7, true);
-        commitBits( buffer );
+        buffer += (char)(0x80 | ((at & 0x07) << 4) | SMS_NumberId_Unknown);
 
         // Output the encoded address and exit.
         buffer += bytes;
@@ -1688,10 +1918,7 @@ void QPDUMessage::appendAddress( QByteArray &buffer, const QString &strin, bool
 
     buffer.append( len );
 
-    setBits(0, 4, SMS_Phone);
-    setBits(4, 3, at);
-    setBit(7, true);
-    commitBits( buffer );
+    buffer += (char)(0x80 | ((at & 0x07) << 4) | SMS_Phone);
 
     bool upper4 = false;
     octet = 0;
@@ -1743,20 +1970,8 @@ void QSMSMessage::appendAddress( QByteArray &buffer, const QString &strin, bool
 static QByteArray expand7Bit( const QByteArray& in )
 {
     QByteArray out;
-    int byte = 0;
-    int size = 0;
-    for ( int posn = 0; posn < in.length(); ++posn ) {
-        for ( int bit = 0; bit < 8; ++bit ) {
-            if ( ( in[posn] & (1 << bit) ) != 0 )
-                byte |= (1 << size);
-            ++size;
-            if ( size >= 7 ) {
-                out += (char)byte;
-                byte = 0;
-                size = 0;
-            }
-        }
-    }
+    out.resize( in.length() * 8 / 7 );
+    QGsmCodec::unpackSeptets( out.data(), in.constData(), out.length() );
     return out;
 }
 
@@ -1863,28 +2078,9 @@ QDateTime QPDUMessage::timeStamp()
 }
 
 // Get the length of a string when encoded in the GSM 7-bit alphabet.
-static uint getEncodedLength( const QString& txt, uint size )
+// Strip off everything except the alphabet bits of a data coding scheme.
+static QSMSDataCodingScheme userDataAlphabet( QSMSDataCodingScheme scheme )
 {
-    uint len = 0;
-    for ( int u = 0; u < (int)size; u++ ) {
-        if ( QGsmCodec::twoByteFromUnicode( txt[u].unicode() ) >= 256 )
-            len += 2;
-        else
-            ++len;
-    }
-    return len;
-}
-
-void QPDUMessage::setUserData(const QString &txt, QSMSDataCodingScheme scheme, QTextCodec *codec, const QByteArray& headers, bool implicitLength)
-{
-    uint len = txt.length();
-    uint u;
-    uint encodedLen;
-    uint headerLen = (uint)(headers.size());
-    if ( headerLen )
-        ++headerLen;
-
-    // Strip off everything except the alphabet bits.
     switch (scheme >> 6) {
     case 0:
     default:
@@ -1908,57 +2104,71 @@ void QPDUMessage::setUserData(const QString &txt, QSMSDataCodingScheme scheme, Q
         }
         break;
     }
+    return scheme;
+}
+
+void QPDUMessage::setUserData(const QString &txt, QSMSDataCodingScheme scheme, QTextCodec *codec, const QByteArray& headers, bool implicitLength)
+{
+    uint len = txt.length();
+    uint u;
+    uint encodedLen;
+    uint headerLen = (uint)(headers.size());
+    if ( headerLen )
+        ++headerLen;
+
+    // Strip off everything except the alphabet bits.
+    scheme = userDataAlphabet( scheme );
 
     if ( scheme == QSMS_DefaultAlphabet ) {
 
-        // Encode the text using the 7-bit GSM alphabet.
-        if ( len > 160 )
-            len = 160;
-        encodedLen = getEncodedLength( txt, len );
-        while ( encodedLen > 160 ) {
-            // Chop off some more characters until it is <= 160.
+        // Encode the text using the 7-bit GSM alphabet, with the national
+        // language shift tables that the header selects.
+        int lockingShift, singleShift;
+        nationalShifts( headers, lockingShift, singleShift );
+        bool national = ( lockingShift || singleShift );
+        uint maxLen = 160 - headerSeptets( headerLen );
+        if ( len > maxLen )
+            len = maxLen;
+        encodedLen = getEncodedLength( txt, len, lockingShift, singleShift );
+        while ( encodedLen > maxLen ) {
+            // Chop off some more characters until it fits.
             --len;
-            encodedLen = getEncodedLength( txt, len );
+            encodedLen = getEncodedLength( txt, len, lockingShift, singleShift );
         }
         if (!implicitLength)
             appendOctet( encodedLen + ( headerLen * 8 + 6 ) / 7 );
-        int bitCount = 0;
-        unsigned short c;
+        int fillBits = 0;
         if ( headerLen > 0 ) {
             // Output the header and align on a septet boundary.
-            bitCount = headerLen * 8;
-            if ((bitCount % 7) != 0)
-                bitCount = 7 - (bitCount % 7);
-            else
-                bitCount = 0;
+            fillBits = ( 7 - ( headerLen * 8 ) % 7 ) % 7;
             appendOctet( headerLen - 1 );
             for ( u = 0; u < headerLen - 1; u++ ) {
                 appendOctet( headers[u] );
             }
         }
+        QByteArray septets;
+        septets.resize( encodedLen );
+        char *s = septets.data();
+        unsigned short c;
         for ( u = 0; u < len; u++ ) {
-            c = QGsmCodec::twoByteFromUnicode( txt[u].unicode() );
+            if ( national ) {
+                c = QGsmCodec::twoByteFromUnicode
+                    ( txt[u], lockingShift, singleShift );
+                if ( c == 0xFFFF )
+                    c = 0x10;       // Not representable.
+            } else {
+                c = QGsmCodec::twoByteFromUnicode( txt[u].unicode() );
+            }
             if ( c >= 256 ) {
                 // Encode a two-byte sequence.
-                for ( int i = 0; i < 7; i++ ) {
-                    if ( bitCount == 8 ) {
-                        bitCount = 0;
-                        commitBits();
-                    }
-                    setBit( bitCount++, (Unit << (i+8)) & c );
-                }
-            }
-            for ( int i = 0; i < 7; i++ ) {
-                if ( bitCount == 8 ) {
-                    bitCount = 0;
-                    commitBits();
-                }
-                setBit( bitCount++, (Unit << i) & c );
+                *s++ = (char)( c >> 8 );
             }
+            *s++ = (char)c;
         }
-        if ( bitCount != 0 ) {
-            commitBits();
-        }
+        int start = mBuffer.size();
+        mBuffer.resize( start + QGsmCodec::packedLength( encodedLen, fillBits ) );
+        QGsmCodec::packSeptets( mBuffer.data() + start, septets.constData(),
+                                encodedLen, fillBits );
 
     } else if ( scheme == QSMS_8BitAlphabet ) {
         // Encode the text using the codec's 8-bit alphabet.
@@ -2047,9 +2257,7 @@ QString QPDUMessage::userData(QSMSDataCodingScheme scheme, QTextCodec *codec, QB
     if ( scheme == QSMS_DefaultAlphabet ) {
 
         // Process a sequence in the default 7-bit GSM character set.
-        int bitCount = 0;
         int startBit = 0;
-        ch = 0;
         if ( implicitLength )
             len = len * 8 / 7;      // Convert 8-bit bytes to 7-bit characters.
         if ( hasHeaders ) {
@@ -2063,40 +2271,46 @@ QString QPDUMessage::userData(QSMSDataCodingScheme scheme, QTextCodec *codec, QB
             if ( isSMSDatagram( *headers ) )
                 return str;
             u = ((headerLen + 1) * 8 + 6) / 7;
-            len -= u;
-            startBit = (headerLen + 1) * 8;
-            if ((startBit % 7) != 0)
-                startBit = 7 - (startBit % 7);
-            else
-                startBit = 0;
+            len = ( len > u ? len - u : 0 );
+            startBit = ( 7 - ( ( headerLen + 1 ) * 8 ) % 7 ) % 7;
         }
+
+        // Decode as much as is actually present if the length is too long.
+        uint avail = (uint)( mBuffer.size() - mPosn );
+        if ( (uint)QGsmCodec::packedLength( len, startBit ) > avail )
+            len = avail ? ( avail * 8 - startBit ) / 7 : 0;
+        QByteArray septets;
+        septets.resize( len );
+        QGsmCodec::unpackSeptets( septets.data(), mBuffer.constData() + mPosn,
+                                  len, startBit );
+        mPosn += QGsmCodec::packedLength( len, startBit );
+
+        int lockingShift = QGsmCodec::Default;
+        int singleShift = QGsmCodec::Default;
+        if ( headers )
+            nationalShifts( *headers, lockingShift, singleShift );
+        bool national = ( lockingShift || singleShift );
+
+        str.resize( len );
+        QChar *out = str.data();
+        const char *s = septets.constData();
         bool prefixed = false;
-        while ( len > 0 ) {
-            if ( !needOctets(1) )
-                return str;
-            for ( int i = startBit; len > 0 && i < 8; i++ ) {
-                // test the bit and shift it down again, as i doesn't mark
-                // where we are in the current char, but bitCount does
-                ch |= ( ( peekOctet() & (Unit << i) ) >> i) << bitCount;
-                bitCount++;
-                if ( bitCount == 7 ) {
-                    bitCount = 0;
-                    if ( ch == 0x1B ) {     // Start of a two-byte encoding.
-                        prefixed = true;
-                    } else if ( prefixed ) {
-                        str += QChar
-                            ( QGsmCodec::twoByteToUnicode( 0x1B00 | ch ) );
-                        prefixed = false;
-                    } else {
-                        str += QGsmCodec::singleToUnicode( (unsigned char)ch );
-                    }
-                    ch = 0;
-                    --len;
-                }
+        for ( u = 0; u < len; ++u ) {
+            ch = (unsigned char)s[u];
+            if ( ch == 0x1B ) {     // Start of a two-byte encoding.
+                prefixed = true;
+            } else if ( national ) {
+                *out++ = QGsmCodec::twoByteToUnicode
+                    ( ( prefixed ? 0x1B00 : 0 ) | ch, lockingShift, singleShift );
+                prefixed = false;
+            } else if ( prefixed ) {
+                *out++ = QGsmCodec::twoByteToUnicode( 0x1B00 | ch );
+                prefixed = false;
+            } else {
+                *out++ = QGsmCodec::singleToUnicode( (char)ch );
             }
-            startBit = 0;
-            skipOctet();
         }
+        str.resize( out - str.constData() );
 
     } else if ( scheme == QSMS_8BitAlphabet && codec ) {
 
@@ -2229,6 +2443,21 @@ QSMSSubmitMessage::QSMSSubmitMessage(const QSMSMessage &m, bool isDeliver)
             scheme = (QSMSDataCodingScheme)dataScheme;
     }
 
+    // Select the national language shift tables for 7-bit text, keeping
+    // any that are already in the header if they can represent it.
+    if ( part == -1 && userDataAlphabet( scheme ) == QSMS_DefaultAlphabet ) {
+        int lockingShift, singleShift;
+        bool supported = nationalShifts( headers, lockingShift, singleShift );
+        if ( !supported || ( ( lockingShift || singleShift ) &&
+             shiftedLength( m.text(), lockingShift, singleShift ) < 0 ) ) {
+            headers = removeShiftHeaders( headers );
+            lockingShift = singleShift = QGsmCodec::Default;
+        }
+        if ( !lockingShift && !singleShift &&
+             m.textShifts( lockingShift, singleShift ) )
+            appendShiftHeaders( headers, lockingShift, singleShift );
+    }
+
     if ( !isDeliver )
         setBits(0, 2, SMS_Submit);
     else
@@ -151,6 +151,10 @@ public:
     static QSMSMessage fromPdu( const QByteArray& pdu );
     static int pduAddressLength( const QByteArray& pdu );
     static void appendAddress( QByteArray &buffer, const QString &strin, bool SCAddress );
+    static QByteArray statusReportPdu( const QString& serviceCenter, int reference,
+                                       const QString& recipient,
+                                       const QDateTime& submitted,
+                                       const QDateTime& discharged, int status );
 
 protected:
     void setMessageType(MessageType);
@@ -165,6 +169,7 @@ private:
     void setFragmentHeader( uint refNum, uint part, uint numParts,
                             QSMSDataCodingScheme scheme );
     void unpackHeaderParts();
+    bool textShifts( int& lockingShift, int& singleShift ) const;
 };
 
 #endif
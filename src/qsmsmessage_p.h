@@ -103,7 +103,9 @@ enum SMSHeaderKind {
     SMS_HK_Data_Request_Command         = 0x1A,
     SMS_HK_RFC_822_Header               = 0x20,
     SMS_HK_Hyperlink_Format_Element     = 0x21,
-    SMS_HK_Reply_Address_Element        = 0x22
+    SMS_HK_Reply_Address_Element        = 0x22,
+    SMS_HK_National_Single_Shift        = 0x24,
+    SMS_HK_National_Locking_Shift       = 0x25
 };
 
 class QPDUMessage
@@ -116,10 +118,9 @@ public:
 
     QByteArray toByteArray() const { return mBuffer; }
 
-    static void setBit(int b, bool on);
-    static void setBits(int offset, int len, int val);
+    void setBit(int b, bool on);
+    void setBits(int offset, int len, int val);
     void commitBits();
-    static void commitBits(QByteArray& buffer);
     void appendOctet(uchar c) { mBuffer += (char)c; }
 
     bool bit(int b);
@@ -152,9 +153,11 @@ public:
     static void appendAddress( QByteArray &buffer, const QString &strin, bool SCAddress );
 
 protected:
+    // The cursor is per message, so that several messages can be
+    // encoded or decoded at once in different threads.
     QByteArray mBuffer;
-    static int mPosn;
-    static char mBits;
+    int mPosn;
+    char mBits;
 };
 
 
@@ -18,75 +18,376 @@
 ****************************************************************************/
 
 #include "qsmsmessagelist.h"
+#include <qfile.h>
 #include <qdebug.h>
+#include <string.h>
+#include <sys/file.h>
 
-QSMSMessageList::QSMSMessageList()
+// Layout of a message store file: a header followed by fixed-size slots.
+// A slot's state byte is written last when a message is stored and first
+// when it is deleted, so that a crash part way through an update leaves
+// the slot either free or complete.  The checksum catches slots that
+// were torn by a power failure rather than by a process crash.
+
+#define SMS_STORE_MAGIC     0x534d5350      // "PSMS"
+#define SMS_STORE_VERSION   1
+#define SMS_STORE_PDU_SIZE  186
+
+struct SMSStoreHeader
+{
+    quint32 magic;
+    quint32 version;
+    quint32 slotSize;
+    quint32 capacity;
+    char reserved[48];
+};
+
+struct SMSStoreSlot
 {
-    SMSList.clear();
-    statusList.clear();
-    deletedFlagList.clear();
-    lengthList.clear();
+    quint8 state;       // 0 if free, otherwise the status plus one
+    quint8 length;
+    quint8 size;
+    quint8 reserved;
+    quint16 check;
+    char pdu[SMS_STORE_PDU_SIZE];
+};
+
+// Order the stores to a slot's contents before the store to its state,
+// for the CPU as well as for the compiler.
+#if defined(__GNUC__)
+#define SMS_STORE_BARRIER() __sync_synchronize()
+#else
+#define SMS_STORE_BARRIER()
+#endif
+
+static quint16 slotChecksum( const SMSStoreSlot *slot )
+{
+    // Fletcher-16 over the length, size and PDU bytes.
+    quint32 sum1 = slot->length;
+    quint32 sum2 = sum1;
+    sum1 = ( sum1 + slot->size ) % 255;
+    sum2 = ( sum2 + sum1 ) % 255;
+    for ( int i = 0; i < slot->size && i < SMS_STORE_PDU_SIZE; i++ ) {
+        sum1 = ( sum1 + (quint8)slot->pdu[i] ) % 255;
+        sum2 = ( sum2 + sum1 ) % 255;
+    }
+    return (quint16)( ( sum2 << 8 ) | sum1 );
+}
+
+// Slot membership is tracked in bitmaps, one bit per slot, so that
+// allocation and per-status listing skip over 32 slots at a time.
+static inline void setSlotBit( QVector<quint32>& map, int i )
+{
+    map[i >> 5] |= ( 1U << ( i & 31 ) );
+}
+
+static inline void clearSlotBit( QVector<quint32>& map, int i )
+{
+    map[i >> 5] &= ~( 1U << ( i & 31 ) );
+}
+
+static inline int lowestBit( quint32 word )
+{
+#if defined(__GNUC__)
+    return __builtin_ctz( word );
+#else
+    int bit = 0;
+    while ( ( word & 1 ) == 0 ) {
+        word >>= 1;
+        ++bit;
+    }
+    return bit;
+#endif
+}
+
+static QList<int> slotsInMap( const QVector<quint32>& map )
+{
+    QList<int> result;
+    for ( int word = 0; word < map.size(); ++word ) {
+        quint32 bits = map[word];
+        while ( bits != 0 ) {
+            result.append( word * 32 + lowestBit( bits ) );
+            bits &= bits - 1;
+        }
+    }
+    return result;
+}
+
+QSMSMessageList::QSMSMessageList( int capacity )
+{
+    used = 0;
+    for ( int s = 0; s < 4; s++ )
+        statusCounts[s] = 0;
+    storeFile = 0;
+    storeMap = 0;
+    setCapacity( capacity );
 }
 
 QSMSMessageList::~QSMSMessageList()
 {
+    closeStore();
 }
 
-void QSMSMessageList::appendSMS( const QByteArray &m, int length )
+bool QSMSMessageList::setCapacity( int capacity )
 {
-    SMSList.append(m);
-    statusList.append(QSMSMessageList::REC_UNREAD);
-    deletedFlagList.append(false);
-    lengthList.append(length);
+    if ( capacity < 0 )
+        return false;
+    if ( storeMap )
+        return ( capacity == entries.size() );   // Fixed by the file.
+    for ( int i = capacity; i < entries.size(); i++ ) {
+        if ( entries[i].status >= 0 )
+            return false;
+    }
+
+    int oldCapacity = entries.size();
+    int words = ( capacity + 31 ) / 32;
+    entries.resize( capacity );
+    freeMap.resize( words );
+    for ( int s = 0; s < 4; s++ )
+        statusMaps[s].resize( words );
+
+    // Mark new slots as free, and drop bits for slots that went away.
+    for ( int i = oldCapacity; i < capacity; i++ ) {
+        entries[i].length = 0;
+        entries[i].status = -1;
+        setSlotBit( freeMap, i );
+    }
+    if ( capacity % 32 )
+        freeMap[words - 1] &= ( 1U << ( capacity % 32 ) ) - 1;
+    return true;
 }
 
+bool QSMSMessageList::open( const QString& fileName )
+{
+    storeError = QString();
+    if ( storeMap || used != 0 ) {
+        storeError = "the message list is already in use";
+        qWarning() << "QSMSMessageList:" << storeError;
+        return false;
+    }
+    if ( !mapStore( fileName ) ) {
+        qWarning() << "QSMSMessageList:" << fileName << storeError;
+        closeStore();
+        return false;
+    }
+
+    // Rebuild the indexes from the slots that were committed.
+    for ( int i = 0; i < entries.size(); i++ ) {
+        SMSStoreSlot *slot = (SMSStoreSlot *)
+            ( storeMap + sizeof(SMSStoreHeader) + i * sizeof(SMSStoreSlot) );
+        if ( slot->state == 0 )
+            continue;
+        if ( slot->state > 4 || slot->size > SMS_STORE_PDU_SIZE ||
+             slot->check != slotChecksum( slot ) ) {
+            qWarning() << "QSMSMessageList: discarding damaged slot" << i;
+            slot->state = 0;
+            continue;
+        }
+        place( i, QByteArray( slot->pdu, slot->size ),
+               slot->length, slot->state - 1 );
+    }
+    return true;
+}
+
+bool QSMSMessageList::mapStore( const QString& fileName )
+{
+    storeFile = new QFile( fileName );
+    if ( !storeFile->open( QIODevice::ReadWrite ) ) {
+        storeError = "cannot be opened: " + storeFile->errorString();
+        return false;
+    }
+
+    // Only one simulated modem may use a store at a time.
+    if ( flock( storeFile->handle(), LOCK_EX | LOCK_NB ) < 0 ) {
+        storeError = "is in use by another connection";
+        return false;
+    }
+
+    // A file without a header was left by a create that did not finish.
+    SMSStoreHeader header;
+    qint64 size = storeFile->size();
+    bool haveHeader = ( size >= (qint64)sizeof(header) &&
+                        storeFile->read( (char *)&header, sizeof(header) ) == sizeof(header) );
+    if ( size == 0 || ( haveHeader && header.magic == 0 ) ) {
+        if ( !createStore( header, size ) ) {
+            storeError = "cannot be created: " + storeFile->errorString();
+            storeFile->resize( 0 );
+            return false;
+        }
+    } else if ( !haveHeader ||
+                header.magic != SMS_STORE_MAGIC ||
+                header.version != SMS_STORE_VERSION ||
+                header.slotSize != sizeof(SMSStoreSlot) ||
+                size < (qint64)( sizeof(header) + (qint64)header.capacity * sizeof(SMSStoreSlot) ) ) {
+        storeError = "is not a message store";
+        return false;
+    }
+
+    storeMap = storeFile->map( 0, size );
+    if ( !storeMap ) {
+        storeError = "cannot be mapped: " + storeFile->errorString();
+        return false;
+    }
+
+    // The capacity of an existing store is fixed by its file.
+    uchar *map = storeMap;
+    storeMap = 0;
+    setCapacity( 0 );
+    setCapacity( header.capacity );
+    storeMap = map;
+    return true;
+}
+
+// Create an empty store with the current capacity.  The slots are
+// allocated first and the header is written last, so that a file is
+// only recognised as a store once it is complete.
+bool QSMSMessageList::createStore( SMSStoreHeader& header, qint64& size )
+{
+    memset( &header, 0, sizeof(header) );
+    header.magic = SMS_STORE_MAGIC;
+    header.version = SMS_STORE_VERSION;
+    header.slotSize = sizeof(SMSStoreSlot);
+    header.capacity = entries.size();
+    size = sizeof(header) + (qint64)header.capacity * sizeof(SMSStoreSlot);
+    return storeFile->resize( 0 ) && storeFile->resize( size ) &&
+           storeFile->seek( 0 ) &&
+           storeFile->write( (const char *)&header, sizeof(header) ) == sizeof(header) &&
+           storeFile->flush();
+}
+
+void QSMSMessageList::closeStore()
+{
+    if ( storeFile ) {
+        if ( storeMap )
+            storeFile->unmap( storeMap );
+        storeFile->close();
+        delete storeFile;
+        storeFile = 0;
+    }
+    storeMap = 0;
+}
+
+void QSMSMessageList::place( int i, const QByteArray& pdu, int length, int status )
+{
+    Entry& e = entries[i];
+    e.pdu = pdu;
+    e.length = length;
+    e.status = status;
+    clearSlotBit( freeMap, i );
+    setSlotBit( statusMaps[status], i );
+    ++statusCounts[status];
+    ++used;
+}
+
+void QSMSMessageList::release( int i )
+{
+    Entry& e = entries[i];
+    clearSlotBit( statusMaps[e.status], i );
+    --statusCounts[e.status];
+    --used;
+    e.pdu = QByteArray();
+    e.length = 0;
+    e.status = -1;
+    setSlotBit( freeMap, i );
+}
+
+int QSMSMessageList::appendSMS( const QByteArray &m, int length, SMSStatus status )
+{
+    if ( storeMap && ( m.size() > SMS_STORE_PDU_SIZE || length > 255 ) )
+        return -1;
+
+    // Use the lowest free slot, as a real message store would.
+    for ( int word = 0; word < freeMap.size(); word++ ) {
+        if ( freeMap[word] == 0 )
+            continue;
+        int i = word * 32 + lowestBit( freeMap[word] );
+        if ( !storeMap ) {
+            place( i, m, length, status );
+            return i;
+        }
+
+        // Fill in the slot, then commit it by setting its state.
+        SMSStoreSlot *slot = (SMSStoreSlot *)
+            ( storeMap + sizeof(SMSStoreHeader) + i * sizeof(SMSStoreSlot) );
+        slot->length = (quint8)length;
+        slot->size = (quint8)m.size();
+        memcpy( slot->pdu, m.constData(), m.size() );
+        slot->check = slotChecksum( slot );
+        SMS_STORE_BARRIER();
+        slot->state = (quint8)( status + 1 );
+        place( i, m, length, status );
+        return i;
+    }
+    return -1;
+}
 
 void QSMSMessageList::deleteSMS( int i )
 {
-    deletedFlagList[i] = true;
+    if ( !contains( i ) )
+        return;
+    if ( storeMap ) {
+        SMSStoreSlot *slot = (SMSStoreSlot *)
+            ( storeMap + sizeof(SMSStoreHeader) + i * sizeof(SMSStoreSlot) );
+        slot->state = 0;
+    }
+    release( i );
 }
 
-int QSMSMessageList::count() const
+bool QSMSMessageList::contains( int i ) const
 {
-    return SMSList.count();
+    return ( i >= 0 && i < entries.size() && entries[i].status >= 0 );
 }
 
-QSMSMessageList::SMSStatus QSMSMessageList::getStatus( int i ) const
+QList<int> QSMSMessageList::indexes() const
 {
-   return statusList[i];
+    QVector<quint32> map( freeMap.size() );
+    for ( int word = 0; word < map.size(); word++ ) {
+        map[word] = statusMaps[0][word] | statusMaps[1][word] |
+                    statusMaps[2][word] | statusMaps[3][word];
+    }
+    return slotsInMap( map );
 }
 
-int QSMSMessageList::getLength( int i ) const
+QList<int> QSMSMessageList::indexes( SMSStatus s ) const
 {
-    return lengthList[i];
+    return slotsInMap( statusMaps[s] );
 }
 
-void QSMSMessageList::setStatus( const SMSStatus &s, int i )
+QSMSMessageList::SMSStatus QSMSMessageList::getStatus( int i ) const
 {
-    statusList[i] = s;
+   return (SMSStatus)entries[i].status;
 }
 
-bool QSMSMessageList::getDeletedFlag( int i ) const
+int QSMSMessageList::getLength( int i ) const
 {
-    return deletedFlagList[i];
+    return entries[i].length;
 }
 
-void QSMSMessageList::setDeletedFlag( bool b, int i )
+void QSMSMessageList::setStatus( const SMSStatus &s, int i )
 {
-    deletedFlagList[i] = b;
+    Entry& e = entries[i];
+    if ( e.status < 0 || e.status == s )
+        return;
+    if ( storeMap )
+        storeMap[sizeof(SMSStoreHeader) + i * sizeof(SMSStoreSlot)] = (uchar)( s + 1 );
+    clearSlotBit( statusMaps[e.status], i );
+    --statusCounts[e.status];
+    e.status = s;
+    setSlotBit( statusMaps[s], i );
+    ++statusCounts[s];
 }
 
 QByteArray & QSMSMessageList::readSMS( int i )
 {
-   if ( statusList[i] == QSMSMessageList::REC_UNREAD ) {
-        statusList[i] = QSMSMessageList::REC_READ;
+   if ( entries[i].status == QSMSMessageList::REC_UNREAD ) {
+        setStatus( QSMSMessageList::REC_READ, i );
   }
 
-   return SMSList[i];
+   return entries[i].pdu;
 }
 
 QByteArray & QSMSMessageList::operator[]( int i )
 {
-    return SMSList[i];
+    return entries[i].pdu;
 
 }
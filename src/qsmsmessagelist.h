@@ -21,8 +21,17 @@
 #define QSMSMESSAGELIST_H
 
 #include <QList>
+#include <QVector>
 #include <QByteArray>
+#include <QString>
 
+class QFile;
+struct SMSStoreHeader;
+
+// Fixed-capacity SMS message store.  Messages live in numbered slots,
+// and a slot is released for reuse as soon as its message is deleted.
+// The slots can optionally be kept in a memory-mapped file, so that the
+// store survives the connection and can be prepared ahead of time.
 class QSMSMessageList
 {
 public:
@@ -33,29 +42,55 @@ public:
         STO_SENT    =3
     };
 
-    QSMSMessageList();
+    explicit QSMSMessageList( int capacity = 99 );
     ~QSMSMessageList();
 
-    void appendSMS( const QByteArray &, int len );
-    void deleteSMS( int );  //note SMS's are not actually physically deleted. A flag is set
+    int capacity() const { return entries.size(); }
+    bool setCapacity( int );    //fails if it would drop a stored message
+
+    bool open( const QString& fileName ); //switch to a file-backed store
+    bool isPersistent() const { return storeMap != 0; }
+    QString errorString() const { return storeError; } //why open() failed
+
+    int appendSMS( const QByteArray &, int len, SMSStatus status = REC_UNREAD ); //returns the slot, or -1 if full
+    void deleteSMS( int );
+
+    int count() const { return used; } //number of stored messages
+    int count( SMSStatus s ) const { return statusCounts[s]; }
+    bool contains( int ) const;
 
-    int count() const; //returns the total number, even those that are 'deleted'
+    QList<int> indexes() const; //stored slots, in ascending order
+    QList<int> indexes( SMSStatus ) const;
 
     SMSStatus getStatus( int ) const;
     void  setStatus( const SMSStatus &, int );
-
-    bool getDeletedFlag( int ) const;
-    void setDeletedFlag( bool, int );
     int getLength( int ) const;
 
     QByteArray & readSMS( int );//returns and sets the status of an SMS
     QByteArray & operator[]( int );//only returns an SMS, does not set status
 
 private:
-    QList<QByteArray> SMSList;
-    QList<SMSStatus> statusList;
-    QList<bool> deletedFlagList;
-    QList<int> lengthList;
+    struct Entry
+    {
+        QByteArray pdu;
+        int length;
+        int status;     // -1 if the slot is free
+    };
+
+    void place( int i, const QByteArray& pdu, int length, int status );
+    void release( int i );
+    bool mapStore( const QString& fileName );
+    bool createStore( SMSStoreHeader& header, qint64& size );
+    void closeStore();
+
+    QVector<Entry> entries;
+    QVector<quint32> freeMap;
+    QVector<quint32> statusMaps[4];
+    int statusCounts[4];
+    int used;
+    QFile *storeFile;
+    uchar *storeMap;
+    QString storeError;
 };
 
 #endif
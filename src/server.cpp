@@ -22,13 +22,32 @@
 #include "hardwaremanipulator.h"
 #include <qdebug.h>
 
+// Minimum time between reports of the connections per shard, in ms.
+#define SHARD_REPORT_INTERVAL   10000
+
 static int phonenumber = 555000;
 
-PhoneSimServer::PhoneSimServer(const QString &f, quint16 port, QObject *parent)
-    : QTcpServer(parent), fact(0), currentRules(0)
+// Create the SimRules object for a connection, in the current thread.
+static SimRules *createConnection(const PendingConnection &conn, QObject *parent)
+{
+    SimRules *sr = new SimRules(conn.fd, parent, conn.rules, conn.fact);
+    sr->setPhoneNumber(conn.phoneNumber);
+    if ( !conn.messageStore.isEmpty() )
+        sr->setMessageStore(conn.messageStore);
+    if ( !conn.simProfile.isEmpty() )
+        sr->setSimProfile(conn.simProfile);
+    if ( !conn.simJournal.isEmpty() )
+        sr->setSimJournal(conn.simJournal);
+    if ( !conn.smsTraffic.isEmpty() )
+        sr->startSmsTraffic(conn.smsTraffic);
+    return sr;
+}
+
+PhoneSimServer::PhoneSimServer(SimRuleSet *rules, quint16 port, QObject *parent)
+    : QTcpServer(parent), ruleSet(rules), shardPool(0), fact(0), currentRules(0)
 {
-    listen( QHostAddress::Any, port );
-    filename = f;
+    if ( !listen( QHostAddress::Any, port ) )
+        qWarning() << "Could not listen on port" << port << ":" << errorString();
 }
 
 PhoneSimServer::~PhoneSimServer()
@@ -41,13 +60,150 @@ void PhoneSimServer::setHardwareManipulator(HardwareManipulatorFactory *f)
     delete fact;
     fact = f;
     if (f)
-        f->setRuleFile(filename);
+        f->setRuleFile(ruleSet->fileName());
+}
+
+SimRules *PhoneSimServer::rules() const
+{
+    if ( shardPool ) {
+        qWarning() << "PhoneSimServer: rules() is not available in sharded mode";
+        return 0;
+    }
+    return currentRules;
 }
 
 void PhoneSimServer::incomingConnection(int s)
 {
-  SimRules *sr = new SimRules(s, this, filename, fact);
-    sr->setPhoneNumber(QString::number(phonenumber));
-    phonenumber++;
-    currentRules = sr;
+    PendingConnection conn;
+    conn.fd = s;
+    conn.rules = ruleSet;
+    conn.fact = fact;
+    conn.phoneNumber = phoneNumber;
+    if ( conn.phoneNumber.isEmpty() ) {
+        conn.phoneNumber = QString::number(phonenumber);
+        phonenumber++;
+    }
+    conn.messageStore = messageStore;
+    conn.simProfile = simProfile;
+    conn.simJournal = simJournal;
+    conn.smsTraffic = smsTraffic;
+
+    if ( shardPool ) {
+        shardPool->leastLoaded()->addConnection(conn);
+        shardPool->reportLoad();
+        return;
+    }
+
+    currentRules = createConnection(conn, this);
+}
+
+PhoneSimShard::PhoneSimShard(int index, PhoneSimShardPool *pool)
+    : QObject(0), shardIndex(index), pool(pool), connections(0)
+{
+    moveToThread(&thread);
+    thread.start();
+}
+
+PhoneSimShard::~PhoneSimShard()
+{
+    // The connections must be destroyed in the thread that owns them,
+    // so let the shard close them and stop its own thread.
+    QMetaObject::invokeMethod(this, "shutdown", Qt::QueuedConnection);
+    thread.wait();
+}
+
+void PhoneSimShard::addConnection(const PendingConnection &conn)
+{
+    // Count the connection straight away, so that a burst of connections
+    // is spread over the shards before any of them has been processed.
+    connections.ref();
+
+    pendingLock.lock();
+    pending.append(conn);
+    pendingLock.unlock();
+
+    QMetaObject::invokeMethod(this, "processPending", Qt::QueuedConnection);
+}
+
+void PhoneSimShard::processPending()
+{
+    pendingLock.lock();
+    QList<PendingConnection> conns = pending;
+    pending.clear();
+    pendingLock.unlock();
+
+    foreach ( const PendingConnection &conn, conns ) {
+        SimRules *sr = createConnection(conn, this);
+        connect(sr, SIGNAL(destroyed()), this, SLOT(connectionClosed()));
+    }
+}
+
+void PhoneSimShard::connectionClosed()
+{
+    connections.deref();
+    QMetaObject::invokeMethod(pool, "reportLoad", Qt::QueuedConnection);
+}
+
+void PhoneSimShard::shutdown()
+{
+    // Deferred deletes that are still pending when the event loop
+    // exits are processed by the thread before it finishes.
+    foreach ( SimRules *sr, findChildren<SimRules *>() ) {
+        disconnect(sr, SIGNAL(destroyed()), this, SLOT(connectionClosed()));
+        sr->deleteLater();
+    }
+    thread.quit();
+}
+
+PhoneSimShardPool::PhoneSimShardPool(int count)
+{
+    reportTimer.setSingleShot(true);
+    connect(&reportTimer, SIGNAL(timeout()), this, SLOT(logLoad()));
+
+    for (int index = 0; index < count; index++)
+        shards.append(new PhoneSimShard(index, this));
+}
+
+PhoneSimShardPool::~PhoneSimShardPool()
+{
+    qDeleteAll(shards);
+}
+
+PhoneSimShard *PhoneSimShardPool::leastLoaded() const
+{
+    PhoneSimShard *best = shards[0];
+    for (int index = 1; index < shards.size(); index++) {
+        if (shards[index]->load() < best->load())
+            best = shards[index];
+    }
+    return best;
+}
+
+QString PhoneSimShardPool::loadReport() const
+{
+    QStringList loads;
+    foreach ( PhoneSimShard *shard, shards )
+        loads += QString::number(shard->load());
+    return loads.join(" ");
+}
+
+void PhoneSimShardPool::reportLoad()
+{
+    // Connections can arrive in bursts of thousands, so don't log each
+    // one, but make sure that the last change is logged eventually.
+    if ( reportTimer.isActive() )
+        return;
+    int wait = 0;
+    if ( lastReport.isValid() )
+        wait = SHARD_REPORT_INTERVAL - lastReport.elapsed();
+    if ( wait > 0 )
+        reportTimer.start(wait);
+    else
+        logLoad();
+}
+
+void PhoneSimShardPool::logLoad()
+{
+    lastReport.start();
+    qDebug() << "Connections per shard:" << loadReport();
 }
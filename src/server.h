@@ -23,27 +23,142 @@
 #include <qtcpserver.h>
 #include <qtcpsocket.h>
 #include <qpointer.h>
+#include <qthread.h>
+#include <qmutex.h>
+#include <qatomic.h>
+#include <qdatetime.h>
+#include <qtimer.h>
 
 #include "phonesim.h"
 
 class PhoneTestServer;
 class HardwareManipulatorFactory;
+class PhoneSimShardPool;
+
+// The settings for a new connection, which are passed to the
+// thread that will create its SimRules object.
+struct PendingConnection
+{
+    int fd;
+    SimRuleSet *rules;
+    HardwareManipulatorFactory *fact;
+    QString phoneNumber;
+    QString messageStore;
+    QString simProfile;
+    QString simJournal;
+    QString smsTraffic;
+};
+
+// A worker thread with its own event loop, which owns the SimRules
+// objects (and their timers and SIM applications) for a subset of
+// the simulated modem connections.
+class PhoneSimShard : public QObject
+{
+    Q_OBJECT
+public:
+    PhoneSimShard(int index, PhoneSimShardPool *pool);
+    ~PhoneSimShard();
+
+    int index() const { return shardIndex; }
+
+    // Number of connections that are currently assigned to this shard.
+    int load() const { return connections.fetchAndAddOrdered(0); }
+
+    // Hand a connected socket over to this shard.  Safe to call from
+    // any thread; the SimRules object is created in the shard's thread.
+    void addConnection(const PendingConnection &conn);
+
+private slots:
+    void processPending();
+    void connectionClosed();
+    void shutdown();
+
+private:
+    int shardIndex;
+    PhoneSimShardPool *pool;
+    QThread thread;
+    mutable QAtomicInt connections;
+    QMutex pendingLock;
+    QList<PendingConnection> pending;
+};
+
+// A fixed pool of shards, shared by all of the servers in the process.
+class PhoneSimShardPool : public QObject
+{
+    Q_OBJECT
+public:
+    PhoneSimShardPool(int count);
+    ~PhoneSimShardPool();
+
+    // Get the shard with the fewest connections.
+    PhoneSimShard *leastLoaded() const;
+
+    // Get the number of connections on every shard, as a string.
+    QString loadReport() const;
+
+public slots:
+    // Log the load report, at most once every few seconds.  A change
+    // that arrives sooner is logged when the interval has passed.
+    void reportLoad();
+
+private slots:
+    void logLoad();
+
+private:
+    QList<PhoneSimShard *> shards;
+    QTime lastReport;
+    QTimer reportTimer;
+};
 
 class PhoneSimServer : public QTcpServer
 {
 public:
-    PhoneSimServer(const QString &, quint16 port, QObject *parent = 0);
+    PhoneSimServer(SimRuleSet *rules, quint16 port, QObject *parent = 0);
     ~PhoneSimServer();
 
     void setHardwareManipulator(HardwareManipulatorFactory *f);
 
-    SimRules *rules() const { return currentRules; }
+    // Give every connection to this server the same phone number,
+    // rather than allocating a new one for each connection.
+    void setPhoneNumber(const QString &number) { phoneNumber = number; }
+
+    // Keep the SMS store of connections to this server in a file,
+    // so that it survives between connections and restarts.
+    void setMessageStore(const QString &fileName) { messageStore = fileName; }
+
+    // Load the SIM filesystems of connections to this server from a
+    // compiled profile, rather than from the rule file.
+    void setSimProfile(const QString &fileName) { simProfile = fileName; }
+
+    // Keep the SIM file updates of connections to this server in a
+    // journal, so that they survive between connections and restarts.
+    void setSimJournal(const QString &fileName) { simJournal = fileName; }
+
+    // Inject generated MT SMS traffic into every connection.
+    void setSmsTraffic(const QString &spec) { smsTraffic = spec; }
+
+    // Run connections on a pool of worker threads instead of the
+    // thread that owns the server.
+    void setShardPool(PhoneSimShardPool *pool) { shardPool = pool; }
+
+    // Get the most recent connection.  Not available in sharded mode,
+    // as the connection is created asynchronously in another thread;
+    // check isSharded() first.
+    SimRules *rules() const;
+
+    bool isSharded() const { return shardPool != 0; }
 
 protected:
     void incomingConnection(int s);
 
 private:
-    QString filename;
+    SimRuleSet *ruleSet;
+    QString phoneNumber;
+    QString messageStore;
+    QString simProfile;
+    QString simJournal;
+    QString smsTraffic;
+    PhoneSimShardPool *shardPool;
 
     HardwareManipulatorFactory *fact;
     QPointer<SimRules> currentRules;
@@ -0,0 +1,752 @@
+/****************************************************************************
+**
+** This file is part of the Qt Extended Opensource Package.
+**
+** This file may be used under the terms of the GNU General Public License
+** version 2.0 as published by the Free Software Foundation and appearing
+** in the file LICENSE.GPL included in the packaging of this file.
+**
+** Please review the following information to ensure GNU General Public
+** Licensing requirements will be met:
+**     http://www.fsf.org/licensing/licenses/info/GPLv2.html.
+**
+**
+****************************************************************************/
+
+#include "simapdu.h"
+
+// Status words for each SimApduError: SW1 and SW2 for the GSM class,
+// from GSM 51.011, and then for the UICC class, from TS 102.221.
+static const quint8 statusWords[][4] =
+{
+    { 0x90, 0x00,   0x90, 0x00 },       // APDU_OK
+    { 0x67, 0x00,   0x67, 0x00 },       // APDU_WRONG_LENGTH
+    { 0x6E, 0x00,   0x6E, 0x00 },       // APDU_WRONG_CLASS
+    { 0x6D, 0x00,   0x6D, 0x00 },       // APDU_WRONG_INSTRUCTION
+    { 0x6B, 0x00,   0x6A, 0x86 },       // APDU_WRONG_PARAMETERS
+    { 0x6B, 0x00,   0x6A, 0x81 },       // APDU_NOT_SUPPORTED
+    { 0x94, 0x04,   0x6A, 0x82 },       // APDU_NOT_FOUND
+    { 0x94, 0x02,   0x6A, 0x83 },       // APDU_RECORD_NOT_FOUND
+    { 0x94, 0x04,   0x62, 0x82 },       // APDU_PATTERN_NOT_FOUND
+    { 0x94, 0x02,   0x6B, 0x00 },       // APDU_OUT_OF_RANGE
+    { 0x94, 0x08,   0x69, 0x81 },       // APDU_WRONG_STRUCTURE
+    { 0x94, 0x00,   0x69, 0x86 },       // APDU_NO_FILE_SELECTED
+    { 0x94, 0x00,   0x69, 0x85 },       // APDU_NOT_ALLOWED
+    { 0x98, 0x04,   0x69, 0x82 },       // APDU_SECURITY
+    { 0x98, 0x40,   0x69, 0x83 }        // APDU_BLOCKED
+};
+
+static QByteArray sw( int sw1, int sw2, const QByteArray& data = QByteArray() )
+{
+    QByteArray resp = data;
+    resp += (char)sw1;
+    resp += (char)sw2;
+    return resp;
+}
+
+static QByteArray sw( const SimApdu& a, enum SimApduError error,
+                      const QByteArray& data = QByteArray() )
+{
+    const quint8 *words = statusWords[error] + ( a.isGsm() ? 0 : 2 );
+    return sw( words[0], words[1], data );
+}
+
+static inline quint16 fidAt( const char *data )
+{
+    return (quint16)( ( (quint8)data[0] << 8 ) | (quint8)data[1] );
+}
+
+static int recordCount( const SimFileItem *item )
+{
+    return item->recordSize() > 0 ? item->size() / item->recordSize() : 0;
+}
+
+static void appendTlv( QByteArray& buf, int tag, const QByteArray& value )
+{
+    buf += (char)tag;
+    buf += (char)value.size();
+    buf += value;
+}
+
+bool SimApdu::parse( const char *apdu, int length )
+{
+    if ( length < 4 )
+        return false;
+    cla = (quint8)apdu[0];
+    ins = (quint8)apdu[1];
+    p1 = (quint8)apdu[2];
+    p2 = (quint8)apdu[3];
+    data = apdu + 5;
+    lc = 0;
+    le = 0;
+    hasLe = false;
+    if ( length == 4 )
+        return true;                    // Case 1: no data either way
+
+    int p3 = (quint8)apdu[4];
+    if ( length == 5 ) {
+        le = p3;                        // Case 2: data from the card
+        hasLe = true;
+    } else if ( length == 5 + p3 ) {
+        lc = p3;                        // Case 3: data to the card
+    } else if ( length == 6 + p3 ) {
+        lc = p3;                        // Case 4: data both ways
+        le = (quint8)apdu[length - 1];
+        hasLe = true;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+SimApduEngine::SimApduEngine( SimFileSystem *fs, SimRules *rules,
+                              enum file_system_type type )
+{
+    this->fs = fs;
+    this->rules = rules;
+
+    // The USIM's files are kept under DFgsm, and an application's under
+    // the root of its own filesystem.
+    adfFid = ( type == FILE_SYSTEM_TYPE_DEFAULT ? 0x7F20 : 0x3F00 );
+
+    /* Select DFgsm initially */
+    currentDF = adf() ? adf() : root();
+    currentEF = 0;
+    currentRecord = 0;
+}
+
+SimApduEngine::~SimApduEngine()
+{
+}
+
+QByteArray SimApduEngine::execute( const char *apdu, int length, bool pinEntered )
+{
+    SimApdu a;
+    if ( !a.parse( apdu, length ) )
+        return sw( 0x67, 0x00 );
+
+    int kind = ( a.cla & 0xF0 );
+    if ( !a.isGsm() && kind != 0x00 && kind != 0x40 && kind != 0x80 && kind != 0xC0 )
+        return sw( a, APDU_WRONG_CLASS );
+
+    // Response data is only available straight after the command.
+    if ( a.ins != 0xC0 )
+        pending = QByteArray();
+
+    switch ( a.ins ) {
+        case 0xA4:  return select( a );
+        case 0xF2:  return status( a );
+        case 0xC0:  return getResponse( a );
+        case 0xB0:  return readBinary( a, pinEntered );
+        case 0xD6:  return updateBinary( a, pinEntered );
+        case 0xB2:  return readRecord( a, pinEntered );
+        case 0xDC:  return updateRecord( a, pinEntered );
+        case 0xA2:  return searchRecord( a, pinEntered );
+        case 0x20:  return verify( a );
+    }
+    return sw( a, APDU_WRONG_INSTRUCTION );
+}
+
+bool SimApduEngine::selectFile( quint16 fid )
+{
+    SimFileItem *item = fs->findItem( fid );
+    if ( !item )
+        return false;
+    setCurrent( item );
+    return true;
+}
+
+QByteArray SimApduEngine::gsmStatus( const SimFileItem *item, quint16 fid )
+{
+    // Format the status response according to GSM 51.011, 9.2.1.
+    char status[15];
+    status[0] = 0x00;           // RFU
+    status[1] = 0x00;
+    int size = item->size();
+    status[2] = (char)(size >> 8);
+    status[3] = (char)size;
+    status[4] = (char)(fid >> 8);
+    status[5] = (char)fid;
+    if ( !item->parentDir() ) {
+        status[6] = 0x01;
+    } else if ( item->isDirectory() ) {
+        status[6] = 0x02;
+    } else {
+        status[6] = 0x04;
+    }
+    status[7] = 0x00;           // RFU
+
+    int access = item->access();
+    status[8] = (access >> 16) & 0xff;
+    status[9] = (access >> 8) & 0xff;
+    status[10] = (access >> 0) & 0xff;
+
+    // File Status, TS 11.11, Section 9.3
+    status[11] = 0x01;
+
+    status[12] = 2;             // Size of data that follows.
+    if ( item->isDirectory() ) {
+        status[13] = 0x00;
+        status[14] = 0x00;
+    } else if ( item->recordSize() > 0 ) {
+        status[13] = (char)(item->type() );
+        status[14] = (char)( item->recordSize() );
+    } else {
+        status[13] = 0x00;
+        status[14] = 0x00;
+    }
+    return QByteArray( status, 15 );
+}
+
+QByteArray SimApduEngine::aidFromTemplate( const QByteArray& record )
+{
+    // Application template, TS 102.221 13.1: 61 L { 4F L aid, 50 L label }.
+    int posn = 0;
+    if ( record.size() >= 2 && (quint8)record[0] == 0x61 )
+        posn = 2;
+    while ( posn + 2 <= record.size() ) {
+        int tag = (quint8)record[posn];
+        int len = (quint8)record[posn + 1];
+        if ( tag == 0x4F )
+            return record.mid( posn + 2, len );
+        posn += 2 + len;
+    }
+    return QByteArray();
+}
+
+SimFileItem *SimApduEngine::findChild( SimFileItem *dir, quint16 fid ) const
+{
+    if ( !dir )
+        return 0;
+    foreach ( SimFileItem *child, dir->children() ) {
+        if ( child->fid() == fid )
+            return child;
+    }
+    return 0;
+}
+
+SimFileItem *SimApduEngine::findFile( quint16 fid ) const
+{
+    // Look where TS 102.221 8.4.1 says a file id can be selected from.
+    SimFileItem *item;
+    if ( fid == 0x3F00 )
+        return root();
+    if ( fid == 0x7FFF )
+        return adf();
+    if ( currentDF->fid() == fid )
+        return currentDF;
+    if ( ( item = findChild( currentDF, fid ) ) != 0 )
+        return item;
+    SimFileItem *parent = currentDF->parentDir();
+    if ( parent && parent->fid() == fid )
+        return parent;
+    if ( ( item = findChild( parent, fid ) ) != 0 )
+        return item;
+
+    // Some files that a USIM keeps in its ADF are in DFtelecom here,
+    // so fall back to the first file with the id anywhere.
+    return fs->findItem( fid );
+}
+
+void SimApduEngine::setCurrent( SimFileItem *item )
+{
+    if ( item->isDirectory() ) {
+        currentDF = item;
+        currentEF = 0;
+    } else {
+        currentDF = item->parentDir() ? item->parentDir() : root();
+        currentEF = item;
+    }
+    currentRecord = 0;
+}
+
+bool SimApduEngine::havePin( bool pinEntered ) const
+{
+    return pinEntered || rules->pinVerified( 0 );
+}
+
+QByteArray SimApduEngine::fcp( const SimFileItem *item ) const
+{
+    // File control parameters, TS 102.221 11.1.1.3.
+    QByteArray value;
+    QByteArray params;
+    if ( item->isDirectory() ) {
+        value += (char)0x78;
+        value += (char)0x21;
+    } else if ( item->recordSize() <= 0 ) {
+        value += (char)0x41;
+        value += (char)0x21;
+    } else {
+        value += (char)( item->type() == FILE_TYPE_CYCLIC ? 0x46 : 0x42 );
+        value += (char)0x21;
+        value += (char)0x00;
+        value += (char)item->recordSize();
+        value += (char)recordCount( item );
+    }
+    appendTlv( params, 0x82, value );
+
+    value = QByteArray();
+    value += (char)( item->fid() >> 8 );
+    value += (char)item->fid();
+    appendTlv( params, 0x83, value );
+
+    if ( item == adf() && !aid.isEmpty() )
+        appendTlv( params, 0x84, aid );
+
+    appendTlv( params, 0x8A, QByteArray( 1, (char)0x05 ) );    // Operational
+
+    if ( !item->isDirectory() ) {
+        value = QByteArray();
+        value += (char)( item->size() >> 8 );
+        value += (char)item->size();
+        appendTlv( params, 0x80, value );
+    }
+
+    QByteArray result;
+    appendTlv( result, 0x62, params );
+    return result;
+}
+
+QByteArray SimApduEngine::respond( const SimApdu& a, const QByteArray& data )
+{
+    // Return the data straight away if the command asked for it, or
+    // hold on to it for GET RESPONSE.
+    if ( a.hasLe || data.isEmpty() )
+        return sw( a, APDU_OK, data.left( a.expected() ) );
+    pending = data;
+    return sw( a.isGsm() ? 0x9F : 0x61, data.size() );
+}
+
+int SimApduEngine::recordNumber( const SimApdu& a, const SimFileItem *item ) const
+{
+    int count = recordCount( item );
+    bool cyclic = ( item->type() == FILE_TYPE_CYCLIC );
+    switch ( a.p2 & 0x07 ) {
+
+        case 0x02:      // Next record
+        {
+            if ( currentRecord >= count )
+                return ( cyclic && count ) ? 1 : 0;
+            return currentRecord + 1;
+        }
+
+        case 0x03:      // Previous record
+        {
+            if ( currentRecord == 0 )
+                return count;
+            if ( currentRecord == 1 )
+                return cyclic ? count : 0;
+            return currentRecord - 1;
+        }
+
+        case 0x04:      // Absolute, or the current record if P1 is zero
+        {
+            int record = ( a.p1 ? a.p1 : currentRecord );
+            return record <= count ? record : 0;
+        }
+    }
+    return -1;
+}
+
+QByteArray SimApduEngine::select( const SimApdu& a )
+{
+    SimFileItem *item = 0;
+    int mode = a.p1;
+
+    // GSM only selects by file id.
+    if ( a.isGsm() && ( a.p1 || a.p2 ) )
+        return sw( a, APDU_WRONG_PARAMETERS );
+
+    switch ( mode ) {
+
+        case 0x00:      // By file id, or the MF if there is none
+        case 0x01:      // Child DF of the current DF
+        case 0x02:      // EF under the current DF
+        {
+            if ( a.lc == 0 && mode == 0x00 && !a.isGsm() ) {
+                item = root();
+                break;
+            }
+            if ( a.lc != 2 )
+                return sw( a, APDU_WRONG_LENGTH );
+            quint16 fid = fidAt( a.data );
+            if ( mode == 0x00 ) {
+                item = findFile( fid );
+            } else {
+                item = findChild( currentDF, fid );
+                if ( item && item->isDirectory() != ( mode == 0x01 ) )
+                    item = 0;
+            }
+        }
+        break;
+
+        case 0x03:      // Parent DF of the current DF
+        {
+            if ( a.lc != 0 )
+                return sw( a, APDU_WRONG_LENGTH );
+            item = currentDF->parentDir();
+        }
+        break;
+
+        case 0x04:      // By DF name, which may be truncated
+        {
+            if ( !aid.isEmpty() && a.lc > 0 &&
+                 aid.startsWith( QByteArray( a.data, a.lc ) ) )
+                item = adf();
+        }
+        break;
+
+        case 0x08:      // By path from the MF
+        case 0x09:      // By path from the current DF
+        {
+            if ( a.lc == 0 || ( a.lc & 1 ) != 0 )
+                return sw( a, APDU_WRONG_LENGTH );
+            item = ( mode == 0x08 ? root() : currentDF );
+            for ( int posn = 0; item && posn < a.lc; posn += 2 ) {
+                quint16 fid = fidAt( a.data + posn );
+                if ( fid == 0x7FFF ) {
+                    item = adf();
+                } else {
+                    SimFileItem *child = findChild( item, fid );
+
+                    // As for selection by id, the last file in the path
+                    // may be kept somewhere else in this filesystem.
+                    if ( !child && posn + 2 == a.lc )
+                        child = fs->findItem( fid );
+                    item = child;
+                }
+            }
+        }
+        break;
+
+        default:
+            return sw( a, APDU_WRONG_PARAMETERS );
+    }
+
+    if ( !item )
+        return sw( a, APDU_NOT_FOUND );
+    setCurrent( item );
+
+    if ( a.isGsm() )
+        return respond( a, gsmStatus( item, item->fid() ) );
+    if ( ( a.p2 & 0x0C ) == 0x0C )
+        return sw( a, APDU_OK );
+    return respond( a, fcp( item ) );
+}
+
+QByteArray SimApduEngine::status( const SimApdu& a )
+{
+    if ( a.isGsm() )
+        return respond( a, gsmStatus( currentDF, currentDF->fid() ) );
+    if ( a.p1 > 0x02 )
+        return sw( a, APDU_WRONG_PARAMETERS );
+
+    switch ( a.p2 ) {
+
+        case 0x00:      // FCP of the current DF
+            return respond( a, fcp( currentDF ) );
+
+        case 0x01:      // Name of the current application
+        {
+            QByteArray name;
+            if ( currentDF == adf() && !aid.isEmpty() )
+                appendTlv( name, 0x84, aid );
+            return respond( a, name );
+        }
+
+        case 0x0C:      // No data
+            return sw( a, APDU_OK );
+    }
+    return sw( a, APDU_WRONG_PARAMETERS );
+}
+
+QByteArray SimApduEngine::getResponse( const SimApdu& a )
+{
+    if ( pending.isEmpty() )
+        return sw( a, APDU_NOT_ALLOWED );
+
+    QByteArray data = pending;
+    pending = QByteArray();
+    int length = a.le;
+    if ( a.isGsm() ) {
+        if ( length == 0 || length > data.size() ) {
+            pending = data;
+            return sw( 0x67, data.size() );
+        }
+        return sw( a, APDU_OK, data.left( length ) );
+    }
+
+    // Le of zero asks for everything, up to 256 bytes.
+    if ( length == 0 || length == data.size() )
+        return sw( a, APDU_OK, data );
+    if ( length > data.size() ) {
+        pending = data;
+        return sw( 0x6C, data.size() );
+    }
+    pending = data.mid( length );
+    return sw( 0x61, pending.size(), data.left( length ) );
+}
+
+QByteArray SimApduEngine::readBinary( const SimApdu& a, bool pinEntered )
+{
+    SimFileItem *item = currentEF;
+    if ( !item )
+        return sw( a, APDU_NO_FILE_SELECTED );
+    if ( a.p1 & 0x80 )
+        return sw( a, APDU_NOT_SUPPORTED );     // Short file ids
+    if ( item->recordSize() > 0 )
+        return sw( a, APDU_WRONG_STRUCTURE );
+    if ( !item->checkAccess( FILE_OP_READ, havePin( pinEntered ) ) )
+        return sw( a, APDU_SECURITY );
+
+    int offset = ( a.p1 << 8 ) | a.p2;
+    int size = item->size();
+    if ( a.isGsm() ) {
+        if ( offset + a.le > size )
+            return sw( a, APDU_OUT_OF_RANGE );
+        if ( !a.le )
+            return sw( 0x67, size - offset );
+        return sw( a, APDU_OK, fs->read( item, offset, a.le ) );
+    }
+
+    if ( !a.hasLe )
+        return sw( a, APDU_WRONG_LENGTH );
+    if ( offset >= size )
+        return sw( a, APDU_OUT_OF_RANGE );
+    int length = a.expected();
+    if ( offset + length > size ) {
+        // End of file reached before reading Le bytes.
+        return sw( 0x62, 0x82, fs->read( item, offset, size - offset ) );
+    }
+    return sw( a, APDU_OK, fs->read( item, offset, length ) );
+}
+
+QByteArray SimApduEngine::updateBinary( const SimApdu& a, bool pinEntered )
+{
+    SimFileItem *item = currentEF;
+    if ( !item )
+        return sw( a, APDU_NO_FILE_SELECTED );
+    if ( a.p1 & 0x80 )
+        return sw( a, APDU_NOT_SUPPORTED );     // Short file ids
+    if ( !item->checkAccess( FILE_OP_UPDATE, havePin( pinEntered ) ) )
+        return sw( a, APDU_SECURITY );
+    if ( item->recordSize() > 0 )
+        return sw( a, APDU_WRONG_STRUCTURE );
+
+    int offset = ( a.p1 << 8 ) | a.p2;
+    int size = item->size();
+    if ( offset + a.lc > size )
+        return sw( a, APDU_OUT_OF_RANGE );
+    if ( !a.lc ) {
+        if ( a.isGsm() )
+            return sw( 0x67, size - offset );
+        return sw( a, APDU_WRONG_LENGTH );
+    }
+    fs->update( item, offset, QByteArray( a.data, a.lc ) );
+    return sw( a, APDU_OK );
+}
+
+QByteArray SimApduEngine::readRecord( const SimApdu& a, bool pinEntered )
+{
+    SimFileItem *item = currentEF;
+    if ( !item )
+        return sw( a, APDU_NO_FILE_SELECTED );
+    if ( a.p2 & 0xF8 )
+        return sw( a, APDU_NOT_SUPPORTED );     // Short file ids
+    if ( !item->checkAccess( FILE_OP_READ, havePin( pinEntered ) ) )
+        return sw( a, APDU_SECURITY );
+    int size = item->recordSize();
+    if ( size <= 0 )
+        return sw( a, APDU_WRONG_STRUCTURE );
+
+    // GSM needs the length of the record, but UICC can ask for it with 0.
+    if ( a.isGsm() && ( a.le < 1 || a.le > size ) )
+        return sw( 0x67, size );
+    if ( !a.isGsm() && a.le != 0 && a.le != size )
+        return sw( 0x6C, size );
+
+    int record = recordNumber( a, item );
+    if ( record < 0 )
+        return sw( a, APDU_WRONG_PARAMETERS );
+    if ( record == 0 )
+        return sw( a, APDU_RECORD_NOT_FOUND );
+    currentRecord = record;
+    int length = ( a.isGsm() ? a.le : size );
+    return sw( a, APDU_OK, fs->read( item, ( record - 1 ) * size, length ) );
+}
+
+QByteArray SimApduEngine::updateRecord( const SimApdu& a, bool pinEntered )
+{
+    SimFileItem *item = currentEF;
+    if ( !item )
+        return sw( a, APDU_NO_FILE_SELECTED );
+    if ( a.p2 & 0xF8 )
+        return sw( a, APDU_NOT_SUPPORTED );     // Short file ids
+    int size = item->recordSize();
+    if ( !a.lc ) {
+        if ( a.isGsm() )
+            return sw( 0x67, size );
+        return sw( a, APDU_WRONG_LENGTH );
+    }
+    if ( !item->checkAccess( FILE_OP_UPDATE, havePin( pinEntered ) ) )
+        return sw( a, APDU_SECURITY );
+    if ( size <= 0 )
+        return sw( a, APDU_WRONG_STRUCTURE );
+    if ( a.lc != size )
+        return sw( a, a.isGsm() ? APDU_WRONG_STRUCTURE : APDU_WRONG_LENGTH );
+
+    QByteArray data( a.data, a.lc );
+    if ( item->type() == FILE_TYPE_CYCLIC && ( a.p2 & 0x07 ) == 0x03 ) {
+        // The oldest record of a cyclic file is replaced, and the new
+        // one becomes record 1.
+        int count = recordCount( item );
+        fs->update( item, 0, data + fs->read( item, 0, ( count - 1 ) * size ) );
+        currentRecord = 1;
+        return sw( a, APDU_OK );
+    }
+
+    int record = recordNumber( a, item );
+    if ( record < 0 )
+        return sw( a, APDU_WRONG_PARAMETERS );
+    if ( record == 0 )
+        return sw( a, APDU_RECORD_NOT_FOUND );
+    currentRecord = record;
+    fs->update( item, ( record - 1 ) * size, data );
+    return sw( a, APDU_OK );
+}
+
+QByteArray SimApduEngine::searchRecord( const SimApdu& a, bool pinEntered )
+{
+    SimFileItem *item = currentEF;
+    if ( !item )
+        return sw( a, APDU_NO_FILE_SELECTED );
+    if ( !item->checkAccess( FILE_OP_READ, havePin( pinEntered ) ) )
+        return sw( a, APDU_SECURITY );
+    int size = item->recordSize();
+    if ( size <= 0 )
+        return sw( a, APDU_WRONG_STRUCTURE );
+    int count = recordCount( item );
+
+    const char *data = a.data;
+    int len = a.lc;
+    int offset = 0;
+    bool anywhere = false;
+    int from, mode;
+    if ( a.isGsm() ) {
+        // SEEK, GSM 51.011 9.2.7, matches the start of each record.
+        from = currentRecord;
+        switch ( a.p2 & 0x0F ) {
+            case 0x00:  from = 0; mode = 0x06; break;
+            case 0x01:  from = 0; mode = 0x07; break;
+            case 0x02:  mode = 0x06; break;
+            case 0x03:  mode = 0x07; break;
+            default:    return sw( a, APDU_WRONG_PARAMETERS );
+        }
+    } else {
+        // SEARCH RECORD, TS 102.221 11.1.7, matches anywhere in a record.
+        // An enhanced search names the mode and offset in its first bytes.
+        if ( a.p2 & 0xF8 )
+            return sw( a, APDU_NOT_SUPPORTED );     // Short file ids
+        mode = a.p2 & 0x07;
+        if ( mode == 0x06 ) {
+            if ( len < 2 )
+                return sw( a, APDU_WRONG_LENGTH );
+            if ( data[0] & 0x08 )
+                return sw( a, APDU_NOT_SUPPORTED ); // Search from a value
+            mode = data[0] & 0x07;
+            offset = (quint8)data[1];
+            data += 2;
+            len -= 2;
+        } else if ( mode != 0x04 && mode != 0x05 ) {
+            return sw( a, APDU_WRONG_PARAMETERS );
+        }
+        anywhere = true;
+        from = ( a.p1 ? a.p1 : currentRecord );
+        if ( from > count )
+            return sw( a, APDU_RECORD_NOT_FOUND );
+    }
+    if ( len <= 0 )
+        return sw( a, APDU_WRONG_LENGTH );
+
+    // Modes 4 and 5 start at the given record, and 6 and 7 just after it.
+    int start, step;
+    switch ( mode ) {
+        case 0x04:  start = ( from ? from : 1 ); step = 1; break;
+        case 0x05:  start = ( from ? from : count ); step = -1; break;
+        case 0x06:  start = from + 1; step = 1; break;
+        case 0x07:  start = ( from ? from - 1 : count ); step = -1; break;
+        default:    return sw( a, APDU_WRONG_PARAMETERS );
+    }
+
+    QByteArray pattern( data, len );
+    QByteArray found;
+    for ( int record = start; record >= 1 && record <= count; record += step ) {
+        QByteArray contents = fs->read( item, ( record - 1 ) * size, size );
+        bool match;
+        if ( anywhere )
+            match = ( contents.indexOf( pattern, offset ) >= 0 );
+        else
+            match = contents.startsWith( pattern );
+        if ( match ) {
+            found += (char)record;
+            if ( a.isGsm() )
+                break;
+        }
+    }
+    if ( found.isEmpty() )
+        return sw( a, APDU_PATTERN_NOT_FOUND );
+    currentRecord = (quint8)found[0];
+
+    if ( a.isGsm() ) {
+        // Type 2 makes the record number available with GET RESPONSE.
+        if ( ( a.p2 & 0xF0 ) == 0x10 ) {
+            pending = found;
+            return sw( 0x9F, 1 );
+        }
+        return sw( a, APDU_OK );
+    }
+    return sw( a, APDU_OK, found );
+}
+
+QByteArray SimApduEngine::verify( const SimApdu& a )
+{
+    int pin;
+    if ( a.p2 == 0x01 || a.p2 == 0x81 )
+        pin = 0;
+    else if ( a.p2 == 0x02 || a.p2 == 0x82 )
+        pin = 1;
+    else
+        return sw( a, APDU_WRONG_PARAMETERS );
+    if ( a.p1 != 0 )
+        return sw( a, APDU_WRONG_PARAMETERS );
+
+    // Without a PIN, UICC VERIFY reports the attempts that are left.
+    if ( !a.lc ) {
+        if ( a.isGsm() )
+            return sw( a, APDU_WRONG_LENGTH );
+        if ( rules->pinVerified( pin ) )
+            return sw( a, APDU_OK );
+        int retries = rules->pinRetries( pin );
+        if ( !retries )
+            return sw( a, APDU_BLOCKED );
+        return sw( 0x63, 0xC0 | retries );
+    }
+    if ( a.lc != 8 )
+        return sw( a, APDU_WRONG_LENGTH );
+    if ( !rules->pinRetries( pin ) )
+        return sw( a, APDU_BLOCKED );
+
+    // PINs are padded to eight bytes with 0xFF.
+    QByteArray value( a.data, a.lc );
+    while ( value.endsWith( (char)0xFF ) )
+        value.chop( 1 );
+    if ( rules->verifyPin( pin, QString::fromUtf8( value ) ) )
+        return sw( a, APDU_OK );
+
+    int retries = rules->pinRetries( pin );
+    if ( !retries )
+        return sw( a, APDU_BLOCKED );
+    if ( a.isGsm() )
+        return sw( a, APDU_SECURITY );
+    return sw( 0x63, 0xC0 | retries );
+}
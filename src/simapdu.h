@@ -0,0 +1,122 @@
+/****************************************************************************
+**
+** This file is part of the Qt Extended Opensource Package.
+**
+** This file may be used under the terms of the GNU General Public License
+** version 2.0 as published by the Free Software Foundation and appearing
+** in the file LICENSE.GPL included in the packaging of this file.
+**
+** Please review the following information to ensure GNU General Public
+** Licensing requirements will be met:
+**     http://www.fsf.org/licensing/licenses/info/GPLv2.html.
+**
+**
+****************************************************************************/
+
+#ifndef SIMAPDU_H
+#define SIMAPDU_H
+
+#include "simfilesystem.h"
+
+// Conditions reported by the APDU engine.  The GSM (CLA A0) and UICC
+// command classes report most of them with different status words.
+enum SimApduError {
+    APDU_OK,
+    APDU_WRONG_LENGTH,
+    APDU_WRONG_CLASS,
+    APDU_WRONG_INSTRUCTION,
+    APDU_WRONG_PARAMETERS,
+    APDU_NOT_SUPPORTED,
+    APDU_NOT_FOUND,
+    APDU_RECORD_NOT_FOUND,
+    APDU_PATTERN_NOT_FOUND,
+    APDU_OUT_OF_RANGE,
+    APDU_WRONG_STRUCTURE,
+    APDU_NO_FILE_SELECTED,
+    APDU_NOT_ALLOWED,
+    APDU_SECURITY,
+    APDU_BLOCKED
+};
+
+// A command APDU, parsed in place according to ISO 7816-4 (short form).
+struct SimApdu
+{
+    quint8 cla;
+    quint8 ins;
+    quint8 p1;
+    quint8 p2;
+    const char *data;
+    int lc;
+    int le;             // the raw byte, where 0 means 256 for UICC commands
+    bool hasLe;
+
+    bool parse( const char *apdu, int length );
+    bool isGsm() const { return cla == 0xA0; }
+    int expected() const { return ( hasLe && le == 0 && !isGsm() ) ? 256 : le; }
+};
+
+// Executes SIM and UICC commands in binary form against a SimFileSystem.
+// The same engine serves AT+CSIM, AT+CRSM and AT+CGLA, and keeps the
+// current directory, file and record between commands, as a card does.
+class SimApduEngine
+{
+public:
+    SimApduEngine( SimFileSystem *fs, SimRules *rules,
+                   enum file_system_type type = FILE_SYSTEM_TYPE_DEFAULT );
+    ~SimApduEngine();
+
+    // Execute a command APDU, and return the response data followed by
+    // SW1 and SW2.  The PIN state belongs to the card, so it is kept by
+    // the SimRules and shared by all of the card's engines.  Set "pinEntered" if the PIN has already been given
+    // some other way, as it has when AT+CRSM is available.
+    QByteArray execute( const char *apdu, int length, bool pinEntered = false );
+    QByteArray execute( const QByteArray& apdu, bool pinEntered = false )
+        { return execute( apdu.constData(), apdu.size(), pinEntered ); }
+
+    // Set the application id that selects the ADF by name.
+    void setAid( const QByteArray& value ) { aid = value; }
+
+    // Select a file by id anywhere in the filesystem, as AT+CRSM does.
+    bool selectFile( quint16 fid );
+
+    // Get the current file, or the current directory if there is none.
+    SimFileItem *currentFile() const { return currentEF ? currentEF : currentDF; }
+
+    // Format the GSM 51.011 response to SELECT or STATUS for an item.
+    static QByteArray gsmStatus( const SimFileItem *item, quint16 fid );
+
+    // Extract the AID from an application template in EFdir format.
+    static QByteArray aidFromTemplate( const QByteArray& record );
+
+private:
+    SimFileSystem *fs;
+    SimRules *rules;
+    quint16 adfFid;
+    QByteArray aid;
+    SimFileItem *currentDF;
+    SimFileItem *currentEF;
+    int currentRecord;
+    QByteArray pending;
+
+    SimFileItem *root() const { return fs->findItem( (quint16)0x3F00 ); }
+    SimFileItem *adf() const { return fs->findItem( adfFid ); }
+    SimFileItem *findChild( SimFileItem *dir, quint16 fid ) const;
+    SimFileItem *findFile( quint16 fid ) const;
+    void setCurrent( SimFileItem *item );
+    bool havePin( bool pinEntered ) const;
+    QByteArray fcp( const SimFileItem *item ) const;
+    QByteArray respond( const SimApdu& a, const QByteArray& data );
+    int recordNumber( const SimApdu& a, const SimFileItem *item ) const;
+
+    QByteArray select( const SimApdu& a );
+    QByteArray status( const SimApdu& a );
+    QByteArray getResponse( const SimApdu& a );
+    QByteArray readBinary( const SimApdu& a, bool pinEntered );
+    QByteArray updateBinary( const SimApdu& a, bool pinEntered );
+    QByteArray readRecord( const SimApdu& a, bool pinEntered );
+    QByteArray updateRecord( const SimApdu& a, bool pinEntered );
+    QByteArray searchRecord( const SimApdu& a, bool pinEntered );
+    QByteArray verify( const SimApdu& a );
+};
+
+#endif
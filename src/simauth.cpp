@@ -16,23 +16,59 @@
 ****************************************************************************/
 
 #include "simauth.h"
-#include <qatutils.h>
-#include <qsimcontrolevent.h>
+#include <qbytearray.h>
+#include <qstringlist.h>
+#include <string.h>
 
 extern "C" {
 #include "comp128.h"
-#include "aes.h"
 }
 
-#define QSTRING_TO_BUF(s) \
-    (uint8_t *)QByteArray::fromHex( s.toUtf8().data() ).data()
+// Decode a hex string into a fixed size buffer, padding with zeroes.
+// Returns false if the string does not hold exactly "len" bytes.
+static bool decodeHex( const QString& hex, uint8_t *buf, int len )
+{
+    QByteArray bytes = QByteArray::fromHex( hex.toLatin1() );
+    memset( buf, 0, len );
+    memcpy( buf, bytes.constData(), qMin( bytes.size(), len ) );
+    return bytes.size() == len;
+}
+
+static quint64 sqnToInt( const uint8_t *sqn )
+{
+    quint64 value = 0;
+    for ( int i = 0; i < 6; i++ )
+        value = ( value << 8 ) | sqn[i];
+    return value;
+}
+
+static void intToSqn( quint64 value, uint8_t *sqn )
+{
+    for ( int i = 5; i >= 0; i-- ) {
+        sqn[i] = (uint8_t)value;
+        value >>= 8;
+    }
+}
 
-SimAuth::SimAuth( QObject *parent, SimXmlNode& n )
+SimAuth::SimAuth( QObject *parent, const QString& ki, const QString& opc,
+                  const QString& sqnHex )
     : QObject( parent )
 {
-    _ki = n.getAttribute( "ki" );
-    _opc = n.getAttribute( "opc" );
-    _sqn = n.getAttribute( "sqn" );
+    // Decode the keys once, rather than on every authentication.
+    decodeHex( ki, _ki, sizeof(_ki) );
+    decodeHex( opc, _opc, sizeof(_opc) );
+    uint8_t sqn[6];
+    decodeHex( sqnHex, sqn, sizeof(sqn) );
+
+    aes_set_key( &_kiSchedule, _ki, sizeof(_ki) );
+
+    // The SQN from the rule file is the first one that will be accepted.
+    _initialSqn = sqnToInt( sqn );
+    _firstSeq = (qint64)( _initialSqn >> SQN_IND_BITS );
+    for ( int i = 0; i < SQN_ARRAY_SIZE; i++ )
+        _seqArray[i] = -1;
+    _sqnChanged = true;
+    updateSqnStatus();
 }
 
 SimAuth::~SimAuth()
@@ -42,18 +78,64 @@ SimAuth::~SimAuth()
 void SimAuth::gsmAuthenticate( QString rand, QString &sres,
         QString &kc )
 {
-    uint8_t ki[16];
     uint8_t _rand[16];
-    uint8_t _sres[4] = { 0 };
-    uint8_t _kc[8] = { 0 };
+    GsmResult result;
+
+    decodeHex( rand, _rand, 16 );
+    gsmAuthenticate( _rand, result );
+
+    sres = QByteArray( (const char *)result.sres, 4 ).toHex();
+    kc = QByteArray( (const char *)result.kc, 8 ).toHex();
+}
+
+void SimAuth::gsmAuthenticate( const uint8_t *rand, GsmResult& result ) const
+{
+    memset( &result, 0, sizeof(result) );
+    comp128( _ki, rand, result.sres, result.kc );
+}
+
+void SimAuth::gsmAuthenticate( const uint8_t (*rands)[16], GsmResult *results,
+        int count ) const
+{
+    for ( int i = 0; i < count; i++ )
+        gsmAuthenticate( rands[i], results[i] );
+}
+
+enum UmtsStatus SimAuth::umtsAuthenticate( QString rand, QString autn,
+        QString &res, QString &ck, QString &ik, QString &auts )
+{
+    UmtsChallenge challenge;
+    UmtsResult result;
+
+    if ( !decodeHex( rand, challenge.rand, 16 ) ||
+         !decodeHex( autn, challenge.autn, 16 ) )
+        return UMTS_ERROR;
+
+    umtsAuthenticate( &challenge, &result, 1 );
 
-    memcpy(ki, QSTRING_TO_BUF( _ki ), 16);
-    memcpy(_rand, QSTRING_TO_BUF( rand ), 16);
+    if ( result.status == UMTS_OK ) {
+        res = QByteArray( (const char *)result.res, 8 ).toHex();
+        ck = QByteArray( (const char *)result.ck, 16 ).toHex();
+        ik = QByteArray( (const char *)result.ik, 16 ).toHex();
+    } else if ( result.status == UMTS_SYNC_FAILURE ) {
+        auts = QByteArray( (const char *)result.auts, 14 ).toHex();
+    }
+
+    return result.status;
+}
 
-    comp128( ki, _rand, _sres, _kc );
+void SimAuth::umtsAuthenticate( const UmtsChallenge& challenge,
+        UmtsResult& result )
+{
+    umtsAuthenticate( &challenge, &result, 1 );
+}
 
-    sres = QByteArray( (const char *)_sres, 4 ).toHex();
-    kc = QByteArray( (const char *)_kc, 8 ).toHex();
+void SimAuth::umtsAuthenticate( const UmtsChallenge *challenges,
+        UmtsResult *results, int count )
+{
+    for ( int i = 0; i < count; i++ )
+        authenticate( challenges[i], results[i] );
+    updateSqnStatus();
 }
 
 /*
@@ -68,53 +150,67 @@ void SimAuth::gsmAuthenticate( QString rand, QString &sres,
         to[i] = a[i] ^ b[i]; \
     }
 
-enum UmtsStatus SimAuth::umtsAuthenticate( QString rand, QString autn,
-        QString &res, QString &ck, QString &ik, QString &auts )
+// Run f1 (or f1* when AMF is zero) over SQN, AMF and RAND, where
+// "temp" is AES[RAND ^ OPc].  Returns OUT1, whose first half is MAC-A
+// and second half is MAC-S.
+void SimAuth::f1( const uint8_t *temp, const uint8_t *sqn,
+        const uint8_t *amf, uint8_t *out1 ) const
 {
     int i;
+    uint8_t in1[16];
+    uint8_t tmp1[16];
+    uint8_t tmp2[16];
 
-    uint8_t ki[16];
-    uint8_t _rand[16];
-    uint8_t _autn[16];
-    uint8_t opc[16];
-    uint8_t sqn_stored[6];
+    // setup IN1
+    memcpy(in1, sqn, 6);
+    memcpy(in1 + 6, amf, 2);
+    memcpy(in1 + 8, sqn, 6);
+    memcpy(in1 + 14, amf, 2);
+
+    for (i = 0; i < 16; i++)
+        tmp1[(i + 8) % 16] = in1[i] ^ _opc[i];
+
+    /* tmp2 = TEMP ^ tmp1 */
+    XOR(tmp2, temp, tmp1, 16);
+    /* tmp2 = E[tmp2]k */
+    aes_encrypt_block(&_kiSchedule, tmp2, tmp1);
+    /* out1 = OUT1 = tmp1 ^ opc */
+    XOR(out1, tmp1, _opc, 16);
+}
+
+void SimAuth::authenticate( const UmtsChallenge& challenge,
+        UmtsResult& result )
+{
+    int i;
+
+    const uint8_t *_rand = challenge.rand;
+    const uint8_t *_autn = challenge.autn;
+    const uint8_t *opc = _opc;
+    static const uint8_t amfResync[2] = { 0x00, 0x00 };
 
     uint8_t ak[6];
     uint8_t sqn[6];
-    uint8_t amf[2];
-    uint8_t mac[8];
-    uint8_t _res[8];
-    uint8_t _ck[16];
-    uint8_t _ik[16];
-    uint8_t _auts[14];
+    uint8_t sqn_ms[6];
+    uint8_t *_res = result.res;
+    uint8_t *_ck = result.ck;
+    uint8_t *_ik = result.ik;
+    uint8_t *_auts = result.auts;
 
     uint8_t temp[16];
     uint8_t out1[16];
     uint8_t out2[16];
     uint8_t out5[16];
-    uint8_t in1[16];
     uint8_t tmp1[16];
-    uint8_t tmp2[16];
-
-    memcpy(ki, QSTRING_TO_BUF( _ki ), 16);
-    memcpy(_rand, QSTRING_TO_BUF( rand ), 16);
-    memcpy(_autn, QSTRING_TO_BUF( autn ), 16);
-    memcpy(opc, QSTRING_TO_BUF( _opc ), 16);
-    memcpy(sqn_stored, QSTRING_TO_BUF( _sqn ), 6);
-
-    // copy out AMF/MAC from AUTN
-    memcpy(amf, _autn + 6, 2);
-    memcpy(mac, _autn + 8, 8);
 
     // TEMP = AES[RAND ^ OPc]
     XOR(temp, _rand, opc, 16);
-    aes_encrypt(ki, 16, temp, temp, 16);
+    aes_encrypt_block(&_kiSchedule, temp, temp);
 
     // f2 algorithm
     // OUT2 == AES[(TEMP ^ OPc) ^ c2] ^ OPc]
     XOR(tmp1, temp, opc, 16);
     tmp1[15] ^= 1;
-    aes_encrypt(ki, 16, tmp1, tmp1, 16);
+    aes_encrypt_block(&_kiSchedule, tmp1, tmp1);
     XOR(out2, tmp1, opc, 16);
 
     // AK is first 6 bytes of OUT2
@@ -125,15 +221,15 @@ enum UmtsStatus SimAuth::umtsAuthenticate( QString rand, QString autn,
     // get SQN, first 6 bytes of AUTN are SQN^AK, so (SQN^AK)^AK = SQN
     XOR(sqn, _autn, ak, 6);
 
-    // f1 algorithm
-    // setup IN1
-    memcpy(in1, sqn, 6);
-    memcpy(in1 + 6, amf, 2);
-    memcpy(in1 + 8, sqn, 6);
-    memcpy(in1 + 14, amf, 2);
+    // f1 algorithm, verify MAC-A matches AUTN
+    f1( temp, sqn, _autn + 6, out1 );
+    if (memcmp(_autn + 8, out1, 8)) {
+        result.status = UMTS_INVALID_MAC;
+        return;
+    }
 
-    // check if SQNs match
-    if (memcmp(sqn, sqn_stored, 6)) {
+    // check that SQN is fresh
+    if ( !acceptSqn( sqnToInt( sqn ) ) ) {
         /*
          * f5* outputs AK' (OUT5)
          */
@@ -142,57 +238,30 @@ enum UmtsStatus SimAuth::umtsAuthenticate( QString rand, QString autn,
 
         /* tmp1 ^ c5. c5 at bit 124 == 1 */
         tmp1[15] ^= 1 << 3;
-        aes_encrypt(ki, 16, tmp1, out5, 16);
+        aes_encrypt_block(&_kiSchedule, tmp1, out5);
         /* out5 ^ opc */
         XOR(out5, out5, opc, 16);
 
-        XOR(_auts, sqn_stored, out5, 6);
+        /* AUTS = SQN_MS ^ AK' || MAC-S */
+        qint64 highest = highestSqn();
+        intToSqn( highest >= 0 ? (quint64)highest : _initialSqn, sqn_ms );
+        XOR(_auts, sqn_ms, out5, 6);
 
         /* run f1 with zero'd AMF to finish AUTS */
-        in1[6] = 0x00;
-        in1[7] = 0x00;
-        in1[14] = 0x00;
-        in1[15] = 0x00;
-
-        for (i = 0; i < 16; i++)
-            tmp1[(i + 8) % 16] = in1[i] ^ opc[i];
-
-        /* tmp2 = TEMP ^ tmp1 */
-        XOR(tmp2, temp, tmp1, 16);
-        /* tmp2 = E[tmp2]k */
-        aes_encrypt(ki, 16, tmp2, tmp1, 16);
-
-        /* out1 = OUT1 = tmp1 ^ opc */
-        XOR(out1, tmp1, opc, 16);
-
+        f1( temp, sqn_ms, amfResync, out1 );
         memcpy(_auts + 6, out1 + 8, 8);
 
-        auts = QByteArray( (const char *)_auts, 14 ).toHex();
-
-        return UMTS_SYNC_FAILURE;
+        result.status = UMTS_SYNC_FAILURE;
+        return;
     }
 
-    for (i = 0; i < 16; i++)
-        tmp1[(i + 8) % 16] = in1[i] ^ opc[i];
-
-    /* tmp2 = TEMP ^ tmp1 */
-    XOR(tmp2, temp, tmp1, 16);
-    /* tmp2 = E[tmp2]k */
-    aes_encrypt(ki, 16, tmp2, tmp1, 16);
-    /* out1 = OUT1 = tmp1 ^ opc */
-    XOR(out1, tmp1, opc, 16);
-
-    // verify MAC-A matches AUTN
-    if (memcmp(_autn + 8, out1, 8))
-        return UMTS_INVALID_MAC;
-
     // f3 algorithm
     for (i = 0; i < 16; i++)
         tmp1[(i + 12) % 16] = temp[i] ^ opc[i];
 
     /* tmp1 ^ c3. c3 at bit 126 == 1 */
     tmp1[15] ^= 1 << 1;
-    aes_encrypt(ki, 16, tmp1, _ck, 16);
+    aes_encrypt_block(&_kiSchedule, tmp1, _ck);
     /* ck ^ opc */
     XOR(_ck, _ck, opc, 16);
 
@@ -202,13 +271,83 @@ enum UmtsStatus SimAuth::umtsAuthenticate( QString rand, QString autn,
 
     /* tmp1 ^ c4. c4 at bit 125 == 1 */
     tmp1[15] ^= 1 << 2;
-    aes_encrypt(ki, 16, tmp1, _ik, 16);
+    aes_encrypt_block(&_kiSchedule, tmp1, _ik);
     /* ik ^ opc */
     XOR(_ik, _ik, opc, 16);
 
-    res = QByteArray( (const char *)_res, 8 ).toHex();
-    ck = QByteArray( (const char *)_ck, 16 ).toHex();
-    ik = QByteArray( (const char *)_ik, 16 ).toHex();
+    result.status = UMTS_OK;
+}
+
+/*
+ * SQN freshness check from 3GPP TS 33.102 Annex C.  SQN is split into
+ * SEQ and a 5 bit index IND, and the highest SEQ accepted is kept for
+ * each index.  A SQN is fresh if its SEQ is higher than the entry for
+ * its index, and not too far ahead of the highest SEQ accepted so far.
+ */
+bool SimAuth::acceptSqn( quint64 sqn )
+{
+    qint64 seq = (qint64)( sqn >> SQN_IND_BITS );
+    int ind = (int)( sqn & ( SQN_ARRAY_SIZE - 1 ) );
+    qint64 highest = -1;
+
+    for ( int i = 0; i < SQN_ARRAY_SIZE; i++ )
+        highest = qMax( highest, _seqArray[i] );
+
+    if ( seq < _firstSeq || seq <= _seqArray[ind] )
+        return false;
+    if ( highest >= 0 && seq - highest > SQN_DELTA )
+        return false;
+
+    _seqArray[ind] = seq;
+    _sqnChanged = true;
+    return true;
+}
+
+// Get the highest SQN accepted so far, which is reported in AUTS,
+// or -1 if none has been accepted yet.
+qint64 SimAuth::highestSqn() const
+{
+    qint64 highest = -1;
+    for ( int i = 0; i < SQN_ARRAY_SIZE; i++ ) {
+        if ( _seqArray[i] < 0 )
+            continue;
+        qint64 sqn = ( _seqArray[i] << SQN_IND_BITS ) | i;
+        if ( sqn > highest )
+            highest = sqn;
+    }
+    return highest;
+}
 
-    return UMTS_OK;
+// Publish the SQN array as variables of the parent, so that it can be
+// queried.  The parent's setVariable() slot is called by name, so that
+// SimAuth can be used on its own, without a SimRules.  This is only
+// done when the array has changed since it was last published.
+void SimAuth::updateSqnStatus()
+{
+    QObject *rules = parent();
+    if ( !rules || !_sqnChanged )
+        return;
+    _sqnChanged = false;
+
+    QString highest;
+    qint64 sqnMs = highestSqn();
+    if ( sqnMs >= 0 ) {
+        uint8_t sqn[6];
+        intToSqn( (quint64)sqnMs, sqn );
+        highest = QByteArray( (const char *)sqn, 6 ).toHex();
+    }
+    QMetaObject::invokeMethod( rules, "setVariable", Qt::DirectConnection,
+        Q_ARG( QString, QString( "AUTHSQN" ) ),
+        Q_ARG( QString, highest ) );
+
+    QStringList seqs;
+    for ( int i = 0; i < SQN_ARRAY_SIZE; i++ ) {
+        if ( _seqArray[i] < 0 )
+            seqs += QString();
+        else
+            seqs += QString::number( _seqArray[i], 16 );
+    }
+    QMetaObject::invokeMethod( rules, "setVariable", Qt::DirectConnection,
+        Q_ARG( QString, QString( "AUTHSQNARRAY" ) ),
+        Q_ARG( QString, seqs.join( "," ) ) );
 }
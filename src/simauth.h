@@ -18,10 +18,18 @@
 #ifndef SIMAUTH_H
 #define SIMAUTH_H
 
-#include "phonesim.h"
+#include <qglobal.h>
+#include <qobject.h>
+#include <qstring.h>
+#include "aes.h"
 
 #define MAX_LOGICAL_CHANNELS    4
 
+// SQN array parameters, from 3GPP TS 33.102 Annex C.
+#define SQN_IND_BITS            5
+#define SQN_ARRAY_SIZE          (1 << SQN_IND_BITS)
+#define SQN_DELTA               (1 << 28)
+
 enum UmtsStatus {
     UMTS_OK,            // Success
     UMTS_INVALID_MAC,   // MAC did not match AUTN parameter
@@ -29,26 +37,81 @@ enum UmtsStatus {
     UMTS_ERROR          // Any other error
 };
 
+// A UMTS challenge, and the vectors computed in response to it.
+struct UmtsChallenge
+{
+    uint8_t rand[16];
+    uint8_t autn[16];
+};
+
+struct UmtsResult
+{
+    enum UmtsStatus status;
+    uint8_t res[8];
+    uint8_t ck[16];
+    uint8_t ik[16];
+    uint8_t auts[14];
+};
+
+struct GsmResult
+{
+    uint8_t sres[4];
+    uint8_t kc[8];
+};
+
 class SimAuth : public QObject
 {
     Q_OBJECT
 public:
-    SimAuth( QObject *parent, SimXmlNode& n );
+    // The keys and the first SQN to accept are given in hex, as they
+    // appear in the <simauth> element of the rule file.
+    SimAuth( QObject *parent, const QString& ki, const QString& opc,
+             const QString& sqn );
     ~SimAuth();
 
     void gsmAuthenticate( QString rand, QString &sres, QString &kc );
     enum UmtsStatus umtsAuthenticate( QString rand, QString autn,
             QString &res, QString &ck, QString &ik, QString &auts );
 
+    // Binary versions, which avoid converting to and from hex.
+    void gsmAuthenticate( const uint8_t *rand, GsmResult& result ) const;
+    void umtsAuthenticate( const UmtsChallenge& challenge, UmtsResult& result );
+
+    // Compute the vectors for several challenges in one call.  The SQN
+    // variables are published once, after the whole batch.
+    void gsmAuthenticate( const uint8_t (*rands)[16], GsmResult *results,
+                          int count ) const;
+    void umtsAuthenticate( const UmtsChallenge *challenges,
+                           UmtsResult *results, int count );
+
 private:
     // secret key, set during initialization (from XML)
-    QString _ki;
+    uint8_t _ki[16];
+
+    // AES key schedule for Ki, used by all of the Milenage functions
+    struct aes_key _kiSchedule;
 
     // operator variant algorithm configuration field
-    QString _opc;
+    uint8_t _opc[16];
+
+    // Sequence numbers stored on SIM: the highest SEQ accepted for
+    // each IND, or -1 if none.
+    qint64 _seqArray[SQN_ARRAY_SIZE];
+
+    // The SQN from the rule file.  Its SEQ is the lowest that will be
+    // accepted, and it stands in for SQN_MS until one has been accepted.
+    quint64 _initialSqn;
+    qint64 _firstSeq;
+
+    // Set when _seqArray changes, until the variables are published.
+    bool _sqnChanged;
 
-    // Sequence number stored on SIM
-    QString _sqn;
+    void f1( const uint8_t *temp, const uint8_t *sqn, const uint8_t *amf,
+             uint8_t *out1 ) const;
+    void authenticate( const UmtsChallenge& challenge, UmtsResult& result );
+    bool acceptSqn( quint64 sqn );
+    qint64 highestSqn() const;
+    void updateSqnStatus();
 };
 
 #endif
@@ -0,0 +1,299 @@
+/****************************************************************************
+**
+** This file is part of the Qt Extended Opensource Package.
+**
+** This file may be used under the terms of the GNU General Public License
+** version 2.0 as published by the Free Software Foundation and appearing
+** in the file LICENSE.GPL included in the packaging of this file.
+**
+** Please review the following information to ensure GNU General Public
+** Licensing requirements will be met:
+**     http://www.fsf.org/licensing/licenses/info/GPLv2.html.
+**
+**
+****************************************************************************/
+
+#include "simfilejournal.h"
+#include "simfilesystem.h"
+#include <qfile.h>
+#include <qlist.h>
+#include <qdebug.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/file.h>
+
+// Layout of a journal: a header followed by variable-length records,
+// each holding the data written by one UPDATE BINARY or UPDATE RECORD.
+// A record is appended with a single write, and carries a checksum so
+// that a record which was cut short by a crash is discarded on replay.
+
+#define SIM_JOURNAL_MAGIC       0x4a495350      // "PSIJ"
+#define SIM_JOURNAL_VERSION     2
+#define SIM_JOURNAL_RECORD      0x5552          // "RU"
+
+// Compact once the journal holds this many records, and several times
+// as many as there are updated pages and records.
+#define SIM_JOURNAL_COMPACT_MIN     1024
+#define SIM_JOURNAL_COMPACT_RATIO   4
+
+// The header identifies the filesystem image that the journal was
+// written against, by the number of files and a hash of their ids and
+// sizes, so that a journal is not replayed into a different SIM.
+struct SimJournalHeader
+{
+    quint32 magic;
+    quint32 version;
+    quint32 itemCount;
+    quint32 layout;
+};
+
+struct SimJournalRecord
+{
+    quint16 magic;
+    quint16 check;
+    quint16 fid;
+    quint16 parent;         // fid of the parent directory, to catch renumbering
+    quint32 offset;
+    quint16 size;
+    quint16 reserved;
+};
+
+static void fletcher( quint32& sum1, quint32& sum2, const char *data, int len )
+{
+    for ( int i = 0; i < len; i++ ) {
+        sum1 = ( sum1 + (quint8)data[i] ) % 255;
+        sum2 = ( sum2 + sum1 ) % 255;
+    }
+}
+
+static quint16 recordChecksum( const SimJournalRecord *r, const char *data )
+{
+    // Fletcher-16 over the fields after the checksum, and then the data.
+    quint32 sum1 = 0;
+    quint32 sum2 = 0;
+    fletcher( sum1, sum2, (const char *)&r->fid, sizeof(*r) - 2 * sizeof(quint16) );
+    fletcher( sum1, sum2, data, r->size );
+    return (quint16)( ( sum2 << 8 ) | sum1 );
+}
+
+static quint16 parentFid( const SimFileItem *item )
+{
+    return item->parentDir() ? item->parentDir()->fid() : 0;
+}
+
+static void fnv( quint32& hash, quint32 value )
+{
+    for ( int i = 0; i < 4; i++ ) {
+        hash = ( hash ^ ( value & 0xFF ) ) * 16777619;
+        value >>= 8;
+    }
+}
+
+static SimJournalHeader journalHeader( const SimFileImage *image )
+{
+    SimJournalHeader header;
+    memset( &header, 0, sizeof(header) );
+    header.magic = SIM_JOURNAL_MAGIC;
+    header.version = SIM_JOURNAL_VERSION;
+
+    // FNV-1a over the layout of every file, in breadth-first order.
+    quint32 hash = 2166136261U;
+    QList<SimFileItem *> pending;
+    pending += image->rootItem();
+    while ( !pending.isEmpty() ) {
+        SimFileItem *item = pending.takeFirst();
+        pending += item->children();
+        fnv( hash, item->fid() );
+        fnv( hash, parentFid( item ) );
+        fnv( hash, (quint32)item->type() );
+        fnv( hash, (quint32)item->size() );
+        fnv( hash, (quint32)item->recordSize() );
+        ++header.itemCount;
+    }
+    header.layout = hash;
+    return header;
+}
+
+static QByteArray headerData( const SimJournalHeader& header )
+{
+    return QByteArray( (const char *)&header, sizeof(header) );
+}
+
+static QByteArray journalRecord( const SimFileItem *item, int offset, const QByteArray& data )
+{
+    SimJournalRecord r;
+    memset( &r, 0, sizeof(r) );
+    r.magic = SIM_JOURNAL_RECORD;
+    r.fid = item->fid();
+    r.parent = parentFid( item );
+    r.offset = (quint32)offset;
+    r.size = (quint16)data.size();
+    r.check = recordChecksum( &r, data.constData() );
+    return QByteArray( (const char *)&r, sizeof(r) ) + data;
+}
+
+SimFileJournal::SimFileJournal()
+{
+    file = 0;
+    records = 0;
+}
+
+SimFileJournal::~SimFileJournal()
+{
+    close();
+}
+
+bool SimFileJournal::open( const QString& name, SimFileSystem *fs )
+{
+    close();
+    fileName = name;
+
+    // Records are written straight through, not held in a buffer that
+    // would be lost if phonesim were killed.
+    file = new QFile( fileName );
+    if ( !file->open( QIODevice::ReadWrite | QIODevice::Unbuffered ) ) {
+        qWarning() << "SimFileJournal: cannot open" << fileName;
+        close();
+        return false;
+    }
+
+    // Only one simulated SIM may use a journal at a time.
+    if ( flock( file->handle(), LOCK_EX | LOCK_NB ) < 0 ) {
+        qWarning() << "SimFileJournal:" << fileName << "is in use";
+        close();
+        return false;
+    }
+
+    if ( file->size() == 0 ) {
+        QByteArray header = headerData( journalHeader( fs->image ) );
+        if ( file->write( header ) != header.size() ) {
+            qWarning() << "SimFileJournal: cannot create" << fileName;
+            close();
+            return false;
+        }
+    } else if ( !replay( fs ) ) {
+        close();
+        return false;
+    }
+    file->seek( file->size() );
+    return true;
+}
+
+bool SimFileJournal::replay( SimFileSystem *fs )
+{
+    SimJournalHeader header;
+    if ( file->read( (char *)&header, sizeof(header) ) != sizeof(header) ||
+         header.magic != SIM_JOURNAL_MAGIC ||
+         header.version != SIM_JOURNAL_VERSION ) {
+        qWarning() << "SimFileJournal:" << fileName << "is not a SIM journal";
+        return false;
+    }
+    SimJournalHeader expected = journalHeader( fs->image );
+    if ( header.itemCount != expected.itemCount ||
+         header.layout != expected.layout ) {
+        qWarning() << "SimFileJournal:" << fileName
+                   << "was written for a different SIM filesystem";
+        return false;
+    }
+
+    qint64 good = file->pos();
+    SimJournalRecord r;
+    records = 0;
+    while ( file->read( (char *)&r, sizeof(r) ) == sizeof(r) &&
+            r.magic == SIM_JOURNAL_RECORD ) {
+        QByteArray data = file->read( r.size );
+        if ( data.size() != r.size || r.check != recordChecksum( &r, data.constData() ) )
+            break;
+        good = file->pos();
+        ++records;
+
+        // Apply the update as it was applied originally.
+        SimFileItem *item = fs->findItem( r.fid );
+        if ( !item || parentFid( item ) != r.parent )
+            qWarning() << "SimFileJournal: ignoring update to unknown file"
+                       << QString::number( r.fid, 16 );
+        else if ( !fs->update( item, (int)r.offset, data ) )
+            qWarning() << "SimFileJournal: ignoring update outside of file"
+                       << QString::number( r.fid, 16 );
+    }
+
+    // Drop anything after the last complete record.
+    if ( good < file->size() ) {
+        qWarning() << "SimFileJournal: discarding damaged tail of" << fileName;
+        file->resize( good );
+    }
+    return true;
+}
+
+void SimFileJournal::append( SimFileSystem *fs, const SimFileItem *item,
+                             int offset, const QByteArray& data )
+{
+    if ( !file )
+        return;
+
+    QByteArray record = journalRecord( item, offset, data );
+    if ( file->write( record ) != record.size() ) {
+        qWarning() << "SimFileJournal: cannot write to" << fileName;
+        close();
+        return;
+    }
+
+    ++records;
+    if ( records >= SIM_JOURNAL_COMPACT_MIN &&
+         records > SIM_JOURNAL_COMPACT_RATIO * fs->updates.size() )
+        compact( fs );
+}
+
+void SimFileJournal::compact( SimFileSystem *fs )
+{
+    // Write one record for each page or record that differs from the image.
+    QByteArray journal = headerData( journalHeader( fs->image ) );
+    int count = 0;
+    QList<SimFileItem *> pending;
+    pending += fs->image->rootItem();
+    while ( !pending.isEmpty() ) {
+        SimFileItem *item = pending.takeFirst();
+        pending += item->children();
+        for ( int n = 0; n < item->chunkCount(); n++ ) {
+            QHash<quint32, QByteArray>::ConstIterator it;
+            it = fs->updates.constFind( SimFileSystem::chunkKey( item, n ) );
+            if ( it != fs->updates.constEnd() ) {
+                journal += journalRecord( item, n * item->chunkSize(), it.value() );
+                ++count;
+            }
+        }
+    }
+
+    // Replace the journal in one step, once the new one is on disk, so
+    // that a crash leaves either the old journal or the new one.  The
+    // new journal is locked before the rename, so that no other instance
+    // can open it under the journal's name before this one does.
+    QString tempName = fileName + ".tmp";
+    QFile *out = new QFile( tempName );
+    bool ok = out->open( QIODevice::ReadWrite | QIODevice::Truncate |
+                         QIODevice::Unbuffered ) &&
+              flock( out->handle(), LOCK_EX | LOCK_NB ) == 0 &&
+              out->write( journal ) == journal.size() &&
+              fsync( out->handle() ) == 0;
+    if ( !ok || rename( QFile::encodeName( tempName ).constData(),
+                        QFile::encodeName( fileName ).constData() ) < 0 ) {
+        qWarning() << "SimFileJournal: cannot compact" << fileName;
+        delete out;
+        QFile::remove( tempName );
+        return;
+    }
+
+    // Carry on appending to the new journal.
+    delete file;
+    file = out;
+    file->seek( file->size() );
+    records = count;
+}
+
+void SimFileJournal::close()
+{
+    delete file;
+    file = 0;
+    records = 0;
+}
@@ -0,0 +1,54 @@
+/****************************************************************************
+**
+** This file is part of the Qt Extended Opensource Package.
+**
+** This file may be used under the terms of the GNU General Public License
+** version 2.0 as published by the Free Software Foundation and appearing
+** in the file LICENSE.GPL included in the packaging of this file.
+**
+** Please review the following information to ensure GNU General Public
+** Licensing requirements will be met:
+**     http://www.fsf.org/licensing/licenses/info/GPLv2.html.
+**
+**
+****************************************************************************/
+
+#ifndef SIMFILEJOURNAL_H
+#define SIMFILEJOURNAL_H
+
+#include <qstring.h>
+#include <qbytearray.h>
+
+class QFile;
+class SimFileSystem;
+class SimFileItem;
+
+// Append-only log of the updates that a SIM has made to its files, so
+// that they survive disconnects and restarts.  Each update is appended
+// with a single write, and is replayed when the journal is next opened.
+// Once most of the journal has been superseded by later updates, it is
+// rewritten to hold just the pages and records that differ from the image.
+class SimFileJournal
+{
+public:
+    SimFileJournal();
+    ~SimFileJournal();
+
+    // Open or create a journal and replay its updates into "fs".
+    bool open( const QString& fileName, SimFileSystem *fs );
+
+    // Record an update that "fs" has just applied.
+    void append( SimFileSystem *fs, const SimFileItem *item,
+                 int offset, const QByteArray& data );
+
+private:
+    QString fileName;
+    QFile *file;
+    int records;
+
+    bool replay( SimFileSystem *fs );
+    void compact( SimFileSystem *fs );
+    void close();
+};
+
+#endif
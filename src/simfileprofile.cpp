@@ -0,0 +1,285 @@
+/****************************************************************************
+**
+** This file is part of the Qt Extended Opensource Package.
+**
+** This file may be used under the terms of the GNU General Public License
+** version 2.0 as published by the Free Software Foundation and appearing
+** in the file LICENSE.GPL included in the packaging of this file.
+**
+** Please review the following information to ensure GNU General Public
+** Licensing requirements will be met:
+**     http://www.fsf.org/licensing/licenses/info/GPLv2.html.
+**
+**
+****************************************************************************/
+
+#include "simfileprofile.h"
+#include "simfilesystem.h"
+#include <qfile.h>
+#include <qvector.h>
+#include <qdebug.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+
+// Layout of a profile: a header, a table of images, the items of every
+// image, and finally the contents of the files and the application ids.
+// Items are stored in the order they were created, so a parent always
+// comes before its children and the first item of an image is its root.
+
+#define SIM_PROFILE_MAGIC       0x4d495350      // "PSIM"
+#define SIM_PROFILE_VERSION     1
+#define SIM_PROFILE_DIRECTORY   0x01
+
+struct SimProfileHeader
+{
+    quint32 magic;
+    quint32 version;
+    quint32 imageCount;
+    quint32 size;           // of the whole file, to catch truncation
+};
+
+struct SimProfileImage
+{
+    quint16 type;           // file_system_type
+    quint16 aidSize;
+    quint32 aidOffset;
+    quint32 itemOffset;
+    quint32 itemCount;
+};
+
+struct SimProfileItem
+{
+    quint16 fid;
+    quint16 parent;         // index of the parent within the image
+    quint8 type;            // file_type
+    quint8 flags;
+    quint16 recordSize;
+    quint32 access;
+    quint32 offset;
+    quint32 size;
+};
+
+SimFileProfile::SimFileProfile()
+{
+    file = 0;
+    map = 0;
+    mapSize = 0;
+}
+
+SimFileProfile::~SimFileProfile()
+{
+    close();
+}
+
+bool SimFileProfile::open( const QString& fileName )
+{
+    close();
+
+    file = new QFile( fileName );
+    if ( !file->open( QIODevice::ReadOnly ) ) {
+        qWarning() << "SimFileProfile: cannot open" << fileName;
+        close();
+        return false;
+    }
+    mapSize = file->size();
+    if ( mapSize >= (qint64)sizeof(SimProfileHeader) )
+        map = file->map( 0, mapSize );
+    if ( !map ) {
+        qWarning() << "SimFileProfile: cannot map" << fileName;
+        close();
+        return false;
+    }
+
+    const SimProfileHeader *header = (const SimProfileHeader *)map;
+    if ( header->magic != SIM_PROFILE_MAGIC ||
+         header->version != SIM_PROFILE_VERSION ||
+         header->size != mapSize ||
+         !contains( sizeof(SimProfileHeader),
+                    (quint64)header->imageCount * sizeof(SimProfileImage) ) ) {
+        qWarning() << "SimFileProfile:" << fileName << "is not a SIM profile";
+        close();
+        return false;
+    }
+
+    const SimProfileImage *entries =
+        (const SimProfileImage *)( map + sizeof(SimProfileHeader) );
+    for ( quint32 i = 0; i < header->imageCount; i++ ) {
+        SimFileImage *image = 0;
+        if ( contains( entries[i].aidOffset, entries[i].aidSize ) )
+            image = loadImage( &entries[i] );
+        if ( !image ) {
+            qWarning() << "SimFileProfile:" << fileName << "is damaged";
+            close();
+            return false;
+        }
+        QString aid = QString::fromLatin1
+            ( (const char *)( map + entries[i].aidOffset ), entries[i].aidSize );
+        delete images.value( aid, 0 );
+        images.insert( aid, image );
+    }
+    return true;
+}
+
+SimFileImage *SimFileProfile::loadImage( const SimProfileImage *entry )
+{
+    if ( !entry->itemCount ||
+         !contains( entry->itemOffset,
+                    (quint64)entry->itemCount * sizeof(SimProfileItem) ) )
+        return 0;
+
+    const SimProfileItem *records = (const SimProfileItem *)( map + entry->itemOffset );
+    QVector<SimFileItem *> items( entry->itemCount );
+    SimFileImage *image = new SimFileImage();
+    for ( quint32 i = 0; i < entry->itemCount; i++ ) {
+        const SimProfileItem& r = records[i];
+        SimFileItem *parent = 0;
+        if ( i > 0 ) {
+            if ( r.parent >= i ) {
+                delete image;
+                return 0;
+            }
+            parent = items[r.parent];
+        }
+        if ( !contains( r.offset, r.size ) ) {
+            delete image;
+            return 0;
+        }
+
+        QString fileid = QString::number( r.fid, 16 ).toUpper().rightJustified( 4, QChar('0') );
+        SimFileItem *item = image->addItem( fileid, parent, r.access, (enum file_type)r.type );
+        if ( i == 0 )
+            image->_rootItem = item;
+        item->setIsDirectory( ( r.flags & SIM_PROFILE_DIRECTORY ) != 0 );
+        item->setRawContents( (const char *)( map + r.offset ), r.size, r.recordSize );
+        items[i] = item;
+    }
+    return image;
+}
+
+void SimFileProfile::close()
+{
+    // The images refer to the mapping, so they must go first.
+    qDeleteAll( images );
+    images.clear();
+    if ( file ) {
+        if ( map )
+            file->unmap( map );
+        file->close();
+        delete file;
+        file = 0;
+    }
+    map = 0;
+    mapSize = 0;
+}
+
+static void collectItems( SimFileItem *item, QVector<SimFileItem *>& list )
+{
+    list[item->index()] = item;
+    foreach ( SimFileItem *child, item->children() )
+        collectItems( child, list );
+}
+
+bool SimFileProfile::compile( const SimRuleSet& rules, const QString& fileName )
+{
+    if ( !rules.isValid() )
+        return false;
+
+    // Collect the images in document order, along with their application ids.
+    QList<const SimFileImage *> compiled;
+    QList<QByteArray> aids;
+    QList<int> types;
+    SimXmlNode *n = rules.documentElement()->children;
+    for ( ; n != 0; n = n->next ) {
+        if ( n->tag == "filesystem" && rules.fileImage( n ) ) {
+            compiled += rules.fileImage( n );
+            aids += QByteArray();
+            types += FILE_SYSTEM_TYPE_DEFAULT;
+        } else if ( n->tag == "application" ) {
+            SimXmlNode *child = n->children;
+            for ( ; child != 0; child = child->next ) {
+                if ( child->tag == "filesystem" && rules.fileImage( child ) ) {
+                    compiled += rules.fileImage( child );
+                    aids += n->getAttribute( "id" ).toLatin1();
+                    types += FILE_SYSTEM_TYPE_ISIM;
+                }
+            }
+        }
+    }
+
+    quint32 itemTotal = 0;
+    foreach ( const SimFileImage *image, compiled ) {
+        if ( image->itemCount > 0xFFFF ) {
+            qWarning() << "SimFileProfile: too many files for a profile";
+            return false;
+        }
+        itemTotal += image->itemCount;
+    }
+    quint32 itemBase = sizeof(SimProfileHeader) + compiled.size() * sizeof(SimProfileImage);
+    quint32 dataBase = itemBase + itemTotal * sizeof(SimProfileItem);
+
+    QByteArray entries;
+    QByteArray items;
+    QByteArray data;
+    for ( int i = 0; i < compiled.size(); i++ ) {
+        const SimFileImage *image = compiled[i];
+        SimProfileImage entry;
+        entry.type = (quint16)types[i];
+        entry.aidSize = (quint16)aids[i].size();
+        entry.aidOffset = dataBase + data.size();
+        entry.itemOffset = itemBase + items.size();
+        entry.itemCount = image->itemCount;
+        entries.append( (const char *)&entry, sizeof(entry) );
+        data += aids[i];
+
+        QVector<SimFileItem *> list( image->itemCount );
+        collectItems( image->rootItem(), list );
+        foreach ( SimFileItem *item, list ) {
+            SimProfileItem r;
+            memset( &r, 0, sizeof(r) );
+            r.fid = item->fid();
+            if ( item->parentDir() )
+                r.parent = (quint16)item->parentDir()->index();
+            r.type = (quint8)item->type();
+            r.flags = ( item->isDirectory() ? SIM_PROFILE_DIRECTORY : 0 );
+            r.recordSize = (quint16)item->recordSize();
+            r.access = (quint32)item->access();
+            r.offset = dataBase + data.size();
+            r.size = item->size();
+            items.append( (const char *)&r, sizeof(r) );
+            data += item->contents();
+        }
+    }
+
+    SimProfileHeader header;
+    header.magic = SIM_PROFILE_MAGIC;
+    header.version = SIM_PROFILE_VERSION;
+    header.imageCount = compiled.size();
+    header.size = dataBase + data.size();
+
+    // Write a new file and rename it over the old one, so that phonesim
+    // instances which have the old profile mapped keep a consistent copy.
+    QString tempName = fileName + ".tmp";
+    QFile out( tempName );
+    if ( !out.open( QIODevice::WriteOnly | QIODevice::Truncate ) ) {
+        qWarning() << "SimFileProfile: cannot create" << tempName;
+        return false;
+    }
+    bool ok = ( out.write( (const char *)&header, sizeof(header) ) == sizeof(header) &&
+                out.write( entries ) == entries.size() &&
+                out.write( items ) == items.size() &&
+                out.write( data ) == data.size() );
+
+    // Make sure that the contents are on disk before the rename, or a
+    // crash could leave an empty or partial profile under the new name.
+    if ( ok )
+        ok = ( out.flush() && fsync( out.handle() ) == 0 );
+    out.close();
+    if ( !ok || rename( QFile::encodeName( tempName ).constData(),
+                        QFile::encodeName( fileName ).constData() ) < 0 ) {
+        qWarning() << "SimFileProfile: cannot write" << fileName;
+        QFile::remove( tempName );
+        return false;
+    }
+    return true;
+}
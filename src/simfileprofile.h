@@ -0,0 +1,59 @@
+/****************************************************************************
+**
+** This file is part of the Qt Extended Opensource Package.
+**
+** This file may be used under the terms of the GNU General Public License
+** version 2.0 as published by the Free Software Foundation and appearing
+** in the file LICENSE.GPL included in the packaging of this file.
+**
+** Please review the following information to ensure GNU General Public
+** Licensing requirements will be met:
+**     http://www.fsf.org/licensing/licenses/info/GPLv2.html.
+**
+**
+****************************************************************************/
+
+#ifndef SIMFILEPROFILE_H
+#define SIMFILEPROFILE_H
+
+#include <qstring.h>
+#include <qmap.h>
+
+class QFile;
+class SimRuleSet;
+class SimFileImage;
+struct SimProfileImage;
+
+// The SIM filesystem and application filesystems of a rule file, compiled
+// into a compact binary file.  Profiles are memory-mapped rather than
+// parsed, and the contents of their files are never copied unless they
+// are updated, so loading one costs little more than opening it.
+class SimFileProfile
+{
+public:
+    SimFileProfile();
+    ~SimFileProfile();
+
+    // Map a profile.  Returns false if it cannot be read or is damaged.
+    bool open( const QString& fileName );
+
+    // Get the image for the SIM itself, or for the application with "aid".
+    const SimFileImage *image( const QString& aid = QString() ) const
+        { return images.value( aid, 0 ); }
+
+    // Compile the filesystems of a rule set into a profile.
+    static bool compile( const SimRuleSet& rules, const QString& fileName );
+
+private:
+    QFile *file;
+    uchar *map;
+    qint64 mapSize;
+    QMap<QString, SimFileImage *> images;
+
+    bool contains( quint64 offset, quint64 size ) const
+        { return offset + size <= (quint64)mapSize; }
+    SimFileImage *loadImage( const SimProfileImage *entry );
+    void close();
+};
+
+#endif
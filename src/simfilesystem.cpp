@@ -18,6 +18,8 @@
 ****************************************************************************/
 
 #include "simfilesystem.h"
+#include "simfilejournal.h"
+#include "simapdu.h"
 #include <qatutils.h>
 #include <qdebug.h>
 
@@ -146,12 +148,50 @@ static SimFileInfo const isimFiles[] =
     {0,             0,          0,             0,         FILE_TYPE_TRANSPARENT}
 };
 
-SimFileSystem::SimFileSystem( SimRules *rules, SimXmlNode& e, enum file_system_type fstype )
-    : QObject( rules )
+// Hashed views of the tables above.  Where several entries match a key,
+// the first one wins, as it did when the tables were searched in order.
+struct SimFileIndex
 {
-    this->rules = rules;
-    rootItem = new SimFileItem( "3F00", 0 );
-    currentItem = rootItem;
+    QHash<QString, const SimFileInfo *> byName;
+    QHash<QString, const SimFileInfo *> byNameOrId;
+    QHash<QString, const SimFileInfo *> withParent;
+    QHash<QString, const SimFileInfo *> isimByName;
+};
+
+static void indexEntry( QHash<QString, const SimFileInfo *>& hash,
+                        const QString& key, const SimFileInfo *info )
+{
+    if ( !hash.contains( key ) )
+        hash.insert( key, info );
+}
+
+static SimFileIndex *buildFileIndex()
+{
+    SimFileIndex *index = new SimFileIndex;
+    const SimFileInfo *info;
+    for ( info = knownFiles; info->fileid; ++info ) {
+        indexEntry( index->byName, info->name, info );
+        indexEntry( index->byNameOrId, info->name, info );
+        indexEntry( index->byNameOrId, info->fileid, info );
+        if ( info->parent )
+            indexEntry( index->withParent, info->fileid, info );
+    }
+    for ( info = isimFiles; info->fileid; ++info )
+        indexEntry( index->isimByName, info->name, info );
+    return index;
+}
+
+static const SimFileIndex& fileIndex()
+{
+    static SimFileIndex *index = buildFileIndex();
+    return *index;
+}
+
+SimFileImage::SimFileImage( SimXmlNode& e, enum file_system_type fstype )
+{
+    itemCount = 0;
+    _rootItem = addItem( "3F00", 0 );
+    SimFileItem *rootItem = _rootItem;
 
     // Create all of the standard directories.
     const SimFileInfo *info;
@@ -164,9 +204,9 @@ SimFileSystem::SimFileSystem( SimRules *rules, SimXmlNode& e, enum file_system_t
     while ( info->fileid ) {
         QString fileid = info->fileid;
         if ( fileid.startsWith( "7F" ) ) {
-            dirItem = new SimFileItem( fileid, rootItem );
+            dirItem = addItem( fileid, rootItem );
         } else if ( fileid.startsWith( "5F" ) ) {
-            new SimFileItem( fileid, dirItem );
+            addItem( fileid, dirItem );
         }
         ++info;
     }
@@ -187,7 +227,7 @@ SimFileSystem::SimFileSystem( SimRules *rules, SimXmlNode& e, enum file_system_t
                     SimFileItem *item;
                     item = findItem( fileid.right(4) );
                     if ( !item )
-                        item = new SimFileItem( fileid.right(4), parent, access, type );
+                        item = addItem( fileid.right(4), parent, access, type );
                     else
                         qDebug() << "File" << name << "defined multiple times";
                     item->setContents( data );
@@ -205,7 +245,7 @@ SimFileSystem::SimFileSystem( SimRules *rules, SimXmlNode& e, enum file_system_t
                 QString name = child->getAttribute( "name" );
                 QByteArray data = QAtUtils::fromHex( child->contents );
                 QString fileid = resolveISimFileId( name );
-                SimFileItem *item = new SimFileItem( fileid.right(4), rootItem, access, type);
+                SimFileItem *item = addItem( fileid.right(4), rootItem, access, type);
                 item->setContents( data );
             }
         } else {
@@ -213,15 +253,134 @@ SimFileSystem::SimFileSystem( SimRules *rules, SimXmlNode& e, enum file_system_t
         }
         child = child->next;
     }
+}
 
-    /* Select DFgsm initially */
-    if ( fstype == FILE_SYSTEM_TYPE_DEFAULT )
-        currentItem = findItem("7F20");
+SimFileImage::SimFileImage()
+{
+    _rootItem = 0;
+    itemCount = 0;
+}
+
+SimFileImage::~SimFileImage()
+{
+    delete _rootItem;
+}
+
+SimFileSystem::SimFileSystem( SimRules *rules, SimXmlNode& e, enum file_system_type fstype )
+    : QObject( rules )
+{
+    this->rules = rules;
+
+    // Use the image that was compiled when the rules were loaded.
+    image = rules->fileImage( &e );
+    privateImage = 0;
+    journal = 0;
+    if ( !image )
+        image = privateImage = new SimFileImage( e, fstype );
+    apduEngine = new SimApduEngine( this, rules, fstype );
+}
+
+SimFileSystem::SimFileSystem( SimRules *rules, const SimFileImage *image,
+                              enum file_system_type fstype )
+    : QObject( rules )
+{
+    this->rules = rules;
+    this->image = image;
+    privateImage = 0;
+    journal = 0;
+    apduEngine = new SimApduEngine( this, rules, fstype );
 }
 
 SimFileSystem::~SimFileSystem()
 {
-    delete rootItem;
+    delete apduEngine;
+    delete journal;
+    delete privateImage;
+}
+
+bool SimFileSystem::setJournal( const QString& fileName )
+{
+    delete journal;
+    journal = 0;
+
+    // Replay the existing updates before new ones are recorded.
+    SimFileJournal *j = new SimFileJournal;
+    if ( !j->open( fileName, this ) ) {
+        delete j;
+        return false;
+    }
+    journal = j;
+    return true;
+}
+
+quint32 SimFileSystem::chunkKey( const SimFileItem *item, int n )
+{
+    return ( (quint32)item->index() << 16 ) | (quint32)n;
+}
+
+QByteArray SimFileSystem::chunk( const SimFileItem *item, int n ) const
+{
+    QHash<quint32, QByteArray>::ConstIterator it;
+    it = updates.constFind( chunkKey( item, n ) );
+    if ( it != updates.constEnd() )
+        return it.value();
+    return item->chunk( n );
+}
+
+QByteArray SimFileSystem::read( const SimFileItem *item, int offset, int length ) const
+{
+    int size = item->chunkSize();
+    int n = offset / size;
+    if ( offset < 0 || length <= 0 || n >= item->chunkCount() )
+        return QByteArray();
+
+    // Reads within a single page or record share its data.
+    QByteArray first = chunk( item, n );
+    int start = offset - n * size;
+    if ( start == 0 && length == first.size() )
+        return first;
+    if ( start + length <= first.size() )
+        return first.mid( start, length );
+
+    QByteArray result = first.mid( start );
+    while ( result.size() < length && ++n < item->chunkCount() )
+        result += chunk( item, n );
+    result.truncate( length );
+    return result;
+}
+
+QByteArray SimFileSystem::contents( const SimFileItem *item ) const
+{
+    return read( item, 0, item->size() );
+}
+
+bool SimFileSystem::update( const SimFileItem *item, int offset, const QByteArray& data )
+{
+    // The APDU engine checks updates against the file, but a journal
+    // does not, so never write outside of the item or across a record.
+    int size = item->chunkSize();
+    bool records = ( item->recordSize() > 0 );
+    if ( offset < 0 || offset >= item->size() || ( records && offset % size ) )
+        return false;
+    int length = qMin( data.size(), item->size() - offset );
+    if ( records )
+        length -= length % size;
+    if ( length <= 0 )
+        return false;
+
+    int posn = 0;
+    while ( posn < length ) {
+        int n = ( offset + posn ) / size;
+        int start = offset + posn - n * size;
+        QByteArray value = chunk( item, n );
+        int len = qMin( value.size() - start, length - posn );
+        value.replace( start, len, data.constData() + posn, len );
+        updates.insert( chunkKey( item, n ), value );
+        posn += len;
+    }
+    if ( journal )
+        journal->append( this, item, offset, data.left( length ) );
+    return length == data.size();
 }
 
 bool SimFileSystem::fileAccess( const QString& args, QString& resp )
@@ -229,243 +388,78 @@ bool SimFileSystem::fileAccess( const QString& args, QString& resp )
     // Extract the arguments to the command.
     uint posn = 0;
     uint command = QAtUtils::parseNumber( args, posn );
-    QString fileid =
-        QString::number( QAtUtils::parseNumber( args, posn ), 16 ).toUpper();
+    quint16 fileid = (quint16)QAtUtils::parseNumber( args, posn );
     uint p1 = QAtUtils::parseNumber( args, posn );
     uint p2 = QAtUtils::parseNumber( args, posn );
     uint p3 = QAtUtils::parseNumber( args, posn );
     QString hexdata = QAtUtils::nextString( args, posn );
     QByteArray data = QAtUtils::fromHex( hexdata );
 
-    // Determine how to execute the command.
-    bool ok = true;
-    SimFileItem *item;
-    QString response;
-    int sw1 = 0;
-    int sw2 = 0;
-    int offset, length;
-    QByteArray contents;
+    // AT+CRSM names the file with every command, so select it first and
+    // then execute the command as a GSM APDU.  The modem has already
+    // asked for the PIN, so access is checked as though it was verified.
+    QByteArray result;
     switch ( command ) {
 
         case 176:       // READ BINARY
-        {
-            offset = (int)((p1 << 8) + p2);
-            length = (int)p3;
-            item = findItem( fileid );
-            if ( !item ) {
-                sw1 = 0x94;
-                sw2 = 0x04;
-            } else if ( item->recordSize() > 0) {
-                sw1 = 0x94;
-                sw2 = 0x08;
-            } else if ( !item->checkAccess( FILE_OP_READ, true ) ) {
-                sw1 = 0x98;
-                sw2 = 0x04;
-            } else {
-                contents = item->contents();
-                if ( ( offset + length ) > contents.size() ) {
-                    sw1 = 0x94;
-                    sw2 = 0x02;
-                } else if ( length ) {
-                    sw1 = 0x9f;
-                    sw2 = length;
-                    response =
-                        QAtUtils::toHex( contents.mid( offset, length ) );
-                } else {
-                    sw1 = 0x67;
-                    sw2 = contents.size() - offset;
-                }
-            }
-            if ( item )
-                currentItem = item;
-        }
-        break;
-
         case 178:       // READ RECORD
+        case 214:       // UPDATE BINARY
+        case 220:       // UPDATE RECORD
         {
-            offset = (int)(p1 - 1);
-            length = (int)p3;
-            item = findItem( fileid );
-            if ( !item ) {
-                sw1 = 0x94;
-                sw2 = 0x04;
-            } else if ( p2 != 0x04 ) {
-                // Only absolute reads are supported.
-                sw1 = 0x6b;
-                sw2 = 0x00;
-            } else if ( !item->checkAccess( FILE_OP_READ, true ) ) {
-                sw1 = 0x98;
-                sw2 = 0x04;
-            } else if ( item->recordSize() <= 0 ) {
-                sw1 = 0x94;
-                sw2 = 0x08;
-            } else {
-                offset *= item->recordSize();
-                contents = item->contents();
-                if ( length < 1 || length > item->recordSize() ) {
-                    sw1 = 0x67;
-                    sw2 = item->recordSize();
-                } else if ( offset >= contents.size() || offset < 0 ) {
-                    sw1 = 0x94;
-                    sw2 = 0x02;
-                } else {
-                    sw1 = 0x9F;
-                    sw2 = length;
-                    response =
-                        QAtUtils::toHex( contents.mid( offset, length ) );
-                }
+            if ( !apduEngine->selectFile( fileid ) ) {
+                result = QByteArray( "\x94\x04", 2 );
+                break;
+            }
+            if ( ( command == 214 || command == 220 ) && data.size() != (int)p3 ) {
+                result = QByteArray( "\x94\x08", 2 );
+                break;
+            }
+            QByteArray apdu;
+            apdu += (char)0xA0;
+            apdu += (char)command;
+            apdu += (char)p1;
+            apdu += (char)p2;
+            apdu += (char)p3;
+            apdu += data;
+            result = apduEngine->execute( apdu, true );
+
+            // Reads have always been reported with 9F and the length.
+            if ( ( command == 176 || command == 178 ) && result.size() > 2 &&
+                 (quint8)result[result.size() - 2] == 0x90 ) {
+                result[result.size() - 2] = (char)0x9F;
+                result[result.size() - 1] = (char)( result.size() - 2 );
             }
-            if ( item )
-                currentItem = item;
         }
         break;
 
         case 192:       // GET RESPONSE
         {
-            item = findItem( fileid );
-            if ( !item ) {
-                sw1 = 0x94;
-                sw2 = 0x04;
+            if ( !apduEngine->selectFile( fileid ) ) {
+                result = QByteArray( "\x94\x04", 2 );
                 break;
             }
-            currentItem = item;
         }
         // Fall through to the next case.
 
         case 242:       // STATUS
         {
-            // Format the status response according to GSM 51.011, 9.2.1.
-            char status[15];
-            status[0] = 0x00;           // RFU
-            status[1] = 0x00;
-            int size = currentItem->contents().size();
-            status[2] = (char)(size >> 8);
-            status[3] = (char)size;
-            status[4] = fileid.left(2).toInt(0, 16);
-            status[5] = fileid.right(2).toInt(0, 16);
-            if ( currentItem == rootItem ) {
-                status[6] = 0x01;
-            } if ( currentItem->isDirectory() ) {
-                status[6] = 0x02;
-            } else {
-                status[6] = 0x04;
-            }
-            status[7] = 0x00;           // RFU
-
-            int access = currentItem->access();
-            status[8] = (access >> 16) & 0xff;
-            status[9] = (access >> 8) & 0xff;
-            status[10] = (access >> 0) & 0xff;
-
-            // File Status, TS 11.11, Section 9.3
-            status[11] = 0x01;
-
-            status[12] = 2;             // Size of data that follows.
-            if ( currentItem->isDirectory() ) {
-                status[13] = 0x00;
-                status[14] = 0x00;
-            } else if ( currentItem->recordSize() > 0 ) {
-                status[13] = (char)(currentItem->type() );
-                status[14] = (char)( currentItem->recordSize() );
-            } else {
-                status[13] = 0x00;
-                status[14] = 0x00;
-            }
-            sw1 = 0x90;
-            sw2 = 0x00;
-            response = QAtUtils::toHex( QByteArray( status, 15 ) );
-        }
-        break;
-
-        case 214:       // UPDATE BINARY
-        {
-            offset = (int)((p1 << 8) + p2);
-            length = (int)p3;
-            item = findItem( fileid );
-            if ( !item ) {
-                sw1 = 0x94;
-                sw2 = 0x04;
-            } else if ( !item->checkAccess( FILE_OP_UPDATE, true ) ) {
-                sw1 = 0x98;
-                sw2 = 0x04;
-            } else if ( item->recordSize() > 0 || data.size() != length ) {
-                sw1 = 0x94;
-                sw2 = 0x08;
-            } else {
-                contents = item->contents();
-                if ( ( offset + length ) > contents.size() ) {
-                    sw1 = 0x94;
-                    sw2 = 0x02;
-                } else if ( length ) {
-                    sw1 = 0x90;
-                    sw2 = 0x00;
-                    item->setContents(
-                            contents.left( offset ) +
-                            data +
-                            contents.mid( offset + length ) );
-                } else {
-                    sw1 = 0x67;
-                    sw2 = contents.size() - offset;
-                }
-            }
-            if ( item )
-                currentItem = item;
-        }
-        break;
-
-        case 220:       // UPDATE RECORD
-        {
-            offset = (int)(p1 - 1);
-            length = (int)p3;
-            item = findItem( fileid );
-            if ( !item ) {
-                sw1 = 0x94;
-                sw2 = 0x04;
-            } else if ( !length ) {
-                sw1 = 0x67;
-                sw2 = item->recordSize();
-            } else if ( !item->checkAccess( FILE_OP_UPDATE, true ) ) {
-                sw1 = 0x98;
-                sw2 = 0x04;
-            } else if ( p2 != 0x04 ) {
-                // Only absolute writes are supported.
-                sw1 = 0x6b;
-                sw2 = 0x00;
-            } else if ( item->recordSize() != length ||
-                    data.size() != length ) {
-                sw1 = 0x94;
-                sw2 = 0x08;
-            } else {
-                offset *= item->recordSize();
-                contents = item->contents();
-                if ( offset >= contents.size() || offset < 0 ) {
-                    sw1 = 0x94;
-                    sw2 = 0x02;
-                } else {
-                    sw1 = 0x90;
-                    sw2 = 0x00;
-                    item->setContents(
-                            contents.left( offset ) +
-                            data +
-                            contents.mid( offset + length ) );
-                }
-            }
-            if ( item )
-                currentItem = item;
+            result = SimApduEngine::gsmStatus( apduEngine->currentFile(), fileid );
+            result += (char)0x90;
+            result += (char)0x00;
         }
         break;
 
-        default: ok = false; break;
+        default: return false;
     }
 
     // Send the response information.
-    if ( sw1 != 0 ) {
-        resp = QString::number(sw1) + "," + QString::number(sw2);
-        if ( !response.isEmpty() )
-            resp += "," + response;
-    }
+    int sw1 = (quint8)result[result.size() - 2];
+    int sw2 = (quint8)result[result.size() - 1];
+    resp = QString::number(sw1) + "," + QString::number(sw2);
+    if ( result.size() > 2 )
+        resp += "," + QAtUtils::toHex( result.left( result.size() - 2 ) );
 
-    return ok;
+    return true;
 }
 
 void SimFileSystem::crsm( const QString& args )
@@ -485,63 +479,44 @@ void SimFileSystem::crsm( const QString& args )
         rules->respond( "ERROR" );
 }
 
-SimFileItem *SimFileSystem::findItem( const QString& fileid ) const
+SimFileItem *SimFileImage::findItem( const QString& fileid ) const
 {
-    return rootItem->findItem( fileid );
+    bool ok;
+    uint fid = fileid.toUInt( &ok, 16 );
+    if ( !ok || fileid.length() != 4 )
+        return 0;
+    return items.value( (quint16)fid );
 }
 
-SimFileItem *SimFileSystem::findItemParent( const QString& fileid ) const
+SimFileItem *SimFileImage::addItem( const QString& fileid, SimFileItem *parentDir,
+                                    int access, enum file_type type )
+{
+    // Lookups find the first item with an id, as a tree search would.
+    SimFileItem *item = new SimFileItem( fileid, parentDir, access, type );
+    item->setIndex( itemCount++ );
+    if ( !items.contains( item->fid() ) )
+        items.insert( item->fid(), item );
+    return item;
+}
+
+SimFileItem *SimFileImage::findItemParent( const QString& fileid ) const
 {
     QString parent = fileid.left( fileid.length() - 4 );
     if ( parent.isEmpty() )
-        return rootItem;
+        return _rootItem;
     else
         return findItem( parent.right(4) );
 }
 
-SimFileItem *SimFileSystem::findItemRelative( const QString& fileid )
-{
-    SimFileItem *item;
-    if ( fileid == "3F00" ) {
-        // We can always find the root directory no matter where we are.
-        item = rootItem;
-    } else if ( currentItem->fileid() == fileid ) {
-        // We can always find where we currently are.
-        item = currentItem;
-    } else if ( currentItem->parentDir() &&
-                currentItem->parentDir()->fileid() == fileid ) {
-        // We can always find our parent directory.
-        item = currentItem->parentDir();
-    } else {
-        // Search the current item's immediate children.
-        QList<SimFileItem *> children = currentItem->children();
-        item = 0;
-        foreach( SimFileItem *temp, children ) {
-            if ( temp->fileid() == fileid ) {
-                item = temp;
-                break;
-            }
-        }
-        if ( !item )
-            return 0;
-    }
-    currentItem = item;
-    return item;
-}
-
-QString SimFileSystem::resolveFileId( const QString& _fileid ) const
+QString SimFileImage::resolveFileId( const QString& _fileid )
 {
     QString fileid = _fileid;
 
     // Convert alphabetic names into their numeric equivalents.
-    const SimFileInfo *info = knownFiles;
-    while ( info->fileid ) {
-        if ( fileid == info->name ) {
-            fileid = info->fileid;
-            break;
-        }
-        ++info;
-    }
+    const SimFileIndex& index = fileIndex();
+    const SimFileInfo *info = index.byName.value( fileid );
+    if ( info )
+        fileid = info->fileid;
 
     // Determine if the fileid is already a full path.
     if ( fileid.startsWith( "3F" ) ||       // MF root directory.
@@ -553,70 +528,51 @@ QString SimFileSystem::resolveFileId( const QString& _fileid ) const
     QString newId = fileid;
     QString first = fileid.left(4);
     for(;;) {
-        info = knownFiles;
-        while ( info->fileid ) {
-            if ( first == info->fileid && info->parent ) {
-                first = info->parent;
-                newId = first + newId;
-                if ( first.startsWith( "3F" ) || first.startsWith( "7F" ) )
-                    return newId;
-                break;
-            }
-            ++info;
-        }
-        if ( !info->fileid ) {
+        info = index.withParent.value( first );
+        if ( !info ) {
             // We could not find a suitable parent directory, so bail out.
             return newId;
         }
+        first = info->parent;
+        newId = first + newId;
+        if ( first.startsWith( "3F" ) || first.startsWith( "7F" ) )
+            return newId;
     }
 }
 
-QString SimFileSystem::resolveISimFileId( const QString& name ) const
+QString SimFileImage::resolveISimFileId( const QString& name )
 {
-    const SimFileInfo *info = (const SimFileInfo *)isimFiles;
-    while ( info->fileid ) {
-        if ( name == info->name ) {
-            QString fileid = info->fileid;
-            return fileid;
-        }
-        ++info;
-    }
+    const SimFileInfo *info = fileIndex().isimByName.value( name );
+    if ( info )
+        return QString( info->fileid );
     return QString("");
 }
 
-int SimFileSystem::findItemAccess( const QString& _fileid ) const
+int SimFileImage::findItemAccess( const QString& fileid )
 {
-    QString fileid = _fileid;
-
-    const SimFileInfo *info = knownFiles;
-    while ( info->fileid ) {
-        if ( fileid == info->name || fileid == info->fileid )
-            return info->access;
-        ++info;
-    }
+    const SimFileInfo *info = fileIndex().byNameOrId.value( fileid );
+    if ( info )
+        return info->access;
 
     return 0;
 }
 
-enum file_type SimFileSystem::findItemFileType( const QString& _fileid ) const
+enum file_type SimFileImage::findItemFileType( const QString& fileid )
 {
-    QString fileid = _fileid;
-
-    const SimFileInfo *info = knownFiles;
-    while ( info->fileid ) {
-        if ( fileid == info->name || fileid == info->fileid )
-            return info->type;
-        ++info;
-    }
+    const SimFileInfo *info = fileIndex().byNameOrId.value( fileid );
+    if ( info )
+        return info->type;
 
     return FILE_TYPE_INVALID;
 }
 SimFileItem::SimFileItem( const QString& fileid, SimFileItem *parentDir,
         int access, enum file_type type)
-    : QObject( parentDir )
 {
     _fileid = fileid;
+    _fid = (quint16)fileid.toUInt( 0, 16 );
+    _index = 0;
     _parentDir = parentDir;
+    _size = 0;
     _recordSize = 0;
     _access = access;
     _isDirectory = false;
@@ -629,18 +585,50 @@ SimFileItem::SimFileItem( const QString& fileid, SimFileItem *parentDir,
 
 SimFileItem::~SimFileItem()
 {
+    qDeleteAll( _children );
 }
 
-SimFileItem *SimFileItem::findItem( const QString& fileid )
+QByteArray SimFileItem::contents() const
 {
-    if ( fileid == _fileid )
-        return this;
-    foreach ( SimFileItem *item, _children ) {
-        SimFileItem *temp = item->findItem( fileid );
-        if ( temp )
-            return temp;
-    }
-    return 0;
+    QByteArray result;
+    result.reserve( _size );
+    foreach ( QByteArray chunk, _chunks )
+        result += chunk;
+    return result;
+}
+
+void SimFileItem::setContents( const QByteArray& value )
+{
+    split( value );
+}
+
+void SimFileItem::setRawContents( const char *data, int size, int recordSize )
+{
+    int chunk;
+    _recordSize = recordSize;
+    chunk = chunkSize();
+    _chunks.clear();
+    _size = size;
+    for ( int posn = 0; posn < size; posn += chunk )
+        _chunks += QByteArray::fromRawData( data + posn, qMin( chunk, size - posn ) );
+}
+
+void SimFileItem::setRecordSize( int value )
+{
+    QByteArray data = contents();
+    _recordSize = value;
+    split( data );
+}
+
+void SimFileItem::split( const QByteArray& value )
+{
+    // Keep the contents in independent pieces, so that updating one
+    // of them leaves the others shared.
+    int size = chunkSize();
+    _chunks.clear();
+    _size = value.size();
+    for ( int posn = 0; posn < value.size(); posn += size )
+        _chunks += value.mid( posn, size );
 }
 
 bool SimFileItem::checkAccess( enum file_op op, bool havepin ) const
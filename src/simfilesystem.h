@@ -23,6 +23,8 @@
 #include "phonesim.h"
 
 class SimFileItem;
+class SimFileJournal;
+class SimApduEngine;
 
 enum file_system_type {
     FILE_SYSTEM_TYPE_DEFAULT,
@@ -53,11 +55,57 @@ enum file_op {
     FILE_OP_INVALIDATE = 0,
 };
 
+// Size of the pages that transparent files are divided into, so that an
+// update copies only the pages that it touches.
+#define SIMFILE_PAGE_SIZE   64
+
+// A SIM filesystem compiled from a <filesystem> element of the rule file.
+// Images are built once, when the rules are loaded, and are shared
+// read-only by every connection.  Each SimFileSystem keeps its own copies
+// of just the pages and records that its SIM has updated.
+class SimFileImage
+{
+    friend class SimFileProfile;
+public:
+    SimFileImage( SimXmlNode& e, enum file_system_type type = FILE_SYSTEM_TYPE_DEFAULT );
+    ~SimFileImage();
+
+    SimFileItem *rootItem() const { return _rootItem; }
+
+    // Find an item with a specific id.
+    SimFileItem *findItem( const QString& fileid ) const;
+    SimFileItem *findItem( quint16 fid ) const { return items.value( fid ); }
+
+    // Find the parent of an item with a specific id even if the
+    // item itself does not exist.  The parameter should be fully qualified.
+    SimFileItem *findItemParent( const QString& fileid ) const;
+
+    // Resolve a file identifier to its full path from the root directory.
+    static QString resolveFileId( const QString& fileid );
+    static QString resolveISimFileId( const QString& fileid );
+
+    // Find access conditions and file type for an item with a specific id.
+    static int findItemAccess( const QString& fileid );
+    static enum file_type findItemFileType( const QString& fileid );
+
+private:
+    SimFileItem *_rootItem;
+    int itemCount;
+    QHash<quint16, SimFileItem *> items;
+
+    SimFileImage();
+    SimFileItem *addItem( const QString& fileid, SimFileItem *parentDir,
+                          int access = 0, enum file_type type = FILE_TYPE_INVALID );
+};
+
 class SimFileSystem : public QObject
 {
     Q_OBJECT
+    friend class SimFileJournal;
 public:
     SimFileSystem( SimRules *rules, SimXmlNode& e, enum file_system_type type = FILE_SYSTEM_TYPE_DEFAULT );
+    SimFileSystem( SimRules *rules, const SimFileImage *image,
+                   enum file_system_type type = FILE_SYSTEM_TYPE_DEFAULT );
     ~SimFileSystem();
 
     // Execute an AT+CRSM command against the filesystem.
@@ -66,48 +114,71 @@ public:
     bool fileAccess( const QString& args, QString& resp );
 
     // Find an item with a specific id.
-    SimFileItem *findItem( const QString& fileid ) const;
-
-    // Find access conditions for an item with a specific id.
-    int findItemAccess( const QString& _fileid ) const;
-
-    // Find file type for an item with a specific id.
-    enum file_type findItemFileType( const QString& _fileid ) const;
+    SimFileItem *findItem( const QString& fileid ) const { return image->findItem( fileid ); }
+    SimFileItem *findItem( quint16 fid ) const { return image->findItem( fid ); }
 
     // Find the parent of an item with a specific id even if the
     // item itself does not exist.  The parameter should be fully qualified.
-    SimFileItem *findItemParent( const QString& fileid ) const;
+    SimFileItem *findItemParent( const QString& fileid ) const
+        { return image->findItemParent( fileid ); }
 
-    // Find an item relative to the current item and update current item.
-    SimFileItem *findItemRelative( const QString& fileid );
+    // Read part of an item as this SIM sees it, including its updates.
+    QByteArray read( const SimFileItem *item, int offset, int length ) const;
+    QByteArray contents( const SimFileItem *item ) const;
 
-    // Resolve a file identifier to its full path from the root directory.
-    QString resolveFileId( const QString& fileid ) const;
+    // Overwrite part of an item, copying only the pages or records it touches.
+    // Data beyond the end of the item, or past the last whole record, is
+    // dropped.  Returns false if any of the data could not be written.
+    bool update( const SimFileItem *item, int offset, const QByteArray& data );
+
+    // Keep updates in a journal, and apply those already in it.
+    bool setJournal( const QString& fileName );
 
-    QString resolveISimFileId( const QString& _fileid ) const;
+    // Get the engine that executes command APDUs against this filesystem.
+    SimApduEngine *engine() const { return apduEngine; }
 
 private:
     SimRules *rules;
-    SimFileItem *rootItem;
-    SimFileItem *currentItem;
+    const SimFileImage *image;
+    SimFileImage *privateImage;
+    SimApduEngine *apduEngine;
+    QHash<quint32, QByteArray> updates;
+    SimFileJournal *journal;
+
+    static quint32 chunkKey( const SimFileItem *item, int n );
+    QByteArray chunk( const SimFileItem *item, int n ) const;
 };
 
-class SimFileItem : public QObject
+class SimFileItem
 {
-    Q_OBJECT
 public:
     SimFileItem( const QString& fileid, SimFileItem *parentDir,
                  int access = 0, enum file_type type = FILE_TYPE_INVALID);
     ~SimFileItem();
 
     QString fileid() const { return _fileid; }
+    quint16 fid() const { return _fid; }
     SimFileItem *parentDir() const { return _parentDir; }
 
-    QByteArray contents() const { return _contents; }
-    void setContents( const QByteArray& value ) { _contents = value; }
+    // Position of the item within its image.
+    int index() const { return _index; }
+    void setIndex( int value ) { _index = value; }
+
+    // Contents as loaded from the rule file, held as records for record
+    // files and as pages for transparent files.
+    QByteArray contents() const;
+    void setContents( const QByteArray& value );
+
+    // Refer to contents that are held elsewhere, such as in a mapped
+    // profile, without copying them.  "data" must outlive the item.
+    void setRawContents( const char *data, int size, int recordSize );
+    int size() const { return _size; }
+    int chunkSize() const { return _recordSize > 0 ? _recordSize : SIMFILE_PAGE_SIZE; }
+    int chunkCount() const { return _chunks.size(); }
+    QByteArray chunk( int n ) const { return _chunks.at( n ); }
 
     int recordSize() const { return _recordSize; }
-    void setRecordSize( int value ) { _recordSize = value; }
+    void setRecordSize( int value );
 
     int access() const { return _access; }
     enum file_type type() const { return _type; }
@@ -117,19 +188,22 @@ public:
 
     QList<SimFileItem *> children() const { return _children; }
 
-    SimFileItem *findItem( const QString& fileid );
-
     bool checkAccess( enum file_op op, bool havepin ) const;
 
 private:
     QString _fileid;
+    quint16 _fid;
+    int _index;
     SimFileItem *_parentDir;
-    QByteArray _contents;
+    QList<QByteArray> _chunks;
+    int _size;
     int _recordSize;
     bool _isDirectory;
     QList<SimFileItem *> _children;
     int _access;
     enum file_type _type;
+
+    void split( const QByteArray& value );
 };
 
 #endif
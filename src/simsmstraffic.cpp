@@ -0,0 +1,328 @@
+/****************************************************************************
+**
+** This file is part of the Qt Extended Opensource Package.
+**
+** This file may be used under the terms of the GNU General Public License
+** version 2.0 as published by the Free Software Foundation and appearing
+** in the file LICENSE.GPL included in the packaging of this file.
+**
+** Please review the following information to ensure GNU General Public
+** Licensing requirements will be met:
+**     http://www.fsf.org/licensing/licenses/info/GPLv2.html.
+**
+**
+****************************************************************************/
+
+#include "simsmstraffic.h"
+#include "simtimerwheel.h"
+#include "phonesim.h"
+#include <qstringlist.h>
+#include <qhash.h>
+#include <qdebug.h>
+#include <math.h>
+#include <stdlib.h>
+
+// Ports used for 8-bit traffic, which is sent as WAP push datagrams.
+#define TRAFFIC_SOURCE_PORT     9200
+#define TRAFFIC_DEST_PORT       2948
+
+class SimSmsTrafficTimer : public SimTimerEntry
+{
+public:
+    SimSmsTrafficTimer( SimSmsTraffic *traffic ) { this->traffic = traffic; }
+
+    void fire() { traffic->arrivals(); }
+
+private:
+    SimSmsTraffic *traffic;
+};
+
+SimSmsTrafficConfig::SimSmsTrafficConfig()
+{
+    rate = 1.0;
+    poisson = false;
+    count = 0;
+    minSize = 20;
+    maxSize = 160;
+    classes += -1;
+    codings += Gsm;
+    reportPercent = 0;
+    direct = true;
+    window = 0;
+    statsInterval = 5;
+    sender = "+15550000001";
+    serviceCenter = "+15550000000";
+}
+
+static bool parseList( const QString& value, const QStringList& names,
+                       int first, QList<int>& list )
+{
+    list.clear();
+    foreach ( QString name, value.split( QChar(':') ) ) {
+        int index = names.indexOf( name );
+        if ( index < 0 )
+            return false;
+        list += first + index;
+    }
+    return !list.isEmpty();
+}
+
+bool SimSmsTrafficConfig::parse( const QString& spec )
+{
+    bool ok = true;
+
+    foreach ( QString item, spec.split( QChar(','), QString::SkipEmptyParts ) ) {
+        int equals = item.indexOf( QChar('=') );
+        if ( equals < 0 )
+            return false;
+        QString key = item.left( equals );
+        QString value = item.mid( equals + 1 );
+
+        if ( key == "rate" ) {
+            rate = value.toDouble( &ok );
+            ok = ok && rate > 0.0;
+        } else if ( key == "arrival" ) {
+            ok = ( value == "poisson" || value == "constant" );
+            poisson = ( value == "poisson" );
+        } else if ( key == "count" ) {
+            count = value.toInt( &ok );
+            ok = ok && count >= 0;
+        } else if ( key == "size" ) {
+            int dash = value.indexOf( QChar('-') );
+            if ( dash < 0 ) {
+                minSize = maxSize = value.toInt( &ok );
+            } else {
+                bool ok2;
+                minSize = value.left( dash ).toInt( &ok );
+                maxSize = value.mid( dash + 1 ).toInt( &ok2 );
+                ok = ok && ok2;
+            }
+            ok = ok && minSize >= 1 && maxSize >= minSize;
+        } else if ( key == "class" ) {
+            QStringList names;
+            names << "none" << "0" << "1" << "2" << "3";
+            ok = parseList( value, names, -1, classes );
+        } else if ( key == "coding" ) {
+            QStringList names;
+            names << "gsm" << "ucs2" << "8bit";
+            ok = parseList( value, names, Gsm, codings );
+        } else if ( key == "reports" ) {
+            reportPercent = value.toInt( &ok );
+            ok = ok && reportPercent >= 0 && reportPercent <= 100;
+        } else if ( key == "mode" ) {
+            ok = ( value == "cmt" || value == "cmti" );
+            direct = ( value == "cmt" );
+        } else if ( key == "window" ) {
+            window = value.toInt( &ok );
+            ok = ok && window >= 0;
+        } else if ( key == "stats" ) {
+            statsInterval = value.toInt( &ok );
+            ok = ok && statsInterval >= 1;
+        } else if ( key == "sender" ) {
+            sender = value;
+        } else if ( key == "smsc" ) {
+            serviceCenter = value;
+        } else {
+            ok = false;
+        }
+        if ( !ok ) {
+            qWarning() << "Invalid SMS traffic setting" << item;
+            return false;
+        }
+    }
+    return true;
+}
+
+SimSmsTraffic::SimSmsTraffic( const SimSmsTrafficConfig& config,
+                              const QString& name, QObject *parent )
+    : QObject( parent )
+{
+    this->config = config;
+    this->name = name;
+
+    // Build the longest possible text once, and take prefixes of it.
+    static char const words[] = "The quick brown fox jumps over the lazy dog 0123456789 ";
+    gsmText.reserve( config.maxSize );
+    ucs2Text.reserve( config.maxSize );
+    octets.resize( config.maxSize );
+    for ( int i = 0; i < config.maxSize; i++ ) {
+        gsmText += QChar( words[i % ( sizeof(words) - 1 )] );
+        ucs2Text += QChar( 0x0430 + i % 32 );   // Cyrillic, not in GSM
+        octets[i] = (char)i;
+    }
+
+    elapsed = 0;
+    clock.start();
+    nextArrival = 0.0;
+    nextStats = (quint64)config.statsInterval * 1000;
+    reference = 0;
+
+    // Each generator has its own random state, seeded from the time and
+    // its phone number, so that modems do not all send in lockstep.
+    randomState = (uint)QDateTime::currentDateTime().toTime_t() ^
+                  (uint)QTime::currentTime().msec() ^ qHash( name );
+    generated = 0;
+    backlog = 0;
+    delivered = 0;
+    reports = 0;
+    waiting = 0;
+    acknowledged = 0;
+    rejected = 0;
+
+    SimTimerWheel::instance()->start( new SimSmsTrafficTimer( this ), this, 0 );
+}
+
+SimSmsTraffic::~SimSmsTraffic()
+{
+}
+
+bool SimSmsTraffic::command( const QString& cmd )
+{
+    if ( !cmd.startsWith( "AT+CNMA" ) || cmd == "AT+CNMA=?" )
+        return false;
+
+    // Every +CMT and +CDS sent in direct mode needs an acknowledgement.
+    // Leave any others to the rules, as they are not for this generator.
+    if ( !waiting )
+        return false;
+    --waiting;
+    if ( cmd.startsWith( "AT+CNMA=2" ) )
+        ++rejected;
+    else
+        ++acknowledged;
+    emit send( "OK" );
+
+    deliverBacklog();
+    return true;
+}
+
+quint64 SimSmsTraffic::now()
+{
+    int delta = clock.restart();
+    if ( delta > 0 )
+        elapsed += delta;
+    return elapsed;
+}
+
+int SimSmsTraffic::nextRandom()
+{
+    return rand_r( &randomState );
+}
+
+double SimSmsTraffic::gap()
+{
+    double mean = 1000.0 / config.rate;
+    if ( !config.poisson )
+        return mean;
+
+    // Exponentially distributed gaps give a Poisson arrival process.
+    double u = nextRandom() / ( RAND_MAX + 1.0 );
+    return -log( 1.0 - u ) * mean;
+}
+
+void SimSmsTraffic::arrivals()
+{
+    quint64 msecs = now();
+    bool limited = ( config.count != 0 );
+
+    // Several messages may arrive per tick of the timer wheel at high rates.
+    while ( nextArrival <= (double)msecs && ( !limited || generated < config.count ) ) {
+        ++generated;
+        ++backlog;
+        nextArrival += gap();
+    }
+    deliverBacklog();
+
+    if ( msecs >= nextStats ) {
+        reportStats();
+        nextStats = msecs + (quint64)config.statsInterval * 1000;
+    }
+
+    // Wake up for the next arrival or the next report, whichever is first.
+    if ( limited && generated >= config.count && !backlog && !waiting ) {
+        reportStats();
+        return;
+    }
+    quint64 wakeup = nextStats;
+    if ( ( !limited || generated < config.count ) && nextArrival < (double)wakeup )
+        wakeup = (quint64)ceil( nextArrival );
+    SimTimerWheel::instance()->start( new SimSmsTrafficTimer( this ), this,
+                                      (int)( wakeup > msecs ? wakeup - msecs : 0 ) );
+}
+
+void SimSmsTraffic::deliverBacklog()
+{
+    // Messages wait at the "network" while the window is full.
+    while ( backlog > 0 && ( !config.window || waiting < config.window ) ) {
+        --backlog;
+        deliver();
+    }
+}
+
+void SimSmsTraffic::deliver()
+{
+    QSMSMessage m = createMessage();
+
+    if ( !config.direct ) {
+        emit store( m );
+    } else {
+        QList<QSMSMessage> list;
+        if ( m.shouldSplit() )
+            list = m.split();
+        else
+            list += m;
+        foreach ( QSMSMessage part, list ) {
+            QByteArray pdu = part.toPdu();
+            int len = pdu.length() - QSMSMessage::pduAddressLength( pdu );
+            emit unsolicited( "+CMT: ," + QString::number( len ) + "\n" + PS_toHex( pdu ) );
+            ++delivered;
+            ++waiting;
+        }
+    }
+
+    if ( config.reportPercent && ( nextRandom() % 100 ) < config.reportPercent ) {
+        QDateTime time = QDateTime::currentDateTime();
+        QByteArray pdu = QSMSMessage::statusReportPdu
+            ( config.serviceCenter, reference, config.sender, time, time, 0 );
+        reference = ( reference + 1 ) & 0xFF;
+        int len = pdu.length() - QSMSMessage::pduAddressLength( pdu );
+        emit unsolicited( "+CDS: " + QString::number( len ) + "\n" + PS_toHex( pdu ) );
+        ++reports;
+        if ( config.direct )
+            ++waiting;
+    }
+}
+
+QSMSMessage SimSmsTraffic::createMessage()
+{
+    int size = config.minSize;
+    if ( config.maxSize > config.minSize )
+        size += nextRandom() % ( config.maxSize - config.minSize + 1 );
+    int coding = config.codings[nextRandom() % config.codings.size()];
+
+    QSMSMessage m;
+    m.setSender( config.sender );
+    m.setServiceCenter( config.serviceCenter );
+    m.setTimestamp( QDateTime::currentDateTime() );
+    if ( coding == SimSmsTrafficConfig::EightBit ) {
+        m.setSourcePort( TRAFFIC_SOURCE_PORT );
+        m.setDestinationPort( TRAFFIC_DEST_PORT );
+        m.setApplicationData( octets.left( size ) );
+    } else {
+        m.setMessageClass( config.classes[nextRandom() % config.classes.size()] );
+        if ( coding == SimSmsTrafficConfig::Ucs2 )
+            m.setText( ucs2Text.left( size ) );
+        else
+            m.setText( gsmText.left( size ) );
+    }
+    return m;
+}
+
+void SimSmsTraffic::reportStats()
+{
+    QString summary = QString( "generated=%1,backlog=%2,delivered=%3,reports=%4,"
+                               "acknowledged=%5,rejected=%6,waiting=%7" )
+        .arg( generated ).arg( backlog ).arg( delivered ).arg( reports )
+        .arg( acknowledged ).arg( rejected ).arg( waiting );
+    emit variable( "SMSTRAFFIC", summary );
+}
@@ -0,0 +1,110 @@
+/****************************************************************************
+**
+** This file is part of the Qt Extended Opensource Package.
+**
+** This file may be used under the terms of the GNU General Public License
+** version 2.0 as published by the Free Software Foundation and appearing
+** in the file LICENSE.GPL included in the packaging of this file.
+**
+** Please review the following information to ensure GNU General Public
+** Licensing requirements will be met:
+**     http://www.fsf.org/licensing/licenses/info/GPLv2.html.
+**
+**
+****************************************************************************/
+
+#ifndef SIMSMSTRAFFIC_H
+#define SIMSMSTRAFFIC_H
+
+#include <qobject.h>
+#include <qstring.h>
+#include <qlist.h>
+#include <qdatetime.h>
+#include <qsmsmessage.h>
+
+// Settings for an SMS traffic generator, parsed from a specification
+// such as "rate=50,arrival=poisson,size=20-400,coding=gsm:ucs2".
+struct SimSmsTrafficConfig
+{
+    enum Coding { Gsm, Ucs2, EightBit };
+
+    SimSmsTrafficConfig();
+
+    // Returns false if the specification is not valid.
+    bool parse( const QString& spec );
+
+    double rate;            // messages per second
+    bool poisson;           // exponential rather than constant gaps
+    int count;              // messages to send, or 0 for no limit
+    int minSize;            // characters, or octets for 8-bit data
+    int maxSize;
+    QList<int> classes;     // picked at random, -1 for no class
+    QList<int> codings;     // picked at random
+    int reportPercent;      // messages followed by a status report
+    bool direct;            // +CMT rather than storing and sending +CMTI
+    int window;             // unacknowledged +CMT/+CDS allowed, 0 for no limit
+    int statsInterval;      // seconds between updates of SMSTRAFFIC
+    QString sender;
+    QString serviceCenter;
+};
+
+// Injects mobile-terminated SMS traffic into a single connection, and
+// counts how much of it the client acknowledges with AT+CNMA.
+class SimSmsTraffic : public QObject
+{
+    Q_OBJECT
+    friend class SimSmsTrafficTimer;
+public:
+    SimSmsTraffic( const SimSmsTrafficConfig& config, const QString& name,
+                   QObject *parent = 0 );
+    ~SimSmsTraffic();
+
+    // Process an AT command.  Returns false if not an acknowledgement.
+    bool command( const QString& cmd );
+
+signals:
+    // Send a response to a command.
+    void send( const QString& line );
+
+    // Send an unsolicited +CMT or +CDS notification.
+    void unsolicited( const QString& line );
+
+    // Place a message in the SMS store and announce it with +CMTI.
+    void store( const QSMSMessage& m );
+
+    // Publish the counters, every few seconds, as a rule variable.
+    void variable( const QString& name, const QString& value );
+
+private:
+    SimSmsTrafficConfig config;
+    QString name;
+    QString gsmText;
+    QString ucs2Text;
+    QByteArray octets;
+    QTime clock;
+    quint64 elapsed;
+    double nextArrival;
+    quint64 nextStats;
+    int reference;
+    unsigned int randomState;
+
+    // Counters, in messages (generated, backlog) or PDUs (the others).
+    int generated;
+    int backlog;
+    int delivered;
+    int reports;
+    int waiting;
+    int acknowledged;
+    int rejected;
+
+    quint64 now();      // in milliseconds
+    int nextRandom();   // 0 to RAND_MAX
+    double gap();
+    void arrivals();
+    void deliverBacklog();
+    void deliver();
+    QSMSMessage createMessage();
+    void reportStats();
+};
+
+#endif
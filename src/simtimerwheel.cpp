@@ -0,0 +1,227 @@
+/****************************************************************************
+**
+** This file is part of the Qt Extended Opensource Package.
+**
+** This file may be used under the terms of the GNU General Public License
+** version 2.0 as published by the Free Software Foundation and appearing
+** in the file LICENSE.GPL included in the packaging of this file.
+**
+** Please review the following information to ensure GNU General Public
+** Licensing requirements will be met:
+**     http://www.fsf.org/licensing/licenses/info/GPLv2.html.
+**
+**
+****************************************************************************/
+
+#include "simtimerwheel.h"
+#include <qthreadstorage.h>
+#include <qmetaobject.h>
+#include <qdebug.h>
+
+static QThreadStorage<SimTimerWheel *> wheels;
+
+SimSlotTimerEntry::SimSlotTimerEntry( QObject *receiver, const char *member )
+{
+    this->receiver = receiver;
+
+    // Skip the code that the SLOT() macro puts in front of the name.
+    QByteArray sig = QMetaObject::normalizedSignature( member + 1 );
+    method = receiver->metaObject()->indexOfMethod( sig.constData() );
+    if ( method < 0 )
+        qWarning() << "SimSlotTimerEntry: no such slot" << sig;
+}
+
+void SimSlotTimerEntry::fire()
+{
+    if ( method >= 0 )
+        receiver->metaObject()->method( method ).invoke( receiver, Qt::DirectConnection );
+}
+
+SimTimerWheel::SimTimerWheel()
+{
+    currentTick = 0;
+    wakeTick = 0;
+    clock.start();
+    timer.setSingleShot( true );
+    connect( &timer, SIGNAL(timeout()), this, SLOT(tick()) );
+}
+
+SimTimerWheel::~SimTimerWheel()
+{
+    qDeleteAll( owners );
+}
+
+SimTimerWheel *SimTimerWheel::instance()
+{
+    if ( !wheels.hasLocalData() )
+        wheels.setLocalData( new SimTimerWheel() );
+    return wheels.localData();
+}
+
+void SimTimerWheel::start( SimTimerEntry *entry, QObject *owner, int msecs )
+{
+    // Synchronize with the clock if the wheel has been idle.
+    quint64 msecsNow = now();
+    bool idle = owners.isEmpty();
+    if ( idle )
+        currentTick = msecsNow / SIMTIMER_TICK;
+
+    // Watch for the owner going away, so that its timers are not left
+    // firing into a deleted object.
+    if ( !watched.contains( owner ) ) {
+        connect( owner, SIGNAL(destroyed(QObject*)),
+                 this, SLOT(ownerDestroyed(QObject*)) );
+        watched.insert( owner );
+    }
+
+    if ( msecs < 0 )
+        msecs = 0;
+    entry->owner = owner;
+    entry->expires = ( msecsNow + msecs + SIMTIMER_TICK - 1 ) / SIMTIMER_TICK;
+    owners.insert( owner, entry );
+    place( entry );
+
+    // Wake up sooner if this entry expires before the current wakeup.
+    if ( idle || !timer.isActive() || entry->expires < wakeTick )
+        schedule();
+}
+
+void SimTimerWheel::cancel( SimTimerEntry *entry )
+{
+    remove( entry );
+    delete entry;
+    if ( owners.isEmpty() )
+        timer.stop();
+}
+
+void SimTimerWheel::cancel( QObject *owner )
+{
+    QList<SimTimerEntry *> list = owners.values( owner );
+    owners.remove( owner );
+    foreach ( SimTimerEntry *entry, list ) {
+        entry->unlink();
+        delete entry;
+    }
+    if ( owners.isEmpty() )
+        timer.stop();
+}
+
+void SimTimerWheel::singleShot( int msecs, QObject *receiver, const char *member )
+{
+    instance()->start( new SimSlotTimerEntry( receiver, member ), receiver, msecs );
+}
+
+void SimTimerWheel::tick()
+{
+    quint64 target = now() / SIMTIMER_TICK;
+
+    while ( currentTick <= target && !owners.isEmpty() ) {
+        int index = (int)( currentTick & ( SIMTIMER_ROOT_SIZE - 1 ) );
+
+        // Move entries down from the coarser levels when the finer
+        // level wraps around.
+        for ( int level = 0; index == 0 && level < SIMTIMER_LEVELS; ++level ) {
+            cascade( level );
+            index = (int)( ( currentTick >> ( SIMTIMER_ROOT_BITS + level * SIMTIMER_LEVEL_BITS ) )
+                           & ( SIMTIMER_LEVEL_SIZE - 1 ) );
+        }
+        index = (int)( currentTick & ( SIMTIMER_ROOT_SIZE - 1 ) );
+
+        // Take the expired entries before firing them, so that entries
+        // started from within fire() land in a later slot.
+        SimTimerLink expired;
+        if ( !root[index].isEmpty() ) {
+            expired.next = root[index].next;
+            expired.prev = root[index].prev;
+            expired.next->prev = &expired;
+            expired.prev->next = &expired;
+            root[index].prev = root[index].next = &root[index];
+        }
+        ++currentTick;
+
+        while ( !expired.isEmpty() ) {
+            SimTimerEntry *entry = static_cast<SimTimerEntry *>( expired.next );
+            remove( entry );
+            entry->fire();
+            delete entry;
+        }
+    }
+
+    schedule();
+}
+
+void SimTimerWheel::ownerDestroyed( QObject *owner )
+{
+    cancel( owner );
+    watched.remove( owner );
+}
+
+void SimTimerWheel::schedule()
+{
+    if ( owners.isEmpty() ) {
+        timer.stop();
+        return;
+    }
+
+    // Sleep until the next slot with entries in it, or until the root
+    // wraps around and the next level has to be cascaded into it.  The
+    // root only holds entries that are due before it wraps, so each of
+    // its slots holds the entries for a single tick.
+    quint64 wrap = ( currentTick | ( SIMTIMER_ROOT_SIZE - 1 ) ) + 1;
+    wakeTick = wrap;
+    for ( quint64 tick = currentTick; tick < wrap; ++tick ) {
+        if ( !root[tick & ( SIMTIMER_ROOT_SIZE - 1 )].isEmpty() ) {
+            wakeTick = tick;
+            break;
+        }
+    }
+    quint64 wakeup = wakeTick * SIMTIMER_TICK;
+    quint64 msecsNow = now();
+    timer.start( wakeup > msecsNow ? (int)( wakeup - msecsNow ) : 0 );
+}
+
+void SimTimerWheel::place( SimTimerEntry *entry )
+{
+    if ( entry->expires < currentTick )
+        entry->expires = currentTick;
+    quint64 delta = entry->expires - currentTick;
+
+    if ( delta < SIMTIMER_ROOT_SIZE ) {
+        root[entry->expires & ( SIMTIMER_ROOT_SIZE - 1 )].append( entry );
+        return;
+    }
+
+    int shift = SIMTIMER_ROOT_BITS;
+    for ( int level = 0; level < SIMTIMER_LEVELS; ++level ) {
+        shift += SIMTIMER_LEVEL_BITS;
+        if ( delta < ( Q_UINT64_C(1) << shift ) || level == SIMTIMER_LEVELS - 1 ) {
+            if ( delta >= ( Q_UINT64_C(1) << shift ) ) {
+                // Clamp absurdly long timeouts to the range of the wheel.
+                entry->expires = currentTick + ( Q_UINT64_C(1) << shift ) - 1;
+            }
+            int index = (int)( ( entry->expires >> ( shift - SIMTIMER_LEVEL_BITS ) )
+                               & ( SIMTIMER_LEVEL_SIZE - 1 ) );
+            levels[level][index].append( entry );
+            return;
+        }
+    }
+}
+
+void SimTimerWheel::cascade( int level )
+{
+    int shift = SIMTIMER_ROOT_BITS + level * SIMTIMER_LEVEL_BITS;
+    int index = (int)( ( currentTick >> shift ) & ( SIMTIMER_LEVEL_SIZE - 1 ) );
+    SimTimerLink& slot = levels[level][index];
+
+    while ( !slot.isEmpty() ) {
+        SimTimerEntry *entry = static_cast<SimTimerEntry *>( slot.next );
+        entry->unlink();
+        place( entry );
+    }
+}
+
+void SimTimerWheel::remove( SimTimerEntry *entry )
+{
+    entry->unlink();
+    owners.remove( entry->owner, entry );
+}
@@ -0,0 +1,134 @@
+/****************************************************************************
+**
+** This file is part of the Qt Extended Opensource Package.
+**
+** This file may be used under the terms of the GNU General Public License
+** version 2.0 as published by the Free Software Foundation and appearing
+** in the file LICENSE.GPL included in the packaging of this file.
+**
+** Please review the following information to ensure GNU General Public
+** Licensing requirements will be met:
+**     http://www.fsf.org/licensing/licenses/info/GPLv2.html.
+**
+**
+****************************************************************************/
+
+#ifndef SIMTIMERWHEEL_H
+#define SIMTIMERWHEEL_H
+
+#include <qobject.h>
+#include <qtimer.h>
+#include <qelapsedtimer.h>
+#include <qhash.h>
+#include <qset.h>
+
+// Resolution of the timer wheel, in milliseconds.
+#define SIMTIMER_TICK           10
+
+#define SIMTIMER_ROOT_BITS      8
+#define SIMTIMER_LEVEL_BITS     6
+#define SIMTIMER_LEVELS         3
+#define SIMTIMER_ROOT_SIZE      (1 << SIMTIMER_ROOT_BITS)
+#define SIMTIMER_LEVEL_SIZE     (1 << SIMTIMER_LEVEL_BITS)
+
+class SimTimerLink
+{
+public:
+    SimTimerLink() { prev = next = this; }
+
+    bool isEmpty() const { return next == this; }
+    void unlink()
+    {
+        prev->next = next;
+        next->prev = prev;
+        prev = next = this;
+    }
+    void append( SimTimerLink *link )
+    {
+        link->prev = prev;
+        link->next = this;
+        prev->next = link;
+        prev = link;
+    }
+
+    SimTimerLink *prev;
+    SimTimerLink *next;
+};
+
+// A pending timeout.  Entries are owned by the wheel once started,
+// and are deleted after they fire or are cancelled.
+class SimTimerEntry : public SimTimerLink
+{
+public:
+    SimTimerEntry() { owner = 0; expires = 0; }
+    virtual ~SimTimerEntry() {}
+
+    virtual void fire() = 0;
+
+private:
+    friend class SimTimerWheel;
+    QObject *owner;
+    quint64 expires;
+};
+
+// Invoke a slot on a receiver, in place of QTimer::singleShot().
+class SimSlotTimerEntry : public SimTimerEntry
+{
+public:
+    SimSlotTimerEntry( QObject *receiver, const char *member );
+
+    void fire();
+
+private:
+    QObject *receiver;
+    int method;
+};
+
+// Hierarchical timer wheel that holds the delayed events of all
+// connections in a thread, driven by a single QTimer.  The timer only
+// runs while there are entries, and sleeps over empty slots.
+class SimTimerWheel : public QObject
+{
+    Q_OBJECT
+public:
+    SimTimerWheel();
+    ~SimTimerWheel();
+
+    // Get the timer wheel for the current thread.
+    static SimTimerWheel *instance();
+
+    // Fire "entry" after "msecs".  The entry is cancelled automatically
+    // if "owner" is destroyed first.
+    void start( SimTimerEntry *entry, QObject *owner, int msecs );
+
+    // Cancel and delete a single entry, or all of the entries for an owner.
+    void cancel( SimTimerEntry *entry );
+    void cancel( QObject *owner );
+
+    int count() const { return owners.size(); }
+
+    // Equivalent of QTimer::singleShot() using the current thread's wheel.
+    static void singleShot( int msecs, QObject *receiver, const char *member );
+
+private slots:
+    void tick();
+    void ownerDestroyed( QObject *owner );
+
+private:
+    SimTimerLink root[SIMTIMER_ROOT_SIZE];
+    SimTimerLink levels[SIMTIMER_LEVELS][SIMTIMER_LEVEL_SIZE];
+    QMultiHash<QObject *, SimTimerEntry *> owners;
+    QSet<QObject *> watched;
+    quint64 currentTick;
+    quint64 wakeTick;
+    QElapsedTimer clock;
+    QTimer timer;
+
+    quint64 now() const { return (quint64)clock.elapsed(); }
+    void schedule();
+    void place( SimTimerEntry *entry );
+    void cascade( int level );
+    void remove( SimTimerEntry *entry );
+};
+
+#endif
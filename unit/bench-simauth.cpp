@@ -0,0 +1,273 @@
+/****************************************************************************
+**
+** This file is part of the Qt Extended Opensource Package.
+**
+** This file may be used under the terms of the GNU General Public License
+** version 2.0 as published by the Free Software Foundation and appearing
+** in the file LICENSE.GPL included in the packaging of this file.
+**
+** Please review the following information to ensure GNU General Public
+** Licensing requirements will be met:
+**     http://www.fsf.org/licensing/licenses/info/GPLv2.html.
+**
+**
+****************************************************************************/
+
+// Checks SimAuth against 3GPP TS 35.208 test set 1, and measures how many
+// COMP128 and Milenage vectors per second the batch entry points compute.
+// SimAuth is given a parent that receives its SQN variables, as it would
+// in phonesim, so that publishing them is part of the measurement.
+
+#include "simauth.h"
+#include "aes.h"
+#include "variablesink.h"
+#include <qdatetime.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define GSM_VECTORS     200000
+#define UMTS_VECTORS    200000
+#define BATCH_SIZE      1024
+
+// Vectors for the quick pass that "make check" runs, which still ends
+// with a partial batch.
+#define QUICK_VECTORS   ( 4 * BATCH_SIZE + 1 )
+
+// TS 35.208, 4.3.1, test set 1.
+static const char testKi[] = "465b5ce8b199b49faa5f0a2ee238a6bc";
+static const char testRand[] = "23553cbe9637a89d218ae64dae47bf35";
+static const char testSqn[] = "ff9bb4d0b607";
+static const char testAmf[] = "b9b9";
+static const char testOpc[] = "cd63cb71954a9f4e48a5994e37a02baf";
+static const char testMac[] = "4a9ffac354dfafb3";
+static const char testAk[] = "aa689c648370";
+static const char testRes[] = "a54211d5e3ba50bf";
+static const char testCk[] = "b40ba9a3c58b2a05bbf0d987b21bf8cb";
+static const char testIk[] = "f769bcd751044604127672711c6d3441";
+
+static int failures = 0;
+
+static QByteArray bin( const char *hex )
+{
+    return QByteArray::fromHex( QByteArray( hex ) );
+}
+
+static void check( const char *what, const uint8_t *value, const char *expected )
+{
+    QByteArray want = bin( expected );
+    if ( memcmp( value, want.constData(), want.size() ) != 0 ) {
+        printf( "FAIL: %s is %s, expected %s\n", what,
+                QByteArray( (const char *)value, want.size() ).toHex().constData(),
+                expected );
+        ++failures;
+    }
+}
+
+// The network side of Milenage, TS 35.206, which builds the challenges
+// that the SIM is given.  It is written separately from SimAuth, so that
+// the two check each other.
+class MilenageNetwork
+{
+public:
+    MilenageNetwork( const QByteArray& ki, const QByteArray& opc )
+    {
+        aes_set_key( &key, (const uint8_t *)ki.constData(), 16 );
+        memcpy( this->opc, opc.constData(), 16 );
+    }
+
+    void challenge( const uint8_t *rand, const uint8_t *sqn, const uint8_t *amf,
+                    UmtsChallenge& c, uint8_t *mac = 0, uint8_t *ak = 0 ) const
+    {
+        uint8_t temp[16], in[16], out[16], macA[8], anonymity[6];
+        int i;
+
+        // TEMP = E[RAND ^ OPc]
+        for ( i = 0; i < 16; i++ )
+            in[i] = rand[i] ^ opc[i];
+        aes_encrypt_block( &key, in, temp );
+
+        // OUT1 = E[TEMP ^ rot(IN1 ^ OPc, r1)] ^ OPc, with r1 = 64 bits
+        uint8_t in1[16];
+        memcpy( in1, sqn, 6 );
+        memcpy( in1 + 6, amf, 2 );
+        memcpy( in1 + 8, sqn, 6 );
+        memcpy( in1 + 14, amf, 2 );
+        for ( i = 0; i < 16; i++ )
+            in[i] = temp[i] ^ in1[( i + 8 ) % 16] ^ opc[( i + 8 ) % 16];
+        aes_encrypt_block( &key, in, out );
+        for ( i = 0; i < 8; i++ )
+            macA[i] = out[i] ^ opc[i];
+
+        // OUT2 = E[rot(TEMP ^ OPc, r2) ^ c2] ^ OPc, with r2 = 0 and c2 = 1
+        for ( i = 0; i < 16; i++ )
+            in[i] = temp[i] ^ opc[i];
+        in[15] ^= 1;
+        aes_encrypt_block( &key, in, out );
+        for ( i = 0; i < 6; i++ )
+            anonymity[i] = out[i] ^ opc[i];
+
+        // AUTN = SQN ^ AK || AMF || MAC-A
+        memcpy( c.rand, rand, 16 );
+        for ( i = 0; i < 6; i++ )
+            c.autn[i] = sqn[i] ^ anonymity[i];
+        memcpy( c.autn + 6, amf, 2 );
+        memcpy( c.autn + 8, macA, 8 );
+        if ( mac )
+            memcpy( mac, macA, 8 );
+        if ( ak )
+            memcpy( ak, anonymity, 6 );
+    }
+
+private:
+    struct aes_key key;
+    uint8_t opc[16];
+};
+
+static void testSet1()
+{
+    MilenageNetwork network( bin( testKi ), bin( testOpc ) );
+    VariableSink sink;
+    SimAuth auth( &sink, testKi, testOpc, testSqn );
+    QByteArray rand = bin( testRand );
+    QByteArray sqn = bin( testSqn );
+    QByteArray amf = bin( testAmf );
+    UmtsChallenge c;
+    UmtsResult result;
+    uint8_t mac[8], ak[6];
+
+    network.challenge( (const uint8_t *)rand.constData(), (const uint8_t *)sqn.constData(),
+                       (const uint8_t *)amf.constData(), c, mac, ak );
+    check( "f1 MAC-A", mac, testMac );
+    check( "f5 AK", ak, testAk );
+
+    // Nothing has been accepted yet.
+    if ( !sink.values.value( "AUTHSQN" ).isEmpty() ) {
+        printf( "FAIL: AUTHSQN is %s before any SQN was accepted\n",
+                sink.values.value( "AUTHSQN" ).toLatin1().constData() );
+        ++failures;
+    }
+
+    auth.umtsAuthenticate( &c, &result, 1 );
+    if ( result.status != UMTS_OK ) {
+        printf( "FAIL: test set 1 was rejected with status %d\n", (int)result.status );
+        ++failures;
+        return;
+    }
+    check( "f2 RES", result.res, testRes );
+    check( "f3 CK", result.ck, testCk );
+    check( "f4 IK", result.ik, testIk );
+    if ( sink.values.value( "AUTHSQN" ) != testSqn ) {
+        printf( "FAIL: AUTHSQN is %s, expected %s\n",
+                sink.values.value( "AUTHSQN" ).toLatin1().constData(), testSqn );
+        ++failures;
+    }
+
+    // The same SQN must not be accepted twice.
+    auth.umtsAuthenticate( &c, &result, 1 );
+    if ( result.status != UMTS_SYNC_FAILURE ) {
+        printf( "FAIL: replayed SQN gave status %d\n", (int)result.status );
+        ++failures;
+    }
+}
+
+static void report( const char *what, int count, int msecs )
+{
+    if ( msecs < 1 )
+        msecs = 1;
+    printf( "%s: %d vectors in %d ms, %.0f vectors/s\n",
+            what, count, msecs, count * 1000.0 / msecs );
+}
+
+static void benchGsm( int vectors )
+{
+    SimAuth auth( 0, testKi, testOpc, testSqn );
+    static uint8_t rands[BATCH_SIZE][16];
+    static GsmResult results[BATCH_SIZE];
+    for ( int i = 0; i < BATCH_SIZE; i++ ) {
+        for ( int j = 0; j < 16; j++ )
+            rands[i][j] = (uint8_t)rand();
+    }
+
+    QTime timer;
+    timer.start();
+    for ( int done = 0; done < vectors; done += BATCH_SIZE )
+        auth.gsmAuthenticate( rands, results, BATCH_SIZE );
+    report( "COMP128", ( vectors + BATCH_SIZE - 1 ) / BATCH_SIZE * BATCH_SIZE,
+            timer.elapsed() );
+}
+
+static void benchUmts( int vectors )
+{
+    // Each challenge has the next SQN, so that every one is fresh.
+    MilenageNetwork network( bin( testKi ), bin( testOpc ) );
+    VariableSink sink;
+    SimAuth auth( &sink, testKi, testOpc, testSqn );
+    QByteArray amf = bin( testAmf );
+    QByteArray first = bin( testSqn );
+    quint64 sqn = 0;
+    for ( int i = 0; i < 6; i++ )
+        sqn = ( sqn << 8 ) | (uint8_t)first[i];
+
+    UmtsChallenge *challenges = new UmtsChallenge [vectors];
+    UmtsResult *results = new UmtsResult [vectors];
+    for ( int n = 0; n < vectors; n++, sqn++ ) {
+        uint8_t rand16[16], sqn6[6];
+        for ( int j = 0; j < 16; j++ )
+            rand16[j] = (uint8_t)rand();
+        for ( int j = 0; j < 6; j++ )
+            sqn6[j] = (uint8_t)( sqn >> ( 40 - 8 * j ) );
+        network.challenge( rand16, sqn6, (const uint8_t *)amf.constData(), challenges[n] );
+    }
+
+    QTime timer;
+    int published = sink.updates;
+    int batches = 0;
+    timer.start();
+    for ( int done = 0; done < vectors; done += BATCH_SIZE, ++batches ) {
+        int count = qMin( BATCH_SIZE, vectors - done );
+        auth.umtsAuthenticate( challenges + done, results + done, count );
+    }
+    report( "Milenage", vectors, timer.elapsed() );
+
+    // AUTHSQN and AUTHSQNARRAY are published once per batch.
+    if ( sink.updates - published != 2 * batches ) {
+        printf( "FAIL: %d variable updates for %d batches\n",
+                sink.updates - published, batches );
+        ++failures;
+    }
+    QString last = QString::number( sqn - 1, 16 ).rightJustified( 12, '0' );
+    if ( sink.values.value( "AUTHSQN" ) != last ) {
+        printf( "FAIL: AUTHSQN is %s, expected %s\n",
+                sink.values.value( "AUTHSQN" ).toLatin1().constData(),
+                last.toLatin1().constData() );
+        ++failures;
+    }
+
+    for ( int n = 0; n < vectors; n++ ) {
+        if ( results[n].status != UMTS_OK ) {
+            printf( "FAIL: challenge %d was rejected with status %d\n",
+                    n, (int)results[n].status );
+            ++failures;
+            break;
+        }
+    }
+    delete [] challenges;
+    delete [] results;
+}
+
+// The checks run on their own by default, with just enough vectors to
+// exercise batching.  Give --bench for the full timing runs.
+int main( int argc, char **argv )
+{
+    bool full = ( argc > 1 && strcmp( argv[1], "--bench" ) == 0 );
+    testSet1();
+    benchGsm( full ? GSM_VECTORS : QUICK_VECTORS );
+    benchUmts( full ? UMTS_VECTORS : QUICK_VECTORS );
+    if ( failures ) {
+        printf( "%d checks failed\n", failures );
+        return 1;
+    }
+    printf( "TS 35.208 test set 1 passed\n" );
+    return 0;
+}
@@ -0,0 +1,165 @@
+/****************************************************************************
+**
+** This file is part of the Qt Extended Opensource Package.
+**
+** This file may be used under the terms of the GNU General Public License
+** version 2.0 as published by the Free Software Foundation and appearing
+** in the file LICENSE.GPL included in the packaging of this file.
+**
+** Please review the following information to ensure GNU General Public
+** Licensing requirements will be met:
+**     http://www.fsf.org/licensing/licenses/info/GPLv2.html.
+**
+**
+****************************************************************************/
+
+// Checks QGsmCodec::packSeptets() and unpackSeptets() against a bit at a
+// time reference for every fill offset and every length up to 170, and
+// compares their throughput.  This file is built twice: test-septets uses
+// the BMI2 kernels when the CPU has them, and test-septets-swar is built
+// with QGSMCODEC_NO_BMI2 so that it always uses the portable kernels.
+
+#include <qgsmcodec.h>
+#include <qdatetime.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_SEPTETS     170
+#define MAX_FILL        7
+#define GUARD           0xA5
+#define BENCH_SEPTETS   160
+#define BENCH_MESSAGES  1000000
+
+static void referencePack( char *out, const char *in, int count, int fillBits )
+{
+    memset( out, 0, QGsmCodec::packedLength( count, fillBits ) );
+    int bit = fillBits;
+    for ( int n = 0; n < count; n++ ) {
+        for ( int i = 0; i < 7; i++, bit++ ) {
+            if ( in[n] & ( 1 << i ) )
+                out[bit / 8] |= (char)( 1 << ( bit % 8 ) );
+        }
+    }
+}
+
+static void referenceUnpack( char *out, const char *in, int count, int fillBits )
+{
+    int bit = fillBits;
+    for ( int n = 0; n < count; n++ ) {
+        int ch = 0;
+        for ( int i = 0; i < 7; i++, bit++ ) {
+            if ( in[bit / 8] & ( 1 << ( bit % 8 ) ) )
+                ch |= ( 1 << i );
+        }
+        out[n] = (char)ch;
+    }
+}
+
+static int check()
+{
+    int failures = 0;
+    for ( int fill = 0; fill <= MAX_FILL; fill++ ) {
+        for ( int count = 0; count <= MAX_SEPTETS; count++ ) {
+            int packed = QGsmCodec::packedLength( count, fill );
+
+            // The top bit of each input character must be ignored.
+            char in[MAX_SEPTETS];
+            for ( int n = 0; n < count; n++ )
+                in[n] = (char)rand();
+
+            // Buffers are sized exactly, so that memory checkers catch
+            // any access beyond them, except for one guard byte on output.
+            char *expected = new char [packed];
+            char *out = new char [packed + 1];
+            referencePack( expected, in, count, fill );
+            memset( out, GUARD, packed + 1 );
+            QGsmCodec::packSeptets( out, in, count, fill );
+            if ( memcmp( out, expected, packed ) != 0 ||
+                 (uchar)out[packed] != GUARD ) {
+                printf( "FAIL: packSeptets, %d septets after %d fill bits\n", count, fill );
+                ++failures;
+            }
+
+            // Fill the padding with ones, which must be skipped.
+            char *pdu = new char [packed];
+            memcpy( pdu, expected, packed );
+            if ( packed > 0 ) {
+                pdu[0] |= (char)( ( 1 << fill ) - 1 );
+                int used = ( fill + count * 7 ) % 8;
+                if ( used )
+                    pdu[packed - 1] |= (char)( 0xFF << used );
+            }
+            char unpacked[MAX_SEPTETS + 1];
+            char reference[MAX_SEPTETS];
+            memset( unpacked, GUARD, count + 1 );
+            referenceUnpack( reference, pdu, count, fill );
+            QGsmCodec::unpackSeptets( unpacked, pdu, count, fill );
+            bool ok = ( memcmp( unpacked, reference, count ) == 0 &&
+                        (uchar)unpacked[count] == GUARD );
+            for ( int n = 0; ok && n < count; n++ )
+                ok = ( unpacked[n] == ( in[n] & 0x7F ) );
+            if ( !ok ) {
+                printf( "FAIL: unpackSeptets, %d septets after %d fill bits\n", count, fill );
+                ++failures;
+            }
+
+            delete [] expected;
+            delete [] out;
+            delete [] pdu;
+        }
+    }
+    return failures;
+}
+
+typedef void (*SeptetFunction)( char *out, const char *in, int count, int fillBits );
+
+static int bench( const char *what, SeptetFunction func, int fill, bool packing )
+{
+    char septets[BENCH_SEPTETS];
+    char octets[( BENCH_SEPTETS * 7 + MAX_FILL ) / 8 + 1];
+    for ( int n = 0; n < BENCH_SEPTETS; n++ )
+        septets[n] = (char)( rand() & 0x7F );
+    referencePack( octets, septets, BENCH_SEPTETS, fill );
+
+    // Fold the output into a checksum, so that none of the work is skipped.
+    QTime timer;
+    int sum = 0;
+    timer.start();
+    for ( int n = 0; n < BENCH_MESSAGES; n++ ) {
+        if ( packing ) {
+            func( octets, septets, BENCH_SEPTETS, fill );
+            sum += octets[n % sizeof(octets)];
+        } else {
+            func( septets, octets, BENCH_SEPTETS, fill );
+            sum += septets[n % sizeof(septets)];
+        }
+    }
+    int msecs = qMax( timer.elapsed(), 1 );
+    printf( "%-26s fill %d: %8.1f Mseptets/s (%d)\n", what, fill,
+            (double)BENCH_SEPTETS * BENCH_MESSAGES / msecs / 1000.0, sum & 0xFF );
+    return msecs;
+}
+
+// The checks run on their own by default.  Give --bench for the timings.
+int main( int argc, char **argv )
+{
+    printf( "Septet kernels: %s\n", QGsmCodec::septetKernel() );
+
+    int failures = check();
+
+    bool full = ( argc > 1 && strcmp( argv[1], "--bench" ) == 0 );
+    for ( int fill = 0; full && fill <= 1; fill++ ) {
+        bench( "packSeptets", QGsmCodec::packSeptets, fill, true );
+        bench( "reference pack", referencePack, fill, true );
+        bench( "unpackSeptets", QGsmCodec::unpackSeptets, fill, false );
+        bench( "reference unpack", referenceUnpack, fill, false );
+    }
+
+    if ( failures ) {
+        printf( "%d checks failed\n", failures );
+        return 1;
+    }
+    printf( "All septet checks passed\n" );
+    return 0;
+}
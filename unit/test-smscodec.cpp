@@ -0,0 +1,191 @@
+/****************************************************************************
+**
+** This file is part of the Qt Extended Opensource Package.
+**
+** This file may be used under the terms of the GNU General Public License
+** version 2.0 as published by the Free Software Foundation and appearing
+** in the file LICENSE.GPL included in the packaging of this file.
+**
+** Please review the following information to ensure GNU General Public
+** Licensing requirements will be met:
+**     http://www.fsf.org/licensing/licenses/info/GPLv2.html.
+**
+**
+****************************************************************************/
+
+// Runs QSMSMessage and QCBSMessage through split(), toPdu() and fromPdu()
+// from several threads at once, and compares every result with the one
+// computed on the main thread afterwards.  The threads start before
+// anything else has used the codecs, so that they also race to create
+// them.
+
+#include <qsmsmessage.h>
+#include <qcbsmessage.h>
+#include <qatutils.h>
+#include <qcoreapplication.h>
+#include <qthread.h>
+#include <qstringlist.h>
+#include <stdio.h>
+
+#define THREADS     8
+#define ITERATIONS  200
+
+static QStringList sampleTexts()
+{
+    QStringList texts;
+    texts += "Hello world";
+    texts += QString( "The quick brown fox jumps over the lazy dog. " ).repeated( 9 );
+    texts += QString::fromUtf8( "{[~]} \\ ^ | 10\xe2\x82\xac " ).repeated( 30 );
+    texts += QString::fromUtf8( "\xc5\x9f\x65\x6b\x65\x72 \xc4\x9f\xc3\xbc\x6c "
+                                "\xc4\xb1\xc5\x9f\xc4\xb1\x6b " ).repeated( 20 );
+    texts += QString::fromUtf8( "\xe0\xa4\xa8\xe0\xa4\xae\xe0\xa4\xb8\xe0\xa5\x8d"
+                                "\xe0\xa4\xa4\xe0\xa5\x87 \xe0\xa4\xa6\xe0\xa5\x81"
+                                "\xe0\xa4\xa8\xe0\xa4\xbf\xe0\xa4\xaf\xe0\xa4\xbe " ).repeated( 20 );
+    texts += QString::fromUtf8( "\xd0\x9f\xd1\x80\xd0\xb8\xd0\xb2\xd0\xb5\xd1\x82 " ).repeated( 25 );
+    return texts;
+}
+
+// The concatenation reference number changes with every split(), so it is
+// cleared before the headers are compared.
+static QString headerSignature( const QByteArray& headers )
+{
+    QByteArray copy = headers;
+    int posn = 0;
+    while ( posn + 1 < copy.size() ) {
+        int id = (uchar)copy[posn];
+        int len = (uchar)copy[posn + 1];
+        if ( id == 0 && len == 3 && posn + 2 < copy.size() )
+            copy[posn + 2] = 0;
+        posn += len + 2;
+    }
+    return QAtUtils::toHex( copy );
+}
+
+static QString smsRoundTrip( const QString& text, bool& ok )
+{
+    QSMSMessage msg;
+    msg.setServiceCenter( "+15555550000" );
+    msg.setSender( "+15555551234" );
+    msg.setTimestamp( QDateTime( QDate( 2009, 3, 1 ), QTime( 12, 30, 0 ) ) );
+    msg.setText( text );
+
+    QString signature;
+    QString joined;
+    QList<QSMSMessage> fragments = msg.split();
+    foreach ( QSMSMessage fragment, fragments ) {
+        QByteArray pdu = fragment.toPdu();
+        QSMSMessage decoded = QSMSMessage::fromPdu( pdu );
+        if ( fragments.size() == 1 )
+            signature += QAtUtils::toHex( pdu );
+        else
+            signature += QString::number( pdu.size() );
+        signature += ":" + headerSignature( decoded.headers() );
+        signature += ":" + decoded.text() + "\n";
+        joined += decoded.text();
+    }
+    if ( joined != text )
+        ok = false;
+    return signature;
+}
+
+static QString cbsRoundTrip( const QString& text, bool& ok )
+{
+    QCBSMessage msg;
+    msg.setMessageCode( 123 );
+    msg.setScope( QCBSMessage::PLMNWide );
+    msg.setUpdateNumber( 5 );
+    msg.setChannel( 50 );
+    msg.setLanguage( QCBSMessage::English );
+    msg.setPage( 1 );
+    msg.setNumPages( 1 );
+    msg.setText( text );
+
+    QString signature;
+    foreach ( QCBSMessage page, msg.split() ) {
+        QByteArray pdu = page.toPdu();
+        QCBSMessage decoded = QCBSMessage::fromPdu( pdu );
+        if ( decoded.channel() != page.channel() ||
+             decoded.page() != page.page() ||
+             decoded.numPages() != page.numPages() )
+            ok = false;
+        signature += QAtUtils::toHex( pdu ) + ":" + decoded.text() + "\n";
+    }
+    return signature;
+}
+
+static QStringList roundTrips( const QStringList& texts, bool& ok )
+{
+    QStringList results;
+    foreach ( QString text, texts ) {
+        results += smsRoundTrip( text, ok );
+        results += cbsRoundTrip( text, ok );
+    }
+    return results;
+}
+
+// Each thread keeps the results of its first pass, and compares its
+// later passes with them.
+class RoundTripThread : public QThread
+{
+public:
+    RoundTripThread( const QStringList& texts )
+        : texts( texts ), failures( 0 ) {}
+
+    const QStringList& firstResults() const { return first; }
+    int failureCount() const { return failures; }
+
+protected:
+    void run()
+    {
+        for ( int n = 0; n < ITERATIONS; n++ ) {
+            bool ok = true;
+            QStringList results = roundTrips( texts, ok );
+            if ( n == 0 )
+                first = results;
+            if ( results != first || !ok )
+                ++failures;
+        }
+    }
+
+private:
+    QStringList texts;
+    QStringList first;
+    int failures;
+};
+
+int main( int argc, char **argv )
+{
+    QCoreApplication app( argc, argv );
+
+    QStringList texts = sampleTexts();
+    QList<RoundTripThread *> threads;
+    for ( int n = 0; n < THREADS; n++ )
+        threads.append( new RoundTripThread( texts ) );
+    foreach ( RoundTripThread *thread, threads )
+        thread->start();
+    foreach ( RoundTripThread *thread, threads )
+        thread->wait();
+
+    bool ok = true;
+    QStringList expected = roundTrips( texts, ok );
+    if ( !ok ) {
+        printf( "FAIL: single threaded round trip does not restore the text\n" );
+        return 1;
+    }
+
+    int failures = 0;
+    foreach ( RoundTripThread *thread, threads ) {
+        failures += thread->failureCount();
+        if ( thread->firstResults() != expected )
+            ++failures;
+    }
+    qDeleteAll( threads );
+
+    if ( failures ) {
+        printf( "%d of %d threaded round trips failed\n",
+                failures, THREADS * ITERATIONS );
+        return 1;
+    }
+    printf( "All SMS and CBS round trips passed in %d threads\n", THREADS );
+    return 0;
+}
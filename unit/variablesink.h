@@ -0,0 +1,42 @@
+/****************************************************************************
+**
+** This file is part of the Qt Extended Opensource Package.
+**
+** This file may be used under the terms of the GNU General Public License
+** version 2.0 as published by the Free Software Foundation and appearing
+** in the file LICENSE.GPL included in the packaging of this file.
+**
+** Please review the following information to ensure GNU General Public
+** Licensing requirements will be met:
+**     http://www.fsf.org/licensing/licenses/info/GPLv2.html.
+**
+**
+****************************************************************************/
+
+#ifndef VARIABLESINK_H
+#define VARIABLESINK_H
+
+#include <qobject.h>
+#include <qhash.h>
+#include <qstring.h>
+
+// Stands in for SimRules as the parent of objects that publish variables
+// by calling their parent's setVariable() slot by name.
+class VariableSink : public QObject
+{
+    Q_OBJECT
+public:
+    VariableSink() : updates( 0 ) {}
+
+    int updates;
+    QHash<QString, QString> values;
+
+public slots:
+    void setVariable( const QString& name, const QString& value )
+    {
+        values[name] = value;
+        ++updates;
+    }
+};
+
+#endif